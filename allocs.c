@@ -0,0 +1,321 @@
+#define _DEFAULT_SOURCE
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "allocs.h"
+#include "coroutine.h"
+#include "map.h"
+#include "utils.h"
+#include "vm.h"
+
+#define REPORT_TOP_SITES 20
+
+// an allocation site is a pc and the kind of object made there, -1 for the compiler
+typedef struct {
+    int pc;
+    ObjectKind kind;
+    unsigned long long objects;
+    unsigned long long bytes;
+    unsigned long long liveObjects;
+    unsigned long long liveBytes;
+    unsigned long long leakedObjects;
+    unsigned long long leakedBytes;
+} Site;
+
+typedef struct {
+    // NULL for an empty slot
+    void *object;
+    size_t bytes;
+    int site;
+    int reachable;
+} Live;
+
+typedef struct {
+    int initialized;
+
+    Site *sites;
+    int sitesLength;
+    int sitesCapacity;
+    // open addressing on (pc, kind), 1 + the index into sites, 0 for an empty slot
+    int *siteSlots;
+    int siteSlotsCapacity;
+
+    // open addressing on the object's address with linear probing
+    Live *live;
+    size_t liveLength;
+    size_t liveCapacity;
+
+    volatile sig_atomic_t dumpRequested;
+} Allocs;
+
+Allocs allocs;
+
+static const char *kindNames[OBJECT_KINDS] = {"string", "literal", "array", "map"};
+
+static void requestDump(int signal) {
+    (void)signal;
+    allocs.dumpRequested = 1;
+}
+
+// the tables use plain calloc so they don't show up in the allocation counts of --stats
+static void* tableCalloc(size_t count, size_t size) {
+    void *table = calloc(count, size);
+    if (table == NULL) {
+        fprintf(stderr, "out of memory tracking allocations\n");
+        exit(1);
+    }
+    return table;
+}
+
+static void initAllocs(void) {
+    allocs.initialized = 1;
+    allocs.siteSlotsCapacity = 256;
+    allocs.siteSlots = (int *)tableCalloc(allocs.siteSlotsCapacity, sizeof(int));
+    allocs.liveCapacity = 1024;
+    allocs.live = (Live *)tableCalloc(allocs.liveCapacity, sizeof(Live));
+    signal(SIGUSR1, requestDump);
+}
+
+static uint32_t hashSite(int pc, ObjectKind kind) {
+    return ((uint32_t)pc * OBJECT_KINDS + kind) * 2654435761u;
+}
+
+static size_t hashObject(void *object) {
+    uint64_t address = (uint64_t)(uintptr_t)object >> 4;
+    return (size_t)(address * 0x9E3779B97F4A7C15ull >> 17);
+}
+
+static void growSiteSlots(void) {
+    free(allocs.siteSlots);
+    allocs.siteSlotsCapacity *= 2;
+    allocs.siteSlots = (int *)tableCalloc(allocs.siteSlotsCapacity, sizeof(int));
+
+    int mask = allocs.siteSlotsCapacity - 1;
+    for (int i = 0; i < allocs.sitesLength; i++) {
+        int slot = hashSite(allocs.sites[i].pc, allocs.sites[i].kind) & mask;
+        while (allocs.siteSlots[slot]) slot = (slot + 1) & mask;
+        allocs.siteSlots[slot] = i + 1;
+    }
+}
+
+static int findSite(int pc, ObjectKind kind) {
+    int mask = allocs.siteSlotsCapacity - 1;
+    int slot = hashSite(pc, kind) & mask;
+    while (allocs.siteSlots[slot]) {
+        Site *site = &allocs.sites[allocs.siteSlots[slot] - 1];
+        if (site->pc == pc && site->kind == kind) return allocs.siteSlots[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+
+    if (allocs.sitesLength == allocs.sitesCapacity) {
+        allocs.sitesCapacity = allocs.sitesCapacity ? allocs.sitesCapacity * 2 : 64;
+        Site *sites = (Site *)tableCalloc(allocs.sitesCapacity, sizeof(Site));
+        if (allocs.sitesLength) memcpy(sites, allocs.sites, sizeof(Site) * allocs.sitesLength);
+        free(allocs.sites);
+        allocs.sites = sites;
+    }
+    allocs.sites[allocs.sitesLength] = (Site){.pc = pc, .kind = kind};
+    allocs.siteSlots[slot] = ++allocs.sitesLength;
+
+    if (allocs.sitesLength * 2 > allocs.siteSlotsCapacity) growSiteSlots();
+    return allocs.sitesLength - 1;
+}
+
+// the slot holding object, or the empty slot it would go in
+static Live* findLive(void *object) {
+    size_t mask = allocs.liveCapacity - 1;
+    size_t slot = hashObject(object) & mask;
+    while (allocs.live[slot].object != NULL && allocs.live[slot].object != object) {
+        slot = (slot + 1) & mask;
+    }
+    return &allocs.live[slot];
+}
+
+static void growLive(void) {
+    Live *old = allocs.live;
+    size_t oldCapacity = allocs.liveCapacity;
+    allocs.liveCapacity *= 2;
+    allocs.live = (Live *)tableCalloc(allocs.liveCapacity, sizeof(Live));
+
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].object != NULL) *findLive(old[i].object) = old[i];
+    }
+    free(old);
+}
+
+static void report(int leaks);
+
+void trackAlloc(void *object, size_t bytes, ObjectKind kind) {
+    if (!allocs.initialized) initAllocs();
+
+    int pc = kind != OBJECT_LITERAL && vm != NULL ? vm->pc : -1;
+    int index = findSite(pc, kind);
+    Site *site = &allocs.sites[index];
+    site->objects += 1;
+    site->bytes += bytes;
+    site->liveObjects += 1;
+    site->liveBytes += bytes;
+
+    if ((allocs.liveLength + 1) * 2 > allocs.liveCapacity) growLive();
+    Live *live = findLive(object);
+    if (live->object == NULL) allocs.liveLength += 1;
+    *live = (Live){.object = object, .bytes = bytes, .site = index};
+
+    if (allocs.dumpRequested) {
+        allocs.dumpRequested = 0;
+        report(0);
+    }
+}
+
+void trackResize(void *object, size_t bytes) {
+    if (!allocs.initialized) return;
+    Live *live = findLive(object);
+    if (live->object == NULL) return;
+
+    Site *site = &allocs.sites[live->site];
+    site->liveBytes += bytes - live->bytes;
+    if (bytes > live->bytes) site->bytes += bytes - live->bytes;
+    live->bytes = bytes;
+}
+
+void trackFree(void *object) {
+    if (!allocs.initialized) return;
+    Live *live = findLive(object);
+    if (live->object == NULL) return;
+
+    Site *site = &allocs.sites[live->site];
+    site->liveObjects -= 1;
+    site->liveBytes -= live->bytes;
+
+    // backward shift, so no tombstones are left behind for the probes
+    size_t mask = allocs.liveCapacity - 1;
+    size_t hole = live - allocs.live;
+    for (size_t next = (hole + 1) & mask; allocs.live[next].object != NULL; next = (next + 1) & mask) {
+        size_t home = hashObject(allocs.live[next].object) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            allocs.live[hole] = allocs.live[next];
+            hole = next;
+        }
+    }
+    allocs.live[hole] = (Live){0};
+    allocs.liveLength -= 1;
+}
+
+static void markReachable(Box box) {
+    ValueType type = TYPE(box);
+    if (type != VAL_STRING && type != VAL_ARRAY && type != VAL_MAP) return;
+
+    Live *live = findLive((void *)(intptr_t)box.obj);
+    if (live->object == NULL || live->reachable) return;
+    live->reachable = 1;
+
+    if (type == VAL_MAP) {
+        Map *map = (Map *)(intptr_t)box.obj;
+        Entry *entries = (Entry *)map->obj.ref;
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (!entries[i].distance) continue;
+            markReachable(entries[i].key);
+            markReachable(entries[i].value);
+        }
+    }
+}
+
+// charges the live objects nothing on the stacks reaches to their sites
+static void findLeaks(void) {
+    for (int i = 0; i < allocs.sitesLength; i++) {
+        allocs.sites[i].leakedObjects = 0;
+        allocs.sites[i].leakedBytes = 0;
+    }
+    for (size_t i = 0; i < allocs.liveCapacity; i++) {
+        allocs.live[i].reachable = 0;
+    }
+
+    visitStacks(markReachable);
+
+    for (size_t i = 0; i < allocs.liveCapacity; i++) {
+        Live *live = &allocs.live[i];
+        if (live->object == NULL || live->reachable) continue;
+        Site *site = &allocs.sites[live->site];
+        if (site->kind == OBJECT_LITERAL) continue;
+        site->leakedObjects += 1;
+        site->leakedBytes += live->bytes;
+    }
+}
+
+// a counter of a site by its offset in Site
+#define FIELD(site, offset) (*(unsigned long long *)((char *)(site) + (offset)))
+
+static size_t sortField;
+
+static int byFieldDescending(const void *a, const void *b) {
+    unsigned long long l = FIELD(&allocs.sites[*(int *)a], sortField);
+    unsigned long long r = FIELD(&allocs.sites[*(int *)b], sortField);
+    if (l != r) return l < r ? 1 : -1;
+    return *(int *)a - *(int *)b;
+}
+
+static void printSite(Site *site) {
+    if (site->pc < 0) {
+        fprintf(stderr, "  %-8s %-23s %-8s", "compile", "", kindNames[site->kind]);
+    } else {
+        InstType type = site->pc < vm->programLength ? vm->program[site->pc].type : INST_EXTRA;
+        fprintf(stderr, "  line %-3d 0x%04X %-16s %-8s", lineForPc(&vm->lines, site->pc), site->pc,
+                stringifyInst(type), kindNames[site->kind]);
+    }
+}
+
+// the sites with any bytes in the bytes field, the most first
+static void table(const char *title, size_t objects, size_t bytes) {
+    int *indices = (int *)tableCalloc(allocs.sitesLength + 1, sizeof(int));
+    for (int i = 0; i < allocs.sitesLength; i++) {
+        indices[i] = i;
+    }
+    sortField = bytes;
+    qsort(indices, allocs.sitesLength, sizeof(int), byFieldDescending);
+
+    fprintf(stderr, "%s:\n", title);
+    for (int i = 0; i < allocs.sitesLength && i < REPORT_TOP_SITES; i++) {
+        Site *site = &allocs.sites[indices[i]];
+        if (!FIELD(site, bytes)) break;
+        printSite(site);
+        fprintf(stderr, " %12llu objects %14llu bytes\n", FIELD(site, objects), FIELD(site, bytes));
+    }
+    fprintf(stderr, "\n");
+    free(indices);
+}
+
+static void report(int leaks) {
+    unsigned long long liveObjects = 0, liveBytes = 0;
+    unsigned long long objects = 0, bytes = 0;
+    for (int i = 0; i < allocs.sitesLength; i++) {
+        liveObjects += allocs.sites[i].liveObjects;
+        liveBytes += allocs.sites[i].liveBytes;
+        objects += allocs.sites[i].objects;
+        bytes += allocs.sites[i].bytes;
+    }
+
+    fprintf(stderr, "===== ALLOCATIONS =====\n\n");
+    fprintf(stderr, "%llu objects live in %llu bytes, %llu allocated in %llu bytes\n\n",
+            liveObjects, liveBytes, objects, bytes);
+    table("live by site", offsetof(Site, liveObjects), offsetof(Site, liveBytes));
+    table("allocated by site", offsetof(Site, objects), offsetof(Site, bytes));
+    if (!leaks) return;
+
+    findLeaks();
+    unsigned long long leakedObjects = 0, leakedBytes = 0;
+    for (int i = 0; i < allocs.sitesLength; i++) {
+        leakedObjects += allocs.sites[i].leakedObjects;
+        leakedBytes += allocs.sites[i].leakedBytes;
+    }
+    fprintf(stderr, "%llu objects leaked in %llu bytes\n\n", leakedObjects, leakedBytes);
+    if (leakedObjects) table("leaked by site", offsetof(Site, leakedObjects), offsetof(Site, leakedBytes));
+}
+
+void dumpAllocs(void) {
+    if (!allocs.initialized) initAllocs();
+    report(1);
+}
@@ -0,0 +1,41 @@
+#ifndef ALLOCS_H
+#define ALLOCS_H
+
+#include <stddef.h>
+
+// allocation tracking, built with `make allocs` (-DNGS_ALLOCS). every string, array and map is
+// tagged with its kind and the pc it was created at, and with its source line through that pc.
+// string constants are made while compiling and belong to the program. when the program is done,
+// and on the next allocation after a SIGUSR1, the live and the cumulative allocations per site go
+// to stderr sorted by bytes. at the end the live objects nothing on the stacks can reach, directly
+// or through a map, are reported as leaks. when the flag is off the TRACK_* hooks in the runtime
+// expand to nothing
+
+typedef enum {
+    OBJECT_STRING,
+    OBJECT_LITERAL,
+    OBJECT_ARRAY,
+    OBJECT_MAP,
+    OBJECT_KINDS,
+} ObjectKind;
+
+// bytes counts the object and the buffer it owns
+void trackAlloc(void *object, size_t bytes, ObjectKind kind);
+// the object's buffer was replaced by one of a different size
+void trackResize(void *object, size_t bytes);
+void trackFree(void *object);
+
+// tables and leak check on stderr, the stacks have to still be there
+void dumpAllocs(void);
+
+#ifdef NGS_ALLOCS
+#define TRACK_ALLOC(object, bytes, kind) trackAlloc(object, bytes, kind)
+#define TRACK_RESIZE(object, bytes) trackResize(object, bytes)
+#define TRACK_FREE(object) trackFree(object)
+#else
+#define TRACK_ALLOC(object, bytes, kind)
+#define TRACK_RESIZE(object, bytes)
+#define TRACK_FREE(object)
+#endif
+
+#endif
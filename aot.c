@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+#include "builtins.h"
+#include "utils.h"
+
+// the top of the operand stack is kept in C locals (t1, t2, ...) for as long as nothing else can
+// observe it. it is flushed back to vm->operandStack before labels, jumps, calls, variable access
+// and any library call that walks the stack
+typedef struct {
+    FILE *out;
+
+    int *cache;
+    int cacheLength;
+    int temps;
+
+    int *isTarget;
+    int *literals;
+} Emitter;
+
+Emitter em;
+
+static int newTemp(void) {
+    em.temps += 1;
+    return em.temps;
+}
+
+static void pushTemp(int temp) {
+    em.cache[em.cacheLength] = temp;
+    em.cacheLength += 1;
+}
+
+static int push(const char *expr) {
+    int temp = newTemp();
+    fprintf(em.out, "    Box t%d = %s;\n", temp, expr);
+    pushTemp(temp);
+    return temp;
+}
+
+static int pop(void) {
+    if (em.cacheLength > 0) {
+        em.cacheLength -= 1;
+        return em.cache[em.cacheLength];
+    }
+
+    int temp = newTemp();
+    fprintf(em.out, "    Box t%d = vm->operandStack[vm->sp];\n", temp);
+    fprintf(em.out, "    vm->sp -= 1;\n");
+    return temp;
+}
+
+// writes the cached values to the operand stack, `indent` lets spills happen inside a slow path
+static void spill(const char *indent) {
+    for (int i = 0; i < em.cacheLength; i++) {
+        fprintf(em.out, "%svm->operandStack[vm->sp + %d] = t%d;\n", indent, i + 1, em.cache[i]);
+    }
+    if (em.cacheLength) fprintf(em.out, "%svm->sp += %d;\n", indent, em.cacheLength);
+}
+
+static void flush(void) {
+    spill("    ");
+    em.cacheLength = 0;
+}
+
+// C expression for the slot an INST_FETCH_VAR or INST_FETCH_LOCAL word reads, or the matching
+// INST_ASSIGN_VAR or INST_ASSIGN_LOCAL writes
+static void fetchedSlotExpr(Inst inst, char *buffer, size_t size) {
+    if (inst.type == INST_FETCH_LOCAL || inst.type == INST_ASSIGN_LOCAL) {
+        snprintf(buffer, size, "localSlot(%d)", inst.operand.int32);
+    } else {
+        snprintf(buffer, size, "%d", inst.operand.int32);
+    }
+}
+
+static void constant(Box box, int pc, char *buffer, size_t size) {
+    switch (TYPE(box)) {
+    case VAL_INT:
+        snprintf(buffer, size, "intBox(%d)", box.int32);
+        break;
+    case VAL_STRING:
+        snprintf(buffer, size, "literals[%d]", em.literals[pc]);
+        break;
+    default: {
+        unsigned long long bits;
+        memcpy(&bits, &box, sizeof(bits));
+        snprintf(buffer, size, "boxFromBits(0x%016llXULL)", bits);
+        break;
+    }
+    }
+}
+
+static void functionName(int index, char *buffer, size_t size) {
+    if (index < 0) {
+        snprintf(buffer, size, "script");
+    } else {
+        snprintf(buffer, size, "fn%d_%s", index, vm->functions[index].name);
+    }
+}
+
+static int functionAt(int ip) {
+    for (int i = 0; i < vm->functionsLength; i++) {
+        if (vm->functions[i].ip == ip) return i;
+    }
+    return -1;
+}
+
+// -1 for top level code
+static int ownerOf(int pc) {
+    for (int i = 0; i < vm->functionsLength; i++) {
+        if (pc >= vm->functions[i].ip && pc < vm->functions[i].end) return i;
+    }
+    return -1;
+}
+
+static void binary(const char *fastPath, const char *slowPath, int spillsStack) {
+    int roperand = pop();
+    int loperand = pop();
+    int result = newTemp();
+
+    fprintf(em.out, "    Box t%d;\n", result);
+    fprintf(em.out, "    if (!%s(t%d, t%d, &t%d)) {\n", fastPath, loperand, roperand, result);
+    if (spillsStack) spill("        ");
+    fprintf(em.out, "        t%d = %s(t%d, t%d);\n", result, slowPath, loperand, roperand);
+    if (spillsStack && em.cacheLength) fprintf(em.out, "        vm->sp -= %d;\n", em.cacheLength);
+    fprintf(em.out, "    }\n");
+
+    pushTemp(result);
+}
+
+// C expression for the source word of a register instruction at pc
+static void sourceExpr(int pc, char *buffer, size_t size) {
+    Inst inst = vm->program[pc];
+    char slot[32];
+
+    switch (inst.type) {
+    case INST_FETCH_VAR:
+    case INST_FETCH_LOCAL:
+        fetchedSlotExpr(inst, slot, sizeof(slot));
+        snprintf(buffer, size, "vm->operandStack[%s]", slot);
+        break;
+    case INST_FETCH_ARG:
+        snprintf(buffer, size, "vm->callStack[vm->frame - 3 - vm->callStack[vm->frame - 3].int32 + %d]", inst.operand.int32);
+        break;
+    default:
+        constant(inst.operand, pc, buffer, size);
+        break;
+    }
+}
+
+// the variables it reads are current once the cache is flushed, the result is pushed or stored
+static void registerOp(int pc, const char *fastPath, const char *slowPath) {
+    Inst *inst = vm->program + pc;
+    char loperand[128], roperand[128], slot[32];
+    sourceExpr(pc + 2, loperand, sizeof(loperand));
+
+    flush();
+    int result = newTemp();
+    fprintf(em.out, "    Box t%d;\n", result);
+    if (inst->type == INST_REG_MOVE) {
+        fprintf(em.out, "    t%d = %s;\n", result, loperand);
+    } else if (inst->type == INST_REG_CMP) {
+        sourceExpr(pc + 3, roperand, sizeof(roperand));
+        fprintf(em.out, "    if (!intCompare(%s, %s, %d, &t%d)) t%d = compareBoxes(%s, %s, %d);\n",
+                loperand, roperand, inst->operand.int32, result, result, loperand, roperand, inst->operand.int32);
+    } else {
+        sourceExpr(pc + 3, roperand, sizeof(roperand));
+        if (fastPath != NULL) {
+            fprintf(em.out, "    if (!%s(%s, %s, &t%d)) t%d = %s(%s, %s);\n",
+                    fastPath, loperand, roperand, result, result, slowPath, loperand, roperand);
+        } else {
+            fprintf(em.out, "    t%d = %s(%s, %s);\n", result, slowPath, loperand, roperand);
+        }
+    }
+
+    if (inst[1].type == INST_STACK_PUSH) {
+        pushTemp(result);
+    } else {
+        fetchedSlotExpr(inst[1], slot, sizeof(slot));
+        fprintf(em.out, "    assignVar(%s, t%d);\n", slot, result);
+    }
+}
+
+static void emitInst(int pc) {
+    Inst inst = vm->program[pc];
+    int operand = inst.operand.int32;
+    char expr[128];
+
+    switch (inst.type) {
+    case INST_STACK_PUSH:
+        constant(inst.operand, pc, expr, sizeof(expr));
+        push(expr);
+        break;
+    case INST_FETCH_VAR:
+        flush();
+        snprintf(expr, sizeof(expr), "vm->operandStack[%d]", operand);
+        push(expr);
+        break;
+    case INST_ASSIGN_VAR: {
+        int value = pop();
+        flush();
+        fprintf(em.out, "    assignVar(%d, t%d);\n", operand, value);
+        break;
+    }
+    case INST_FETCH_LOCAL:
+        flush();
+        snprintf(expr, sizeof(expr), "vm->operandStack[localSlot(%d)]", operand);
+        push(expr);
+        break;
+    case INST_ASSIGN_LOCAL: {
+        int value = pop();
+        flush();
+        fprintf(em.out, "    assignVar(localSlot(%d), t%d);\n", operand, value);
+        break;
+    }
+    // the library calls free string and array operands that are no longer on the stack
+    case INST_ADD:
+        binary("intAdd", "addBoxes", 1);
+        break;
+    case INST_SUB:
+        binary("intSub", "subBoxes", 1);
+        break;
+    case INST_MULT:
+        binary("intMult", "multBoxes", 1);
+        break;
+    case INST_DIV: {
+        int roperand = pop();
+        int loperand = pop();
+        flush();
+        snprintf(expr, sizeof(expr), "divBoxes(t%d, t%d)", loperand, roperand);
+        push(expr);
+        break;
+    }
+    case INST_LOGICAL_NOT: {
+        int value = pop();
+        snprintf(expr, sizeof(expr), "notBox(t%d)", value);
+        push(expr);
+        break;
+    }
+    case INST_CMP: {
+        int roperand = pop();
+        int loperand = pop();
+        int result = newTemp();
+
+        fprintf(em.out, "    Box t%d;\n", result);
+        fprintf(em.out, "    if (!intCompare(t%d, t%d, %d, &t%d)) t%d = compareBoxes(t%d, t%d, %d);\n",
+                loperand, roperand, operand, result, result, loperand, roperand, operand);
+        pushTemp(result);
+        break;
+    }
+    case INST_JMP:
+        flush();
+        if (operand < 0) fprintf(em.out, "    CHARGE_BUDGET(%d);\n", -operand);
+        fprintf(em.out, "    goto L%d;\n", pc + operand);
+        break;
+    case INST_JMP_IF_NOT: {
+        int value = pop();
+        flush();
+        fprintf(em.out, "    if (!t%d.int32 || vm->conditionBreaker) goto L%d;\n", value, pc + operand);
+        break;
+    }
+    case INST_LOOP_STEP: {
+        Inst *extra = vm->program + pc + 1;
+        char slot[32];
+        fetchedSlotExpr(extra[0], slot, sizeof(slot));
+        if (extra[3].type == INST_STACK_PUSH) {
+            constant(extra[3].operand, pc + 4, expr, sizeof(expr));
+        } else {
+            char limit[32];
+            fetchedSlotExpr(extra[3], limit, sizeof(limit));
+            snprintf(expr, sizeof(expr), "vm->operandStack[%s]", limit);
+        }
+
+        flush();
+        fprintf(em.out, "    if (stepLoop(%s, %d, %d, %s)) {\n", slot, extra[1].operand.int32, extra[2].operand.int32, expr);
+        fprintf(em.out, "        CHARGE_BUDGET(%d);\n", LOOP_STEP_LENGTH - operand);
+        fprintf(em.out, "        goto L%d;\n", pc + operand);
+        fprintf(em.out, "    }\n");
+        break;
+    }
+    case INST_REG_ADD:
+        registerOp(pc, "intAdd", "addBoxes");
+        break;
+    case INST_REG_SUB:
+        registerOp(pc, "intSub", "subBoxes");
+        break;
+    case INST_REG_MULT:
+        registerOp(pc, "intMult", "multBoxes");
+        break;
+    case INST_REG_DIV:
+        registerOp(pc, NULL, "divBoxes");
+        break;
+    case INST_REG_CMP:
+    case INST_REG_MOVE:
+        registerOp(pc, NULL, NULL);
+        break;
+    case INST_REG_JMP_IF_NOT: {
+        char loperand[128], roperand[128];
+        int condition = vm->program[pc + 1].operand.int32;
+        sourceExpr(pc + 2, loperand, sizeof(loperand));
+        sourceExpr(pc + 3, roperand, sizeof(roperand));
+
+        flush();
+        int result = newTemp();
+        fprintf(em.out, "    Box t%d;\n", result);
+        fprintf(em.out, "    if (!intCompare(%s, %s, %d, &t%d)) t%d = compareBoxes(%s, %s, %d);\n",
+                loperand, roperand, condition, result, result, loperand, roperand, condition);
+        fprintf(em.out, "    if (!t%d.int32 || vm->conditionBreaker) goto L%d;\n", result, pc + operand);
+        break;
+    }
+    case INST_SET_CB:
+        fprintf(em.out, "    vm->conditionBreaker = 1;\n");
+        break;
+    case INST_UNSET_CB:
+        fprintf(em.out, "    vm->conditionBreaker = 0;\n");
+        break;
+    case INST_ARRAY_NEW:
+        flush();
+        fprintf(em.out, "    arrayLiteral(%d);\n", operand);
+        break;
+    case INST_ARRAY_ALLOC:
+        flush();
+        fprintf(em.out, "    allocArray(%d);\n", operand);
+        break;
+    case INST_INDEX_GET:
+        flush();
+        fprintf(em.out, "    indexGet();\n");
+        break;
+    case INST_INDEX_SET:
+        flush();
+        fprintf(em.out, "    indexSet();\n");
+        break;
+    case INST_ARRAY_REDUCE:
+        flush();
+        fprintf(em.out, "    reduceArray(%d);\n", operand);
+        break;
+    case INST_MAP_NEW:
+        flush();
+        fprintf(em.out, "    allocMap();\n");
+        break;
+    case INST_MAP_HAS:
+        flush();
+        fprintf(em.out, "    mapHas();\n");
+        break;
+    case INST_MAP_DELETE:
+        flush();
+        fprintf(em.out, "    mapRemove();\n");
+        break;
+    case INST_CALL_NATIVE:
+        flush();
+        if (natives[operand].suspends) {
+            // only the main program runs, a suspended native parks it until the event loop woke it
+            fprintf(em.out, "    while (callNative(%d));\n", operand);
+        } else {
+            fprintf(em.out, "    callNative(%d);\n", operand);
+        }
+        break;
+    case INST_SPAWN:
+    case INST_YIELD:
+    case INST_RESUME:
+    case INST_WAIT:
+        // emitted functions run on the C stack, which a switch would have to swap
+        fprintf(stderr, "emit-c: coroutines are not supported at 0x%04X\n", pc);
+        exit(1);
+    case INST_STACK_SWEEP:
+        flush();
+        fprintf(em.out, "    sweepStack(%d);\n", operand);
+        break;
+    case INST_PUSH_ARG: {
+        int value = pop();
+        fprintf(em.out, "    vm->csp += 1;\n");
+        fprintf(em.out, "    vm->callStack[vm->csp] = t%d;\n", value);
+        break;
+    }
+    case INST_FETCH_ARG:
+        snprintf(expr, sizeof(expr), "vm->callStack[vm->frame - 3 - vm->callStack[vm->frame - 3].int32 + %d]", operand);
+        push(expr);
+        break;
+    case INST_CALL: {
+        int callee = functionAt(operand);
+        if (callee < 0) {
+            fprintf(stderr, "emit-c: call to unknown function at 0x%04X\n", operand);
+            exit(1);
+        }
+
+        flush();
+        functionName(callee, expr, sizeof(expr));
+        fprintf(em.out, "    callFunction(%d, %s);\n", pc + 1, expr);
+        break;
+    }
+    case INST_RET:
+        flush();
+        fprintf(em.out, "    returnFromFunction();\n");
+        fprintf(em.out, "    return;\n");
+        break;
+    case INST_EXTRA:
+        break;
+    }
+}
+
+static void emitFunction(int index) {
+    char name[128];
+    functionName(index, name, sizeof(name));
+
+    fprintf(em.out, "static void %s(void) {\n", name);
+
+    em.temps = 0;
+    em.cacheLength = 0;
+
+    for (int pc = 0; pc < vm->programLength; pc += instLength(vm->program[pc].type)) {
+        if (ownerOf(pc) != index) continue;
+
+        if (em.isTarget[pc]) {
+            flush();
+            fprintf(em.out, "L%d:;\n", pc);
+        }
+        emitInst(pc);
+    }
+
+    flush();
+    if (index < 0 && em.isTarget[vm->programLength]) {
+        fprintf(em.out, "L%d:;\n", vm->programLength);
+    }
+    fprintf(em.out, "}\n\n");
+}
+
+static void emitStringLiteral(Object *obj) {
+    fprintf(em.out, "\"");
+    for (size_t i = 0; i + 1 < obj->length; i++) {
+        unsigned char c = ((unsigned char *)obj->ref)[i];
+        if (c == '\\' || c == '"') {
+            fprintf(em.out, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7F) {
+            fprintf(em.out, "\\%03o", c);
+        } else {
+            fprintf(em.out, "%c", c);
+        }
+    }
+    fprintf(em.out, "\"");
+}
+
+void emitC(FILE *out, const char *sourcePath) {
+    em = (Emitter){.out = out};
+    em.cache = (int *)safe_malloc(sizeof(int) * (vm->programLength + 1));
+    em.isTarget = (int *)safe_calloc(vm->programLength + 1, sizeof(int));
+    em.literals = (int *)safe_calloc(vm->programLength + 1, sizeof(int));
+
+    int literalsLength = 0;
+    for (int pc = 0; pc < vm->programLength; pc += instLength(vm->program[pc].type)) {
+        Inst inst = vm->program[pc];
+        if (inst.type == INST_JMP || inst.type == INST_JMP_IF_NOT || inst.type == INST_LOOP_STEP || inst.type == INST_REG_JMP_IF_NOT) {
+            em.isTarget[pc + inst.operand.int32] = 1;
+        }
+        if (inst.type == INST_STACK_PUSH && TYPE(inst.operand) == VAL_STRING) {
+            em.literals[pc] = literalsLength;
+            literalsLength += 1;
+        }
+    }
+
+    fprintf(out, "// generated by ngs --emit-c from %s\n", sourcePath);
+    fprintf(out, "#include \"runtime.h\"\n\n");
+
+    if (literalsLength) fprintf(out, "static Box literals[%d];\n\n", literalsLength);
+
+    char name[128];
+    for (int i = 0; i < vm->functionsLength; i++) {
+        functionName(i, name, sizeof(name));
+        fprintf(out, "static void %s(void);\n", name);
+    }
+    fprintf(out, "\n");
+
+    for (int i = 0; i < vm->functionsLength; i++) {
+        emitFunction(i);
+    }
+    emitFunction(-1);
+
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    initVM(NULL, 0, NULL, 0, (LineTable){0});\n");
+    for (int pc = 0; pc < vm->programLength; pc++) {
+        Inst inst = vm->program[pc];
+        if (inst.type == INST_STACK_PUSH && TYPE(inst.operand) == VAL_STRING) {
+            Object *obj = (Object *)(intptr_t)inst.operand.obj;
+            fprintf(out, "    literals[%d] = stringLiteral(", em.literals[pc]);
+            emitStringLiteral(obj);
+            fprintf(out, ", %zu);\n", obj->length - 1);
+        }
+    }
+    fprintf(out, "\n    script();\n\n");
+    fprintf(out, "    freeVM();\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    free(em.literals);
+    free(em.isTarget);
+    free(em.cache);
+}
@@ -0,0 +1,11 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdio.h>
+#include "vm.h"
+
+// writes the loaded program as a C translation unit, one function per script function.
+// build it against the runtime library: make runtime && cc -O2 -I. out.c libngsrt.a -lm -pthread
+void emitC(FILE *out, const char *sourcePath);
+
+#endif
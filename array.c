@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "array.h"
+#include "utils.h"
+#include "allocs.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_SUPPORTED 1
+#include <immintrin.h>
+#else
+#define SIMD_SUPPORTED 0
+#endif
+
+#define PRINT_MAX_ELEMENTS 16
+
+// which side of a kernel is a single scalar repeated over the whole length
+typedef enum {
+    BROADCAST_NONE,
+    BROADCAST_LEFT,
+    BROADCAST_RIGHT,
+} Broadcast;
+
+typedef void (*F64Kernel)(double *out, const double *a, const double *b, size_t n, Broadcast broadcast);
+typedef void (*I32Kernel)(int32_t *out, const int32_t *a, const int32_t *b, size_t n, Broadcast broadcast);
+
+typedef struct {
+    const char *name;
+
+    // indexed by op - INST_ADD. there is no vector int division, see divideI32()
+    F64Kernel f64[4];
+    I32Kernel i32[3];
+
+    // min and max are never called on empty arrays
+    double (*sumF64)(const double *p, size_t n);
+    double (*minF64)(const double *p, size_t n);
+    double (*maxF64)(const double *p, size_t n);
+    int64_t (*sumI32)(const int32_t *p, size_t n);
+    int32_t (*minI32)(const int32_t *p, size_t n);
+    int32_t (*maxI32)(const int32_t *p, size_t n);
+} Kernels;
+
+// ===== SCALAR KERNELS (also the tails of the vector ones) =====
+
+#define SCALAR_BINARY(name, type, expr)                                                              \
+    static void name(type *out, const type *a, const type *b, size_t n, Broadcast broadcast) {      \
+        size_t aStep = broadcast != BROADCAST_LEFT;                                                  \
+        size_t bStep = broadcast != BROADCAST_RIGHT;                                                 \
+        for (size_t i = 0; i < n; i++) {                                                             \
+            type l = a[i * aStep];                                                                   \
+            type r = b[i * bStep];                                                                   \
+            out[i] = expr;                                                                           \
+        }                                                                                            \
+    }
+
+SCALAR_BINARY(addF64, double, l + r)
+SCALAR_BINARY(subF64, double, l - r)
+SCALAR_BINARY(multF64, double, l * r)
+SCALAR_BINARY(divF64, double, l / r)
+// through unsigned, like the int paths of addBoxes()
+SCALAR_BINARY(addI32, int32_t, (int32_t)((uint32_t)l + (uint32_t)r))
+SCALAR_BINARY(subI32, int32_t, (int32_t)((uint32_t)l - (uint32_t)r))
+SCALAR_BINARY(multI32, int32_t, (int32_t)((uint32_t)l * (uint32_t)r))
+
+#define SCALAR_FOLD(name, type, result, identity, expr)     \
+    static result name(const type *p, size_t n) {          \
+        result acc = identity;                              \
+        for (size_t i = 0; i < n; i++) {                    \
+            type x = p[i];                                  \
+            acc = expr;                                     \
+        }                                                   \
+        return acc;                                         \
+    }
+
+SCALAR_FOLD(sumF64, double, double, 0, acc + x)
+SCALAR_FOLD(minF64, double, double, p[0], x < acc ? x : acc)
+SCALAR_FOLD(maxF64, double, double, p[0], x > acc ? x : acc)
+SCALAR_FOLD(sumI32, int32_t, int64_t, 0, acc + x)
+SCALAR_FOLD(minI32, int32_t, int32_t, p[0], x < acc ? x : acc)
+SCALAR_FOLD(maxI32, int32_t, int32_t, p[0], x > acc ? x : acc)
+
+static Kernels scalarKernels = {
+    .name = "scalar",
+    .f64 = {addF64, subF64, multF64, divF64},
+    .i32 = {addI32, subI32, multI32},
+    .sumF64 = sumF64, .minF64 = minF64, .maxF64 = maxF64,
+    .sumI32 = sumI32, .minI32 = minI32, .maxI32 = maxI32,
+};
+
+#if SIMD_SUPPORTED
+
+// ===== VECTOR KERNELS =====
+
+// one function per (isa, element type, op). the vector loop covers whole registers and the
+// scalar kernel finishes the remaining elements
+#define SIMD_BINARY(name, isa, type, vec, width, load, store, set1, op, tail)                        \
+    __attribute__((target(isa)))                                                                     \
+    static void name(type *out, const type *a, const type *b, size_t n, Broadcast broadcast) {      \
+        size_t i = 0;                                                                                \
+        if (broadcast == BROADCAST_NONE) {                                                           \
+            for (; i + width <= n; i += width) store(out + i, op(load(a + i), load(b + i)));         \
+            tail(out + i, a + i, b + i, n - i, broadcast);                                           \
+        } else if (broadcast == BROADCAST_LEFT) {                                                    \
+            vec l = set1(a[0]);                                                                      \
+            for (; i + width <= n; i += width) store(out + i, op(l, load(b + i)));                   \
+            tail(out + i, a, b + i, n - i, broadcast);                                               \
+        } else {                                                                                     \
+            vec r = set1(b[0]);                                                                      \
+            for (; i + width <= n; i += width) store(out + i, op(load(a + i), r));                   \
+            tail(out + i, a + i, b, n - i, broadcast);                                               \
+        }                                                                                            \
+    }
+
+// min/max (identity p[0]) and f64 sums (identity 0), lanes are combined with the scalar fold
+#define SIMD_FOLD(name, isa, type, vec, width, load, store, set1, op, identity, tail, combine)       \
+    __attribute__((target(isa)))                                                                     \
+    static type name(const type *p, size_t n) {                                                      \
+        vec acc = set1(identity);                                                                    \
+        size_t i = 0;                                                                                \
+        for (; i + width <= n; i += width) acc = op(acc, load(p + i));                               \
+        type lanes[width];                                                                           \
+        store(lanes, acc);                                                                           \
+        type result = combine(tail(lanes, width), tail(p + i, n - i), n - i);                        \
+        return result;                                                                               \
+    }
+
+#define SUM_LANES(lanes, rest, restLength) ((lanes) + (rest))
+#define MIN_LANES(lanes, rest, restLength) ((restLength) && (rest) < (lanes) ? (rest) : (lanes))
+#define MAX_LANES(lanes, rest, restLength) ((restLength) && (rest) > (lanes) ? (rest) : (lanes))
+
+#define LOAD_PD256(p) _mm256_loadu_pd(p)
+#define STORE_PD256(p, v) _mm256_storeu_pd(p, v)
+#define LOAD_SI256(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE_SI256(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define LOAD_PD128(p) _mm_loadu_pd(p)
+#define STORE_PD128(p, v) _mm_storeu_pd(p, v)
+#define LOAD_SI128(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE_SI128(p, v) _mm_storeu_si128((__m128i *)(p), v)
+
+SIMD_BINARY(addF64Avx2, "avx2", double, __m256d, 4, LOAD_PD256, STORE_PD256, _mm256_set1_pd, _mm256_add_pd, addF64)
+SIMD_BINARY(subF64Avx2, "avx2", double, __m256d, 4, LOAD_PD256, STORE_PD256, _mm256_set1_pd, _mm256_sub_pd, subF64)
+SIMD_BINARY(multF64Avx2, "avx2", double, __m256d, 4, LOAD_PD256, STORE_PD256, _mm256_set1_pd, _mm256_mul_pd, multF64)
+SIMD_BINARY(divF64Avx2, "avx2", double, __m256d, 4, LOAD_PD256, STORE_PD256, _mm256_set1_pd, _mm256_div_pd, divF64)
+SIMD_BINARY(addI32Avx2, "avx2", int32_t, __m256i, 8, LOAD_SI256, STORE_SI256, _mm256_set1_epi32, _mm256_add_epi32, addI32)
+SIMD_BINARY(subI32Avx2, "avx2", int32_t, __m256i, 8, LOAD_SI256, STORE_SI256, _mm256_set1_epi32, _mm256_sub_epi32, subI32)
+SIMD_BINARY(multI32Avx2, "avx2", int32_t, __m256i, 8, LOAD_SI256, STORE_SI256, _mm256_set1_epi32, _mm256_mullo_epi32, multI32)
+
+SIMD_FOLD(sumF64Avx2, "avx2", double, __m256d, 4, LOAD_PD256, STORE_PD256, _mm256_set1_pd, _mm256_add_pd, 0, sumF64, SUM_LANES)
+SIMD_FOLD(minF64Avx2, "avx2", double, __m256d, 4, LOAD_PD256, STORE_PD256, _mm256_set1_pd, _mm256_min_pd, p[0], minF64, MIN_LANES)
+SIMD_FOLD(maxF64Avx2, "avx2", double, __m256d, 4, LOAD_PD256, STORE_PD256, _mm256_set1_pd, _mm256_max_pd, p[0], maxF64, MAX_LANES)
+SIMD_FOLD(minI32Avx2, "avx2", int32_t, __m256i, 8, LOAD_SI256, STORE_SI256, _mm256_set1_epi32, _mm256_min_epi32, p[0], minI32, MIN_LANES)
+SIMD_FOLD(maxI32Avx2, "avx2", int32_t, __m256i, 8, LOAD_SI256, STORE_SI256, _mm256_set1_epi32, _mm256_max_epi32, p[0], maxI32, MAX_LANES)
+
+// int sums are widened to 64 bits lane by lane so they can't wrap
+__attribute__((target("avx2")))
+static int64_t sumI32Avx2(const int32_t *p, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = LOAD_SI256(p + i);
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    int64_t lanes[4];
+    STORE_SI256(lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumI32(p + i, n - i);
+}
+
+SIMD_BINARY(addF64Sse, "sse4.1", double, __m128d, 2, LOAD_PD128, STORE_PD128, _mm_set1_pd, _mm_add_pd, addF64)
+SIMD_BINARY(subF64Sse, "sse4.1", double, __m128d, 2, LOAD_PD128, STORE_PD128, _mm_set1_pd, _mm_sub_pd, subF64)
+SIMD_BINARY(multF64Sse, "sse4.1", double, __m128d, 2, LOAD_PD128, STORE_PD128, _mm_set1_pd, _mm_mul_pd, multF64)
+SIMD_BINARY(divF64Sse, "sse4.1", double, __m128d, 2, LOAD_PD128, STORE_PD128, _mm_set1_pd, _mm_div_pd, divF64)
+SIMD_BINARY(addI32Sse, "sse4.1", int32_t, __m128i, 4, LOAD_SI128, STORE_SI128, _mm_set1_epi32, _mm_add_epi32, addI32)
+SIMD_BINARY(subI32Sse, "sse4.1", int32_t, __m128i, 4, LOAD_SI128, STORE_SI128, _mm_set1_epi32, _mm_sub_epi32, subI32)
+SIMD_BINARY(multI32Sse, "sse4.1", int32_t, __m128i, 4, LOAD_SI128, STORE_SI128, _mm_set1_epi32, _mm_mullo_epi32, multI32)
+
+SIMD_FOLD(sumF64Sse, "sse4.1", double, __m128d, 2, LOAD_PD128, STORE_PD128, _mm_set1_pd, _mm_add_pd, 0, sumF64, SUM_LANES)
+SIMD_FOLD(minF64Sse, "sse4.1", double, __m128d, 2, LOAD_PD128, STORE_PD128, _mm_set1_pd, _mm_min_pd, p[0], minF64, MIN_LANES)
+SIMD_FOLD(maxF64Sse, "sse4.1", double, __m128d, 2, LOAD_PD128, STORE_PD128, _mm_set1_pd, _mm_max_pd, p[0], maxF64, MAX_LANES)
+SIMD_FOLD(minI32Sse, "sse4.1", int32_t, __m128i, 4, LOAD_SI128, STORE_SI128, _mm_set1_epi32, _mm_min_epi32, p[0], minI32, MIN_LANES)
+SIMD_FOLD(maxI32Sse, "sse4.1", int32_t, __m128i, 4, LOAD_SI128, STORE_SI128, _mm_set1_epi32, _mm_max_epi32, p[0], maxI32, MAX_LANES)
+
+__attribute__((target("sse4.1")))
+static int64_t sumI32Sse(const int32_t *p, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = LOAD_SI128(p + i);
+        acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(v));
+        acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+    }
+    int64_t lanes[2];
+    STORE_SI128(lanes, acc);
+    return lanes[0] + lanes[1] + sumI32(p + i, n - i);
+}
+
+static Kernels avx2Kernels = {
+    .name = "avx2",
+    .f64 = {addF64Avx2, subF64Avx2, multF64Avx2, divF64Avx2},
+    .i32 = {addI32Avx2, subI32Avx2, multI32Avx2},
+    .sumF64 = sumF64Avx2, .minF64 = minF64Avx2, .maxF64 = maxF64Avx2,
+    .sumI32 = sumI32Avx2, .minI32 = minI32Avx2, .maxI32 = maxI32Avx2,
+};
+
+static Kernels sseKernels = {
+    .name = "sse",
+    .f64 = {addF64Sse, subF64Sse, multF64Sse, divF64Sse},
+    .i32 = {addI32Sse, subI32Sse, multI32Sse},
+    .sumF64 = sumF64Sse, .minF64 = minF64Sse, .maxF64 = maxF64Sse,
+    .sumI32 = sumI32Sse, .minI32 = minI32Sse, .maxI32 = maxI32Sse,
+};
+
+#endif
+
+static Kernels *kernels;
+
+static Kernels* selectKernels(void) {
+    if (kernels != NULL) return kernels;
+    kernels = &scalarKernels;
+
+#if SIMD_SUPPORTED
+    char *env = getenv("NGS_SIMD");
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2");
+    int sse = __builtin_cpu_supports("sse4.1");
+
+    if (env != NULL && !strcmp(env, "scalar")) return kernels;
+    if (env != NULL && !strcmp(env, "sse")) avx2 = 0;
+
+    if (avx2) {
+        kernels = &avx2Kernels;
+    } else if (sse) {
+        kernels = &sseKernels;
+    }
+#endif
+
+    return kernels;
+}
+
+// ===== ARRAYS =====
+
+static size_t elementSize(ArrayKind kind) {
+    return kind == ARRAY_F64 ? sizeof(double) : sizeof(int32_t);
+}
+
+Array* newArray(ArrayKind kind, size_t length) {
+    Array *array = (Array *)safe_malloc(sizeof(Array));
+    // one spare element so empty arrays still own a buffer
+    array->obj = (Object){.length = length, .ref = safe_malloc(elementSize(kind) * (length + 1))};
+    array->kind = kind;
+    TRACK_ALLOC(array, sizeof(Array) + elementSize(kind) * (length + 1), OBJECT_ARRAY);
+    return array;
+}
+
+void freeArray(Array *array) {
+    TRACK_FREE(array);
+    free(array->obj.ref);
+    free(array);
+}
+
+static Array* asArray(Box box) {
+    return TYPE(box) == VAL_ARRAY ? (Array *)(intptr_t)box.obj : NULL;
+}
+
+static int isFloat(Box box, Array *array) {
+    return array != NULL ? array->kind == ARRAY_F64 : TYPE(box) == VAL_FLOAT;
+}
+
+// an operand of an f64 kernel: the array's own buffer, i32 elements converted into `out`,
+// or a scalar kept in `scalar`
+static const double* f64Operand(Box box, Array *array, double *out, double *scalar) {
+    if (array == NULL) {
+        *scalar = TYPE(box) == VAL_INT ? (double)box.int32 : box.float64;
+        return scalar;
+    }
+    if (array->kind == ARRAY_F64) return (double *)array->obj.ref;
+
+    int32_t *elements = (int32_t *)array->obj.ref;
+    for (size_t i = 0; i < array->obj.length; i++) {
+        out[i] = (double)elements[i];
+    }
+    return out;
+}
+
+static void divideI32(int32_t *out, const int32_t *a, const int32_t *b, size_t n, Broadcast broadcast) {
+    size_t aStep = broadcast != BROADCAST_LEFT;
+    size_t bStep = broadcast != BROADCAST_RIGHT;
+
+    for (size_t i = 0; i < n; i++) {
+        int32_t l = a[i * aStep];
+        int32_t r = b[i * bStep];
+        if (r == 0) runtimeError("division by zero");
+        // INT32_MIN / -1 wraps like the other i32 operations instead of trapping
+        out[i] = r == -1 ? (int32_t)(0u - (uint32_t)l) : l / r;
+    }
+}
+
+Box arrayArith(InstType op, Box loperand, Box roperand) {
+    if (TYPE(loperand) == VAL_MAP || TYPE(roperand) == VAL_MAP) runtimeError("maps don't support arithmetic");
+    if (TYPE(loperand) == VAL_STRING || TYPE(roperand) == VAL_STRING) {
+        runtimeError("illegal operation between array and string");
+    }
+
+    Array *larray = asArray(loperand);
+    Array *rarray = asArray(roperand);
+    if (larray != NULL && rarray != NULL && larray->obj.length != rarray->obj.length) {
+        runtimeError("element-wise operation on arrays of different lengths");
+    }
+
+    size_t length = larray != NULL ? larray->obj.length : rarray->obj.length;
+    Broadcast broadcast = larray == NULL ? BROADCAST_LEFT : rarray == NULL ? BROADCAST_RIGHT : BROADCAST_NONE;
+    Kernels *k = selectKernels();
+
+    Array *result;
+    if (isFloat(loperand, larray) || isFloat(roperand, rarray)) {
+        result = newArray(ARRAY_F64, length);
+        double *out = (double *)result->obj.ref;
+
+        double lscalar, rscalar;
+        const double *a = f64Operand(loperand, larray, out, &lscalar);
+        const double *b = f64Operand(roperand, rarray, out, &rscalar);
+        k->f64[op - INST_ADD](out, a, b, length, broadcast);
+    } else {
+        result = newArray(ARRAY_I32, length);
+        int32_t *out = (int32_t *)result->obj.ref;
+
+        const int32_t *a = larray != NULL ? (int32_t *)larray->obj.ref : &loperand.int32;
+        const int32_t *b = rarray != NULL ? (int32_t *)rarray->obj.ref : &roperand.int32;
+        if (op == INST_DIV) {
+            divideI32(out, a, b, length, broadcast);
+        } else {
+            k->i32[op - INST_ADD](out, a, b, length, broadcast);
+        }
+    }
+
+    cleanup_object(loperand);
+    cleanup_object(roperand);
+
+    return createBox(result, VAL_ARRAY);
+}
+
+static Box intOrFloat(int64_t value) {
+    if (value >= INT32_MIN && value <= INT32_MAX) {
+        int32_t result = (int32_t)value;
+        return createBox(&result, VAL_INT);
+    }
+    double result = (double)value;
+    return createBox(&result, VAL_FLOAT);
+}
+
+Box arrayReduce(Box box, Reduction reduction) {
+    if (reduction == REDUCE_LEN && TYPE(box) == VAL_MAP) return intOrFloat((int64_t)((Object *)(intptr_t)box.obj)->length);
+    if (reduction == REDUCE_LEN && TYPE(box) == VAL_STRING) return intOrFloat((int64_t)((Object *)(intptr_t)box.obj)->length - 1);
+
+    Array *array = asArray(box);
+    if (array == NULL) runtimeError("expected an array");
+
+    size_t n = array->obj.length;
+    if (reduction == REDUCE_LEN) return intOrFloat((int64_t)n);
+
+    if (n == 0 && reduction != REDUCE_SUM) {
+        runtimeError(reduction == REDUCE_MIN ? "min of an empty array" : "max of an empty array");
+    }
+
+    Kernels *k = selectKernels();
+    if (array->kind == ARRAY_F64) {
+        double *p = (double *)array->obj.ref;
+        double result = reduction == REDUCE_SUM ? k->sumF64(p, n) : reduction == REDUCE_MIN ? k->minF64(p, n) : k->maxF64(p, n);
+        return createBox(&result, VAL_FLOAT);
+    }
+
+    int32_t *p = (int32_t *)array->obj.ref;
+    if (reduction == REDUCE_SUM) return intOrFloat(k->sumI32(p, n));
+
+    int32_t result = reduction == REDUCE_MIN ? k->minI32(p, n) : k->maxI32(p, n);
+    return createBox(&result, VAL_INT);
+}
+
+static size_t checkedIndex(Array *array, Box index) {
+    if (array == NULL) runtimeError("indexing a value that is not an array");
+    if (TYPE(index) != VAL_INT) runtimeError("array index must be an int");
+    if (index.int32 < 0 || (size_t)index.int32 >= array->obj.length) runtimeError("array index out of bounds");
+    return (size_t)index.int32;
+}
+
+Box arrayGet(Box box, Box index) {
+    Array *array = asArray(box);
+    size_t i = checkedIndex(array, index);
+
+    if (array->kind == ARRAY_F64) return createBox((double *)array->obj.ref + i, VAL_FLOAT);
+    return createBox((int32_t *)array->obj.ref + i, VAL_INT);
+}
+
+void arraySet(Box box, Box index, Box value) {
+    Array *array = asArray(box);
+    size_t i = checkedIndex(array, index);
+    ValueType type = TYPE(value);
+
+    if (array->kind == ARRAY_F64 && (type == VAL_INT || type == VAL_FLOAT)) {
+        ((double *)array->obj.ref)[i] = type == VAL_INT ? (double)value.int32 : value.float64;
+    } else if (array->kind == ARRAY_I32 && type == VAL_INT) {
+        ((int32_t *)array->obj.ref)[i] = value.int32;
+    } else {
+        runtimeError(array->kind == ARRAY_I32 ? "int arrays can only hold ints" : "float arrays can only hold numbers");
+    }
+}
+
+void arrayLiteral(int count) {
+    Box *elements = vm->operandStack + vm->sp - count + 1;
+    ArrayKind kind = ARRAY_I32;
+
+    for (int i = 0; i < count; i++) {
+        ValueType type = TYPE(elements[i]);
+        if (type == VAL_FLOAT) {
+            kind = ARRAY_F64;
+        } else if (type != VAL_INT) {
+            runtimeError("array elements must be numbers");
+        }
+    }
+
+    Array *array = newArray(kind, count);
+    for (int i = 0; i < count; i++) {
+        int index = i;
+        arraySet(createBox(array, VAL_ARRAY), createBox(&index, VAL_INT), elements[i]);
+    }
+
+    vm->sp -= count;
+    STACK_PUSH(createBox(array, VAL_ARRAY));
+}
+
+void allocArray(ArrayKind kind) {
+    STACK_POP(Box length);
+    if (TYPE(length) != VAL_INT || length.int32 < 0) runtimeError("array length must be a non-negative int");
+
+    Array *array = newArray(kind, length.int32);
+    memset(array->obj.ref, 0, elementSize(kind) * length.int32);
+    STACK_PUSH(createBox(array, VAL_ARRAY));
+}
+
+void reduceArray(Reduction reduction) {
+    STACK_POP(Box array);
+    STACK_PUSH(arrayReduce(array, reduction));
+    cleanup_object(array);
+}
+
+void printArray(Array *array) {
+    printf("[");
+    for (size_t i = 0; i < array->obj.length && i < PRINT_MAX_ELEMENTS; i++) {
+        if (i) printf(", ");
+        if (array->kind == ARRAY_F64) {
+            printf("%f", ((double *)array->obj.ref)[i]);
+        } else {
+            printf("%d", ((int32_t *)array->obj.ref)[i]);
+        }
+    }
+    if (array->obj.length > PRINT_MAX_ELEMENTS) printf(", ... %zu elements", array->obj.length);
+    printf("]");
+}
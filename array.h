@@ -0,0 +1,46 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include "vm.h"
+
+// contiguous numeric arrays. element-wise + - * / and the reductions run on AVX2 or SSE4.1
+// kernels picked at startup from what the cpu supports, $NGS_SIMD=scalar|sse|avx2 overrides it.
+// i32 arithmetic wraps around instead of promoting, anything mixed with a float becomes f64
+
+typedef enum {
+    ARRAY_I32,
+    ARRAY_F64,
+} ArrayKind;
+
+typedef enum {
+    REDUCE_LEN,
+    REDUCE_SUM,
+    REDUCE_MIN,
+    REDUCE_MAX,
+} Reduction;
+
+typedef struct {
+    // length is the number of elements in ref
+    Object obj;
+    ArrayKind kind;
+} Array;
+
+Array* newArray(ArrayKind kind, size_t length);
+void freeArray(Array *array);
+
+// op is one of INST_ADD, INST_SUB, INST_MULT, INST_DIV, at least one operand is an array or a map,
+// which is reported as an error
+Box arrayArith(InstType op, Box loperand, Box roperand);
+Box arrayReduce(Box array, Reduction reduction);
+Box arrayGet(Box array, Box index);
+void arraySet(Box array, Box index, Box value);
+
+// operand stack entry points shared by the interpreter, the JIT and --emit-c code, indexing is
+// indexGet()/indexSet() in vm.h
+void arrayLiteral(int count);
+void allocArray(ArrayKind kind);
+void reduceArray(Reduction reduction);
+
+void printArray(Array *array);
+
+#endif
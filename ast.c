@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+#include "cache.h"
+#include "utils.h"
+
+Ast ast;
+
+void astInitialize(char *source) {
+    ast = (Ast){.source = source};
+
+    ast.capacity = 1024;
+    ast.nodes = (Node *)safe_malloc(sizeof(Node) * ast.capacity);
+    ast.nodes[0] = (Node){.type = NODE_NONE};
+    ast.length = 1;
+
+    ast.namesCapacity = 64;
+    ast.names = (Name *)safe_malloc(sizeof(Name) * ast.namesCapacity);
+    ast.bucketsCapacity = 128;
+    ast.buckets = (int *)safe_calloc(ast.bucketsCapacity, sizeof(int));
+}
+
+void freeAst(void) {
+    free(ast.nodes);
+    free(ast.names);
+    free(ast.buckets);
+    free(ast.functions);
+    free(ast.keyNames);
+    ast = (Ast){0};
+}
+
+int newNode(NodeType type, int line) {
+    if (ast.length >= ast.capacity) {
+        ast.capacity *= 2;
+        ast.nodes = (Node *)safe_realloc(ast.nodes, sizeof(Node) * ast.capacity);
+    }
+
+    ast.nodes[ast.length] = (Node){.type = type, .line = line};
+    return ast.length++;
+}
+
+int newFunction(int firstLine) {
+    if (ast.functionsLength >= ast.functionsCapacity) {
+        ast.functionsCapacity = ast.functionsCapacity == 0 ? 16 : ast.functionsCapacity * 2;
+        ast.functions = (FunctionInfo *)safe_realloc(ast.functions, sizeof(FunctionInfo) * ast.functionsCapacity);
+    }
+
+    ast.functions[ast.functionsLength] = (FunctionInfo){.firstLine = firstLine, .names = ast.keyNamesLength, .cached = -1, .symbol = -1};
+    return ast.functionsLength++;
+}
+
+void addKeyName(int name) {
+    if (ast.keyNamesLength >= ast.keyNamesCapacity) {
+        ast.keyNamesCapacity = ast.keyNamesCapacity == 0 ? 64 : ast.keyNamesCapacity * 2;
+        ast.keyNames = (int *)safe_realloc(ast.keyNames, sizeof(int) * ast.keyNamesCapacity);
+    }
+    ast.keyNames[ast.keyNamesLength++] = name;
+}
+
+// bucket holding the name, or the empty one it would go in
+static int findBucket(const char *lexeme, int length, uint64_t hash) {
+    int mask = ast.bucketsCapacity - 1;
+    int bucket = hash & mask;
+
+    while (ast.buckets[bucket] != 0) {
+        Name *name = &ast.names[ast.buckets[bucket] - 1];
+        if (name->hash == hash && name->length == length && !memcmp(name->lexeme, lexeme, length)) break;
+        bucket = (bucket + 1) & mask;
+    }
+    return bucket;
+}
+
+static void growBuckets(void) {
+    free(ast.buckets);
+    ast.bucketsCapacity *= 2;
+    ast.buckets = (int *)safe_calloc(ast.bucketsCapacity, sizeof(int));
+
+    for (int i = 0; i < ast.namesLength; i++) {
+        Name *name = &ast.names[i];
+        ast.buckets[findBucket(name->lexeme, name->length, name->hash)] = i + 1;
+    }
+}
+
+int internName(char *lexeme, int length) {
+    uint64_t hash = hashBytes(0xcbf29ce484222325ULL, lexeme, length);
+    int bucket = findBucket(lexeme, length, hash);
+    if (ast.buckets[bucket] != 0) return ast.buckets[bucket] - 1;
+
+    if (ast.namesLength >= ast.namesCapacity) {
+        ast.namesCapacity *= 2;
+        ast.names = (Name *)safe_realloc(ast.names, sizeof(Name) * ast.namesCapacity);
+    }
+    ast.names[ast.namesLength] = (Name){
+        .lexeme = lexeme, .length = length, .hash = hash,
+        .var = -1, .param = -1, .symbol = -1, .native = -2, .intrinsic = -2, .keyed = -1,
+    };
+    ast.buckets[bucket] = ++ast.namesLength;
+
+    // kept at most half full
+    if (ast.namesLength * 2 > ast.bucketsCapacity) growBuckets();
+    return ast.namesLength - 1;
+}
+
+int findName(const char *lexeme, int length) {
+    int bucket = findBucket(lexeme, length, hashBytes(0xcbf29ce484222325ULL, lexeme, length));
+    return ast.buckets[bucket] - 1;
+}
@@ -0,0 +1,158 @@
+#ifndef AST_H
+#define AST_H
+
+#include <stdint.h>
+#include "vm.h"
+#include "scanner.h"
+
+// the parser turns a unit into a tree of nodes kept in one growable array, which the passes after
+// it walk: scope resolution and code generation in compiler.c, constant folding in optimizer.c.
+// nodes refer to each other by index so the array can move while it grows, and all of it is freed
+// at once when the unit is done
+
+typedef enum {
+    // node 0, stands for no node
+    NODE_NONE,
+
+    // value
+    NODE_CONSTANT,
+    // a: offset of the lexeme in the source, b: its length
+    NODE_STRING,
+    // a: name. resolved to a NODE_VAR (a: variable slot) or a NODE_PARAM (a: parameter index)
+    NODE_NAME,
+    NODE_VAR,
+    NODE_PARAM,
+    // a: name, b: first NODE_ARG. resolved to a call of a function (a: symbol, c: name), a
+    // NODE_NATIVE (a: index in natives) or a NODE_INTRINSIC (a: index in intrinsics)
+    NODE_CALL,
+    // as NODE_CALL, c: line of "spawn"
+    NODE_SPAWN,
+    NODE_NATIVE,
+    NODE_INTRINSIC,
+    // a: expression
+    NODE_ARG,
+    // a: first element
+    NODE_ARRAY,
+    // a[b]
+    NODE_INDEX,
+    // a op b, c: INST_ADD, INST_SUB, INST_MULT or INST_DIV
+    NODE_BINARY,
+    // a op b, c: Condition
+    NODE_COMPARE,
+
+    // a: name, b: initializer
+    NODE_LET,
+    // a: name, then the variable slot once resolved, b: value, c: line of "="
+    NODE_ASSIGN,
+    // a: NODE_NAME of the array, b: index, c: value
+    NODE_INDEX_ASSIGN,
+    // a: condition, b: block, c: else block or NODE_IF
+    NODE_IF,
+    // a: condition, b: block, c: variables in scope at the loop once resolved
+    NODE_LOOP,
+    // a: first statement, b: variables it declares once resolved, c: line of its }
+    NODE_BLOCK,
+    // a: expression
+    NODE_RETURN,
+    NODE_YIELD,
+    // a: name, b: body, 0 while only its tokens have been hashed, c: index in ast.functions
+    NODE_FUNCTION,
+    // a: offset of the path in the source, b: its length
+    NODE_IMPORT,
+} NodeType;
+
+typedef struct {
+    NodeType type;
+    // line the node's instructions are attributed to
+    int line;
+    int a;
+    int b;
+    int c;
+    // next statement of a block or the unit, argument of a call, element of an array or parameter
+    // of a function, 0 at the end
+    int next;
+    Box value;
+} Node;
+
+// an identifier of the unit, every occurrence of it shares one
+typedef struct {
+    char *lexeme;
+    int length;
+    uint64_t hash;
+
+    // what the name stands for at the node the resolver is at. innermost variable and first
+    // parameter and function of that name, -1 if there is none
+    int var;
+    int param;
+    int symbol;
+    // index in natives and intrinsic of that name, -1 if there is none, -2 until looked up
+    int native;
+    int intrinsic;
+
+    // function whose key already covers the name, see FunctionInfo
+    int keyed;
+} Name;
+
+typedef struct {
+    // first parameter, a NODE_NAME each
+    int params;
+    // line of "fun"
+    int firstLine;
+
+    // hash of its tokens from the name to the closing } with their lines relative to firstLine,
+    // 0 if the unit has no function cache. the resolver completes the key with what the names
+    // among them, ast.keyNames[names] on, resolve to outside of it
+    uint64_t tokens;
+    int names;
+    int namesLength;
+    // scanner right after "fun", to parse the function from once the cache turns out to lack it
+    Scanner start;
+
+    // filled in by the resolver: its key (0 if it can't be cached) or the index of the cached code
+    // that stands in for its body (-1 if there is none), its symbol and the first variable slot of
+    // its frame
+    uint64_t key;
+    int cached;
+    int symbol;
+    int localsBase;
+} FunctionInfo;
+
+typedef struct {
+    char *source;
+
+    Node *nodes;
+    int length;
+    int capacity;
+
+    Name *names;
+    int namesLength;
+    int namesCapacity;
+    // open addressing on the hash, name index + 1 or 0 for an empty bucket
+    int *buckets;
+    int bucketsCapacity;
+
+    FunctionInfo *functions;
+    int functionsLength;
+    int functionsCapacity;
+    int *keyNames;
+    int keyNamesLength;
+    int keyNamesCapacity;
+} Ast;
+
+extern Ast ast;
+
+// empties ast for the unit whose source starts at source
+void astInitialize(char *source);
+void freeAst(void);
+
+// index of a new node, all of whose fields besides type and line are 0
+int newNode(NodeType type, int line);
+int newFunction(int firstLine);
+void addKeyName(int name);
+
+// index of the name, added if it is new
+int internName(char *lexeme, int length);
+// -1 if the unit never mentions it
+int findName(const char *lexeme, int length);
+
+#endif
@@ -0,0 +1,16 @@
+#!/bin/sh
+# times the array kernels against the equivalent scalar loop: ./bench/arrays.sh [path to main]
+main=${1:-./main}
+dir=$(dirname "$0")
+
+run() {
+    start=$(date +%s.%N)
+    env "$@" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "%.3fs\n", $2 - $1 }'
+}
+
+printf "%-22s" "scalar loop"; run "$main" "$dir/scalar_ops.ngs"
+for simd in scalar sse avx2; do
+    printf "%-22s" "arrays ($simd)"; run NGS_SIMD=$simd "$main" "$dir/array_ops.ngs"
+done
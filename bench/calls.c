@@ -0,0 +1,70 @@
+// calls per second through the embedding API, see ngs.h:
+//   make lib && cc -O2 -I. bench/calls.c libngs.a -lm -pthread -o calls && ./calls [calls]
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ngs.h"
+
+static const char *script =
+    "let calls = 0;\n"
+    "fun add(a, b) {\n"
+    "    return a + b;\n"
+    "}\n"
+    "fun count(step) {\n"
+    "    calls = calls + step;\n"
+    "    return calls;\n"
+    "}\n"
+    "fun greet(name) {\n"
+    "    return \"hello \" + name;\n"
+    "}\n"
+    "fun checksum(n) {\n"
+    "    let total = 0;\n"
+    "    let i = 0;\n"
+    "    loop i < n {\n"
+    "        total = total + i * i;\n"
+    "        i = i + 1;\n"
+    "    }\n"
+    "    return total;\n"
+    "}\n";
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, int function, Box *args, int nargs, int calls, int releaseResult) {
+    Box result;
+    double start = now();
+    for (int i = 0; i < calls; i++) {
+        if (ngsCall(function, args, nargs, &result) != 0) exit(1);
+        if (releaseResult) ngsRelease(result);
+    }
+    double elapsed = now() - start;
+
+    printf("%-16s %10.0f calls/s  %7.3f us/call\n", name, calls / elapsed, elapsed * 1e6 / calls);
+}
+
+int main(int argc, char *argv[]) {
+    int calls = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    if (ngsLoad(script) != 0) return 1;
+
+    int one = 1;
+    int two = 2;
+    int ten = 10;
+    Box numbers[] = {createBox(&one, VAL_INT), createBox(&two, VAL_INT)};
+    Box name = ngsString("world");
+    Box loopLength = createBox(&ten, VAL_INT);
+
+    bench("add(1, 2)", ngsFunction("add"), numbers, 2, calls, 0);
+    bench("count(1)", ngsFunction("count"), numbers, 1, calls, 0);
+    bench("greet(\"world\")", ngsFunction("greet"), &name, 1, calls, 1);
+    bench("checksum(10)", ngsFunction("checksum"), &loopLength, 1, calls, 0);
+
+    ngsRelease(name);
+    ngsFree();
+    return 0;
+}
@@ -0,0 +1,10 @@
+#!/bin/sh
+# coroutine switches per second, 1000 tasks yielding 1000 times each:
+# ./bench/coroutines.sh [path to main]
+main=${1:-./main}
+dir=$(dirname "$0")
+
+start=$(date +%s.%N)
+switches=$("$main" "$dir/coroutines.ngs" | grep -m1 '^[0-9][0-9]*$')
+end=$(date +%s.%N)
+echo "$start $end $switches" | awk '{ printf "%d switches in %.3fs, %.0f switches/s\n", $3, $2 - $1, $3 / ($2 - $1) }'
@@ -0,0 +1,33 @@
+#!/bin/sh
+# records per second through `main each` against one process per record:
+# ./bench/each.sh [path to main] [records]
+main=${1:-./main}
+records=${2:-200000}
+script=$(mktemp)
+
+cat > "$script" <<'NGS'
+let seen = 0;
+fun record(line) {
+    seen = seen + 1;
+    print(line + " " + str(len(line)));
+    return 0;
+}
+NGS
+
+printf "%-22s" "each"
+seq 1 "$records" | "$main" each --stats "$script" 2>&1 > /dev/null | sed -n 's/.*, \([0-9]*\) per second$/\1 records\/s/p'
+
+# the same work as a whole script per record, over a sample of them
+sample=200
+printf 'print("1" + " " + str(len("1")));\n' > "$script"
+start=$(date +%s.%N)
+i=0
+while [ $i -lt $sample ]; do
+    "$main" "$script" > /dev/null
+    i=$((i + 1))
+done
+end=$(date +%s.%N)
+printf "%-22s" "process per record"
+echo "$start $end $sample" | awk '{ printf "%.0f records/s\n", $3 / ($2 - $1) }'
+
+rm -f "$script"
@@ -0,0 +1,259 @@
+// compiler throughput on generated scripts of growing size, with the time of scanning on its own
+// and of each pass of compile() (see PassTimes in compiler.h) in tokens and lines per second:
+//   make lib && cc -O2 -I. bench/frontend.c libngs.a -lm -pthread -o frontend
+//   ./frontend [functions] [locals] [depth] [strings]   times 1/8, 1/4, 1/2 and all of the functions
+//   ./frontend -f script.ngs                             times a script of your own
+//   ./frontend -p [functions] [locals] [depth] [strings] prints the script it would generate
+// every block of a generated function declares locals variables and nests an if or a loop until
+// depth is reached, strings is the percentage of the variables initialized with a string literal
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compiler.h"
+#include "scanner.h"
+
+#define RUNS 5
+
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+} Source;
+
+typedef struct {
+    int locals;
+    int depth;
+    int strings;
+    // variables declared so far, decides which ones get a string
+    int declared;
+} Shape;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void append(Source *source, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(source->text + source->length, source->capacity - source->length, format, args);
+        va_end(args);
+        if ((size_t)written < source->capacity - source->length) {
+            source->length += written;
+            return;
+        }
+        source->capacity *= 2;
+        source->text = (char *)realloc(source->text, source->capacity);
+    }
+}
+
+// identifiers can only hold letters, so numbers are written in base 26
+static void letters(char *buffer, int n) {
+    char digits[16];
+    int length = 0;
+    do {
+        digits[length++] = 'a' + n % 26;
+        n /= 26;
+    } while (n > 0);
+    for (int i = 0; i < length; i++) buffer[i] = digits[length - 1 - i];
+    buffer[length] = '\0';
+}
+
+// name of the variable number i declared at the level
+static void variable(char *buffer, int level, int i) {
+    buffer[0] = 'v';
+    letters(buffer + 1, level);
+    size_t length = strlen(buffer);
+    buffer[length++] = 'x';
+    letters(buffer + length, i);
+}
+
+static void indent(Source *source, int level) {
+    append(source, "%*s", level * 4, "");
+}
+
+// a block at the given level of nesting, 1 for a function's body
+static void block(Source *source, Shape *shape, int level) {
+    char name[40];
+    char number[40] = "a";
+    for (int i = 0; i < shape->locals; i++) {
+        int declared = shape->declared++;
+        variable(name, level, i);
+        indent(source, level);
+        if (declared * 37 % 100 < shape->strings) {
+            append(source, "let %s = \"literal number %d of the script\";\n", name, declared);
+        } else {
+            append(source, "let %s = (%s - a) * %d + b;\n", name, number, declared % 13 + 1);
+            strcpy(number, name);
+        }
+    }
+    if (level >= shape->depth) return;
+
+    indent(source, level);
+    if (level % 2) {
+        append(source, "if %s > %d {\n", number, level * 10);
+        block(source, shape, level + 1);
+        indent(source, level);
+        append(source, "} else {\n");
+        indent(source, level + 1);
+        append(source, "r = r + %d;\n", level);
+        indent(source, level);
+        append(source, "}\n");
+    } else {
+        letters(name, level);
+        append(source, "let i%s = 0;\n", name);
+        indent(source, level);
+        append(source, "loop i%s < %d {\n", name, level * 5);
+        block(source, shape, level + 1);
+        letters(name, level);
+        indent(source, level + 1);
+        append(source, "i%s = i%s + 1;\n", name, name);
+        indent(source, level);
+        append(source, "}\n");
+    }
+}
+
+// functions that each call the one before, then a call of the last one
+static char* generate(int functions, int locals, int depth, int strings) {
+    Source source = {.text = (char *)malloc(4096), .capacity = 4096};
+    source.text[0] = '\0';
+    Shape shape = {.locals = locals, .depth = depth, .strings = strings};
+    char name[16];
+
+    for (int i = 0; i < functions; i++) {
+        letters(name, i);
+        append(&source, "fun f%s(a, b) {\n    let r = b;\n", name);
+        if (i > 0) {
+            letters(name, i - 1);
+            append(&source, "    r = f%s(r, a);\n", name);
+        }
+        block(&source, &shape, 1);
+        append(&source, "    return a + r;\n}\n\n");
+    }
+    letters(name, functions - 1);
+    append(&source, "print(f%s(1, 2));\n", name);
+    return source.text;
+}
+
+static char* readFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "could not open %s\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    char *text = (char *)malloc(length + 1);
+    if (fread(text, 1, length, file) != (size_t)length) {
+        fprintf(stderr, "could not read %s\n", path);
+        exit(1);
+    }
+    text[length] = '\0';
+    fclose(file);
+    return text;
+}
+
+// seconds scanning the whole source takes, its tokens go to tokens
+static double scanOnce(const char *source, long *tokens) {
+    char *buffer = strdup(source);
+    double start = now();
+    scannerInitialize(buffer);
+    long count = 0;
+    while (nextToken().type != TOK_EOF) count++;
+    double elapsed = now() - start;
+    free(buffer);
+    *tokens = count;
+    return elapsed;
+}
+
+static void compileOnce(const char *source) {
+    char *buffer = strdup(source);
+    scannerInitialize(buffer);
+    int length = 0;
+    Function *functions;
+    int functionsLength;
+    LineTable lines;
+    Inst *program = compile(NULL, &length, &functions, &functionsLength, &lines);
+
+    free(program);
+    for (int i = 0; i < functionsLength; i++) free(functions[i].name);
+    free(functions);
+    freeLines(&lines);
+    free(buffer);
+}
+
+static void report(const char *pass, double seconds, long tokens, long lines) {
+    printf("  %-10s%10.2f ms%10.2f Mtokens/s%10.2f Mlines/s\n", pass, seconds * 1e3,
+           tokens / seconds / 1e6, lines / seconds / 1e6);
+}
+
+// means over RUNS of scanning and compiling source
+static void bench(const char *name, const char *source) {
+    long lines = 1;
+    for (const char *c = source; *c; c++) lines += *c == '\n';
+
+    long tokens = 0;
+    double scan = 0;
+    PassTimes total = {0};
+    for (int run = 0; run < RUNS; run++) {
+        scan += scanOnce(source, &tokens);
+        passTimes = (PassTimes){0};
+        compileOnce(source);
+        total.parse += passTimes.parse;
+        total.resolve += passTimes.resolve;
+        total.optimize += passTimes.optimize;
+        total.emit += passTimes.emit;
+    }
+
+    printf("%s: %ld lines, %ld tokens, %zu bytes\n", name, lines, tokens, strlen(source));
+    report("scan", scan / RUNS, tokens, lines);
+    report("parse", total.parse / RUNS, tokens, lines);
+    report("resolve", total.resolve / RUNS, tokens, lines);
+    report("optimize", total.optimize / RUNS, tokens, lines);
+    report("emit", total.emit / RUNS, tokens, lines);
+    report("compile", (total.parse + total.resolve + total.optimize + total.emit) / RUNS, tokens, lines);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        char *source = readFile(argv[2]);
+        bench(argv[2], source);
+        free(source);
+        return 0;
+    }
+
+    int print = argc > 1 && strcmp(argv[1], "-p") == 0;
+    char **args = argv + print;
+    int count = argc - print;
+    int functions = count > 1 ? atoi(args[1]) : 800;
+    int locals = count > 2 ? atoi(args[2]) : 4;
+    int depth = count > 3 ? atoi(args[3]) : 4;
+    int strings = count > 4 ? atoi(args[4]) : 20;
+    if (functions < 1 || locals < 0 || depth < 1 || strings < 0 || strings > 100) {
+        fprintf(stderr, "usage: %s [-p] [functions] [locals] [depth] [strings 0-100]\n", argv[0]);
+        return 1;
+    }
+
+    if (print) {
+        char *source = generate(functions, locals, depth, strings);
+        fputs(source, stdout);
+        free(source);
+        return 0;
+    }
+
+    for (int n = functions / 8 > 0 ? functions / 8 : functions; n <= functions; n *= 2) {
+        char name[64];
+        snprintf(name, sizeof(name), "%d functions", n);
+        char *source = generate(n, locals, depth, strings);
+        bench(name, source);
+        free(source);
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# line reading through the event loop with each backend:
+# ./bench/io.sh [path to main]
+main=${1:-./main}
+dir=$(dirname "$0")
+
+seq 1 200000 > /tmp/ngs_io_bench.txt
+
+run() {
+    start=$(date +%s.%N)
+    "$@" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "%.3fs\n", $2 - $1 }'
+}
+
+printf "%-22s" "io_uring"; run "$main" "$dir/io_lines.ngs"
+printf "%-22s" "epoll + threads"; run env NGS_IO=epoll "$main" "$dir/io_lines.ngs"
+
+rm -f /tmp/ngs_io_bench.txt
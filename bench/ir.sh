@@ -0,0 +1,28 @@
+#!/bin/sh
+# instructions generated for every benchmark with NGS_IR=0 and with the ir, and with a counters build
+# (make counters) the instructions it executes too: ./bench/ir.sh [path to main]
+main=${1:-./main}
+dir=$(dirname "$0")
+json=$(mktemp)
+
+generated() {
+    env NGS_COUNTERS_JSON=/dev/null "$@" disassemble "$file" 2> /dev/null | grep -c '^PC:'
+}
+
+executed() {
+    rm -f "$json"
+    env NGS_COUNTERS_JSON="$json" "$@" "$file" > /dev/null 2>&1
+    if [ -s "$json" ]; then
+        sed -n 's/^  "instructions": \([0-9]*\),$/\1/p' "$json"
+    else
+        echo -
+    fi
+}
+
+printf "%-22s %10s %10s %14s %14s\n" "" "generated" "with ir" "executed" "with ir"
+for file in "$dir"/*.ngs; do
+    printf "%-22s %10s %10s %14s %14s\n" "$(basename "$file" .ngs)" \
+        "$(generated NGS_IR=0 "$main")" "$(generated "$main")" \
+        "$(executed NGS_IR=0 "$main")" "$(executed "$main")"
+done
+rm -f "$json"
@@ -0,0 +1,79 @@
+// runs a command a number of times with its output thrown away and prints the median wall time
+// in seconds and the largest peak rss in kilobytes over the runs, see run.sh:
+//   cc -O2 bench/measure.c -o bench/measure && ./bench/measure runs command [arguments]
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareTimes(const void *a, const void *b) {
+    double l = *(const double *)a;
+    double r = *(const double *)b;
+    return (l > r) - (l < r);
+}
+
+// seconds the command took, its peak rss goes to rss. exits if it doesn't run or fails
+static double runOnce(char *argv[], long *rss) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        exit(1);
+    }
+    double elapsed = now() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        exit(1);
+    }
+    *rss = usage.ru_maxrss;
+    return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int runs = argc > 2 ? atoi(argv[1]) : 0;
+    if (runs < 1) {
+        fprintf(stderr, "usage: %s runs command [arguments]\n", argv[0]);
+        return 1;
+    }
+
+    double *times = (double *)malloc(runs * sizeof(double));
+    long peak = 0;
+    for (int i = 0; i < runs; i++) {
+        long rss;
+        times[i] = runOnce(argv + 2, &rss);
+        if (rss > peak) peak = rss;
+    }
+
+    qsort(times, runs, sizeof(double), compareTimes);
+    double median = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    printf("%.4f %ld\n", median, peak);
+
+    free(times);
+    return 0;
+}
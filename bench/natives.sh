@@ -0,0 +1,16 @@
+#!/bin/sh
+# times the math natives against the same work in script functions, and the string natives:
+# ./bench/natives.sh [path to main]
+main=${1:-./main}
+dir=$(dirname "$0")
+
+run() {
+    start=$(date +%s.%N)
+    "$main" "$1" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "%.3fs\n", $2 - $1 }'
+}
+
+printf "%-22s" "script functions"; run "$dir/script_math.ngs"
+printf "%-22s" "math natives"; run "$dir/native_math.ngs"
+printf "%-22s" "string natives"; run "$dir/native_strings.ngs"
@@ -0,0 +1,109 @@
+// compile time of a generated script without the function cache, with all of it cached and with
+// one function edited before every compile, see cache.h:
+//   make lib && cc -O2 -I. bench/recompile.c libngs.a -lm -pthread -o recompile && ./recompile [functions]
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "compiler.h"
+#include "scanner.h"
+
+#define RUNS 100
+
+static const char *path = "/tmp/ngs_recompile_bench.ngs";
+// XDG_CACHE_HOME for the run, so the user's cache is left alone
+static const char *cacheHome = "/tmp/ngs_recompile_cache";
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// functions with a nested loop and an if chain each, the first one gets edit added to its body
+static char* generate(int functions, int edit) {
+    size_t capacity = (size_t)functions * 512 + 64;
+    char *source = (char *)malloc(capacity);
+    size_t length = 0;
+
+    for (int i = 0; i < functions; i++) {
+        length += snprintf(source + length, capacity - length,
+            "fun f%d(a, b) {\n"
+            "    let x = a * %d + b;\n"
+            "    let y = x - %d;\n"
+            "    let i = 0;\n"
+            "    loop i < 100 {\n"
+            "        let j = 0;\n"
+            "        loop j < 10 {\n"
+            "            x = x + i * j + y * 2 - a;\n"
+            "            j = j + 1;\n"
+            "        }\n"
+            "        if x > y {\n"
+            "            y = y + x / 3;\n"
+            "        } else {\n"
+            "            y = 0;\n"
+            "        }\n"
+            "        i = i + 1;\n"
+            "    }\n"
+            "    return x + y + %d;\n"
+            "}\n", i, i, i, i == 0 ? edit : 0);
+    }
+    return source;
+}
+
+// microseconds to compile source, which is saved at path first so the cache can find it
+static double compileOnce(const char *source, int cached) {
+    FILE *file = fopen(path, "w");
+    fputs(source, file);
+    fclose(file);
+    char *buffer = strdup(source);
+
+    double start = now();
+    scannerInitialize(buffer);
+    int length = 0;
+    Function *functions;
+    int functionsLength;
+    LineTable lines;
+    Inst *program = compile(cached ? path : NULL, &length, &functions, &functionsLength, &lines);
+    double elapsed = (now() - start) * 1e6;
+
+    free(program);
+    for (int i = 0; i < functionsLength; i++) free(functions[i].name);
+    free(functions);
+    freeLines(&lines);
+    free(buffer);
+    return elapsed;
+}
+
+// mean over RUNS compiles of the script, with the first function edited before each of them if
+// editing is set. the first compile fills the cache
+static double bench(int functions, int cached, int editing) {
+    char *source = generate(functions, 0);
+    compileOnce(source, cached);
+    free(source);
+
+    double total = 0;
+    for (int run = 1; run <= RUNS; run++) {
+        source = generate(functions, editing ? run : 0);
+        total += compileOnce(source, cached);
+        free(source);
+    }
+    return total / RUNS;
+}
+
+int main(int argc, char *argv[]) {
+    int functions = argc > 1 ? atoi(argv[1]) : 30;
+    setenv("XDG_CACHE_HOME", cacheHome, 1);
+    system("rm -rf /tmp/ngs_recompile_cache");
+
+    printf("%-24s%8.1f us\n", "no cache", bench(functions, 0, 0));
+    printf("%-24s%8.1f us\n", "all functions cached", bench(functions, 1, 0));
+    printf("%-24s%8.1f us\n", "one function edited", bench(functions, 1, 1));
+
+    unlink(path);
+    system("rm -rf /tmp/ngs_recompile_cache");
+    return 0;
+}
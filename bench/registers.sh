@@ -0,0 +1,34 @@
+#!/bin/sh
+# instructions dispatched and time taken by every benchmark compiled to stack instructions only
+# (NGS_REGISTERS=0) and with register instructions, in the interpreter and with the jit. dispatches
+# need a counters build (make counters): ./bench/registers.sh [path to main]
+main=${1:-./main}
+dir=$(dirname "$0")
+json=$(mktemp)
+
+executed() {
+    rm -f "$json"
+    env NGS_COUNTERS_JSON="$json" "$@" "$file" > /dev/null 2>&1
+    if [ -s "$json" ]; then
+        sed -n 's/^  "instructions": \([0-9]*\),$/\1/p' "$json"
+    else
+        echo -
+    fi
+}
+
+run() {
+    start=$(date +%s.%N)
+    env "$@" "$file" > /dev/null 2>&1
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "%.3fs\n", $2 - $1 }'
+}
+
+printf "%-22s %12s %12s %10s %10s %10s %10s\n" "" "dispatched" "registers" "interp" "registers" "jit" "registers"
+for file in "$dir"/*.ngs; do
+    case $(basename "$file") in io_lines.ngs) continue ;; esac
+    printf "%-22s %12s %12s %10s %10s %10s %10s\n" "$(basename "$file" .ngs)" \
+        "$(executed NGS_REGISTERS=0 "$main")" "$(executed "$main")" \
+        "$(run NGS_REGISTERS=0 NGS_JIT=0 "$main")" "$(run NGS_JIT=0 "$main")" \
+        "$(run NGS_REGISTERS=0 "$main")" "$(run "$main")"
+done
+rm -f "$json"
@@ -0,0 +1,54 @@
+#!/bin/sh
+# every bench/*.ngs, or the ones named, with the median wall time over $BENCH_RUNS runs (5 by
+# default), the instructions a counters build (make counters) dispatches for it and the peak rss,
+# as json on stdout to compare between commits. make bench builds what it needs and runs it:
+#   ./bench/run.sh [path to main] [path to counters build] [benchmark...]
+main=${1:-./main}
+counters=${2:-}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+dir=$(dirname "$0")
+runs=${BENCH_RUNS:-5}
+measure="$dir/measure"
+json=$(mktemp)
+
+if [ ! -x "$measure" ]; then
+    cc -O2 -std=c99 "$dir/measure.c" -o "$measure" || exit 1
+fi
+
+# io_lines.ngs reads this
+seq 1 200000 > /tmp/ngs_io_bench.txt
+
+instructions() {
+    if [ -z "$counters" ]; then
+        echo null
+        return
+    fi
+    rm -f "$json"
+    NGS_COUNTERS_JSON="$json" "$counters" "$1" > /dev/null 2>&1
+    count=$(sed -n 's/^  "instructions": \([0-9]*\),$/\1/p' "$json" 2>/dev/null)
+    echo "${count:-null}"
+}
+
+if [ $# -eq 0 ]; then
+    set -- $(ls "$dir"/*.ngs | sed 's|.*/||; s|\.ngs$||')
+fi
+
+echo "{"
+echo "  \"commit\": \"$(git -C "$dir" rev-parse --short HEAD 2>/dev/null)\","
+echo "  \"runs\": $runs,"
+echo "  \"benchmarks\": ["
+separator=""
+for name in "$@"; do
+    echo "$name" >&2
+    result=$("$measure" "$runs" "$main" "$dir/$name.ngs") || result="null null"
+    printf '%s    {"name": "%s", "median_seconds": %s, "instructions": %s, "peak_rss_kb": %s}' \
+        "$separator" "$name" "${result% *}" "$(instructions "$dir/$name.ngs")" "${result#* }"
+    separator=",
+"
+done
+echo
+echo "  ]"
+echo "}"
+
+rm -f "$json" /tmp/ngs_io_bench.txt
@@ -0,0 +1,36 @@
+#!/bin/sh
+# a script that builds a map of strings and a table of floats before its work, run from source and
+# resumed from the snapshot it takes after the setup: ./bench/warm.sh [path to main]
+main=${1:-./main}
+script=$(mktemp)
+snap=$(mktemp)
+
+cat > "$script" <<NGS
+let names = map(1024);
+let i = 0;
+loop i < 20000 {
+    names[i] = "entry " + str(i * i);
+    i = i + 1;
+}
+let sines = floats(100000);
+i = 0;
+loop i < 100000 {
+    sines[i] = sin(i / 1000.0);
+    i = i + 1;
+}
+snapshot("$snap");
+print(names[1234]);
+print(sines[5000]);
+NGS
+
+run() {
+    start=$(date +%s.%N)
+    "$@" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "%.3fs\n", $2 - $1 }'
+}
+
+printf "%-22s" "from source"; run "$main" "$script"
+printf "%-22s" "resumed"; run "$main" resume "$snap"
+
+rm -f "$script" "$snap"
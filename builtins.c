@@ -0,0 +1,335 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include "builtins.h"
+#include "coroutine.h"
+#include "io.h"
+#include "allocs.h"
+#include "snapshot.h"
+#include "utils.h"
+
+static void argumentError(const char *native, const char *expected) {
+    char message[128];
+    snprintf(message, sizeof(message), "%s expects %s", native, expected);
+    runtimeError(message);
+}
+
+static double number(Box box, const char *native) {
+    switch (TYPE(box)) {
+    case VAL_INT: return (double)box.int32;
+    case VAL_FLOAT: return box.float64;
+    default:
+        argumentError(native, "a number");
+        return 0;
+    }
+}
+
+static int integer(Box box, const char *native) {
+    if (TYPE(box) != VAL_INT) argumentError(native, "an int");
+    return box.int32;
+}
+
+static Object* string(Box box, const char *native) {
+    if (TYPE(box) != VAL_STRING) argumentError(native, "a string");
+    return (Object *)(intptr_t)box.obj;
+}
+
+static Box floatBox(double value) {
+    return createBox(&value, VAL_FLOAT);
+}
+
+static Box intBox(int value) {
+    return createBox(&value, VAL_INT);
+}
+
+// ints stay ints, anything that doesn't fit is returned as a float
+static Box wholeNumber(double value) {
+    if (value >= INT32_MIN && value <= INT32_MAX) return intBox((int)value);
+    return floatBox(value);
+}
+
+// takes ownership of bytes, which must hold length characters and a terminator
+static Box newString(char *bytes, size_t length) {
+    Object *obj = (Object *)safe_malloc(sizeof(Object));
+    *obj = (Object){.length = length + 1, .ref = bytes};
+    TRACK_ALLOC(obj, sizeof(Object) + length + 1, OBJECT_STRING);
+    return createBox(obj, VAL_STRING);
+}
+
+static Box copyString(const char *bytes, size_t length) {
+    char *copy = (char *)safe_malloc(length + 1);
+    memcpy(copy, bytes, length);
+    copy[length] = '\0';
+    return newString(copy, length);
+}
+
+// ===== MATH =====
+
+static Box nativeSqrt(Box *args) { return floatBox(sqrt(number(args[0], "sqrt"))); }
+static Box nativeSin(Box *args) { return floatBox(sin(number(args[0], "sin"))); }
+static Box nativeCos(Box *args) { return floatBox(cos(number(args[0], "cos"))); }
+static Box nativeTan(Box *args) { return floatBox(tan(number(args[0], "tan"))); }
+static Box nativeExp(Box *args) { return floatBox(exp(number(args[0], "exp"))); }
+static Box nativeLog(Box *args) { return floatBox(log(number(args[0], "log"))); }
+static Box nativeFloat(Box *args) { return floatBox(number(args[0], "float")); }
+static Box nativeFloor(Box *args) { return wholeNumber(floor(number(args[0], "floor"))); }
+static Box nativeCeil(Box *args) { return wholeNumber(ceil(number(args[0], "ceil"))); }
+static Box nativeRound(Box *args) { return wholeNumber(round(number(args[0], "round"))); }
+static Box nativeInt(Box *args) { return wholeNumber(trunc(number(args[0], "int"))); }
+
+static Box nativePow(Box *args) {
+    return floatBox(pow(number(args[0], "pow"), number(args[1], "pow")));
+}
+
+static Box nativeAtan2(Box *args) {
+    return floatBox(atan2(number(args[0], "atan2"), number(args[1], "atan2")));
+}
+
+static Box nativeAbs(Box *args) {
+    if (TYPE(args[0]) == VAL_INT) return wholeNumber(fabs((double)args[0].int32));
+    return floatBox(fabs(number(args[0], "abs")));
+}
+
+// seconds on a monotonic clock, for timing parts of a script
+static Box nativeClock(Box *args) {
+    (void)args;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return floatBox((double)now.tv_sec + now.tv_nsec / 1e9);
+}
+
+// ===== STRINGS =====
+
+static Box mapBytes(Object *obj, int (*convert)(int)) {
+    size_t length = obj->length - 1;
+    char *bytes = (char *)safe_malloc(length + 1);
+    for (size_t i = 0; i < length; i++) {
+        bytes[i] = (char)convert((unsigned char)((char *)obj->ref)[i]);
+    }
+    bytes[length] = '\0';
+    return newString(bytes, length);
+}
+
+static Box nativeUpper(Box *args) { return mapBytes(string(args[0], "upper"), toupper); }
+static Box nativeLower(Box *args) { return mapBytes(string(args[0], "lower"), tolower); }
+
+// substr(s, start, count), count is clamped to the end of s
+static Box nativeSubstr(Box *args) {
+    Object *obj = string(args[0], "substr");
+    int start = integer(args[1], "substr");
+    int count = integer(args[2], "substr");
+    int length = (int)obj->length - 1;
+
+    if (start < 0 || start > length || count < 0) runtimeError("substr out of range");
+    if (count > length - start) count = length - start;
+
+    return copyString((char *)obj->ref + start, count);
+}
+
+// index of the first occurrence of needle, -1 if there is none
+static Box nativeFind(Box *args) {
+    char *haystack = (char *)string(args[0], "find")->ref;
+    char *at = strstr(haystack, (char *)string(args[1], "find")->ref);
+    return intBox(at == NULL ? -1 : (int)(at - haystack));
+}
+
+static Box nativeRepeat(Box *args) {
+    Object *obj = string(args[0], "repeat");
+    int times = integer(args[1], "repeat");
+    if (times < 0) runtimeError("repeat count must not be negative");
+
+    size_t length = obj->length - 1;
+    char *bytes = (char *)safe_malloc(length * times + 1);
+    for (int i = 0; i < times; i++) {
+        memcpy(bytes + length * i, obj->ref, length);
+    }
+    bytes[length * times] = '\0';
+    return newString(bytes, length * times);
+}
+
+static Box nativeStr(Box *args) {
+    char buffer[64];
+    switch (TYPE(args[0])) {
+    case VAL_INT:
+        snprintf(buffer, sizeof(buffer), "%d", args[0].int32);
+        break;
+    case VAL_FLOAT:
+        snprintf(buffer, sizeof(buffer), "%.15g", args[0].float64);
+        break;
+    case VAL_STRING: {
+        Object *obj = (Object *)(intptr_t)args[0].obj;
+        return copyString((char *)obj->ref, obj->length - 1);
+    }
+    default:
+        argumentError("str", "a number or a string");
+    }
+    return copyString(buffer, strlen(buffer));
+}
+
+// parses an int or a float out of the whole string
+static Box nativeNum(Box *args) {
+    char *text = (char *)string(args[0], "num")->ref;
+    char *end;
+
+    long integerValue = strtol(text, &end, 10);
+    if (*text && !*end && integerValue >= INT32_MIN && integerValue <= INT32_MAX) return intBox((int)integerValue);
+
+    double value = strtod(text, &end);
+    if (!*text || *end) runtimeError("num expects a string holding a number");
+    return floatBox(value);
+}
+
+static Box nativeOrd(Box *args) {
+    Object *obj = string(args[0], "ord");
+    if (obj->length < 2) runtimeError("ord of an empty string");
+    return intBox(((unsigned char *)obj->ref)[0]);
+}
+
+static Box nativeChr(Box *args) {
+    int code = integer(args[0], "chr");
+    if (code < 1 || code > 255) runtimeError("chr expects a code between 1 and 255");
+
+    char byte = (char)code;
+    return copyString(&byte, 1);
+}
+
+// ===== I/O =====
+
+static Box nativePrint(Box *args) {
+    printBox(args[0]);
+    printf("\n");
+    return intBox(0);
+}
+
+static Box nativeOpen(Box *args) {
+    return intBox(ioOpen((char *)string(args[0], "open")->ref, (char *)string(args[1], "open")->ref));
+}
+
+static Box nativeClose(Box *args) {
+    return intBox(ioClose(integer(args[0], "close")));
+}
+
+static Box nativeRead(Box *args) {
+    const char *bytes;
+    size_t length;
+    if (!ioRead(integer(args[0], "read"), integer(args[1], "read"), &bytes, &length)) {
+        suspendNative();
+        return intBox(0);
+    }
+    return copyString(bytes, length);
+}
+
+static Box nativeReadLine(Box *args) {
+    const char *bytes;
+    size_t length;
+    if (!ioReadLine(integer(args[0], "readline"), &bytes, &length)) {
+        suspendNative();
+        return intBox(0);
+    }
+    return copyString(bytes, length);
+}
+
+static Box nativeWrite(Box *args) {
+    Object *obj = string(args[1], "write");
+    if (!ioWrite(integer(args[0], "write"), (char *)obj->ref, obj->length - 1)) {
+        suspendNative();
+        return intBox(0);
+    }
+    return intBox((int)obj->length - 1);
+}
+
+// ===== SNAPSHOTS =====
+
+static Box nativeSnapshot(Box *args) {
+    writeSnapshot((char *)string(args[0], "snapshot")->ref);
+    return intBox(0);
+}
+
+Native natives[NATIVES_MAX] = {
+    {"sqrt", 1, nativeSqrt, 0},
+    {"sin", 1, nativeSin, 0},
+    {"cos", 1, nativeCos, 0},
+    {"tan", 1, nativeTan, 0},
+    {"exp", 1, nativeExp, 0},
+    {"log", 1, nativeLog, 0},
+    {"pow", 2, nativePow, 0},
+    {"atan2", 2, nativeAtan2, 0},
+    {"abs", 1, nativeAbs, 0},
+    {"floor", 1, nativeFloor, 0},
+    {"ceil", 1, nativeCeil, 0},
+    {"round", 1, nativeRound, 0},
+    {"int", 1, nativeInt, 0},
+    {"float", 1, nativeFloat, 0},
+    {"clock", 0, nativeClock, 0},
+    {"upper", 1, nativeUpper, 0},
+    {"lower", 1, nativeLower, 0},
+    {"substr", 3, nativeSubstr, 0},
+    {"find", 2, nativeFind, 0},
+    {"repeat", 2, nativeRepeat, 0},
+    {"str", 1, nativeStr, 0},
+    {"num", 1, nativeNum, 0},
+    {"ord", 1, nativeOrd, 0},
+    {"chr", 1, nativeChr, 0},
+    {"print", 1, nativePrint, 0},
+    {"open", 2, nativeOpen, 0},
+    {"close", 1, nativeClose, 0},
+    {"read", 2, nativeRead, 1},
+    {"readline", 1, nativeReadLine, 1},
+    {"write", 2, nativeWrite, 1},
+    // never suspends, but the flag keeps it out of compiled code so the snapshot is taken between
+    // two interpreted instructions
+    {"snapshot", 1, nativeSnapshot, 1},
+};
+
+int nativesLength = 31;
+
+// set by suspendNative() for the call in progress
+static int suspended;
+
+int registerNative(const char *name, int arity, NativeFn fn) {
+    if (nativesLength >= NATIVES_MAX || arity < 0 || arity > NATIVE_MAX_ARITY) return -1;
+
+    natives[nativesLength] = (Native){.name = name, .arity = arity, .fn = fn};
+    nativesLength += 1;
+    return nativesLength - 1;
+}
+
+int findNative(const char *name, size_t length) {
+    // later registrations shadow the starter library
+    for (int i = nativesLength - 1; i >= 0; i--) {
+        if (strlen(natives[i].name) == length && !memcmp(natives[i].name, name, length)) return i;
+    }
+    return -1;
+}
+
+void suspendNative(void) {
+    suspended = 1;
+}
+
+int callNative(int index) {
+    Native *native = &natives[index];
+    Box *args = vm->operandStack + vm->sp - native->arity + 1;
+
+    Box result = native->fn(args);
+    if (suspended) {
+        suspended = 0;
+        parkCoroutine();
+        return 1;
+    }
+
+    Box popped[NATIVE_MAX_ARITY];
+    memcpy(popped, args, sizeof(Box) * native->arity);
+    vm->sp -= native->arity;
+    STACK_PUSH(result);
+
+    for (int i = 0; i < native->arity; i++) {
+        cleanup_object(popped[i]);
+    }
+    return 0;
+}
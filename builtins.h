@@ -0,0 +1,39 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "vm.h"
+
+#define NATIVES_MAX 256
+#define NATIVE_MAX_ARITY 8
+
+// args points at the first of the native's arguments on the operand stack. they stay there
+// during the call and are popped (and freed if nothing else holds them) by callNative()
+typedef Box (*NativeFn)(Box *args);
+
+typedef struct {
+    const char *name;
+    int arity;
+    NativeFn fn;
+    // may call suspendNative(), so the instruction can't be run from compiled code
+    int suspends;
+} Native;
+
+// the starter math and string library comes first, registerNative() appends.
+// calls are resolved to an index at compile time, so register before compiling
+extern Native natives[NATIVES_MAX];
+extern int nativesLength;
+
+// returns the index of the new native, -1 if the registry is full or arity is too large
+int registerNative(const char *name, int arity, NativeFn fn);
+int findNative(const char *name, size_t length);
+
+// runs natives[index] on the arguments on top of the stack and replaces them with the result.
+// returns 1 instead if the native suspended, the running coroutine is then parked with vm->pc
+// still on the call, which runs again once the coroutine has been woken
+int callNative(int index);
+
+// called by a native that can't finish before the event loop woke the running coroutine, see io.h.
+// what the native returns is ignored and its arguments stay on the stack
+void suspendNative(void);
+
+#endif
@@ -0,0 +1,360 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "builtins.h"
+#include "allocs.h"
+#include "utils.h"
+
+// bumped whenever the layout of a cache file or the code the compiler emits for a source changes
+#define CACHE_FORMAT 5
+
+// -1 until NGS_CACHE is read
+static int cacheSetting = -1;
+uint64_t hashBytes(uint64_t hash, const void *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ ((const uint8_t *)bytes)[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t hashInt(uint64_t hash, int64_t value) {
+    hash = (hash ^ (uint64_t)value) * 0x100000001b3ULL;
+    return hash ^ (hash >> 29);
+}
+
+void setCacheEnabled(int enabled) {
+    cacheSetting = enabled;
+}
+
+int cacheEnabled(void) {
+    if (cacheSetting < 0) {
+        char *env = getenv("NGS_CACHE");
+        cacheSetting = env == NULL || strcmp(env, "0");
+    }
+    return cacheSetting;
+}
+
+// $XDG_CACHE_HOME/ngs or ~/.cache/ngs, NULL if neither variable is set. with create set every
+// directory on the way is made if needed
+static char* cacheDir(int create) {
+    char *base = getenv("XDG_CACHE_HOME");
+    const char *under = "/ngs";
+    if (base == NULL || base[0] == '\0') {
+        base = getenv("HOME");
+        under = "/.cache/ngs";
+    }
+    if (base == NULL || base[0] == '\0') return NULL;
+
+    char *dir = (char *)safe_malloc(strlen(base) + strlen(under) + 1);
+    sprintf(dir, "%s%s", base, under);
+    if (create) {
+        for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            mkdir(dir, 0755);
+            *slash = '/';
+        }
+        mkdir(dir, 0755);
+    }
+    return dir;
+}
+
+char* cachePath(const char *path, const char *suffix, int create) {
+    if (!cacheEnabled()) return NULL;
+    char *dir = cacheDir(create);
+    if (dir == NULL) return NULL;
+
+    // the name alone would mix up scripts of the same name in different directories
+    char *absolute = realpath(path, NULL);
+    const char *full = absolute == NULL ? path : absolute;
+    uint64_t hash = hashBytes(0xcbf29ce484222325ULL, full, strlen(full));
+    free(absolute);
+
+    const char *slash = strrchr(path, '/');
+    const char *name = slash == NULL ? path : slash + 1;
+    char *cache = (char *)safe_malloc(strlen(dir) + strlen(name) + strlen(suffix) + 24);
+    sprintf(cache, "%s/%s-%016llx.%s", dir, name, (unsigned long long)hash, suffix);
+    free(dir);
+    return cache;
+}
+
+uint64_t buildKey(void) {
+    int format[] = {CACHE_FORMAT, INST_EXTRA, (int)sizeof(Inst), nativesLength};
+    uint64_t hash = hashBytes(0xcbf29ce484222325ULL, format, sizeof(format));
+    for (int i = 0; i < nativesLength; i++) {
+        hash = hashBytes(hash, natives[i].name, strlen(natives[i].name) + 1);
+    }
+    return hash;
+}
+
+int openCacheReader(CacheReader *reader, const char *path) {
+    *reader = (CacheReader){0};
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return 0;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    reader->bytes = (uint8_t *)safe_malloc(size > 0 ? size : 1);
+    reader->length = size > 0 ? fread(reader->bytes, 1, size, file) : 0;
+    fclose(file);
+    return 1;
+}
+
+void closeCacheReader(CacheReader *reader) {
+    free(reader->bytes);
+    *reader = (CacheReader){0};
+}
+
+int readBytes(CacheReader *reader, void *out, size_t length) {
+    if (reader->length - reader->at < length) return 0;
+
+    memcpy(out, reader->bytes + reader->at, length);
+    reader->at += length;
+    return 1;
+}
+
+void writeInt(FILE *file, int value) {
+    fwrite(&value, sizeof(int), 1, file);
+}
+
+void writeString(FILE *file, const char *text, int length) {
+    writeInt(file, length);
+    fwrite(text, 1, length, file);
+}
+
+int readInt(CacheReader *reader, int *value) {
+    return readBytes(reader, value, sizeof(int));
+}
+
+char* readString(CacheReader *reader, int *length) {
+    if (!readInt(reader, length) || *length < 0 || *length > PROGRAM_MAX_SIZE * 64) return NULL;
+
+    char *text = (char *)safe_malloc(*length + 1);
+    if (!readBytes(reader, text, *length)) {
+        free(text);
+        return NULL;
+    }
+    text[*length] = '\0';
+    return text;
+}
+
+void writeCode(FILE *file, Inst *code, int length) {
+    for (int pc = 0; pc < length; pc++) {
+        int isString = TYPE(code[pc].operand) == VAL_STRING;
+        writeInt(file, code[pc].type);
+        writeInt(file, isString);
+        if (isString) {
+            Object *obj = (Object *)(intptr_t)code[pc].operand.obj;
+            writeString(file, (char *)obj->ref, obj->length - 1);
+        } else {
+            fwrite(&code[pc].operand, sizeof(Box), 1, file);
+        }
+    }
+}
+
+int readCode(CacheReader *reader, Inst *code, int length) {
+    memset(code, 0, sizeof(Inst) * length);
+
+    for (int pc = 0; pc < length; pc++) {
+        int type, isString, ok = readInt(reader, &type) && readInt(reader, &isString);
+
+        if (ok && isString) {
+            int bytesLength;
+            char *bytes = readString(reader, &bytesLength);
+            if ((ok = bytes != NULL)) {
+                Object *obj = (Object *)safe_malloc(sizeof(Object));
+                *obj = (Object){.length = bytesLength + 1, .ref = bytes, .isLiteral = 1};
+                TRACK_ALLOC(obj, sizeof(Object) + bytesLength + 1, OBJECT_LITERAL);
+                code[pc].operand = createBox(obj, VAL_STRING);
+            }
+        } else if (ok) {
+            ok = readBytes(reader, &code[pc].operand, sizeof(Box));
+        }
+
+        if (!ok) {
+            freeLiterals(code, pc);
+            return 0;
+        }
+        code[pc].type = (InstType)type;
+    }
+    return 1;
+}
+
+void freeLiterals(Inst *code, int length) {
+    for (int pc = 0; pc < length; pc++) {
+        if (TYPE(code[pc].operand) != VAL_STRING) continue;
+
+        Object *obj = (Object *)(intptr_t)code[pc].operand.obj;
+        TRACK_FREE(obj);
+        free(obj->ref);
+        free(obj);
+    }
+}
+
+static void freeCachedFunction(CachedFunction *function) {
+    if (!function->used && function->code != NULL) freeLiterals(function->code, function->length);
+    free(function->code);
+    free(function->lines);
+    free(function->calls);
+    for (int i = 0; i < function->callsLength; i++) free(function->callees[i]);
+    free(function->callees);
+}
+
+// 0 if the file ends early, what was read of function is freed then
+static int readCachedFunction(CacheReader *reader, CachedFunction *function) {
+    *function = (CachedFunction){0};
+
+    int ok = readBytes(reader, &function->key, sizeof(uint64_t)) &&
+             readInt(reader, &function->length) && function->length > 0 && function->length <= PROGRAM_MAX_SIZE;
+    if (!ok) return 0;
+
+    function->code = (Inst *)safe_malloc(sizeof(Inst) * function->length);
+    function->lines = (int *)safe_malloc(sizeof(int) * function->length);
+    if (!readCode(reader, function->code, function->length)) {
+        free(function->code);
+        function->code = NULL;
+        ok = 0;
+    }
+    ok = ok && readBytes(reader, function->lines, sizeof(int) * function->length);
+
+    ok = ok && readInt(reader, &function->callsLength) && function->callsLength >= 0 && function->callsLength <= function->length;
+    if (ok) {
+        function->calls = (int *)safe_malloc(sizeof(int) * (function->callsLength + 1));
+        function->callees = (char **)safe_calloc(function->callsLength + 1, sizeof(char *));
+    }
+    for (int i = 0; ok && i < function->callsLength; i++) {
+        int length;
+        ok = readInt(reader, &function->calls[i]) && function->calls[i] >= 0 && function->calls[i] < function->length &&
+             (function->callees[i] = readString(reader, &length)) != NULL;
+    }
+
+    if (!ok) {
+        if (function->callees == NULL) function->callsLength = 0;
+        freeCachedFunction(function);
+    }
+    return ok;
+}
+
+FunctionCache* openFunctionCache(const char *path) {
+    if (path == NULL) return NULL;
+
+    char *file = cachePath(path, "functions", 0);
+    if (file == NULL) return NULL;
+
+    FunctionCache *cache = (FunctionCache *)safe_calloc(1, sizeof(FunctionCache));
+    cache->path = file;
+    cache->build = buildKey();
+
+    CacheReader reader;
+    if (!openCacheReader(&reader, cache->path)) return cache;
+
+    char magic[4];
+    uint64_t key;
+    if (readBytes(&reader, magic, 4) && !memcmp(magic, "NGSF", 4) &&
+        readBytes(&reader, &key, sizeof(key)) && key == cache->build) {
+        // a damaged file keeps the functions in front of the damage and is rewritten
+        while (reader.at < reader.length) {
+            if (cache->length >= cache->capacity) {
+                cache->capacity = cache->capacity == 0 ? 16 : cache->capacity * 2;
+                cache->functions = (CachedFunction *)safe_realloc(cache->functions, sizeof(CachedFunction) * cache->capacity);
+            }
+            if (!readCachedFunction(&reader, &cache->functions[cache->length])) break;
+            cache->length += 1;
+        }
+        cache->valid = reader.at == reader.length;
+    }
+    cache->loaded = cache->length;
+    closeCacheReader(&reader);
+    return cache;
+}
+
+CachedFunction* findCachedFunction(FunctionCache *cache, uint64_t key) {
+    if (cache == NULL) return NULL;
+
+    for (int i = 0; i < cache->length; i++) {
+        CachedFunction *function = &cache->functions[i];
+        if (function->key == key && !function->used) return function;
+    }
+    return NULL;
+}
+
+void addCachedFunction(FunctionCache *cache, CachedFunction function) {
+    if (cache->length >= cache->capacity) {
+        cache->capacity = cache->capacity == 0 ? 16 : cache->capacity * 2;
+        cache->functions = (CachedFunction *)safe_realloc(cache->functions, sizeof(CachedFunction) * cache->capacity);
+    }
+
+    function.used = 1;
+    cache->functions[cache->length++] = function;
+}
+
+static void writeCachedFunction(FILE *file, CachedFunction *function) {
+    fwrite(&function->key, sizeof(uint64_t), 1, file);
+    writeInt(file, function->length);
+    writeCode(file, function->code, function->length);
+    fwrite(function->lines, sizeof(int), function->length, file);
+    writeInt(file, function->callsLength);
+    for (int c = 0; c < function->callsLength; c++) {
+        writeInt(file, function->calls[c]);
+        writeString(file, function->callees[c], strlen(function->callees[c]));
+    }
+}
+
+// the used functions only, in a new file renamed over the old one so a concurrent run never reads
+// half of it
+static void rewriteFunctionCache(FunctionCache *cache) {
+    free(cacheDir(1));
+
+    char *temp = (char *)safe_malloc(strlen(cache->path) + 32);
+    sprintf(temp, "%s.%d", cache->path, (int)getpid());
+
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL) {
+        free(temp);
+        return;
+    }
+
+    fwrite("NGSF", 1, 4, file);
+    fwrite(&cache->build, sizeof(uint64_t), 1, file);
+    for (int i = 0; i < cache->length; i++) {
+        if (cache->functions[i].used) writeCachedFunction(file, &cache->functions[i]);
+    }
+
+    if (fclose(file) == 0) {
+        rename(temp, cache->path);
+    } else {
+        unlink(temp);
+    }
+    free(temp);
+}
+
+void closeFunctionCache(FunctionCache *cache) {
+    if (cache == NULL) return;
+
+    int stale = 0;
+    for (int i = 0; i < cache->loaded; i++) stale += !cache->functions[i].used;
+
+    // new functions are appended, so an edit only writes what it recompiled. versions nothing uses
+    // any more pile up in the file until they outnumber the rest
+    if (!cache->valid || stale > cache->length - stale) {
+        rewriteFunctionCache(cache);
+    } else if (cache->length > cache->loaded) {
+        FILE *file = fopen(cache->path, "ab");
+        if (file != NULL) {
+            for (int i = cache->loaded; i < cache->length; i++) writeCachedFunction(file, &cache->functions[i]);
+            fclose(file);
+        }
+    }
+
+    for (int i = 0; i < cache->length; i++) freeCachedFunction(&cache->functions[i]);
+    free(cache->functions);
+    free(cache->path);
+    free(cache);
+}
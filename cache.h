@@ -0,0 +1,86 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "vm.h"
+
+// compiled code kept on disk in $XDG_CACHE_HOME/ngs, or ~/.cache/ngs: whole module units (see
+// module.h) and the code of single functions, so that editing one function of a script only
+// recompiles that function. NGS_CACHE=0 or --no-cache turn it off
+
+// on unless NGS_CACHE is 0, main turns it off for --no-cache
+int cacheEnabled(void);
+void setCacheEnabled(int enabled);
+// the cache file with suffix of the file at path, named after it and a hash of its absolute path.
+// with create set the directory is made if needed. NULL if the cache is off or has no directory
+char* cachePath(const char *path, const char *suffix, int create);
+uint64_t hashBytes(uint64_t hash, const void *bytes, size_t length);
+uint64_t hashInt(uint64_t hash, int64_t value);
+// hash of what compiled code depends on besides its source: the instruction encoding and the
+// registered natives, whose indices it holds
+uint64_t buildKey(void);
+
+// a cache file read into memory in one go, decoded from at on
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t at;
+} CacheReader;
+
+// 0 if there is no file at path
+int openCacheReader(CacheReader *reader, const char *path);
+void closeCacheReader(CacheReader *reader);
+// 0 if the file ends first
+int readBytes(CacheReader *reader, void *out, size_t length);
+
+void writeInt(FILE *file, int value);
+void writeString(FILE *file, const char *text, int length);
+int readInt(CacheReader *reader, int *value);
+// NULL if the file ends early or the length is corrupt
+char* readString(CacheReader *reader, int *length);
+
+// string literals are written out by value, every other operand as its bits
+void writeCode(FILE *file, Inst *code, int length);
+// 0 if the file ends early, the literals read so far are freed then
+int readCode(CacheReader *reader, Inst *code, int length);
+void freeLiterals(Inst *code, int length);
+
+typedef struct {
+    uint64_t key;
+    Inst *code;
+    // relative to the line of the function's "fun"
+    int *lines;
+    int length;
+    // pcs of its INST_CALL and INST_SPAWN instructions and the names of the functions they call
+    int *calls;
+    char **callees;
+    int callsLength;
+    // set once its code is part of the program, the literals are shared with it from then on
+    int used;
+} CachedFunction;
+
+typedef struct {
+    char *path;
+    // buildKey(), the start of every function's key
+    uint64_t build;
+    CachedFunction *functions;
+    int length;
+    int capacity;
+    // the ones read from the file come first, the ones the compile added after them
+    int loaded;
+    // whether the file was one of this build's and could be read to its end
+    int valid;
+} FunctionCache;
+
+// the cache of the file at path, empty if it has none yet. NULL for a source without a file or
+// with the cache off
+FunctionCache* openFunctionCache(const char *path);
+// an unused function cached under key, NULL if there is none
+CachedFunction* findCachedFunction(FunctionCache *cache, uint64_t key);
+// takes over code, lines, calls and callees, which the program shares the literals of
+void addCachedFunction(FunctionCache *cache, CachedFunction function);
+// saves the functions the compile added, then frees the cache
+void closeFunctionCache(FunctionCache *cache);
+
+#endif
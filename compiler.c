@@ -1,644 +1,919 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "compiler.h"
+#include "parser.h"
+#include "ast.h"
+#include "array.h"
+#include "builtins.h"
+#include "optimizer.h"
+#include "ir.h"
+#include "module.h"
+#include "cache.h"
+#include "perf.h"
+#include "allocs.h"
 #include "utils.h"
 
-typedef struct {
-    Token prev;
-    Token curr;
-    int steppedBack;
-} TokenReader;
-
-TokenReader tr;
+// a unit is parsed into an ast (see ast.h), whose names are then resolved to variable slots,
+// parameters, functions and builtins, its constants folded and its code generated
 
-Token pushForward(void) {
-    if (tr.steppedBack) {
-        tr.steppedBack = 0;
-    } else {
-        tr.prev = tr.curr;
-        tr.curr = nextToken();
-    }
-    return tr.curr;
-}
-
-void pushBack(void) {
-    tr.steppedBack = 1;
-}
+typedef struct {
+    int name;
+    int line;
+    int depth;
+    // variable of the same name it shadows, the name stands for that one again once it goes out of scope
+    int shadowed;
+} Var;
 
 typedef struct {
-    Token symbol;
-    Token *params;
+    int name;
+    // -1 - i for compiler.imports[i], set by the code generator for the unit's own functions
     int ip;
+    int end;
 } Symbol;
 
-typedef struct {
-    Token symbol;
-    int depth;
-} Var;
-
 typedef struct {
     int currentDepth;
-    
-    Token *params;
 
     Var *vars;
     int varsLength;
     int varsCapacity;
-    
-    Symbol symbols[100];
+    // first variable declared in the function being compiled, -1 at top level
+    int localsBase;
+
+    Symbol *symbols;
     int symbolsLength;
     int symbolsCapacity;
 
     Inst *program;
     int *programLength;
-} Parser;
-
-Parser parser;
+    // source line of each instruction, encoded into a LineTable once compilation is done
+    int *lines;
+
+    // file being compiled, NULL for a source without one
+    const char *path;
+    Import *imports;
+    int importsLength;
+    char **deps;
+    int depsLength;
+
+    // compiled functions of earlier runs, NULL for a source without a file
+    FunctionCache *cache;
+} Compiler;
+
+Compiler compiler;
+
+Intrinsic intrinsics[INTRINSICS_LENGTH] = {
+    {"ints", 1, INST_ARRAY_ALLOC, ARRAY_I32},
+    {"floats", 1, INST_ARRAY_ALLOC, ARRAY_F64},
+    {"len", 1, INST_ARRAY_REDUCE, REDUCE_LEN},
+    {"sum", 1, INST_ARRAY_REDUCE, REDUCE_SUM},
+    {"min", 1, INST_ARRAY_REDUCE, REDUCE_MIN},
+    {"max", 1, INST_ARRAY_REDUCE, REDUCE_MAX},
+    {"map", 1, INST_MAP_NEW, 0},
+    {"has", 2, INST_MAP_HAS, 0},
+    {"delete", 2, INST_MAP_DELETE, 0},
+    {"resume", 1, INST_RESUME, 0},
+    {"wait", 1, INST_WAIT, 0},
+};
+
+int nativeOf(int name) {
+    Name *n = &ast.names[name];
+    if (n->native == -2) n->native = findNative(n->lexeme, n->length);
+    return n->native;
+}
 
-void expression(void);
-int stmt(void);
-int functionCall(void);
+int intrinsicOf(int name) {
+    Name *n = &ast.names[name];
+    if (n->intrinsic != -2) return n->intrinsic;
 
-void pushInst(Inst inst) {
-    parser.program[*parser.programLength] = inst;
-    *parser.programLength += 1;
+    n->intrinsic = -1;
+    for (int i = 0; i < INTRINSICS_LENGTH; i++) {
+        if ((int)strlen(intrinsics[i].name) == n->length && !memcmp(intrinsics[i].name, n->lexeme, n->length)) n->intrinsic = i;
+    }
+    return n->intrinsic;
 }
 
-int matchingKeyword(Token token, char *keyword, size_t length) {
-    if (token.length != length) return 0;
-    return !memcmp(token.lexeme, keyword, length);
+// a function, or a native or intrinsic that no variable shadows, can only be called. parameters
+// don't shadow builtins
+void expectCall(int name, int line) {
+    Name *n = &ast.names[name];
+    if (n->symbol >= 0 || (n->var < 0 && (nativeOf(name) >= 0 || intrinsicOf(name) >= 0))) {
+        fprintf(stderr, "line %d: expected (\n", line);
+        exit(1);
+    }
 }
 
-int matchingTokenLexeme(Token a, Token b) {
-    if (a.length != b.length) return 0;
-    return !memcmp(a.lexeme, b.lexeme, a.length);
-}
+void declareVar(int name, int line) {
+    Name *n = &ast.names[name];
+    if (n->var >= 0 && compiler.vars[n->var].depth == compiler.currentDepth) {
+        fprintf(stderr, "line %d: identifier (X) has already been declared on line %d\n", line, compiler.vars[n->var].line);
+        exit(1);
+    }
 
-int var(void) {
-    Token ident = pushForward();
+    if (compiler.varsLength >= compiler.varsCapacity) {
+        compiler.varsCapacity *= 2;
+        compiler.vars = (Var *)safe_realloc(compiler.vars, sizeof(Var) * compiler.varsCapacity);
+    }
+    compiler.vars[compiler.varsLength] = (Var){.name = name, .line = line, .depth = compiler.currentDepth, .shadowed = n->var};
+    n->var = compiler.varsLength;
+    compiler.varsLength += 1;
+}
 
-    // 1. check variables first
-    for (int i = parser.varsLength - 1; i >= 0; i--) {
-        Var var = parser.vars[i];
-        if (matchingTokenLexeme(var.symbol, ident) && var.depth <= parser.currentDepth) {
-            pushInst((Inst){.type = INST_FETCH_VAR, .operand = createBox(&i, VAL_INT)});
-            return 1;
-        }
+void popVars(int length) {
+    while (compiler.varsLength > length) {
+        Var var = compiler.vars[--compiler.varsLength];
+        ast.names[var.name].var = var.shadowed;
     }
+}
 
-    // 2. check paramaters
-    for (int i = 0; parser.params + i != NULL; i++) {
-        if (matchingTokenLexeme(parser.params[i], ident)) {
-            pushInst((Inst){.type = INST_FETCH_ARG, .operand = createBox(&i, VAL_INT)});
-            return 1;
-        }
+int declareSymbol(int name, int ip) {
+    if (compiler.symbolsLength >= compiler.symbolsCapacity) {
+        compiler.symbolsCapacity *= 2;
+        compiler.symbols = (Symbol *)safe_realloc(compiler.symbols, sizeof(Symbol) * compiler.symbolsCapacity);
     }
 
-    pushBack();
-    return 0;
+    compiler.symbols[compiler.symbolsLength] = (Symbol){.name = name, .ip = ip};
+    if (ast.names[name].symbol < 0) ast.names[name].symbol = compiler.symbolsLength;
+    return compiler.symbolsLength++;
 }
 
-// primary := functionCall | var | STRING | CHARACTER | DECIMAL | INTEGER | "(" expression ")"
-void primary(void) {
-    if (tr.curr.type == TOK_LPAREN) {
-        pushForward();
-        expression();
-
-        Token rparen = pushForward();
-        if (rparen.type != TOK_RPAREN) {
-            fprintf(stderr, "line %d: missing closing ) for expression\n", rparen.line);
-            exit(1);
-        }
-    } else {
-        char *endptr = tr.curr.lexeme + tr.curr.length;
+void forgetSymbol(void) {
+    compiler.symbolsLength -= 1;
+    Name *n = &ast.names[compiler.symbols[compiler.symbolsLength].name];
+    if (n->symbol == compiler.symbolsLength) n->symbol = -1;
+}
 
-        switch (tr.curr.type) {
-        case TOK_INTEGER: {
-            long v = strtol(tr.curr.lexeme, &endptr, 10);
-            pushInst((Inst){.type = INST_STACK_PUSH, .operand = createBox(&v, VAL_INT)});
-            break;
-        }
-        case TOK_FLOAT: {
-            double v = strtod(tr.curr.lexeme, &endptr);
-            pushInst((Inst){.type = INST_STACK_PUSH, .operand = createBox(&v, VAL_FLOAT)});
-            break;
-        }
-        case TOK_IDENT: {
-            pushBack();
-            if (!functionCall() && !var()) {
-                Token ident = pushForward();
-                fprintf(stderr, "line %d: could not find symbol or identifier for X\n", ident.line);
-                exit(1);
-            }
-            break;
-        }
-        case TOK_STRING: {
-            char *str = (char *)safe_malloc(tr.curr.length + 1);
-            memcpy(str, tr.curr.lexeme, tr.curr.length);
-            str[tr.curr.length] = '\0';
+void resolveExpr(int node);
+void resolveStmt(int node);
 
-            Object *obj = (Object *)safe_malloc(sizeof(Object));
-            obj->length = tr.curr.length + 1;
-            obj->ref = str;
+// variables come before parameters
+void resolveVar(int node, const char *missing) {
+    Node *n = &ast.nodes[node];
+    Name *name = &ast.names[n->a];
 
-            pushInst((Inst){.type = INST_STACK_PUSH, .operand = createBox(obj, VAL_STRING)});
-            break;
-        }
-        default:
-            fprintf(stderr, "line %d: expected identifier or expression\n", tr.curr.line);
-            exit(1);
-        }
+    if (name->var >= 0) {
+        *n = (Node){.type = NODE_VAR, .line = n->line, .a = name->var, .next = n->next};
+    } else if (name->param >= 0) {
+        *n = (Node){.type = NODE_PARAM, .line = n->line, .a = name->param, .next = n->next};
+    } else {
+        fprintf(stderr, "line %d: %s\n", n->line, missing);
+        exit(1);
     }
 }
 
-// unary := ("+" | "-") unary | primary
-void unary(void) {
-    primary();
+int argumentsLength(int arg) {
+    int length = 0;
+    for (; arg != 0; arg = ast.nodes[arg].next) length++;
+    return length;
 }
 
-// factor := unary {: ("*" | "/") unary :}
-void factor(void) {
-    unary();
+// a call is of a function first, then of a native and then of an intrinsic that no variable shadows
+void resolveCall(int node, int isStmt) {
+    Node *n = &ast.nodes[node];
+    Name *name = &ast.names[n->a];
 
-    step:
-        switch (pushForward().type) {
-        case TOK_MULT:
-            pushForward();
-            unary();
-            pushInst((Inst){.type = INST_MULT});
-            goto step;
-        case TOK_DIV:
-            pushForward();
-            unary();
-            pushInst((Inst){.type = INST_DIV});
-            goto step;
-        default:
-            pushBack();
-        }
-}
+    if (name->symbol >= 0) {
+        n->c = n->a;
+        n->a = name->symbol;
+    } else if (n->type == NODE_SPAWN) {
+        fprintf(stderr, "line %d: spawn expects a function call\n", n->c);
+        exit(1);
+    } else if (name->var < 0 && (nativeOf(n->a) >= 0 || intrinsicOf(n->a) >= 0)) {
+        int native = nativeOf(n->a);
+        const char *builtin = native >= 0 ? natives[native].name : intrinsics[name->intrinsic].name;
+        int arity = native >= 0 ? natives[native].arity : intrinsics[name->intrinsic].arity;
 
-// term := factor {: ("+" | "-") factor :}
-void term(void) {
-    factor();
-
-    step:
-        switch (pushForward().type) {
-        case TOK_PLUS:
-            pushForward();
-            factor();
-            pushInst((Inst){.type = INST_ADD});
-            goto step;
-        case TOK_MINUS:
-            pushForward();
-            factor();
-            pushInst((Inst){.type = INST_SUB});
-            goto step;
-        default:
-            pushBack();
+        if (argumentsLength(n->b) != arity) {
+            fprintf(stderr, "line %d: %s takes %d arguments\n", n->line, builtin, arity);
+            exit(1);
         }
-}
 
-// comparison := term {: (">=" | ">" | "<=" | "<") term :}
-void comparison(void) {
-    term();
+        if (native >= 0) {
+            n->type = NODE_NATIVE;
+            n->a = native;
+        } else {
+            n->type = NODE_INTRINSIC;
+            n->a = name->intrinsic;
+        }
+    } else if (isStmt) {
+        fprintf(stderr, "line %d: unrecognizable statement\n", n->line);
+        exit(1);
+    } else {
+        fprintf(stderr, "line %d: could not find symbol or identifier for X\n", n->line);
+        exit(1);
+    }
 
-    Condition c;
+    for (int arg = n->b; arg != 0; arg = ast.nodes[arg].next) resolveExpr(ast.nodes[arg].a);
+}
 
-    step:
-        switch (pushForward().type) {
-        case TOK_GE:
-            c = CMP_GE;
-            pushForward();
-            term();
-            pushInst((Inst){.type = INST_CMP, .operand = createBox(&c, VAL_INT)});
-            goto step;
-            break;
-        case TOK_LE:
-            c = CMP_LE;
-            pushForward();
-            term();
-            pushInst((Inst){.type = INST_CMP, .operand = createBox(&c, VAL_INT)});
-            goto step;
-            break;
-        case TOK_GT:
-            c = CMP_GT;
-            pushForward();
-            term();
-            pushInst((Inst){.type = INST_CMP, .operand = createBox(&c, VAL_INT)});
-            goto step;
-            break;
-        case TOK_LT:
-            c = CMP_LT;
-            pushForward();
-            term();
-            pushInst((Inst){.type = INST_CMP, .operand = createBox(&c, VAL_INT)});
-            goto step;
-            break;
-        default:
-            pushBack();
-        }
+void resolveExpr(int node) {
+    Node *n = &ast.nodes[node];
+
+    switch (n->type) {
+    case NODE_NAME:
+        expectCall(n->a, n->line);
+        resolveVar(node, "could not find symbol or identifier for X");
+        break;
+    case NODE_CALL:
+    case NODE_SPAWN:
+        resolveCall(node, 0);
+        break;
+    case NODE_ARRAY:
+        for (int element = n->a; element != 0; element = ast.nodes[element].next) resolveExpr(element);
+        break;
+    case NODE_INDEX:
+    case NODE_BINARY:
+    case NODE_COMPARE:
+        resolveExpr(n->a);
+        resolveExpr(n->b);
+        break;
+    default:
+        break;
+    }
 }
 
-// equality := comparison {: ("==" | "!=") comparison :}
-void equality(void) {
-    comparison();
+void resolveBlock(int node) {
+    int varsLength = compiler.varsLength;
+    compiler.currentDepth += 1;
 
-    Condition c;
+    for (int stmt = ast.nodes[node].a; stmt != 0; stmt = ast.nodes[stmt].next) resolveStmt(stmt);
 
-    step:
-        switch (pushForward().type) {
-        case TOK_EQ:
-            c = CMP_EQ;
-            pushForward();
-            comparison();
-            pushInst((Inst){.type = INST_CMP, .operand = createBox(&c, VAL_INT)});
-            goto step;
-            break;
-        case TOK_NE:
-            c = CMP_NE;
-            pushForward();
-            comparison();
-            pushInst((Inst){.type = INST_CMP, .operand = createBox(&c, VAL_INT)});
-            goto step;
-            break;
-        default:
-            pushBack();
-        }
+    compiler.currentDepth -= 1;
+    ast.nodes[node].b = compiler.varsLength - varsLength;
+    popVars(varsLength);
 }
 
-// expression := equality;
-void expression(void) {
-    equality();
+// finishes the key the parser started with what the names among the function's tokens resolve to
+// outside of it: the slot of a global, or -2 for a function since its ip changes from run to run.
+// code compiled without the ir or without registers is kept apart
+uint64_t functionKey(FunctionInfo *function) {
+    uint64_t key = hashInt(compiler.cache->build, compiler.varsLength);
+    key = hashInt(key, irEnabled());
+    key = hashInt(key, registersEnabled());
+    key = hashInt(key, function->tokens);
+
+    for (int i = 0; i < function->namesLength; i++) {
+        Name *name = &ast.names[ast.keyNames[function->names + i]];
+        key = hashInt(key, name->hash);
+        key = hashInt(key, name->symbol >= 0 ? -2 : name->var);
+    }
+    return key == 0 ? 1 : key;
 }
 
-// declStmt := "let" IDENT "=" expression
-int declStmt(void) {    
-    if (!matchingKeyword(pushForward(), "let", 3)) {
-        pushBack();
-        return 0;
+// takes cached as the code of the function, if every function it calls is declared
+int reuseFunction(int node, CachedFunction *cached) {
+    FunctionInfo *function = &ast.functions[ast.nodes[node].c];
+    // declared first, so calls to itself resolve
+    int symbol = declareSymbol(ast.nodes[node].a, 0);
+
+    for (int i = 0; i < cached->callsLength; i++) {
+        int callee = findName(cached->callees[i], strlen(cached->callees[i]));
+        if (callee < 0 || ast.names[callee].symbol < 0) {
+            forgetSymbol();
+            return 0;
+        }
     }
 
-    Token ident = pushForward(); 
-    if (ident.type != TOK_IDENT) {
-        fprintf(stderr, "line %d: expected identifier\n", ident.line);
-        exit(1);
-    }
+    cached->used = 1;
+    // an index, since the functions compiled afterwards are added to the cache
+    function->cached = cached - compiler.cache->functions;
+    function->symbol = symbol;
+    return 1;
+}
 
-    for (int i = parser.varsLength - 1; i >= 0; i--) {
-        Var var = parser.vars[i];
-        if (var.depth == parser.currentDepth && matchingTokenLexeme(var.symbol, ident)) {
-            fprintf(stderr, "line %d: identifier (X) has already been declared on line %d\n", ident.line, var.symbol.line);
-            exit(1);
-        }
-    }
+void resolveFunction(int node) {
+    FunctionInfo *function = &ast.functions[ast.nodes[node].c];
+    function->localsBase = compiler.varsLength;
 
-    if (parser.varsLength >= parser.varsCapacity) {
-        parser.varsCapacity *= 2;
-        parser.vars = (Var *)realloc(parser.vars, sizeof(Var) * parser.varsCapacity);
+    if (compiler.cache != NULL && function->tokens != 0) {
+        function->key = functionKey(function);
+        CachedFunction *cached = findCachedFunction(compiler.cache, function->key);
+        if (cached != NULL && reuseFunction(node, cached)) return;
     }
-    parser.vars[parser.varsLength] = (Var){.depth = parser.currentDepth, .symbol = ident};
-    parser.varsLength += 1; 
+    if (ast.nodes[node].b == 0) parseFunction(node);
 
-    Token assignment = pushForward();
-    if (assignment.type != TOK_ASSIGNMENT) {
-        fprintf(stderr, "line %d: expected assignment after variable declaration\n", assignment.line);
-        exit(1);
+    function->symbol = declareSymbol(ast.nodes[node].a, 0);
+
+    int index = 0;
+    for (int param = function->params; param != 0; param = ast.nodes[param].next) {
+        Name *name = &ast.names[ast.nodes[param].a];
+        if (name->param < 0) name->param = index;
+        index++;
     }
 
-    pushForward();
-    expression();
+    compiler.localsBase = function->localsBase;
+    resolveBlock(ast.nodes[node].b);
+    compiler.localsBase = -1;
 
-    return 1;
+    for (int param = function->params; param != 0; param = ast.nodes[param].next) {
+        ast.names[ast.nodes[param].a].param = -1;
+    }
 }
 
-// programBlock := "{" {: stmt [ "return" expression; (then BREAK) ] :} "}"
-void programBlock(void) {
-    int prevVarsLength = parser.varsLength;
-    parser.currentDepth += 1;
+void resolveImport(int node) {
+    char *lexeme = ast.source + ast.nodes[node].a;
+    int length = ast.nodes[node].b;
+    int line = ast.nodes[node].line;
 
-    Token lsquirly = pushForward();
-    if (lsquirly.type != TOK_LSQUIRLY) {
-        fprintf(stderr, "line %d: expected {\n", lsquirly.line);
+    char *path = resolveModule(compiler.path, lexeme, length);
+    if (path == NULL) {
+        fprintf(stderr, "line %d: cannot find module %.*s\n", line, length, lexeme);
         exit(1);
     }
 
-    Token terminator;
+    for (int i = 0; i < compiler.depsLength; i++) {
+        if (!strcmp(compiler.deps[i], path)) {
+            free(path);
+            return;
+        }
+    }
+
+    Unit *module = loadModule(path);
 
-    step:
-        terminator = pushForward();
+    compiler.deps = (char **)safe_realloc(compiler.deps, sizeof(char *) * (compiler.depsLength + 1));
+    compiler.deps[compiler.depsLength++] = path;
+    compiler.imports = (Import *)safe_realloc(compiler.imports, sizeof(Import) * (compiler.importsLength + module->exportsLength + 1));
 
-        switch(terminator.type) {
-        case TOK_RSQUIRLY:
-        case TOK_EOF:
-            break;
-        default:
-            pushBack();
-            if (!stmt()) {
-                fprintf(stderr, "line %d: unrecognizable statement\n", pushForward().line);
-                exit(1);
-            };
-            goto step;
+    for (int e = 0; e < module->exportsLength; e++) {
+        char *function = module->exports[e].name;
+        int name = internName(function, strlen(function));
+
+        if (ast.names[name].symbol >= 0) {
+            fprintf(stderr, "line %d: %s of %.*s is already declared\n", line, function, length, lexeme);
+            exit(1);
         }
 
-    if (terminator.type != TOK_RSQUIRLY) {
-        fprintf(stderr, "line %d: expected closing } for block statement\n", terminator.line);
-        exit(1);
+        char *modulePath = (char *)safe_malloc(strlen(path) + 1);
+        strcpy(modulePath, path);
+        char *importName = (char *)safe_malloc(strlen(function) + 1);
+        strcpy(importName, function);
+        compiler.imports[compiler.importsLength] = (Import){.module = modulePath, .name = importName};
+
+        declareSymbol(name, -1 - compiler.importsLength);
+        compiler.importsLength += 1;
     }
+}
 
-    parser.currentDepth -= 1;
-    int danglingOperands = parser.varsLength - prevVarsLength;
-    if (danglingOperands) pushInst((Inst){.type = INST_STACK_SWEEP, .operand = createBox(&danglingOperands, VAL_INT)});
-    parser.varsLength = prevVarsLength;
+void resolveStmt(int node) {
+    Node *n = &ast.nodes[node];
+
+    switch (n->type) {
+    case NODE_LET:
+        // the variable is in scope in its own initializer
+        declareVar(n->a, n->line);
+        resolveExpr(n->b);
+        break;
+    case NODE_ASSIGN:
+        expectCall(n->a, n->c);
+        if (ast.names[n->a].var < 0) {
+            fprintf(stderr, "line %d: must provide declaration for (X) before assignment\n", n->c);
+            exit(1);
+        }
+        n->a = ast.names[n->a].var;
+        resolveExpr(n->b);
+        break;
+    case NODE_INDEX_ASSIGN:
+        expectCall(ast.nodes[n->a].a, ast.nodes[n->a].line);
+        resolveVar(n->a, "must provide declaration for (X) before assignment");
+        resolveExpr(n->b);
+        resolveExpr(n->c);
+        break;
+    case NODE_CALL:
+    case NODE_SPAWN:
+        resolveCall(node, 1);
+        break;
+    case NODE_RETURN:
+        resolveExpr(n->a);
+        break;
+    case NODE_IF:
+        resolveExpr(n->a);
+        resolveBlock(n->b);
+        if (n->c != 0 && ast.nodes[n->c].type == NODE_IF) {
+            resolveStmt(n->c);
+        } else if (n->c != 0) {
+            resolveBlock(n->c);
+        }
+        break;
+    case NODE_LOOP:
+        n->c = compiler.varsLength;
+        resolveExpr(n->a);
+        resolveBlock(n->b);
+        break;
+    case NODE_FUNCTION:
+        resolveFunction(node);
+        break;
+    case NODE_IMPORT:
+        resolveImport(node);
+        break;
+    default:
+        break;
+    }
 }
 
-// conditionalBlock := expression programBlock
-void conditionalBlock(void) {
-    pushForward();
-    expression();
+void pushInst(Inst inst, int line) {
+    if (*compiler.programLength >= PROGRAM_MAX_SIZE) {
+        fprintf(stderr, "line %d: program is too large\n", line);
+        exit(1);
+    }
 
-    pushInst((Inst){.type = INST_JMP_IF_NOT});
-    Inst *cjmp = &parser.program[*parser.programLength - 1];
-    int jumpFrom = *parser.programLength;   
+    compiler.lines[*compiler.programLength] = line;
+    compiler.program[*compiler.programLength] = inst;
+    *compiler.programLength += 1;
+}
 
-    programBlock();
+void pushIntInst(InstType type, int operand, int line) {
+    pushInst((Inst){.type = type, .operand = createBox(&operand, VAL_INT)}, line);
+}
 
-    pushInst((Inst){.type = INST_SET_CB});
+// a function's own variables are addressed relative to its frame, the ones before it are globals
+void pushVarInst(InstType type, int slot, int line) {
+    if (compiler.localsBase >= 0 && slot >= compiler.localsBase) {
+        type = type == INST_FETCH_VAR ? INST_FETCH_LOCAL : INST_ASSIGN_LOCAL;
+        slot -= compiler.localsBase;
+    }
+    pushIntInst(type, slot, line);
+}
 
-    // backpatch offset of programBlock
-    int relativeAddr = *parser.programLength - jumpFrom + 1;
-    cjmp->operand = createBox(&relativeAddr, VAL_INT);
+// pc of the jump, whose offset patchJump() fills in once its target is emitted
+int pushJump(InstType type, int line) {
+    pushInst((Inst){.type = type}, line);
+    return *compiler.programLength - 1;
 }
 
-// loopBlock := expression programBlock
-void loopBlock(void) {
-    int loopCondition = *parser.programLength;
+void patchJump(int pc) {
+    int relativeAddr = *compiler.programLength - pc;
+    compiler.program[pc].operand = createBox(&relativeAddr, VAL_INT);
+}
 
-    pushForward();
-    expression();
+void emitExpr(int node);
+void emitStmt(int node);
 
-    pushInst((Inst){.type = INST_JMP_IF_NOT});
-    Inst *cjmp = &parser.program[*parser.programLength - 1];
-    int jumpFrom = *parser.programLength;   
+int registersEnabled(void) {
+    static int enabled = -1;
+    if (enabled < 0) {
+        char *env = getenv("NGS_REGISTERS");
+        enabled = env == NULL || strcmp(env, "0");
+    }
+    return enabled;
+}
 
-    programBlock();
+// a variable, parameter or number, which a register instruction reads in place
+int isRegisterSource(int node) {
+    Node *n = &ast.nodes[node];
+    if (n->type == NODE_VAR || n->type == NODE_PARAM) return 1;
+    return n->type == NODE_CONSTANT && (TYPE(n->value) == VAL_INT || TYPE(n->value) == VAL_FLOAT);
+}
 
-    int absJmp = -(*parser.programLength - loopCondition);
-    pushInst((Inst){.type = INST_JMP, .operand = createBox(&absJmp, VAL_INT)});
+// an operation on two sources, compiled to one register instruction instead of four stack ones
+int isRegisterOp(int node) {
+    Node *n = &ast.nodes[node];
+    if (!registersEnabled() || (n->type != NODE_BINARY && n->type != NODE_COMPARE)) return 0;
+    return isRegisterSource(n->a) && isRegisterSource(n->b);
+}
 
-    // backpatch offset of programBlock
-    int relativeAddr = *parser.programLength - jumpFrom + 1;
-    cjmp->operand = createBox(&relativeAddr, VAL_INT);
+void pushRegisterSource(int node) {
+    Node *n = &ast.nodes[node];
+    if (n->type == NODE_VAR) {
+        pushVarInst(INST_FETCH_VAR, n->a, n->line);
+    } else if (n->type == NODE_PARAM) {
+        pushIntInst(INST_FETCH_ARG, n->a, n->line);
+    } else {
+        pushInst((Inst){.type = INST_STACK_PUSH, .operand = n->value}, n->line);
+    }
 }
 
-// ifStmt := "if" conditionalBlock [ "else" (ifStmt | programBlock) ]
-int ifStmt(void) {
-    if (matchingKeyword(pushForward(), "if", 2)) {
-        conditionalBlock();
-        if (matchingKeyword(pushForward(), "else", 4)) {
-            if (!ifStmt()) {
-                int fallthrough = 1;
-                pushInst((Inst){.type = INST_STACK_PUSH, .operand = createBox(&fallthrough, VAL_INT)});
+// the operation at node into the variable at slot, or pushed with slot -1. line is the one of the store
+void emitRegisterOp(int node, int slot, int line) {
+    Node *n = &ast.nodes[node];
+    if (n->type == NODE_COMPARE) {
+        pushIntInst(INST_REG_CMP, n->c, n->line);
+    } else {
+        pushInst((Inst){.type = (InstType)(INST_REG_ADD + n->c - INST_ADD)}, n->line);
+    }
 
-                pushInst((Inst){.type = INST_JMP_IF_NOT});
-                Inst *cjmp = &parser.program[*parser.programLength - 1];
-                int jumpFrom = *parser.programLength;
+    if (slot < 0) {
+        pushInst((Inst){.type = INST_STACK_PUSH}, line);
+    } else {
+        pushVarInst(INST_ASSIGN_VAR, slot, line);
+    }
+    pushRegisterSource(n->a);
+    pushRegisterSource(n->b);
+}
 
-                programBlock();
+// jumps unless the condition at node holds, see pushJump()
+int emitConditionJump(int node, int line) {
+    Node *n = &ast.nodes[node];
+    if (n->type != NODE_COMPARE || !isRegisterOp(node)) {
+        emitExpr(node);
+        return pushJump(INST_JMP_IF_NOT, line);
+    }
 
-                // backpatch offset of programBlock
-                int relativeAddr = *parser.programLength - jumpFrom + 1;
-                cjmp->operand = createBox(&relativeAddr, VAL_INT);
-            };
-        } else {
-            pushBack();
-        }
+    int pc = pushJump(INST_REG_JMP_IF_NOT, line);
+    pushIntInst(INST_EXTRA, n->c, n->line);
+    pushRegisterSource(n->a);
+    pushRegisterSource(n->b);
+    return pc;
+}
 
-        pushInst((Inst){.type = INST_UNSET_CB});
-        return 1;
+// arguments of a function go through INST_PUSH_ARG and are followed by their count, those of a
+// builtin stay on the operand stack
+void emitCall(Node *n) {
+    int count = 0;
+    for (int arg = n->b; arg != 0; arg = ast.nodes[arg].next) {
+        emitExpr(ast.nodes[arg].a);
+        if (n->type == NODE_CALL || n->type == NODE_SPAWN) pushInst((Inst){.type = INST_PUSH_ARG}, ast.nodes[arg].line);
+        count++;
     }
-    pushBack();
-    return 0;
-}
 
-int returnStmt(void) {
-    if (matchingKeyword(pushForward(), "return", 6)) {
-        pushForward();
-        expression();
-        pushInst((Inst){.type = INST_RET});
-        return 1;
+    switch (n->type) {
+    case NODE_NATIVE:
+        pushIntInst(INST_CALL_NATIVE, n->a, n->line);
+        break;
+    case NODE_INTRINSIC:
+        pushIntInst(intrinsics[n->a].type, intrinsics[n->a].operand, n->line);
+        break;
+    default:
+        pushIntInst(INST_STACK_PUSH, count, n->line);
+        pushInst((Inst){.type = INST_PUSH_ARG}, n->line);
+        pushIntInst(n->type == NODE_SPAWN ? INST_SPAWN : INST_CALL, compiler.symbols[n->a].ip, n->line);
     }
-    pushBack();
-    return 0;
 }
 
-// assignmentStmt := ident "=" expression
-int assignmentStmt(void) {
-    Token ident = pushForward();
-    if (ident.type == TOK_IDENT) {
-        Token assignment = pushForward();
-        if (assignment.type == TOK_ASSIGNMENT) {
-            fprintf(stderr, "line %d: must provide declaration for (X) before assignment\n", assignment.line);
-            exit(1);
-        }
+void emitExpr(int node) {
+    Node *n = &ast.nodes[node];
+
+    switch (n->type) {
+    case NODE_CONSTANT:
+        pushInst((Inst){.type = INST_STACK_PUSH, .operand = n->value}, n->line);
+        break;
+    case NODE_STRING: {
+        char *str = (char *)safe_malloc(n->b + 1);
+        memcpy(str, ast.source + n->a, n->b);
+        str[n->b] = '\0';
 
-        for (int i = parser.varsLength - 1; i >= 0; i--) {
-            Var var = parser.vars[i];
-            if (var.depth <= parser.currentDepth && matchingTokenLexeme(var.symbol, ident)) {
-                pushForward();
-                expression();
-                pushInst((Inst){.type = INST_ASSIGN_VAR, .operand = createBox(&i, VAL_INT)});
-                return 1;
-            }
+        Object *obj = (Object *)safe_malloc(sizeof(Object));
+        *obj = (Object){.length = n->b + 1, .ref = str, .isLiteral = 1};
+        TRACK_ALLOC(obj, sizeof(Object) + n->b + 1, OBJECT_LITERAL);
+
+        pushInst((Inst){.type = INST_STACK_PUSH, .operand = createBox(obj, VAL_STRING)}, n->line);
+        break;
+    }
+    case NODE_VAR:
+        pushVarInst(INST_FETCH_VAR, n->a, n->line);
+        break;
+    case NODE_PARAM:
+        pushIntInst(INST_FETCH_ARG, n->a, n->line);
+        break;
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        emitCall(n);
+        break;
+    case NODE_ARRAY: {
+        int count = 0;
+        for (int element = n->a; element != 0; element = ast.nodes[element].next) {
+            emitExpr(element);
+            count++;
         }
+        pushIntInst(INST_ARRAY_NEW, count, n->line);
+        break;
     }
-    pushBack();
-    return 0;
-}
-
-int loopStmt(void) {
-    Token ident = pushForward();
-    if (matchingKeyword(ident, "loop", 4)) {
-        loopBlock();
-        return 1;
+    case NODE_INDEX:
+        emitExpr(n->a);
+        emitExpr(n->b);
+        pushInst((Inst){.type = INST_INDEX_GET}, n->line);
+        break;
+    case NODE_BINARY:
+        if (isRegisterOp(node)) {
+            emitRegisterOp(node, -1, n->line);
+            break;
+        }
+        emitExpr(n->a);
+        emitExpr(n->b);
+        pushInst((Inst){.type = (InstType)n->c}, n->line);
+        break;
+    case NODE_COMPARE:
+        if (isRegisterOp(node)) {
+            emitRegisterOp(node, -1, n->line);
+            break;
+        }
+        emitExpr(n->a);
+        emitExpr(n->b);
+        pushIntInst(INST_CMP, n->c, n->line);
+        break;
+    default:
+        break;
     }
-    pushBack();
-    return 0;
 }
 
-// stmt := functionCall; | declStmt; | returnStmt; | assignmentStmt; | ifStmt | loopStmt
-int stmt(void) {
-    int result = 0;
+// the variables a block declares are swept off the stack at its }
+void emitBlock(int node) {
+    Node *block = &ast.nodes[node];
+    for (int stmt = block->a; stmt != 0; stmt = ast.nodes[stmt].next) emitStmt(stmt);
 
-    if (ifStmt() || loopStmt()) {
-        result = 1;
-    // assignmentStmt() must be called at the very end since it depends on looking forward twice (just a flaw with implementation)
-    } else if (declStmt() || functionCall() || returnStmt() || assignmentStmt()) {
-        result = 1;
-        Token semicol = pushForward();
-        if (semicol.type != TOK_SEMICOL) {
-            fprintf(stderr, "line %d: missing semicolon\n", semicol.line);
-            exit(1);
-        }
+    if (block->b) pushIntInst(INST_STACK_SWEEP, block->b, block->c);
+}
+
+// every if of an if/else chain sets the condition breaker once its block has run, which makes the
+// else blocks after it fall through
+void emitIf(Node *n) {
+    Node *then = &ast.nodes[n->b];
+
+    int cjmp = emitConditionJump(n->a, then->line);
+    emitBlock(n->b);
+    pushInst((Inst){.type = INST_SET_CB}, then->c);
+    patchJump(cjmp);
+
+    if (n->c != 0 && ast.nodes[n->c].type == NODE_IF) {
+        emitIf(&ast.nodes[n->c]);
+    } else if (n->c != 0) {
+        Node *otherwise = &ast.nodes[n->c];
+        pushIntInst(INST_STACK_PUSH, 1, otherwise->line);
+        cjmp = pushJump(INST_JMP_IF_NOT, otherwise->line);
+        emitBlock(n->c);
+        patchJump(cjmp);
     }
 
-    return result;
+    pushInst((Inst){.type = INST_UNSET_CB}, n->line);
 }
 
-// args := [ expression {: , expression :} ]
-void args(void) {
-    int numArgs = 0;
+void emitLoop(Node *n) {
+    Node *body = &ast.nodes[n->b];
+    int loopCondition = *compiler.programLength;
+
+    int cjmp = emitConditionJump(n->a, body->line);
+    emitBlock(n->b);
+    pushIntInst(INST_JMP, -(*compiler.programLength - loopCondition), body->c);
+    patchJump(cjmp);
 
-    if (pushForward().type != TOK_RPAREN) {
-        numArgs += 1;
+    optimizeLoop(compiler.program, compiler.lines, compiler.programLength, loopCondition, n->c, compiler.localsBase);
+}
 
-        expression();
-        pushInst((Inst){.type = INST_PUSH_ARG});
+// stores the function compiled from ip on under key
+void cacheFunction(uint64_t key, int ip, int firstLine) {
+    int length = *compiler.programLength - ip;
+    CachedFunction function = {.key = key, .length = length};
+    function.code = (Inst *)safe_malloc(sizeof(Inst) * length);
+    function.lines = (int *)safe_malloc(sizeof(int) * length);
+    function.calls = (int *)safe_malloc(sizeof(int) * (length + 1));
+    function.callees = (char **)safe_malloc(sizeof(char *) * (length + 1));
+
+    memcpy(function.code, compiler.program + ip, sizeof(Inst) * length);
+    for (int pc = 0; pc < length; pc++) {
+        function.lines[pc] = compiler.lines[ip + pc] - firstLine;
+    }
 
-        while (pushForward().type == TOK_COMMA) {
-            pushForward();
-            expression();
-            pushInst((Inst){.type = INST_PUSH_ARG});
+    for (int pc = 0; pc < length; pc += instLength(function.code[pc].type)) {
+        InstType type = function.code[pc].type;
+        if (type != INST_CALL && type != INST_SPAWN) continue;
 
-            numArgs += 1;
+        // calls go to the first function of a name, so the name finds the callee again
+        Symbol *callee = NULL;
+        for (int i = 0; i < compiler.symbolsLength && callee == NULL; i++) {
+            if (compiler.symbols[i].ip == function.code[pc].operand.int32) callee = &compiler.symbols[i];
         }
+        Name *name = &ast.names[callee->name];
+        char *copy = (char *)safe_malloc(name->length + 1);
+        memcpy(copy, name->lexeme, name->length);
+        copy[name->length] = '\0';
+
+        function.calls[function.callsLength] = pc;
+        function.callees[function.callsLength++] = copy;
     }
 
-    pushInst((Inst){.type = INST_STACK_PUSH, .operand = createBox(&numArgs, VAL_INT)});
-    pushInst((Inst){.type = INST_PUSH_ARG});
-    pushBack();
+    addCachedFunction(compiler.cache, function);
 }
 
-// functionCall := IDENT "(" args ")"
-int functionCall(void) {
-    Token ident = pushForward();
-
-    for (int i = 0; i < parser.symbolsLength; i++) {
-        if (matchingTokenLexeme(parser.symbols[i].symbol, ident)) {
-            Token lparen = pushForward();
-            if (lparen.type != TOK_LPAREN) {
-                fprintf(stderr, "line %d: expected (\n", lparen.line);
-                exit(1);
-            }
-
-            args();
+// copies the cached code of a function in, its calls relinked by the names of their callees
+void emitCachedFunction(FunctionInfo *function) {
+    CachedFunction *cached = &compiler.cache->functions[function->cached];
+    int ip = *compiler.programLength;
+    if (ip + cached->length > PROGRAM_MAX_SIZE) {
+        fprintf(stderr, "line %d: program is too large\n", function->firstLine);
+        exit(1);
+    }
 
-            Token rparen = pushForward();
-            if (rparen.type != TOK_RPAREN) {
-                fprintf(stderr, "line %d: expected )\n", rparen.line);
-                exit(1);
-            }
+    compiler.symbols[function->symbol].ip = ip + 1;
+    compiler.symbols[function->symbol].end = ip + cached->length;
 
-            pushInst((Inst){.type = INST_CALL, .operand = createBox(&parser.symbols[i].ip, VAL_INT)});
-            return 1;
-        }
+    memcpy(compiler.program + ip, cached->code, sizeof(Inst) * cached->length);
+    for (int pc = 0; pc < cached->length; pc++) {
+        compiler.lines[ip + pc] = function->firstLine + cached->lines[pc];
     }
-
-    pushBack();
-    return 0;
+    // code of the function starts at 0 in the cache, the jumps in it are relative
+    for (int i = 0; i < cached->callsLength; i++) {
+        Name *callee = &ast.names[findName(cached->callees[i], strlen(cached->callees[i]))];
+        compiler.program[ip + cached->calls[i]].operand = createBox(&compiler.symbols[callee->symbol].ip, VAL_INT);
+    }
+    *compiler.programLength += cached->length;
 }
 
-// params := [ IDENT {: , IDENT :} ]
-void params(Token **params) {
-    Token param = pushForward();
-    if (param.type != TOK_IDENT) {
-        pushBack();
+void emitFunction(Node *n) {
+    FunctionInfo *function = &ast.functions[n->c];
+    if (function->cached >= 0) {
+        emitCachedFunction(function);
         return;
-    };
+    }
 
-    int paramsLength = 6;
-    *params = (Token *)safe_malloc(sizeof(Token) * paramsLength);
+    Node *body = &ast.nodes[n->b];
+    int jmp = pushJump(INST_JMP, n->line);
+    compiler.symbols[function->symbol].ip = *compiler.programLength;
 
-    int i = 0;
-    (*params)[i++] = param;
+    compiler.localsBase = function->localsBase;
+    emitBlock(n->b);
+    compiler.localsBase = -1;
 
-    while (pushForward().type == TOK_COMMA) {
-        param = pushForward();
-        if (param.type != TOK_IDENT) {
-            fprintf(stderr, "line %d: expected identifier\n", param.line);
-            exit(1);
-        }
+    // TODO: PUSH AN UNDEFINED VALUE HERE
+    pushInst((Inst){.type = INST_RET}, body->c);
+    compiler.symbols[function->symbol].end = *compiler.programLength;
+    patchJump(jmp);
 
-        if (i >= paramsLength) {
-            *params = realloc(*params, paramsLength * 2);
-            paramsLength = paramsLength * 2;
-        }
+    if (function->key != 0) cacheFunction(function->key, jmp, function->firstLine);
+}
 
-        (*params)[i++] = param;
+void emitStmt(int node) {
+    Node *n = &ast.nodes[node];
+
+    switch (n->type) {
+    case NODE_LET:
+        emitExpr(n->b);
+        break;
+    case NODE_ASSIGN:
+        if (isRegisterOp(n->b)) {
+            emitRegisterOp(n->b, n->a, n->line);
+        } else if (registersEnabled() && isRegisterSource(n->b)) {
+            pushInst((Inst){.type = INST_REG_MOVE}, n->line);
+            pushVarInst(INST_ASSIGN_VAR, n->a, n->line);
+            pushRegisterSource(n->b);
+        } else {
+            emitExpr(n->b);
+            pushVarInst(INST_ASSIGN_VAR, n->a, n->line);
+        }
+        break;
+    case NODE_INDEX_ASSIGN:
+        emitExpr(n->a);
+        emitExpr(n->b);
+        emitExpr(n->c);
+        pushInst((Inst){.type = INST_INDEX_SET}, n->line);
+        break;
+    // the result of a call statement is dropped so the stack lines up with the variable slots again
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        emitCall(n);
+        pushIntInst(INST_STACK_SWEEP, 1, n->line);
+        break;
+    case NODE_RETURN:
+        emitExpr(n->a);
+        pushInst((Inst){.type = INST_RET}, n->line);
+        break;
+    case NODE_YIELD:
+        pushInst((Inst){.type = INST_YIELD}, n->line);
+        break;
+    case NODE_IF:
+        emitIf(n);
+        break;
+    case NODE_LOOP:
+        emitLoop(n);
+        break;
+    case NODE_FUNCTION:
+        emitFunction(n);
+        break;
+    default:
+        break;
     }
-    pushBack();
 }
 
-// functionDecl := "fun" IDENT "(" params ")" programBlock
-int functionDecl(void) {
-    if (matchingKeyword(pushForward(), "fun", 3)) {
-        Token ident = pushForward();
-        if (ident.type != TOK_IDENT) {
-            fprintf(stderr, "line %d: expected identifier for function declaration\n", ident.line);
-            exit(1);
-        }
+// copies the symbol table out since symbol names point into the source buffer
+Function* exportFunctions(int *functionsLength) {
+    Function *functions = (Function *)safe_malloc(sizeof(Function) * (compiler.symbolsLength + 1));
 
-        pushInst((Inst){.type = INST_JMP});
-        Inst *jmp = &parser.program[*parser.programLength - 1];
-        int jumpFrom = *parser.programLength;
+    *functionsLength = 0;
+    for (int i = 0; i < compiler.symbolsLength; i++) {
+        Symbol symbol = compiler.symbols[i];
+        if (symbol.ip < 0) continue;
 
-        Token lparen = pushForward();
-        if (lparen.type != TOK_LPAREN) {
-            fprintf(stderr, "line %d: missing (\n", lparen.line);
-            exit(1);
-        }
+        Name *name = &ast.names[symbol.name];
+        char *copy = (char *)safe_malloc(name->length + 1);
+        memcpy(copy, name->lexeme, name->length);
+        copy[name->length] = '\0';
 
-        Symbol *symbol = parser.symbols + parser.symbolsLength;
-        *symbol = (Symbol){.symbol = ident, .ip = *parser.programLength};
-        parser.symbolsLength += 1;
+        functions[(*functionsLength)++] = (Function){.name = copy, .ip = symbol.ip, .end = symbol.end};
+    }
 
-        params(&symbol->params);
-        parser.params = symbol->params;
+    return functions;
+}
 
-        Token rparen = pushForward();
-        if (rparen.type != TOK_RPAREN) {
-            fprintf(stderr, "line %d: missing )\n", rparen.line);
-            exit(1);
-        }
+void startUnit(const char *path, int *programLength, char *source) {
+    compiler = (Compiler){.programLength = programLength, .localsBase = -1, .path = path};
+    compiler.program = (Inst *)safe_malloc(sizeof(Inst) * PROGRAM_MAX_SIZE);
+    compiler.lines = (int *)safe_malloc(sizeof(int) * PROGRAM_MAX_SIZE);
 
-        programBlock();
+    compiler.varsCapacity = 6;
+    compiler.vars = (Var *)safe_malloc(sizeof(Var) * compiler.varsCapacity);
+    compiler.symbolsCapacity = 16;
+    compiler.symbols = (Symbol *)safe_malloc(sizeof(Symbol) * compiler.symbolsCapacity);
 
-        free(symbol->params);
-        parser.params = NULL;
+    compiler.cache = openFunctionCache(path);
+    astInitialize(source);
+}
 
-        // TODO: PUSH AN UNDEFINED VALUE HERE
-        pushInst((Inst){.type = INST_RET});
+PassTimes passTimes;
 
-        // backpatch offset from function
-        int relativeAddr = *parser.programLength - jumpFrom + 1;
-        jmp->operand = createBox(&relativeAddr, VAL_INT);
-        return 1;
-    }
-    pushBack();
-    return 0;
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// globalScope := {: stmt | function :}
-void globalScope(void) {
-    while (pushForward().type != TOK_EOF) {
-        pushBack();
-        if (!functionDecl() && !stmt()) {
-            fprintf(stderr, "line %d: unrecognizable statement\n", pushForward().line);
-            exit(1);
-        }
-    }
+// parses the unit, resolves it, folds its constants, optimizes it through the ir and generates its
+// code
+void compileUnit(int module) {
+    double start = now();
+    Phase outer = perfPhase(PHASE_PARSE);
+    int first = parseUnit(module, compiler.cache != NULL);
+    double parsed = now();
+
+    perfPhase(PHASE_RESOLVE);
+    for (int node = first; node != 0; node = ast.nodes[node].next) resolveStmt(node);
+    double resolved = now();
+    perfPhase(PHASE_OPTIMIZE);
+    foldConstants(first);
+    optimizeUnit(first);
+    double optimized = now();
+    perfPhase(PHASE_EMIT);
+    for (int node = first; node != 0; node = ast.nodes[node].next) emitStmt(node);
+    perfPhase(outer);
+
+    passTimes.parse += parsed - start;
+    passTimes.resolve += resolved - parsed;
+    passTimes.optimize += optimized - resolved;
+    passTimes.emit += now() - optimized;
+}
+
+// hands the code, line and symbol tables over to unit
+void finishUnit(Unit *unit) {
+    closeFunctionCache(compiler.cache);
+
+    unit->code = compiler.program;
+    unit->lines = compiler.lines;
+    unit->length = *compiler.programLength;
+    unit->exports = exportFunctions(&unit->exportsLength);
+    unit->imports = compiler.imports;
+    unit->importsLength = compiler.importsLength;
+    unit->deps = compiler.deps;
+    unit->depsLength = compiler.depsLength;
+    findRelocations(unit);
+
+    free(compiler.vars);
+    free(compiler.symbols);
+    freeAst();
+}
+
+void compileModule(Unit *unit, char *source) {
+    // the importer is resolved further once the module is done
+    Compiler importer = compiler;
+    Ast importerAst = ast;
+
+    int length = 0;
+    scannerInitialize(source);
+    startUnit(unit->path, &length, source);
+    compileUnit(1);
+    finishUnit(unit);
+
+    compiler = importer;
+    ast = importerAst;
 }
 
-Inst* compile(int *programLength) {
-    parser.programLength = programLength;
-    parser.program = (Inst *)safe_malloc(sizeof(Inst) * 4096);
+Inst* compile(const char *path, int *programLength, Function **functions, int *functionsLength, LineTable *lines) {
+    // compile() may run more than once in a process when embedded, see ngs.h
+    startUnit(path, programLength, scanner.current);
+    compileUnit(0);
+
+    Unit program = {.path = (char *)path};
+    finishUnit(&program);
+    linkProgram(&program, &program.exports, &program.exportsLength);
 
-    parser.varsCapacity = 6;
-    parser.vars = (Var *)safe_malloc(sizeof(Var) * parser.varsCapacity);
-    
-    globalScope();
+    *programLength = program.length;
+    *functions = program.exports;
+    *functionsLength = program.exportsLength;
+    *lines = encodeLines(program.lines, program.length);
+
+    free(program.lines);
+    for (int i = 0; i < program.importsLength; i++) {
+        free(program.imports[i].module);
+        free(program.imports[i].name);
+    }
+    free(program.imports);
+    for (int i = 0; i < program.depsLength; i++) free(program.deps[i]);
+    free(program.deps);
+    free(program.relocations);
 
-    free(parser.vars);
-    
-    return parser.program;
+    return program.code;
 }
@@ -3,7 +3,39 @@
 
 #include "scanner.h"
 #include "vm.h"
+#include "module.h"
 
-Inst* compile(int *programLength);
+typedef struct {
+    char *name;
+    int arity;
+    InstType type;
+    int operand;
+} Intrinsic;
+
+#define INTRINSICS_LENGTH 11
+
+// builtins compiled straight to array, map and coroutine instructions
+extern Intrinsic intrinsics[INTRINSICS_LENGTH];
+
+// 0 with NGS_REGISTERS=0, which compiles everything to stack instructions. part of a function's
+// cache key
+int registersEnabled(void);
+
+// seconds each pass took over the units compiled since it was last zeroed, see bench/frontend.c.
+// parsing includes the scanning it drives, and the resolution of an import includes the whole
+// compilation of the module
+typedef struct {
+    double parse;
+    double resolve;
+    double optimize;
+    double emit;
+} PassTimes;
+
+extern PassTimes passTimes;
+
+// path is the script's file, imports are resolved next to it. NULL for a source without one
+Inst* compile(const char *path, int *programLength, Function **functions, int *functionsLength, LineTable *lines);
+// compiles the module at unit->path from source, see module.h
+void compileModule(Unit *unit, char *source);
 
 #endif
@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "coroutine.h"
+#include "io.h"
+#include "utils.h"
+
+typedef struct {
+    Coroutine *coroutines;
+    int length;
+    int capacity;
+    int current;
+
+    // records and stack segments of collected coroutines
+    int *freeRecords;
+    int freeRecordsLength;
+    int *freeSegments;
+    int freeSegmentsLength;
+    // segments handed out so far, the next new one gets this index
+    int segments;
+
+    // ring buffer of the runnable coroutines other than the running one
+    int *queue;
+    int head;
+    int queued;
+
+    // pc the running coroutine was switched in at, and how many turns in a row ended right there
+    // waiting for a coroutine that is still running, see endTurn()
+    int turnStart;
+    int idleTurns;
+} Scheduler;
+
+Scheduler scheduler;
+
+#define QUEUE_CAPACITY (COROUTINES_MAX + 1)
+
+void initCoroutines(void) {
+    scheduler = (Scheduler){.capacity = 16};
+    scheduler.coroutines = (Coroutine *)safe_malloc(sizeof(Coroutine) * scheduler.capacity);
+    scheduler.freeRecords = (int *)safe_malloc(sizeof(int) * scheduler.capacity);
+    scheduler.freeSegments = (int *)safe_malloc(sizeof(int) * COROUTINES_MAX);
+    scheduler.queue = (int *)safe_malloc(sizeof(int) * QUEUE_CAPACITY);
+
+    scheduler.coroutines[0] = (Coroutine){.state = COROUTINE_RUNNABLE, .segment = -1};
+    scheduler.length = 1;
+}
+
+void freeCoroutines(void) {
+    free(scheduler.coroutines);
+    free(scheduler.freeRecords);
+    free(scheduler.freeSegments);
+    free(scheduler.queue);
+    scheduler = (Scheduler){0};
+}
+
+static void enqueue(int id) {
+    scheduler.queue[(scheduler.head + scheduler.queued) % QUEUE_CAPACITY] = id;
+    scheduler.queued += 1;
+}
+
+static int dequeue(void) {
+    int id = scheduler.queue[scheduler.head];
+    scheduler.head = (scheduler.head + 1) % QUEUE_CAPACITY;
+    scheduler.queued -= 1;
+    return id;
+}
+
+static void unqueue(int id) {
+    for (int i = 0; i < scheduler.queued; i++) {
+        if (scheduler.queue[(scheduler.head + i) % QUEUE_CAPACITY] != id) continue;
+
+        for (; i + 1 < scheduler.queued; i++) {
+            scheduler.queue[(scheduler.head + i) % QUEUE_CAPACITY] = scheduler.queue[(scheduler.head + i + 1) % QUEUE_CAPACITY];
+        }
+        scheduler.queued -= 1;
+        return;
+    }
+}
+
+static void switchTo(int next) {
+    Coroutine *from = &scheduler.coroutines[scheduler.current];
+    from->sp = vm->sp;
+    from->csp = vm->csp;
+    from->frame = vm->frame;
+    from->pc = vm->pc;
+    from->conditionBreaker = vm->conditionBreaker;
+
+    Coroutine *to = &scheduler.coroutines[next];
+    vm->sp = to->sp;
+    vm->csp = to->csp;
+    vm->frame = to->frame;
+    vm->pc = to->pc;
+    vm->conditionBreaker = to->conditionBreaker;
+    scheduler.current = next;
+    scheduler.turnStart = vm->pc;
+}
+
+// front of the run queue, once the event loop had a chance to wake parked coroutines. with the
+// queue empty this waits until one of them is woken
+static int nextCoroutine(void) {
+    if (ioWaiting()) pollIo(scheduler.queued == 0);
+    return dequeue();
+}
+
+// the running coroutine goes to the back of the queue and the front one takes over. a turn costs
+// fuel like a call, so coroutines that only pass the turn around still run out of budget
+static void rotate(void) {
+    CHARGE_BUDGET(1);
+    enqueue(scheduler.current);
+    switchTo(nextCoroutine());
+}
+
+// called before the running coroutine gives up its turn, waiting is set if it can't go on until
+// another one finishes. a waiting turn that ended where it started did nothing else, once every
+// queued coroutine had one of those in a row and no i/o can wake a parked one, none of them ever
+// will
+static void endTurn(int waiting) {
+    if (!waiting || vm->pc != scheduler.turnStart) {
+        scheduler.idleTurns = 0;
+        return;
+    }
+    scheduler.idleTurns += 1;
+    if (scheduler.idleTurns > scheduler.queued && !ioWaiting()) {
+        runtimeError("deadlock, every coroutine is waiting for another one");
+    }
+}
+
+static int isObject(Box box) {
+    ValueType type = TYPE(box);
+    return type == VAL_STRING || type == VAL_ARRAY || type == VAL_MAP;
+}
+
+static int newCoroutine(void) {
+    int segment;
+    if (scheduler.freeSegmentsLength > 0) {
+        segment = scheduler.freeSegments[--scheduler.freeSegmentsLength];
+    } else if (scheduler.segments < COROUTINES_MAX) {
+        segment = scheduler.segments++;
+    } else {
+        runtimeError("too many coroutines");
+        return -1;
+    }
+
+    int id;
+    if (scheduler.freeRecordsLength > 0) {
+        id = scheduler.freeRecords[--scheduler.freeRecordsLength];
+    } else {
+        if (scheduler.length >= scheduler.capacity) {
+            scheduler.capacity *= 2;
+            scheduler.coroutines = safe_realloc(scheduler.coroutines, sizeof(Coroutine) * scheduler.capacity);
+            scheduler.freeRecords = safe_realloc(scheduler.freeRecords, sizeof(int) * scheduler.capacity);
+        }
+        id = scheduler.length++;
+    }
+
+    Coroutine *coroutine = &scheduler.coroutines[id];
+    *coroutine = (Coroutine){.state = COROUTINE_RUNNABLE, .segment = segment};
+    mapSegment(segment, &coroutine->stackBase, &coroutine->callStackBase);
+    return id;
+}
+
+static int coroutineId(Box box) {
+    if (TYPE(box) != VAL_INT || box.int32 < 0 || box.int32 >= scheduler.length ||
+        scheduler.coroutines[box.int32].state == COROUTINE_FREE) {
+        runtimeError("not a coroutine");
+    }
+    return box.int32;
+}
+
+void spawnCoroutine(int ip) {
+    CHARGE_BUDGET(1);
+
+    int id = newCoroutine();
+    Coroutine *coroutine = &scheduler.coroutines[id];
+
+    // the arguments and their count move over from the spawning call stack, then the frame
+    // pushFrame() would build returns to the end of the program
+    int count = vm->callStack[vm->csp].int32 + 1;
+    memcpy(vm->callStack + coroutine->callStackBase, vm->callStack + vm->csp - count + 1, sizeof(Box) * count);
+    vm->csp -= count;
+
+    int returnPc = vm->programLength;
+    int sp = coroutine->stackBase - 1;
+    int frame = -1;
+    coroutine->csp = coroutine->callStackBase + count - 1;
+    vm->callStack[++coroutine->csp] = createBox(&returnPc, VAL_INT);
+    vm->callStack[++coroutine->csp] = createBox(&sp, VAL_INT);
+    vm->callStack[++coroutine->csp] = createBox(&frame, VAL_INT);
+    coroutine->frame = coroutine->csp;
+    coroutine->sp = sp;
+    coroutine->pc = ip;
+    enqueue(id);
+
+    STACK_PUSH(createBox(&id, VAL_INT));
+}
+
+void yieldCoroutine(void) {
+    vm->pc += 1;
+    endTurn(0);
+    if (scheduler.queued > 0 || ioWaiting()) rotate();
+}
+
+void resumeCoroutine(void) {
+    STACK_POP(Box box);
+    int id = coroutineId(box);
+
+    int switching = scheduler.coroutines[id].state == COROUTINE_RUNNABLE && id != scheduler.current;
+    STACK_PUSH(createBox(&switching, VAL_INT));
+    vm->pc += 1;
+    if (!switching) return;
+
+    endTurn(0);
+    unqueue(id);
+    enqueue(scheduler.current);
+    switchTo(id);
+}
+
+void waitCoroutine(void) {
+    int id = coroutineId(vm->operandStack[vm->sp]);
+    if (id == 0) runtimeError("cannot wait for the main program");
+    if (id == scheduler.current) runtimeError("a coroutine cannot wait for itself");
+
+    Coroutine *coroutine = &scheduler.coroutines[id];
+    if (coroutine->state != COROUTINE_DONE) {
+        // the id stays on the stack and the wait runs again on the next turn. if nothing else can
+        // run, id is parked and there is no point in a turn before the event loop woke someone
+        endTurn(1);
+        if (scheduler.queued == 0) pollIo(1);
+        rotate();
+        return;
+    }
+
+    vm->operandStack[vm->sp] = coroutine->result;
+    if (isObject(coroutine->result)) ((Object *)(intptr_t)coroutine->result.obj)->refs -= 1;
+
+    coroutine->state = COROUTINE_FREE;
+    scheduler.freeRecords[scheduler.freeRecordsLength++] = id;
+    vm->pc += 1;
+}
+
+int finishCoroutine(void) {
+    int id = scheduler.current;
+
+    if (id != 0) {
+        Coroutine *coroutine = &scheduler.coroutines[id];
+        STACK_POP(coroutine->result);
+        // pinned like a map entry until wait() hands it out
+        if (isObject(coroutine->result)) ((Object *)(intptr_t)coroutine->result.obj)->refs += 1;
+
+        coroutine->state = COROUTINE_DONE;
+        scheduler.freeSegments[scheduler.freeSegmentsLength++] = coroutine->segment;
+        endTurn(0);
+    } else {
+        // the main program waits at its end for the others
+        if (scheduler.queued == 0) {
+            if (!ioWaiting()) return 0;
+            pollIo(1);
+        }
+        endTurn(1);
+        CHARGE_BUDGET(1);
+        enqueue(0);
+    }
+
+    switchTo(nextCoroutine());
+    return 1;
+}
+
+void resetCoroutines(void) {
+    resetIo();
+
+    Coroutine *program = &scheduler.coroutines[0];
+    if (scheduler.current != 0) {
+        vm->sp = program->sp;
+        vm->csp = program->csp;
+        vm->frame = program->frame;
+        vm->pc = program->pc;
+        vm->conditionBreaker = program->conditionBreaker;
+    }
+    program->state = COROUTINE_RUNNABLE;
+
+    for (int id = 1; id < scheduler.length; id++) {
+        Coroutine *coroutine = &scheduler.coroutines[id];
+        if (coroutine->state != COROUTINE_DONE || !isObject(coroutine->result)) continue;
+
+        ((Object *)(intptr_t)coroutine->result.obj)->refs -= 1;
+        coroutine->state = COROUTINE_FREE;
+        cleanup_object(coroutine->result);
+    }
+
+    // segments stay mapped and are handed out again from the first one
+    scheduler.current = 0;
+    scheduler.length = 1;
+    scheduler.freeRecordsLength = 0;
+    scheduler.freeSegmentsLength = 0;
+    scheduler.segments = 0;
+    scheduler.head = 0;
+    scheduler.queued = 0;
+    scheduler.idleTurns = 0;
+}
+
+int stacksHold(Box box) {
+    for (int id = 0; id < scheduler.length; id++) {
+        Coroutine *coroutine = &scheduler.coroutines[id];
+        if (coroutine->state != COROUTINE_RUNNABLE && coroutine->state != COROUTINE_PARKED) continue;
+
+        int running = id == scheduler.current;
+        int sp = running ? vm->sp : coroutine->sp;
+        int csp = running ? vm->csp : coroutine->csp;
+
+        for (int i = sp; i >= coroutine->stackBase; i--) {
+            if (vm->operandStack[i].obj == box.obj) return 1;
+        }
+        // arguments of the active calls
+        for (int i = csp; i >= coroutine->callStackBase; i--) {
+            if (vm->callStack[i].obj == box.obj) return 1;
+        }
+    }
+    return 0;
+}
+
+void visitStacks(void (*visit)(Box box)) {
+    for (int id = 0; id < scheduler.length; id++) {
+        Coroutine *coroutine = &scheduler.coroutines[id];
+        if (coroutine->state == COROUTINE_DONE) visit(coroutine->result);
+        if (coroutine->state != COROUTINE_RUNNABLE && coroutine->state != COROUTINE_PARKED) continue;
+
+        int running = id == scheduler.current;
+        int sp = running ? vm->sp : coroutine->sp;
+        int csp = running ? vm->csp : coroutine->csp;
+
+        for (int i = sp; i >= coroutine->stackBase; i--) visit(vm->operandStack[i]);
+        for (int i = csp; i >= coroutine->callStackBase; i--) visit(vm->callStack[i]);
+    }
+}
+
+void parkCoroutine(void) {
+    endTurn(0);
+    scheduler.coroutines[scheduler.current].state = COROUTINE_PARKED;
+    switchTo(nextCoroutine());
+}
+
+void wakeCoroutine(int id) {
+    scheduler.coroutines[id].state = COROUTINE_RUNNABLE;
+    enqueue(id);
+}
+
+int currentCoroutine(void) {
+    return scheduler.current;
+}
+
+int runnableCoroutines(void) {
+    return scheduler.queued;
+}
+
+int liveCoroutines(void) {
+    int live = 0;
+    for (int id = 0; id < scheduler.length; id++) {
+        live += scheduler.coroutines[id].state != COROUTINE_FREE;
+    }
+    return live;
+}
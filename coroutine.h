@@ -0,0 +1,81 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "vm.h"
+
+// cooperative coroutines inside one vm. `spawn f(args)` starts a call to f as a new coroutine and
+// evaluates to its id, `yield;` moves the running coroutine to the back of the run queue,
+// resume(id) switches to id right away and wait(id) yields until id has returned, then evaluates
+// to its return value. the main program is coroutine 0, once it reaches its end the queue is
+// drained before the run finishes.
+//
+// every coroutine gets its own segment of the operand and call stack mappings (see initStacks()),
+// so variables, which are absolute operand stack slots, stay shared and a switch only swaps
+// sp, csp, frame, pc and conditionBreaker. a segment is as large as the main program's stack,
+// --stack-size and --callstack-size apply to coroutines too, and its pages are committed as they
+// are touched
+
+#define COROUTINES_MAX 4096
+
+typedef enum {
+    COROUTINE_RUNNABLE,
+    // waiting for the event loop to wake it, see io.h
+    COROUTINE_PARKED,
+    // returned, result holds the value until wait() collects it
+    COROUTINE_DONE,
+    // record and stack segment can be reused
+    COROUTINE_FREE,
+} CoroutineState;
+
+typedef struct {
+    CoroutineState state;
+    int sp;
+    int csp;
+    int frame;
+    int pc;
+    int conditionBreaker;
+
+    // first slots of its stack segments, 0 for the main program
+    int stackBase;
+    int callStackBase;
+    // -1 for the main program
+    int segment;
+
+    Box result;
+} Coroutine;
+
+void initCoroutines(void);
+void freeCoroutines(void);
+
+// the next four run the instruction at vm->pc and leave vm->pc where the (now) running coroutine
+// continues. INST_SPAWN finds the arguments on the call stack like INST_CALL does
+void spawnCoroutine(int ip);
+void yieldCoroutine(void);
+void resumeCoroutine(void);
+void waitCoroutine(void);
+
+// called once the running coroutine ran off the end of the program. returns 1 if another one has
+// been switched in, 0 once all of them are done and the main program is running again
+int finishCoroutine(void);
+
+// switches back to the main program and drops every other coroutine, for recovering from errors
+void resetCoroutines(void);
+
+// takes the running coroutine off the run queue and switches to the next runnable one, waiting for
+// the event loop if there is none. vm->pc is left on the instruction to run again once woken
+void parkCoroutine(void);
+void wakeCoroutine(int id);
+
+int currentCoroutine(void);
+// coroutines waiting for a turn, not counting the running one
+int runnableCoroutines(void);
+// coroutines that haven't been freed, the main program included
+int liveCoroutines(void);
+
+// whether a value sits on the operand or call stack of any live coroutine
+int stacksHold(Box box);
+// calls visit on every value on the operand and call stacks of the live coroutines and on the
+// results no wait() has collected yet
+void visitStacks(void (*visit)(Box box));
+
+#endif
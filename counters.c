@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "counters.h"
+#include "utils.h"
+
+#define REPORT_TOP_PCS 20
+
+typedef struct {
+    int function;
+    unsigned long long entryCount;
+} Activation;
+
+typedef struct {
+    unsigned long long executed;
+    unsigned long long perOpcode[INST_EXTRA + 1];
+    unsigned long long *perPc;
+
+    // function index of each entry point, -1 elsewhere
+    int *functionAt;
+    unsigned long long *calls;
+    unsigned long long *inclusive;
+    // live activations per function, so recursion is only counted by the outermost one
+    int *depth;
+
+    Activation *activations;
+    int activationsLength;
+    int activationsCapacity;
+} Counters;
+
+Counters counters;
+
+void initCounters(void) {
+    counters = (Counters){0};
+    counters.perPc = (unsigned long long *)safe_calloc(vm->programLength + 1, sizeof(unsigned long long));
+    counters.functionAt = (int *)safe_malloc(sizeof(int) * (vm->programLength + 1));
+    counters.calls = (unsigned long long *)safe_calloc(vm->functionsLength + 1, sizeof(unsigned long long));
+    counters.inclusive = (unsigned long long *)safe_calloc(vm->functionsLength + 1, sizeof(unsigned long long));
+    counters.depth = (int *)safe_calloc(vm->functionsLength + 1, sizeof(int));
+
+    for (int pc = 0; pc <= vm->programLength; pc++) {
+        counters.functionAt[pc] = -1;
+    }
+    for (int i = 0; i < vm->functionsLength; i++) {
+        counters.functionAt[vm->functions[i].ip] = i;
+    }
+}
+
+void freeCounters(void) {
+    free(counters.activations);
+    free(counters.depth);
+    free(counters.inclusive);
+    free(counters.calls);
+    free(counters.functionAt);
+    free(counters.perPc);
+}
+
+void countInst(int pc) {
+    counters.executed += 1;
+    counters.perOpcode[vm->program[pc].type] += 1;
+    counters.perPc[pc] += 1;
+}
+
+void countCall(int target) {
+    int function = counters.functionAt[target];
+    if (function < 0) return;
+
+    if (counters.activationsLength >= counters.activationsCapacity) {
+        counters.activationsCapacity = counters.activationsCapacity * 2 + 64;
+        counters.activations = safe_realloc(counters.activations, sizeof(Activation) * counters.activationsCapacity);
+    }
+    counters.activations[counters.activationsLength++] = (Activation){.function = function, .entryCount = counters.executed};
+
+    counters.calls[function] += 1;
+    counters.depth[function] += 1;
+}
+
+void countReturn(void) {
+    if (counters.activationsLength == 0) return;
+
+    Activation activation = counters.activations[--counters.activationsLength];
+    counters.depth[activation.function] -= 1;
+    if (counters.depth[activation.function] == 0) {
+        counters.inclusive[activation.function] += counters.executed - activation.entryCount;
+    }
+}
+
+unsigned long long instructionsExecuted(void) {
+    return counters.executed;
+}
+
+static unsigned long long *sortKeys;
+
+static int byCountDescending(const void *a, const void *b) {
+    unsigned long long l = sortKeys[*(int *)a];
+    unsigned long long r = sortKeys[*(int *)b];
+    if (l != r) return l < r ? 1 : -1;
+    return *(int *)a - *(int *)b;
+}
+
+static int *sortedIndices(unsigned long long *keys, int length) {
+    int *indices = (int *)safe_malloc(sizeof(int) * (length + 1));
+    for (int i = 0; i < length; i++) {
+        indices[i] = i;
+    }
+
+    sortKeys = keys;
+    qsort(indices, length, sizeof(int), byCountDescending);
+    return indices;
+}
+
+static void percent(FILE *out, unsigned long long count) {
+    fprintf(out, "%6.2f%%", counters.executed ? 100.0 * count / counters.executed : 0.0);
+}
+
+static void writeReport(FILE *out) {
+    int opcodesLength = INST_EXTRA + 1;
+    int *opcodes = sortedIndices(counters.perOpcode, opcodesLength);
+    int *pcs = sortedIndices(counters.perPc, vm->programLength);
+    int *functions = sortedIndices(counters.inclusive, vm->functionsLength);
+
+    fprintf(out, "===== COUNTERS =====\n\n");
+    fprintf(out, "%llu instructions executed\n\n", counters.executed);
+
+    fprintf(out, "per opcode:\n");
+    for (int i = 0; i < opcodesLength && counters.perOpcode[opcodes[i]]; i++) {
+        fprintf(out, "  %-18s %14llu ", stringifyInst(opcodes[i]), counters.perOpcode[opcodes[i]]);
+        percent(out, counters.perOpcode[opcodes[i]]);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\nhottest pcs:\n");
+    for (int i = 0; i < vm->programLength && i < REPORT_TOP_PCS && counters.perPc[pcs[i]]; i++) {
+        int pc = pcs[i];
+        fprintf(out, "  0x%04X %-18s %14llu ", pc, stringifyInst(vm->program[pc].type), counters.perPc[pc]);
+        percent(out, counters.perPc[pc]);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\nfunctions (calls, inclusive instructions):\n");
+    for (int i = 0; i < vm->functionsLength && counters.calls[functions[i]]; i++) {
+        int fn = functions[i];
+        fprintf(out, "  %-18s %10llu %14llu ", vm->functions[fn].name, counters.calls[fn], counters.inclusive[fn]);
+        percent(out, counters.inclusive[fn]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "\n");
+
+    free(functions);
+    free(pcs);
+    free(opcodes);
+}
+
+static void writeJSON(FILE *out) {
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"opcodes\": {", counters.executed);
+
+    int first = 1;
+    for (int op = 0; op <= INST_EXTRA; op++) {
+        if (!counters.perOpcode[op]) continue;
+        fprintf(out, "%s\n    \"%s\": %llu", first ? "" : ",", stringifyInst(op), counters.perOpcode[op]);
+        first = 0;
+    }
+
+    fprintf(out, "\n  },\n  \"pcs\": [");
+    first = 1;
+    for (int pc = 0; pc < vm->programLength; pc++) {
+        if (!counters.perPc[pc]) continue;
+        fprintf(out, "%s\n    {\"pc\": %d, \"opcode\": \"%s\", \"count\": %llu}",
+                first ? "" : ",", pc, stringifyInst(vm->program[pc].type), counters.perPc[pc]);
+        first = 0;
+    }
+
+    fprintf(out, "\n  ],\n  \"functions\": [");
+    for (int i = 0; i < vm->functionsLength; i++) {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"calls\": %llu, \"instructions\": %llu}",
+                i ? "," : "", vm->functions[i].name, counters.calls[i], counters.inclusive[i]);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void dumpCounters(void) {
+    writeReport(stderr);
+
+    char *path = getenv("NGS_COUNTERS_JSON");
+    if (path == NULL) path = COUNTERS_JSON_DEFAULT;
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "could not open %s for writing\n", path);
+        return;
+    }
+    writeJSON(out);
+    fclose(out);
+}
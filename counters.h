@@ -0,0 +1,34 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include "vm.h"
+
+// execution counters, built with `make counters` (-DNGS_COUNTERS). when the flag is off the
+// COUNT_* hooks in the interpreter expand to nothing. the JIT stays disabled while counting
+// since native code doesn't report back
+
+#define COUNTERS_JSON_DEFAULT "ngs-counters.json"
+
+void initCounters(void);
+void freeCounters(void);
+
+void countInst(int pc);
+void countCall(int target);
+void countReturn(void);
+
+unsigned long long instructionsExecuted(void);
+
+// sorted text report on stderr, JSON to $NGS_COUNTERS_JSON (or COUNTERS_JSON_DEFAULT)
+void dumpCounters(void);
+
+#ifdef NGS_COUNTERS
+#define COUNT_INST(pc) countInst(pc)
+#define COUNT_CALL(target) countCall(target)
+#define COUNT_RETURN() countReturn()
+#else
+#define COUNT_INST(pc)
+#define COUNT_CALL(target)
+#define COUNT_RETURN()
+#endif
+
+#endif
@@ -0,0 +1,662 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "io.h"
+#include "coroutine.h"
+#include "utils.h"
+
+#define STREAM_BUFFER_SIZE 4096
+#define IO_THREADS 4
+#define RING_ENTRIES 256
+#define EPOLL_BATCH 64
+// user_data of ring entries whose completion nobody waits for
+#define NO_COROUTINE UINT64_MAX
+// epoll data of the thread pool's eventfd
+#define POOL_EVENT UINT64_MAX
+// every parked coroutine has at most one job in flight
+#define JOBS_CAPACITY (COROUTINES_MAX + 1)
+
+typedef enum {
+    BACKEND_NONE,
+    BACKEND_URING,
+    BACKEND_EPOLL,
+} Backend;
+
+typedef struct {
+    int known;
+    int regular;
+    // opened by ioOpen(), closed by freeIo() if the script didn't
+    int opened;
+
+    // read ahead, buffer[start..end) hasn't been handed out yet
+    char *buffer;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    // the last read into the buffer hit the end of the file
+    int eof;
+
+    // coroutine parked on the fd, -1 if none
+    int waiter;
+    // in the epoll set, after the first wait it is re-armed with EPOLL_CTL_MOD
+    int watched;
+} Stream;
+
+typedef enum {
+    REQUEST_IDLE,
+    // waiting for the fd to become ready
+    REQUEST_POLLING,
+    // a transfer on a regular file is in flight
+    REQUEST_TRANSFER,
+    // the transfer finished, result holds what read() or write() returned or -errno
+    REQUEST_DONE,
+} RequestState;
+
+typedef struct {
+    RequestState state;
+    int fd;
+    ssize_t result;
+    // bytes of the current write() that are already out, it continues there after a park
+    size_t written;
+} Request;
+
+typedef struct {
+    int id;
+    int fd;
+    int writing;
+    char *buffer;
+    size_t length;
+    ssize_t result;
+} Job;
+
+typedef struct {
+    Backend backend;
+
+    Stream *streams;
+    int streamsLength;
+    // by coroutine id
+    Request *requests;
+    int requestsLength;
+    int waiting;
+    // set by resetIo(), completions are collected without waking anyone
+    int dropping;
+
+    int epoll;
+    int poolEvent;
+    pthread_t threads[IO_THREADS];
+    int threadsStarted;
+    // guards the rest of the thread pool
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int stopping;
+    Job *jobs;
+    int jobsHead;
+    int jobsQueued;
+    Job *finished;
+    int finishedLength;
+
+    int ring;
+    char *rings;
+    size_t ringsSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned unsubmitted;
+} EventLoop;
+
+EventLoop events;
+
+static void ioError(const char *call, int fd, int error) {
+    char message[128];
+    snprintf(message, sizeof(message), "%s on fd %d failed: %s", call, fd, strerror(error));
+    runtimeError(message);
+}
+
+static int startRing(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring < 0) return 0;
+
+    // both rings in one mapping, and reads and writes at the file position (offset -1)
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS;
+    if ((params.features & needed) != needed) {
+        close(ring);
+        return 0;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    char *rings = mmap(NULL, ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        close(ring);
+        return 0;
+    }
+
+    size_t sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(rings, ringsSize);
+        close(ring);
+        return 0;
+    }
+
+    events.ring = ring;
+    events.rings = rings;
+    events.ringsSize = ringsSize;
+    events.sqes = (struct io_uring_sqe *)sqes;
+    events.sqesSize = sqesSize;
+    events.sqTail = (unsigned *)(rings + params.sq_off.tail);
+    events.sqArray = (unsigned *)(rings + params.sq_off.array);
+    events.sqMask = *(unsigned *)(rings + params.sq_off.ring_mask);
+    events.sqEntries = params.sq_entries;
+    events.cqHead = (unsigned *)(rings + params.cq_off.head);
+    events.cqTail = (unsigned *)(rings + params.cq_off.tail);
+    events.cqMask = *(unsigned *)(rings + params.cq_off.ring_mask);
+    events.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    return 1;
+}
+
+static void startEvents(void) {
+    if (events.backend != BACKEND_NONE) return;
+
+    // a write to a closed pipe is reported as a runtime error instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    char *forced = getenv("NGS_IO");
+    if ((forced == NULL || strcmp(forced, "epoll")) && startRing()) {
+        events.backend = BACKEND_URING;
+        return;
+    }
+
+    events.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (events.epoll < 0) ioError("epoll_create1", -1, errno);
+    events.backend = BACKEND_EPOLL;
+}
+
+static void* worker(void *unused) {
+    (void)unused;
+
+    pthread_mutex_lock(&events.lock);
+    for (;;) {
+        while (events.jobsQueued == 0 && !events.stopping) {
+            pthread_cond_wait(&events.work, &events.lock);
+        }
+        if (events.stopping) break;
+
+        Job job = events.jobs[events.jobsHead];
+        events.jobsHead = (events.jobsHead + 1) % JOBS_CAPACITY;
+        events.jobsQueued -= 1;
+        pthread_mutex_unlock(&events.lock);
+
+        ssize_t result = job.writing ? write(job.fd, job.buffer, job.length) : read(job.fd, job.buffer, job.length);
+        job.result = result < 0 ? -errno : result;
+
+        pthread_mutex_lock(&events.lock);
+        events.finished[events.finishedLength++] = job;
+        uint64_t one = 1;
+        ssize_t ignored = write(events.poolEvent, &one, sizeof(one));
+        (void)ignored;
+    }
+    pthread_mutex_unlock(&events.lock);
+    return NULL;
+}
+
+static void startPool(void) {
+    events.poolEvent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (events.poolEvent < 0) ioError("eventfd", -1, errno);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = POOL_EVENT};
+    if (epoll_ctl(events.epoll, EPOLL_CTL_ADD, events.poolEvent, &event) < 0) ioError("epoll_ctl", events.poolEvent, errno);
+
+    events.jobs = (Job *)safe_malloc(sizeof(Job) * JOBS_CAPACITY);
+    events.finished = (Job *)safe_malloc(sizeof(Job) * JOBS_CAPACITY);
+    pthread_mutex_init(&events.lock, NULL);
+    pthread_cond_init(&events.work, NULL);
+    for (int i = 0; i < IO_THREADS; i++) {
+        pthread_create(&events.threads[i], NULL, worker, NULL);
+    }
+    events.threadsStarted = 1;
+}
+
+static Stream* streamOf(int fd) {
+    if (fd < 0) runtimeError("not a file descriptor");
+
+    if (fd >= events.streamsLength) {
+        int length = events.streamsLength ? events.streamsLength : 16;
+        while (length <= fd) length *= 2;
+        events.streams = safe_realloc(events.streams, sizeof(Stream) * length);
+        memset(events.streams + events.streamsLength, 0, sizeof(Stream) * (length - events.streamsLength));
+        events.streamsLength = length;
+    }
+
+    Stream *stream = &events.streams[fd];
+    if (!stream->known) {
+        struct stat info;
+        if (fstat(fd, &info) < 0) ioError("fstat", fd, errno);
+
+        startEvents();
+        *stream = (Stream){.known = 1, .regular = S_ISREG(info.st_mode) || S_ISBLK(info.st_mode), .waiter = -1};
+    }
+    if (stream->waiter >= 0 && stream->waiter != currentCoroutine()) {
+        char message[96];
+        snprintf(message, sizeof(message), "another coroutine is waiting on fd %d", fd);
+        runtimeError(message);
+    }
+    return stream;
+}
+
+static Request* requestOf(int id) {
+    if (id >= events.requestsLength) {
+        int length = events.requestsLength ? events.requestsLength : 16;
+        while (length <= id) length *= 2;
+        events.requests = safe_realloc(events.requests, sizeof(Request) * length);
+        memset(events.requests + events.requestsLength, 0, sizeof(Request) * (length - events.requestsLength));
+        events.requestsLength = length;
+    }
+    return &events.requests[id];
+}
+
+static void enterRing(int block) {
+    for (;;) {
+        unsigned flags = block ? IORING_ENTER_GETEVENTS : 0;
+        long submitted = syscall(__NR_io_uring_enter, events.ring, events.unsubmitted, block ? 1 : 0, flags, NULL, 0);
+        if (submitted >= 0) {
+            events.unsubmitted -= (unsigned)submitted;
+            return;
+        }
+        // a signal (the profiler's) cut the wait short, the caller looks at the completions again
+        if (errno == EINTR) return;
+        ioError("io_uring_enter", events.ring, errno);
+    }
+}
+
+static void pushEntry(struct io_uring_sqe *entry) {
+    if (events.unsubmitted == events.sqEntries) enterRing(0);
+
+    unsigned tail = *events.sqTail;
+    unsigned index = tail & events.sqMask;
+    events.sqes[index] = *entry;
+    events.sqArray[index] = index;
+    __atomic_store_n(events.sqTail, tail + 1, __ATOMIC_RELEASE);
+    events.unsubmitted += 1;
+}
+
+// parks the coroutine until fd is ready
+static void watch(int id, Stream *stream, int fd, int writing) {
+    if (events.backend == BACKEND_URING) {
+        struct io_uring_sqe entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.opcode = IORING_OP_POLL_ADD;
+        entry.fd = fd;
+        entry.poll32_events = writing ? POLLOUT : POLLIN;
+        entry.user_data = (uint64_t)id;
+        pushEntry(&entry);
+        return;
+    }
+
+    struct epoll_event event = {.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT, .data.u64 = (uint64_t)id};
+    if (epoll_ctl(events.epoll, stream->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) < 0) ioError("epoll_ctl", fd, errno);
+    stream->watched = 1;
+}
+
+// parks the coroutine until the transfer is done
+static void submit(int id, int fd, int writing, char *buffer, size_t length) {
+    if (length > INT_MAX) length = INT_MAX;
+
+    if (events.backend == BACKEND_URING) {
+        struct io_uring_sqe entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.opcode = writing ? IORING_OP_WRITE : IORING_OP_READ;
+        entry.fd = fd;
+        entry.addr = (uint64_t)(uintptr_t)buffer;
+        entry.len = (unsigned)length;
+        entry.off = (uint64_t)-1;
+        entry.user_data = (uint64_t)id;
+        pushEntry(&entry);
+        return;
+    }
+
+    if (!events.threadsStarted) startPool();
+
+    pthread_mutex_lock(&events.lock);
+    Job job = {.id = id, .fd = fd, .writing = writing, .buffer = buffer, .length = length};
+    events.jobs[(events.jobsHead + events.jobsQueued) % JOBS_CAPACITY] = job;
+    events.jobsQueued += 1;
+    pthread_cond_signal(&events.work);
+    pthread_mutex_unlock(&events.lock);
+}
+
+// moves up to length bytes between fd and buffer and stores what read() or write() returned (or
+// -errno) in result. returns 0 if the coroutine has to park first, the caller runs again once it
+// has been woken and has to pass the same buffer
+static int transfer(int fd, int writing, char *buffer, size_t length, ssize_t *result) {
+    Stream *stream = streamOf(fd);
+    int id = currentCoroutine();
+    Request *request = requestOf(id);
+
+    if (request->state == REQUEST_DONE) {
+        request->state = REQUEST_IDLE;
+        *result = request->result;
+        return 1;
+    }
+
+    if (stream->regular) {
+        if (runnableCoroutines() == 0) {
+            ssize_t done = writing ? write(fd, buffer, length) : read(fd, buffer, length);
+            *result = done < 0 ? -errno : done;
+            return 1;
+        }
+        submit(id, fd, writing, buffer, length);
+        request->state = REQUEST_TRANSFER;
+    } else {
+        struct pollfd ready = {.fd = fd, .events = writing ? POLLOUT : POLLIN};
+        if (poll(&ready, 1, 0) > 0) {
+            // a pipe with room for anything takes PIPE_BUF bytes without blocking
+            if (writing && length > PIPE_BUF) length = PIPE_BUF;
+            ssize_t done = writing ? write(fd, buffer, length) : read(fd, buffer, length);
+            if (done >= 0 || errno != EAGAIN) {
+                *result = done < 0 ? -errno : done;
+                return 1;
+            }
+        }
+        watch(id, stream, fd, writing);
+        request->state = REQUEST_POLLING;
+    }
+
+    request->fd = fd;
+    stream->waiter = id;
+    events.waiting += 1;
+    return 0;
+}
+
+// the wait of coroutine id is over. returns 1 if it was woken
+static int complete(int id, ssize_t result) {
+    Request *request = &events.requests[id];
+    events.streams[request->fd].waiter = -1;
+    events.waiting -= 1;
+
+    if (request->state == REQUEST_TRANSFER && !events.dropping) {
+        request->result = result;
+        request->state = REQUEST_DONE;
+    } else {
+        request->state = REQUEST_IDLE;
+    }
+
+    if (events.dropping) return 0;
+    wakeCoroutine(id);
+    return 1;
+}
+
+static int reapRing(void) {
+    int woken = 0;
+    unsigned head = *events.cqHead;
+    while (head != __atomic_load_n(events.cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *entry = &events.cqes[head & events.cqMask];
+        if (entry->user_data != NO_COROUTINE) woken += complete((int)entry->user_data, entry->res);
+        head += 1;
+    }
+    __atomic_store_n(events.cqHead, head, __ATOMIC_RELEASE);
+    return woken;
+}
+
+static int reapPool(void) {
+    uint64_t count;
+    ssize_t ignored = read(events.poolEvent, &count, sizeof(count));
+    (void)ignored;
+
+    int woken = 0;
+    pthread_mutex_lock(&events.lock);
+    for (int i = 0; i < events.finishedLength; i++) {
+        woken += complete(events.finished[i].id, events.finished[i].result);
+    }
+    events.finishedLength = 0;
+    pthread_mutex_unlock(&events.lock);
+    return woken;
+}
+
+static int reapEpoll(int block) {
+    struct epoll_event ready[EPOLL_BATCH];
+    int count = epoll_wait(events.epoll, ready, EPOLL_BATCH, block ? -1 : 0);
+    if (count < 0) {
+        if (errno == EINTR) return 0;
+        ioError("epoll_wait", events.epoll, errno);
+    }
+
+    int woken = 0;
+    for (int i = 0; i < count; i++) {
+        if (ready[i].data.u64 == POOL_EVENT) {
+            woken += reapPool();
+        } else {
+            woken += complete((int)ready[i].data.u64, 0);
+        }
+    }
+    return woken;
+}
+
+int ioWaiting(void) {
+    return events.waiting;
+}
+
+void pollIo(int block) {
+    int woken = 0;
+    while (events.waiting > 0) {
+        if (events.backend == BACKEND_URING) {
+            woken += reapRing();
+            if (woken > 0 || (!block && events.unsubmitted == 0)) return;
+            enterRing(block);
+            woken += reapRing();
+        } else {
+            woken += reapEpoll(block);
+        }
+        if (!block || woken > 0 || events.dropping) return;
+    }
+}
+
+void resetIo(void) {
+    events.dropping = 1;
+    for (int id = 0; id < events.requestsLength; id++) {
+        Request *request = &events.requests[id];
+        if (request->state != REQUEST_POLLING) continue;
+
+        // readiness may never come, transfers on regular files finish on their own
+        if (events.backend == BACKEND_URING) {
+            struct io_uring_sqe entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.opcode = IORING_OP_POLL_REMOVE;
+            entry.fd = -1;
+            entry.addr = (uint64_t)id;
+            entry.user_data = NO_COROUTINE;
+            pushEntry(&entry);
+        } else {
+            epoll_ctl(events.epoll, EPOLL_CTL_DEL, request->fd, NULL);
+            events.streams[request->fd].watched = 0;
+            complete(id, 0);
+        }
+    }
+    while (events.waiting > 0) {
+        pollIo(1);
+    }
+    events.dropping = 0;
+
+    if (events.requests != NULL) memset(events.requests, 0, sizeof(Request) * events.requestsLength);
+}
+
+void freeIo(void) {
+    resetIo();
+
+    if (events.threadsStarted) {
+        pthread_mutex_lock(&events.lock);
+        events.stopping = 1;
+        pthread_cond_broadcast(&events.work);
+        pthread_mutex_unlock(&events.lock);
+        for (int i = 0; i < IO_THREADS; i++) {
+            pthread_join(events.threads[i], NULL);
+        }
+        pthread_mutex_destroy(&events.lock);
+        pthread_cond_destroy(&events.work);
+        close(events.poolEvent);
+        free(events.jobs);
+        free(events.finished);
+    }
+    if (events.backend == BACKEND_EPOLL) close(events.epoll);
+    if (events.backend == BACKEND_URING) {
+        munmap(events.sqes, events.sqesSize);
+        munmap(events.rings, events.ringsSize);
+        close(events.ring);
+    }
+
+    for (int fd = 0; fd < events.streamsLength; fd++) {
+        if (events.streams[fd].opened) close(fd);
+        free(events.streams[fd].buffer);
+    }
+    free(events.streams);
+    free(events.requests);
+    events = (EventLoop){0};
+}
+
+int ioOpen(const char *path, const char *mode) {
+    int flags;
+    if (!strcmp(mode, "r")) {
+        flags = O_RDONLY;
+    } else if (!strcmp(mode, "w")) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (!strcmp(mode, "a")) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        runtimeError("open expects the mode \"r\", \"w\" or \"a\"");
+        return -1;
+    }
+
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    // whatever was known about an earlier file with this number is stale
+    if (fd < events.streamsLength) {
+        free(events.streams[fd].buffer);
+        events.streams[fd] = (Stream){0};
+    }
+    streamOf(fd)->opened = 1;
+    return fd;
+}
+
+int ioClose(int fd) {
+    Stream *stream = streamOf(fd);
+    if (stream->waiter >= 0) runtimeError("close on an fd a coroutine is waiting on");
+
+    if (stream->watched) epoll_ctl(events.epoll, EPOLL_CTL_DEL, fd, NULL);
+    free(stream->buffer);
+    *stream = (Stream){0};
+    return close(fd) < 0 ? -1 : 0;
+}
+
+// reads more into the stream's buffer, 0 if the coroutine has to park first. the buffer only
+// moves while nothing is in flight, so the read that runs again after a park lands in the same place
+static int fill(int fd, Stream *stream) {
+    if (stream->start == stream->end) {
+        stream->start = 0;
+        stream->end = 0;
+    }
+    if (stream->end == stream->capacity) {
+        if (stream->start > 0) {
+            memmove(stream->buffer, stream->buffer + stream->start, stream->end - stream->start);
+            stream->end -= stream->start;
+            stream->start = 0;
+        } else {
+            stream->capacity = stream->capacity ? stream->capacity * 2 : STREAM_BUFFER_SIZE;
+            stream->buffer = safe_realloc(stream->buffer, stream->capacity);
+        }
+    }
+
+    ssize_t result;
+    if (!transfer(fd, 0, stream->buffer + stream->end, stream->capacity - stream->end, &result)) return 0;
+    if (result < 0) ioError("read", fd, (int)-result);
+
+    stream->end += result;
+    stream->eof = result == 0;
+    return 1;
+}
+
+// hands out the next count buffered bytes
+static void take(Stream *stream, size_t count, const char **bytes, size_t *length) {
+    *bytes = stream->buffer != NULL ? stream->buffer + stream->start : "";
+    *length = count;
+    stream->start += count;
+    // an end of file is reported once, the next read looks again
+    if (count == 0) stream->eof = 0;
+}
+
+int ioRead(int fd, int max, const char **bytes, size_t *length) {
+    if (max < 0) runtimeError("read expects a count that isn't negative");
+
+    Stream *stream = streamOf(fd);
+    if (stream->start == stream->end && !stream->eof && max > 0) {
+        if (!fill(fd, stream)) return 0;
+    }
+
+    size_t available = stream->end - stream->start;
+    take(stream, available < (size_t)max ? available : (size_t)max, bytes, length);
+    return 1;
+}
+
+int ioReadLine(int fd, const char **bytes, size_t *length) {
+    Stream *stream = streamOf(fd);
+    for (;;) {
+        size_t available = stream->end - stream->start;
+        char *newline = available > 0 ? memchr(stream->buffer + stream->start, '\n', available) : NULL;
+        if (newline != NULL) {
+            take(stream, newline - (stream->buffer + stream->start) + 1, bytes, length);
+            return 1;
+        }
+        if (stream->eof) {
+            take(stream, available, bytes, length);
+            stream->eof = 0;
+            return 1;
+        }
+        if (!fill(fd, stream)) return 0;
+    }
+}
+
+int ioWrite(int fd, const char *bytes, size_t length) {
+    streamOf(fd);
+    Request *request = requestOf(currentCoroutine());
+
+    // what print() buffered goes out first
+    if (fd == STDOUT_FILENO) fflush(stdout);
+
+    while (request->written < length) {
+        ssize_t result;
+        if (!transfer(fd, 1, (char *)bytes + request->written, length - request->written, &result)) return 0;
+        if (result < 0) {
+            request->written = 0;
+            ioError("write", fd, (int)-result);
+        }
+        request->written += result;
+    }
+    request->written = 0;
+    return 1;
+}
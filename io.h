@@ -0,0 +1,36 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stddef.h>
+
+// file and pipe i/o behind the natives open, close, read, readline and write. a read or write that
+// would block parks the running coroutine (see parkCoroutine()) and the event loop wakes it once
+// the fd is ready or the transfer is done, the native then runs again from the start.
+//
+// pipes, ttys and sockets are waited on for readiness. regular files can't be, their transfers run
+// on io_uring or, where that isn't available (or NGS_IO=epoll), on a small thread pool that reports
+// back through an eventfd in the epoll set. with nothing else to run they are done in place
+
+// -1 if the file can't be opened. mode is "r", "w" (truncates) or "a". like open(2), opening a
+// fifo waits for its other end
+int ioOpen(const char *path, const char *mode);
+int ioClose(int fd);
+
+// these return 0 if the running coroutine has to park before the call can finish. bytes point into
+// the fd's read buffer and stay valid until the next call on it, length 0 means end of file
+int ioRead(int fd, int max, const char **bytes, size_t *length);
+// the line keeps its '\n', only the last one of a file may lack it
+int ioReadLine(int fd, const char **bytes, size_t *length);
+// writes all of bytes
+int ioWrite(int fd, const char *bytes, size_t length);
+
+// coroutines parked on i/o
+int ioWaiting(void);
+// wakes the coroutines whose fd is ready or whose transfer is done. with block set it waits until
+// it woke at least one
+void pollIo(int block);
+// forgets every parked coroutine, waits on fds are cancelled and transfers waited for
+void resetIo(void);
+void freeIo(void);
+
+#endif
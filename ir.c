@@ -0,0 +1,1368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "ir.h"
+#include "ast.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "builtins.h"
+#include "cache.h"
+#include "utils.h"
+
+// a function body or the top level is built into blocks of values straight from its resolved tree.
+// a variable stands for the value last assigned to it: reads are looked up through the
+// predecessors of the block and merged by phis where they differ, and loop headers get their phis
+// completed once the back edge is known (Braun et al., "Simple and Efficient Construction of
+// Static Single Assignment Form")
+
+typedef enum {
+    // value
+    IR_CONST,
+    // a: parameter index
+    IR_PARAM,
+    // a: slot, a global on entry or once a call or a coroutine switch could have changed it
+    IR_LOAD,
+    // a variable read in its own initializer
+    IR_UNDEF,
+    // a: slot, operands: a value per predecessor of the block
+    IR_PHI,
+    // a op b, c: INST_ADD, INST_SUB, INST_MULT or INST_DIV
+    IR_BINARY,
+    // a op b, c: Condition
+    IR_CMP,
+    // c: node
+    IR_STRING,
+    // operands: elements
+    IR_ARRAY,
+    // a[b]
+    IR_INDEX,
+    // operands: arguments, a: symbol and c: name of the function
+    IR_CALL,
+    IR_SPAWN,
+    // operands: arguments, a: index in natives or intrinsics
+    IR_NATIVE,
+    IR_INTRINSIC,
+
+    // a: slot, b: value, c: name of the variable. the slot holds b from here on
+    IR_SET,
+    // a[b] = c
+    IR_INDEX_SET,
+    // a: value, -1 at the end of a function body
+    IR_RETURN,
+    IR_YIELD,
+} IrOp;
+
+typedef struct {
+    IrOp op;
+    int block;
+    int a;
+    int b;
+    int c;
+    // of phis, calls and arrays, in ir.operands
+    int operands;
+    int operandsLength;
+    Box value;
+    // next value of the block
+    int next;
+
+    // value this one turned out to be, -1 if there is none. see valueOf()
+    int same;
+    // an int or a float whenever it is computed
+    int number;
+    // computed or stored by the code the tree is left with
+    int live;
+    // first IR_SET of this value and the next IR_SET of the one it sets, see findHolder()
+    int holders;
+    int nextHolder;
+} IrValue;
+
+typedef struct {
+    int block;
+    int next;
+} IrEdge;
+
+typedef struct {
+    int first;
+    int last;
+    // in ir.edges
+    int preds;
+    int lastPred;
+    int predsLength;
+    // immediate dominator, the block the first edge comes from since an if or a loop is entered
+    // before its blocks, and the length of the chain of them
+    int idom;
+    int depth;
+    // until sealed new predecessors may be added, reads then leave phis to be completed. linked
+    // through their b
+    int sealed;
+    int incomplete;
+
+    // jumps to succs[0], or branches to succs[0] if cond holds and to succs[1] if it doesn't.
+    // cond is -1 for the condition breaker of an else block, see emitIf()
+    int succs[2];
+    int cond;
+    // calls and coroutine switches so far, which change what the globals hold
+    int clobbers;
+} IrBlock;
+
+typedef struct {
+    // -1 for an empty entry
+    int block;
+    int slot;
+    int value;
+    // clobbers of the block when it was stored
+    int stamp;
+} IrDef;
+
+// what the ir knows about a node of the tree
+typedef struct {
+    int value;
+    // only a variable, parameter or constant under it, and no call
+    int pure;
+    // of a NODE_VAR, what it reads
+    int def;
+    // variable holding the value of the node where it is computed and what it reads there, -1
+    // if there is none
+    int holder;
+    int holderDef;
+} IrNode;
+
+typedef struct {
+    IrValue *values;
+    int valuesLength;
+    int valuesCapacity;
+    IrBlock *blocks;
+    int blocksLength;
+    int blocksCapacity;
+    IrEdge *edges;
+    int edgesLength;
+    int edgesCapacity;
+    int *operands;
+    int operandsLength;
+    int operandsCapacity;
+
+    // open addressing on (block, slot)
+    IrDef *defs;
+    int defsLength;
+    int defsCapacity;
+    // value numbers, open addressing on what a value is computed from
+    int *numbers;
+    int numbersCapacity;
+
+    IrNode *nodes;
+    // names of the slots, the globals' from the top level's declarations
+    int *slotNames;
+    int slotNamesCapacity;
+
+    // block being built, -1 after a return
+    int current;
+    int varsLength;
+    // slots below globals are the ones calls and other coroutines can change. stores to slots
+    // below locals are seen outside of what is being built and are never dropped
+    int globals;
+    int locals;
+    int undefined;
+    // a phi some numbered value uses turned out to be trivial since it was numbered
+    int stale;
+    // whether inferNumbers() ran for the region, most have no use for it
+    int inferred;
+    // marking what the dump shows rather than what the stores depend on, see eliminateDeadCode()
+    int markStores;
+} Ir;
+
+Ir ir;
+FILE *irDump;
+
+void setIrDump(FILE *out) {
+    irDump = out;
+}
+
+int irEnabled(void) {
+    static int enabled = -1;
+    if (enabled < 0) {
+        char *env = getenv("NGS_IR");
+        enabled = env == NULL || strcmp(env, "0");
+    }
+    return enabled;
+}
+
+// the value v stands for, looking through copies and values found to be the same as another
+static int valueOf(int v) {
+    while (1) {
+        IrValue *value = &ir.values[v];
+        if (value->same >= 0) {
+            v = value->same;
+        } else if (value->op == IR_SET) {
+            v = value->b;
+        } else {
+            return v;
+        }
+    }
+}
+
+static int newValueIn(int block, IrOp op) {
+    if (ir.valuesLength >= ir.valuesCapacity) {
+        ir.valuesCapacity = ir.valuesCapacity == 0 ? 256 : ir.valuesCapacity * 2;
+        ir.values = (IrValue *)safe_realloc(ir.values, sizeof(IrValue) * ir.valuesCapacity);
+    }
+
+    int v = ir.valuesLength++;
+    ir.values[v] = (IrValue){.op = op, .block = block, .next = -1, .same = -1, .holders = -1, .nextHolder = -1};
+
+    IrBlock *b = &ir.blocks[block];
+    if (b->last >= 0) {
+        ir.values[b->last].next = v;
+    } else {
+        b->first = v;
+    }
+    b->last = v;
+    return v;
+}
+
+static int newValue(IrOp op, int a, int b, int c) {
+    int v = newValueIn(ir.current, op);
+    ir.values[v].a = a;
+    ir.values[v].b = b;
+    ir.values[v].c = c;
+    return v;
+}
+
+// index of length operands for the caller to fill in, values built meanwhile may add their own
+static int reserveOperands(int length) {
+    if (ir.operandsLength + length > ir.operandsCapacity) {
+        while (ir.operandsLength + length > ir.operandsCapacity) {
+            ir.operandsCapacity = ir.operandsCapacity == 0 ? 256 : ir.operandsCapacity * 2;
+        }
+        ir.operands = (int *)safe_realloc(ir.operands, sizeof(int) * ir.operandsCapacity);
+    }
+    ir.operandsLength += length;
+    return ir.operandsLength - length;
+}
+
+static int newBlock(void) {
+    if (ir.blocksLength >= ir.blocksCapacity) {
+        ir.blocksCapacity = ir.blocksCapacity == 0 ? 64 : ir.blocksCapacity * 2;
+        ir.blocks = (IrBlock *)safe_realloc(ir.blocks, sizeof(IrBlock) * ir.blocksCapacity);
+    }
+
+    ir.blocks[ir.blocksLength] = (IrBlock){
+        .first = -1, .last = -1, .preds = -1, .lastPred = -1, .idom = -1, .incomplete = -1, .succs = {-1, -1}, .cond = -1,
+    };
+    return ir.blocksLength++;
+}
+
+static void addEdge(int from, int to) {
+    if (ir.edgesLength >= ir.edgesCapacity) {
+        ir.edgesCapacity = ir.edgesCapacity == 0 ? 128 : ir.edgesCapacity * 2;
+        ir.edges = (IrEdge *)safe_realloc(ir.edges, sizeof(IrEdge) * ir.edgesCapacity);
+    }
+
+    int edge = ir.edgesLength++;
+    ir.edges[edge] = (IrEdge){.block = from, .next = -1};
+
+    IrBlock *b = &ir.blocks[to];
+    if (b->lastPred >= 0) {
+        ir.edges[b->lastPred].next = edge;
+    } else {
+        b->preds = edge;
+        b->idom = from;
+        b->depth = ir.blocks[from].depth + 1;
+    }
+    b->lastPred = edge;
+    b->predsLength += 1;
+
+    IrBlock *f = &ir.blocks[from];
+    f->succs[f->succs[0] < 0 ? 0 : 1] = to;
+}
+
+static IrDef* findDef(int block, int slot) {
+    unsigned mask = ir.defsCapacity - 1;
+    unsigned at = ((unsigned)block * 0x9e3779b1u ^ (unsigned)slot * 0x85ebca6bu) & mask;
+
+    while (ir.defs[at].block >= 0 && (ir.defs[at].block != block || ir.defs[at].slot != slot)) {
+        at = (at + 1) & mask;
+    }
+    return &ir.defs[at];
+}
+
+static void growDefs(void) {
+    IrDef *defs = ir.defs;
+    int capacity = ir.defsCapacity;
+
+    ir.defsCapacity = capacity == 0 ? 256 : capacity * 2;
+    ir.defs = (IrDef *)safe_malloc(sizeof(IrDef) * ir.defsCapacity);
+    for (int i = 0; i < ir.defsCapacity; i++) ir.defs[i].block = -1;
+
+    for (int i = 0; i < capacity; i++) {
+        if (defs[i].block >= 0) *findDef(defs[i].block, defs[i].slot) = defs[i];
+    }
+    free(defs);
+}
+
+static void writeVariable(int slot, int block, int value) {
+    IrDef *def = findDef(block, slot);
+    if (def->block < 0) {
+        // kept at most half full
+        if ((ir.defsLength + 1) * 2 > ir.defsCapacity) {
+            growDefs();
+            def = findDef(block, slot);
+        }
+        ir.defsLength += 1;
+        def->block = block;
+        def->slot = slot;
+    }
+    def->value = value;
+    def->stamp = ir.blocks[block].clobbers;
+}
+
+static int undefined(void) {
+    if (ir.undefined < 0) ir.undefined = newValueIn(0, IR_UNDEF);
+    return ir.undefined;
+}
+
+static int readVariable(int slot, int block);
+
+// a phi whose operands are all the same value, or itself, is that value
+static int removeTrivialPhi(int phi) {
+    int same = -1;
+    for (int i = 0; i < ir.values[phi].operandsLength; i++) {
+        int operand = valueOf(ir.operands[ir.values[phi].operands + i]);
+        if (operand == same || operand == phi) continue;
+        if (same >= 0) return phi;
+        same = operand;
+    }
+
+    if (same < 0) same = undefined();
+    ir.values[phi].same = same;
+    return same;
+}
+
+static int addPhiOperands(int phi) {
+    IrBlock *b = &ir.blocks[ir.values[phi].block];
+    int operands = reserveOperands(b->predsLength);
+    ir.values[phi].operands = operands;
+    ir.values[phi].operandsLength = b->predsLength;
+
+    int i = 0;
+    for (int edge = b->preds; edge >= 0; edge = ir.edges[edge].next) {
+        int operand = readVariable(ir.values[phi].a, ir.edges[edge].block);
+        ir.operands[operands + i++] = operand;
+    }
+    return removeTrivialPhi(phi);
+}
+
+static int readVariable(int slot, int block) {
+    IrDef *def = findDef(block, slot);
+    IrBlock *b = &ir.blocks[block];
+    if (def->block >= 0 && (slot >= ir.globals || def->stamp == b->clobbers)) return def->value;
+
+    int value;
+    if (slot < ir.globals && (b->clobbers > 0 || b->predsLength == 0)) {
+        value = newValueIn(block, IR_LOAD);
+        ir.values[value].a = slot;
+    } else if (b->predsLength == 0) {
+        value = undefined();
+    } else if (!b->sealed) {
+        value = newValueIn(block, IR_PHI);
+        ir.values[value].a = slot;
+        ir.values[value].b = b->incomplete;
+        b->incomplete = value;
+    } else if (b->predsLength == 1) {
+        value = readVariable(slot, ir.edges[b->preds].block);
+    } else {
+        // stored first so the reads through a loop end at the phi. a trivial phi is still what
+        // the reads get, valueOf() looks through it and markDef() reaches the stores behind it
+        value = newValueIn(block, IR_PHI);
+        ir.values[value].a = slot;
+        writeVariable(slot, block, value);
+        addPhiOperands(value);
+    }
+
+    writeVariable(slot, block, value);
+    return value;
+}
+
+static void sealBlock(int block) {
+    int phi = ir.blocks[block].incomplete;
+    while (phi >= 0) {
+        int next = ir.values[phi].b;
+        if (addPhiOperands(phi) != phi) ir.stale = 1;
+        phi = next;
+    }
+    ir.blocks[block].incomplete = -1;
+    ir.blocks[block].sealed = 1;
+}
+
+static void nameSlot(int slot, int name) {
+    if (slot >= ir.slotNamesCapacity) {
+        while (slot >= ir.slotNamesCapacity) ir.slotNamesCapacity = ir.slotNamesCapacity == 0 ? 64 : ir.slotNamesCapacity * 2;
+        ir.slotNames = (int *)safe_realloc(ir.slotNames, sizeof(int) * ir.slotNamesCapacity);
+    }
+    ir.slotNames[slot] = name;
+}
+
+static int dominates(int block, int other) {
+    while (ir.blocks[other].depth > ir.blocks[block].depth) other = ir.blocks[other].idom;
+    return block == other;
+}
+
+static int numbered(IrOp op) {
+    return op == IR_CONST || op == IR_PARAM || op == IR_BINARY || op == IR_CMP;
+}
+
+static unsigned numberHash(int v) {
+    IrValue *value = &ir.values[v];
+    uint64_t bits;
+    if (value->op == IR_CONST) {
+        memcpy(&bits, &value->value, sizeof(Box));
+    } else if (value->op == IR_PARAM) {
+        bits = value->a;
+    } else {
+        bits = (uint64_t)valueOf(value->a) << 32 | (unsigned)valueOf(value->b);
+        bits = hashInt(bits, value->c);
+    }
+    return (unsigned)hashInt(hashInt(0xcbf29ce484222325ULL, value->op), bits);
+}
+
+static int sameNumber(int v, int w) {
+    IrValue *x = &ir.values[v];
+    IrValue *y = &ir.values[w];
+    if (x->op != y->op) return 0;
+
+    switch (x->op) {
+    case IR_CONST:
+        return !memcmp(&x->value, &y->value, sizeof(Box));
+    case IR_PARAM:
+        return x->a == y->a;
+    default:
+        return x->c == y->c && valueOf(x->a) == valueOf(y->a) && valueOf(x->b) == valueOf(y->b);
+    }
+}
+
+static void clearNumbers(void) {
+    int capacity = 256;
+    while (capacity < ir.valuesLength * 2) capacity *= 2;
+    if (capacity > ir.numbersCapacity) {
+        ir.numbersCapacity = capacity;
+        ir.numbers = (int *)safe_realloc(ir.numbers, sizeof(int) * capacity);
+    }
+    memset(ir.numbers, -1, sizeof(int) * ir.numbersCapacity);
+}
+
+// a constant computed from constants becomes one, and a value computed the same way from the same
+// values as one that is computed on every way to it becomes that one. returns the value v stands
+// for
+static int numberValue(int v) {
+    IrValue *value = &ir.values[v];
+    if (value->same >= 0 || !numbered(value->op)) return valueOf(v);
+
+    if (value->op == IR_BINARY || value->op == IR_CMP) {
+        IrValue *left = &ir.values[valueOf(value->a)];
+        IrValue *right = &ir.values[valueOf(value->b)];
+        Box result;
+        if (left->op == IR_CONST && right->op == IR_CONST && foldBoxes(value->op == IR_CMP, value->c, left->value, right->value, &result)) {
+            value->op = IR_CONST;
+            value->value = result;
+        }
+    }
+
+    // grown before it is half full
+    if (ir.valuesLength * 2 > ir.numbersCapacity) {
+        clearNumbers();
+        for (int w = 0; w < v; w++) {
+            if (ir.values[w].same < 0 && numbered(ir.values[w].op)) {
+                unsigned mask = ir.numbersCapacity - 1;
+                unsigned at = numberHash(w) & mask;
+                while (ir.numbers[at] >= 0) at = (at + 1) & mask;
+                ir.numbers[at] = w;
+            }
+        }
+    }
+
+    unsigned mask = ir.numbersCapacity - 1;
+    unsigned at = numberHash(v) & mask;
+    while (ir.numbers[at] >= 0) {
+        int w = ir.numbers[at];
+        if (w != v && ir.values[w].same < 0 && sameNumber(v, w)) {
+            int op = ir.values[v].op;
+            if (op == IR_CONST || op == IR_PARAM || dominates(ir.values[w].block, ir.values[v].block)) {
+                ir.values[v].same = w;
+                return w;
+            }
+            // the one after it is what the blocks v dominates see
+            ir.numbers[at] = v;
+            return v;
+        }
+        if (w == v) return v;
+        at = (at + 1) & mask;
+    }
+    ir.numbers[at] = v;
+    return v;
+}
+
+static int constant(Box box) {
+    int v = newValue(IR_CONST, 0, 0, 0);
+    ir.values[v].value = box;
+    return numberValue(v);
+}
+
+// a variable in scope that already holds the value node computes, so the node can be replaced by
+// a read of it
+static void findHolder(int node, int value) {
+    int v = valueOf(value);
+    for (int set = ir.values[v].holders; set >= 0; set = ir.values[set].nextHolder) {
+        int slot = ir.values[set].a;
+        if (slot >= ir.varsLength) continue;
+
+        int def = readVariable(slot, ir.current);
+        if (valueOf(def) == v) {
+            ir.nodes[node].holder = slot;
+            ir.nodes[node].holderDef = def;
+            return;
+        }
+    }
+}
+
+// the ir of a let or an assignment, the slot holds value from here on
+static int setVariable(int slot, int value, int stmt) {
+    int set = newValue(IR_SET, slot, value, ir.slotNames[slot]);
+    writeVariable(slot, ir.current, set);
+
+    int v = valueOf(value);
+    ir.values[set].nextHolder = ir.values[v].holders;
+    ir.values[v].holders = set;
+    ir.nodes[stmt].value = set;
+    return set;
+}
+
+// a call can run anything, and so can another coroutine once this one yields
+static void clobber(void) {
+    ir.blocks[ir.current].clobbers += 1;
+}
+
+static int buildExpr(int node);
+
+static int buildCall(int node) {
+    Node *n = &ast.nodes[node];
+
+    int length = 0;
+    for (int arg = n->b; arg != 0; arg = ast.nodes[arg].next) length++;
+    int operands = reserveOperands(length);
+
+    int i = 0;
+    for (int arg = n->b; arg != 0; arg = ast.nodes[arg].next) {
+        int operand = buildExpr(ast.nodes[arg].a);
+        ir.operands[operands + i++] = operand;
+    }
+
+    IrOp op = IR_CALL;
+    int clobbers = 1;
+    switch (n->type) {
+    case NODE_SPAWN:
+        op = IR_SPAWN;
+        break;
+    case NODE_NATIVE:
+        op = IR_NATIVE;
+        clobbers = natives[n->a].suspends;
+        break;
+    case NODE_INTRINSIC:
+        op = IR_INTRINSIC;
+        clobbers = intrinsics[n->a].type == INST_RESUME || intrinsics[n->a].type == INST_WAIT;
+        break;
+    default:
+        break;
+    }
+
+    int value = newValue(op, n->a, 0, n->c);
+    ir.values[value].operands = operands;
+    ir.values[value].operandsLength = length;
+    if (clobbers) clobber();
+    return value;
+}
+
+static int buildExpr(int node) {
+    Node *n = &ast.nodes[node];
+    IrNode *info = &ir.nodes[node];
+    *info = (IrNode){.holder = -1};
+    int value;
+
+    switch (n->type) {
+    case NODE_CONSTANT:
+        value = constant(n->value);
+        info->pure = 1;
+        break;
+    case NODE_STRING:
+        value = newValue(IR_STRING, 0, 0, node);
+        break;
+    case NODE_VAR:
+        value = info->def = readVariable(n->a, ir.current);
+        info->pure = 1;
+        break;
+    case NODE_PARAM:
+        value = numberValue(newValue(IR_PARAM, n->a, 0, 0));
+        info->pure = 1;
+        break;
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        value = buildCall(node);
+        break;
+    case NODE_ARRAY: {
+        int length = 0;
+        for (int element = n->a; element != 0; element = ast.nodes[element].next) length++;
+        int operands = reserveOperands(length);
+
+        int i = 0;
+        for (int element = n->a; element != 0; element = ast.nodes[element].next) {
+            int operand = buildExpr(element);
+            ir.operands[operands + i++] = operand;
+        }
+        value = newValue(IR_ARRAY, 0, 0, 0);
+        ir.values[value].operands = operands;
+        ir.values[value].operandsLength = length;
+        break;
+    }
+    case NODE_INDEX: {
+        int array = buildExpr(n->a);
+        int index = buildExpr(n->b);
+        value = newValue(IR_INDEX, array, index, 0);
+        break;
+    }
+    case NODE_BINARY:
+    case NODE_COMPARE: {
+        int left = buildExpr(n->a);
+        int right = buildExpr(n->b);
+        value = numberValue(newValue(n->type == NODE_COMPARE ? IR_CMP : IR_BINARY, left, right, n->c));
+
+        info->pure = ir.nodes[n->a].pure && ir.nodes[n->b].pure;
+        if (info->pure) findHolder(node, value);
+        break;
+    }
+    default:
+        value = undefined();
+        break;
+    }
+
+    info->value = value;
+    return value;
+}
+
+// what a condition without calls comes to on entry to a loop, 0 if it isn't known
+static int constantOf(int node, Box *value) {
+    Node *n = &ast.nodes[node];
+    Box left, right;
+
+    switch (n->type) {
+    case NODE_CONSTANT:
+        *value = n->value;
+        return 1;
+    case NODE_VAR: {
+        IrValue *v = &ir.values[valueOf(readVariable(n->a, ir.current))];
+        *value = v->value;
+        return v->op == IR_CONST;
+    }
+    case NODE_BINARY:
+    case NODE_COMPARE:
+        return constantOf(n->a, &left) && constantOf(n->b, &right) && foldBoxes(n->type == NODE_COMPARE, n->c, left, right, value);
+    default:
+        return 0;
+    }
+}
+
+static int isFalse(Box value) {
+    return TYPE(value) == VAL_INT && value.int32 == 0;
+}
+
+static void buildStmt(int node);
+
+static void buildBlock(int node) {
+    int varsLength = ir.varsLength;
+    int last = 0;
+
+    for (int stmt = ast.nodes[node].a; stmt != 0; stmt = ast.nodes[stmt].next) {
+        if (ir.current < 0) {
+            // nothing after a return runs
+            ast.nodes[last].next = 0;
+            break;
+        }
+        buildStmt(stmt);
+        last = stmt;
+    }
+    ir.varsLength = varsLength;
+}
+
+// the conditions of an if/else chain are all evaluated, a block runs if its condition holds and the
+// condition breaker isn't set yet, so every block may be followed by the next condition
+static void buildIf(int node) {
+    while (1) {
+        Node *n = &ast.nodes[node];
+        int cond = buildExpr(n->a);
+        IrValue *value = &ir.values[valueOf(cond)];
+
+        if (value->op == IR_CONST && isFalse(value->value)) {
+            // never runs, the condition stays for the breaker
+            ast.nodes[n->b].a = 0;
+            ast.nodes[n->b].b = 0;
+        } else {
+            int test = ir.current;
+            int then = newBlock();
+            int skip = newBlock();
+            addEdge(test, then);
+            addEdge(test, skip);
+            ir.blocks[test].cond = cond;
+            sealBlock(then);
+
+            ir.current = then;
+            buildBlock(n->b);
+            if (ir.current >= 0) addEdge(ir.current, skip);
+            sealBlock(skip);
+            ir.current = skip;
+        }
+
+        if (n->c == 0) return;
+        if (ast.nodes[n->c].type == NODE_IF) {
+            node = n->c;
+            continue;
+        }
+
+        int test = ir.current;
+        int otherwise = newBlock();
+        int join = newBlock();
+        addEdge(test, otherwise);
+        addEdge(test, join);
+        sealBlock(otherwise);
+
+        ir.current = otherwise;
+        buildBlock(n->c);
+        if (ir.current >= 0) addEdge(ir.current, join);
+        sealBlock(join);
+        ir.current = join;
+        return;
+    }
+}
+
+static void buildLoop(int node) {
+    Node *n = &ast.nodes[node];
+
+    Box value;
+    if (constantOf(n->a, &value) && isFalse(value)) {
+        // never entered
+        n->type = NODE_NONE;
+        return;
+    }
+
+    int header = newBlock();
+    addEdge(ir.current, header);
+    ir.current = header;
+    int cond = buildExpr(n->a);
+
+    int body = newBlock();
+    int exit = newBlock();
+    addEdge(header, body);
+    addEdge(header, exit);
+    ir.blocks[header].cond = cond;
+    sealBlock(body);
+    sealBlock(exit);
+
+    ir.current = body;
+    buildBlock(n->b);
+    if (ir.current >= 0) addEdge(ir.current, header);
+    sealBlock(header);
+    ir.current = exit;
+}
+
+static void buildStmt(int node) {
+    Node *n = &ast.nodes[node];
+    ir.nodes[node] = (IrNode){.value = -1, .holder = -1};
+
+    switch (n->type) {
+    case NODE_LET: {
+        int slot = ir.varsLength++;
+        nameSlot(slot, n->a);
+        writeVariable(slot, ir.current, undefined());
+        setVariable(slot, buildExpr(n->b), node);
+        break;
+    }
+    case NODE_ASSIGN:
+        setVariable(n->a, buildExpr(n->b), node);
+        break;
+    case NODE_INDEX_ASSIGN: {
+        int array = buildExpr(n->a);
+        int index = buildExpr(n->b);
+        int value = buildExpr(n->c);
+        ir.nodes[node].value = newValue(IR_INDEX_SET, array, index, value);
+        break;
+    }
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        buildExpr(node);
+        break;
+    case NODE_RETURN: {
+        int value = buildExpr(n->a);
+        ir.nodes[node].value = newValue(IR_RETURN, value, 0, 0);
+        ir.current = -1;
+        break;
+    }
+    case NODE_YIELD:
+        ir.nodes[node].value = newValue(IR_YIELD, 0, 0, 0);
+        clobber();
+        break;
+    case NODE_IF:
+        buildIf(node);
+        break;
+    case NODE_LOOP:
+        buildLoop(node);
+        break;
+    default:
+        break;
+    }
+}
+
+// phis left with a single value once the graph is complete go, and the values computed from them
+// are numbered again until nothing changes
+static void simplify(void) {
+    while (1) {
+        for (int v = 0; v < ir.valuesLength; v++) {
+            if (ir.values[v].op == IR_PHI && ir.values[v].same < 0 && removeTrivialPhi(v) != v) ir.stale = 1;
+        }
+        if (!ir.stale) return;
+
+        ir.stale = 0;
+        clearNumbers();
+        for (int v = 0; v < ir.valuesLength; v++) {
+            if (ir.values[v].same < 0 && numbered(ir.values[v].op)) numberValue(v);
+        }
+    }
+}
+
+// optimistic, a phi on a loop is a number unless something makes it otherwise
+static void inferNumbers(void) {
+    for (int v = 0; v < ir.valuesLength; v++) {
+        IrValue *value = &ir.values[v];
+        if (value->op == IR_CONST) {
+            value->number = TYPE(value->value) == VAL_INT || TYPE(value->value) == VAL_FLOAT;
+        } else {
+            value->number = value->op == IR_BINARY || value->op == IR_CMP || value->op == IR_PHI;
+        }
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int v = 0; v < ir.valuesLength; v++) {
+            IrValue *value = &ir.values[v];
+            if (!value->number || value->same >= 0) continue;
+
+            if (value->op == IR_BINARY) {
+                value->number = ir.values[valueOf(value->a)].number && ir.values[valueOf(value->b)].number;
+            } else if (value->op == IR_PHI) {
+                for (int i = 0; i < value->operandsLength && value->number; i++) {
+                    value->number = ir.values[valueOf(ir.operands[value->operands + i])].number;
+                }
+            }
+            if (!value->number) changed = 1;
+        }
+    }
+}
+
+static int isNumber(int v) {
+    if (!ir.inferred) {
+        ir.inferred = 1;
+        inferNumbers();
+    }
+    return ir.values[valueOf(v)].number;
+}
+
+static void rewriteExpr(int node) {
+    Node *n = &ast.nodes[node];
+    IrNode *info = &ir.nodes[node];
+
+    if (info->pure) {
+        IrValue *value = &ir.values[valueOf(info->value)];
+        if (value->op == IR_CONST && n->type != NODE_CONSTANT) {
+            *n = (Node){.type = NODE_CONSTANT, .line = n->line, .next = n->next, .value = value->value};
+            return;
+        }
+        if (info->holder >= 0 && isNumber(info->value)) {
+            *n = (Node){.type = NODE_VAR, .line = n->line, .a = info->holder, .next = n->next};
+            info->def = info->holderDef;
+            return;
+        }
+    }
+
+    switch (n->type) {
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        for (int arg = n->b; arg != 0; arg = ast.nodes[arg].next) rewriteExpr(ast.nodes[arg].a);
+        break;
+    case NODE_ARRAY:
+        for (int element = n->a; element != 0; element = ast.nodes[element].next) rewriteExpr(element);
+        break;
+    case NODE_INDEX:
+    case NODE_BINARY:
+    case NODE_COMPARE:
+        rewriteExpr(n->a);
+        rewriteExpr(n->b);
+        break;
+    default:
+        break;
+    }
+}
+
+static void rewriteStmt(int node);
+
+static void rewriteBlock(int node) {
+    for (int stmt = ast.nodes[node].a; stmt != 0; stmt = ast.nodes[stmt].next) rewriteStmt(stmt);
+}
+
+static void rewriteStmt(int node) {
+    Node *n = &ast.nodes[node];
+
+    switch (n->type) {
+    case NODE_LET:
+    case NODE_ASSIGN:
+        rewriteExpr(n->b);
+        break;
+    case NODE_INDEX_ASSIGN:
+        rewriteExpr(n->b);
+        rewriteExpr(n->c);
+        break;
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+    case NODE_RETURN:
+        rewriteExpr(n->type == NODE_RETURN ? n->a : node);
+        break;
+    case NODE_IF:
+        rewriteExpr(n->a);
+        rewriteBlock(n->b);
+        if (n->c != 0 && ast.nodes[n->c].type == NODE_IF) {
+            rewriteStmt(n->c);
+        } else if (n->c != 0) {
+            rewriteBlock(n->c);
+        }
+        break;
+    case NODE_LOOP:
+        rewriteExpr(n->a);
+        rewriteBlock(n->b);
+        break;
+    default:
+        break;
+    }
+}
+
+// a read keeps the stores it may see, through the phis it goes through
+static void markDef(int def) {
+    IrValue *value = &ir.values[def];
+    if (value->live) return;
+    value->live = 1;
+
+    if (value->op == IR_PHI) {
+        for (int i = 0; i < value->operandsLength; i++) markDef(ir.operands[value->operands + i]);
+    }
+}
+
+static void markExpr(int node) {
+    Node *n = &ast.nodes[node];
+    IrNode *info = &ir.nodes[node];
+
+    if (n->type == NODE_VAR) {
+        markDef(info->def);
+        return;
+    }
+    if (info->value >= 0) ir.values[valueOf(info->value)].live = 1;
+
+    switch (n->type) {
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        for (int arg = n->b; arg != 0; arg = ast.nodes[arg].next) markExpr(ast.nodes[arg].a);
+        break;
+    case NODE_ARRAY:
+        for (int element = n->a; element != 0; element = ast.nodes[element].next) markExpr(element);
+        break;
+    case NODE_INDEX:
+    case NODE_BINARY:
+    case NODE_COMPARE:
+        markExpr(n->a);
+        markExpr(n->b);
+        break;
+    default:
+        break;
+    }
+}
+
+static void markStmt(int node);
+
+static void markBlock(int node) {
+    for (int stmt = ast.nodes[node].a; stmt != 0; stmt = ast.nodes[stmt].next) markStmt(stmt);
+}
+
+static void markStmt(int node) {
+    Node *n = &ast.nodes[node];
+    int value = ir.nodes[node].value;
+
+    switch (n->type) {
+    case NODE_LET:
+    case NODE_ASSIGN:
+        markExpr(n->b);
+        if (ir.values[value].a < ir.locals || (ir.markStores && ir.nodes[n->b].value >= 0)) ir.values[value].live = 1;
+        break;
+    case NODE_INDEX_ASSIGN:
+        markExpr(n->a);
+        markExpr(n->b);
+        markExpr(n->c);
+        ir.values[value].live = 1;
+        break;
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        markExpr(node);
+        break;
+    case NODE_RETURN:
+        markExpr(n->a);
+        ir.values[value].live = 1;
+        break;
+    case NODE_YIELD:
+        ir.values[value].live = 1;
+        break;
+    case NODE_IF:
+        markExpr(n->a);
+        markBlock(n->b);
+        if (n->c != 0 && ast.nodes[n->c].type == NODE_IF) {
+            markStmt(n->c);
+        } else if (n->c != 0) {
+            markBlock(n->c);
+        }
+        break;
+    case NODE_LOOP:
+        markExpr(n->a);
+        markBlock(n->b);
+        break;
+    default:
+        break;
+    }
+}
+
+// whether dropping the evaluation of node changes nothing: no calls, and nothing that can fail
+static int removable(int node) {
+    Node *n = &ast.nodes[node];
+
+    switch (n->type) {
+    case NODE_CONSTANT:
+    case NODE_VAR:
+    case NODE_PARAM:
+        return 1;
+    case NODE_BINARY:
+    case NODE_COMPARE: {
+        if (!removable(n->a) || !removable(n->b)) return 0;
+        if (!isNumber(ir.nodes[n->a].value) || !isNumber(ir.nodes[n->b].value)) return 0;
+        if (n->type == NODE_COMPARE || n->c != INST_DIV) return 1;
+
+        // an int division by 0 or of INT_MIN by -1 faults
+        Box divisor = ast.nodes[n->b].value;
+        if (ast.nodes[n->b].type != NODE_CONSTANT) return 0;
+        return TYPE(divisor) == VAL_FLOAT || (divisor.int32 != 0 && divisor.int32 != -1);
+    }
+    default:
+        return 0;
+    }
+}
+
+static int dropStores(int node);
+
+static int dropStoresIn(int block) {
+    int dropped = 0;
+    for (int stmt = ast.nodes[block].a; stmt != 0; stmt = ast.nodes[stmt].next) dropped |= dropStores(stmt);
+    return dropped;
+}
+
+// stores to a function's own variables that nothing reads are dropped, or for a let (whose slot
+// has to stay) the value is replaced by 0
+static int dropStores(int node) {
+    Node *n = &ast.nodes[node];
+    int value = ir.nodes[node].value;
+
+    switch (n->type) {
+    case NODE_LET:
+        if (ir.values[value].live || ast.nodes[n->b].type == NODE_CONSTANT || !removable(n->b)) return 0;
+        int zero = 0;
+        ast.nodes[n->b] = (Node){.type = NODE_CONSTANT, .line = ast.nodes[n->b].line, .value = createBox(&zero, VAL_INT)};
+        ir.nodes[n->b].value = -1;
+        return 1;
+    case NODE_ASSIGN:
+        if (ir.values[value].live || !removable(n->b)) return 0;
+        n->type = NODE_NONE;
+        return 1;
+    case NODE_IF: {
+        int dropped = dropStoresIn(n->b);
+        if (n->c != 0 && ast.nodes[n->c].type == NODE_IF) {
+            dropped |= dropStores(n->c);
+        } else if (n->c != 0) {
+            dropped |= dropStoresIn(n->c);
+        }
+        return dropped;
+    }
+    case NODE_LOOP:
+        return dropStoresIn(n->b);
+    default:
+        return 0;
+    }
+}
+
+static void eliminateDeadCode(int first, int isBody) {
+    int dropped = 1;
+    while (dropped) {
+        for (int v = 0; v < ir.valuesLength; v++) {
+            // the return a function body ends with
+            ir.values[v].live = ir.values[v].op == IR_RETURN && ir.values[v].a < 0;
+        }
+
+        if (isBody) {
+            markBlock(first);
+        } else {
+            for (int stmt = first; stmt != 0; stmt = ast.nodes[stmt].next) markStmt(stmt);
+        }
+        for (int block = 0; block < ir.blocksLength; block++) {
+            if (ir.blocks[block].cond >= 0) ir.values[valueOf(ir.blocks[block].cond)].live = 1;
+        }
+
+        dropped = isBody ? dropStoresIn(first) : 0;
+    }
+
+    if (irDump == NULL) return;
+
+    // the stores left are part of the code too
+    ir.markStores = 1;
+    if (isBody) {
+        markBlock(first);
+    } else {
+        for (int stmt = first; stmt != 0; stmt = ast.nodes[stmt].next) markStmt(stmt);
+    }
+    ir.markStores = 0;
+}
+
+static void dumpName(int name) {
+    fprintf(irDump, "%.*s", ast.names[name].length, ast.names[name].lexeme);
+}
+
+static void dumpValue(int v) {
+    IrValue *value = &ir.values[v];
+    static const char *ops[] = {"add", "sub", "mult", "div"};
+    static const char *conditions[] = {"gt", "lt", "ge", "le", "eq", "ne"};
+
+    fprintf(irDump, "  ");
+    if (value->op == IR_SET) {
+        dumpName(value->c);
+        fprintf(irDump, " = v%d\n", valueOf(value->b));
+        return;
+    }
+    if (value->op != IR_INDEX_SET && value->op != IR_RETURN && value->op != IR_YIELD) fprintf(irDump, "v%d = ", v);
+
+    switch (value->op) {
+    case IR_CONST:
+        if (TYPE(value->value) == VAL_INT) {
+            fprintf(irDump, "const %d", value->value.int32);
+        } else {
+            fprintf(irDump, "const %g", value->value.float64);
+        }
+        break;
+    case IR_PARAM:
+        fprintf(irDump, "param %d", value->a);
+        break;
+    case IR_LOAD:
+        fprintf(irDump, "load ");
+        dumpName(ir.slotNames[value->a]);
+        break;
+    case IR_UNDEF:
+        fprintf(irDump, "undef");
+        break;
+    case IR_PHI:
+        fprintf(irDump, "phi");
+        break;
+    case IR_BINARY:
+        fprintf(irDump, "%s v%d v%d", ops[value->c - INST_ADD], valueOf(value->a), valueOf(value->b));
+        break;
+    case IR_CMP:
+        fprintf(irDump, "%s v%d v%d", conditions[value->c], valueOf(value->a), valueOf(value->b));
+        break;
+    case IR_STRING:
+        fprintf(irDump, "string %.*s", ast.nodes[value->c].b, ast.source + ast.nodes[value->c].a);
+        break;
+    case IR_ARRAY:
+        fprintf(irDump, "array");
+        break;
+    case IR_INDEX:
+        fprintf(irDump, "index v%d v%d", valueOf(value->a), valueOf(value->b));
+        break;
+    case IR_CALL:
+    case IR_SPAWN:
+        fprintf(irDump, "%s ", value->op == IR_CALL ? "call" : "spawn");
+        dumpName(value->c);
+        break;
+    case IR_NATIVE:
+        fprintf(irDump, "native %s", natives[value->a].name);
+        break;
+    case IR_INTRINSIC:
+        fprintf(irDump, "intrinsic %s", intrinsics[value->a].name);
+        break;
+    case IR_INDEX_SET:
+        fprintf(irDump, "v%d[v%d] = v%d", valueOf(value->a), valueOf(value->b), valueOf(value->c));
+        break;
+    case IR_RETURN:
+        fprintf(irDump, "return");
+        if (value->a >= 0) fprintf(irDump, " v%d", valueOf(value->a));
+        break;
+    case IR_YIELD:
+        fprintf(irDump, "yield");
+        break;
+    default:
+        break;
+    }
+
+    for (int i = 0; i < value->operandsLength; i++) fprintf(irDump, " v%d", valueOf(ir.operands[value->operands + i]));
+    fprintf(irDump, "\n");
+}
+
+// live values only, phis first
+static void dump(const char *kind, int name) {
+    int built = 0, kept = 0;
+    for (int v = 0; v < ir.valuesLength; v++) {
+        if (ir.values[v].op != IR_PHI) built++;
+        if (ir.values[v].live && ir.values[v].same < 0 && ir.values[v].op != IR_PHI) kept++;
+    }
+
+    fprintf(irDump, "%s", kind);
+    if (name >= 0) {
+        fprintf(irDump, " ");
+        dumpName(name);
+    }
+    fprintf(irDump, ": %d values, %d after optimization\n", built, kept);
+
+    for (int block = 0; block < ir.blocksLength; block++) {
+        IrBlock *b = &ir.blocks[block];
+        fprintf(irDump, "b%d:", block);
+        if (b->predsLength > 0) fprintf(irDump, " <-");
+        for (int edge = b->preds; edge >= 0; edge = ir.edges[edge].next) fprintf(irDump, " b%d", ir.edges[edge].block);
+        fprintf(irDump, "\n");
+
+        for (int phis = 1; phis >= 0; phis--) {
+            for (int v = b->first; v >= 0; v = ir.values[v].next) {
+                IrValue *value = &ir.values[v];
+                if ((value->op == IR_PHI) == phis && value->live && value->same < 0) dumpValue(v);
+            }
+        }
+
+        if (b->succs[1] >= 0 && b->cond >= 0) {
+            fprintf(irDump, "  branch v%d b%d b%d\n", valueOf(b->cond), b->succs[0], b->succs[1]);
+        } else if (b->succs[1] >= 0) {
+            fprintf(irDump, "  branch breaker b%d b%d\n", b->succs[1], b->succs[0]);
+        } else if (b->succs[0] >= 0) {
+            fprintf(irDump, "  jump b%d\n", b->succs[0]);
+        }
+    }
+    fprintf(irDump, "\n");
+}
+
+static void startRegion(int varsLength, int globals, int locals) {
+    ir.valuesLength = 0;
+    ir.blocksLength = 0;
+    ir.edgesLength = 0;
+    ir.operandsLength = 0;
+    ir.defsLength = 0;
+    memset(ir.defs, -1, sizeof(IrDef) * ir.defsCapacity);
+    clearNumbers();
+
+    ir.varsLength = varsLength;
+    ir.globals = globals;
+    ir.locals = locals;
+    ir.undefined = -1;
+    ir.stale = 0;
+    ir.inferred = 0;
+
+    ir.current = newBlock();
+    sealBlock(ir.current);
+}
+
+static void finishRegion(int first, int isBody) {
+    simplify();
+
+    if (isBody) {
+        rewriteBlock(first);
+    } else {
+        for (int stmt = first; stmt != 0; stmt = ast.nodes[stmt].next) rewriteStmt(stmt);
+    }
+    eliminateDeadCode(first, isBody);
+}
+
+static void optimizeFunction(int node) {
+    Node *n = &ast.nodes[node];
+    FunctionInfo *function = &ast.functions[n->c];
+
+    // its own variables only live as long as a call
+    startRegion(function->localsBase, function->localsBase, function->localsBase);
+    buildBlock(n->b);
+    if (ir.current >= 0) newValue(IR_RETURN, -1, 0, 0);
+
+    finishRegion(n->b, 1);
+    if (irDump != NULL) dump("fun", n->a);
+}
+
+// what the top level stores stays on the stack once the program is done, so it is never dropped
+static void optimizeTopLevel(int first, int globals) {
+    startRegion(0, globals, INT_MAX);
+
+    for (int stmt = first; stmt != 0; stmt = ast.nodes[stmt].next) {
+        if (ast.nodes[stmt].type == NODE_FUNCTION || ast.nodes[stmt].type == NODE_IMPORT) continue;
+        if (ir.current < 0) {
+            // after a return
+            ir.current = newBlock();
+            sealBlock(ir.current);
+        }
+        buildStmt(stmt);
+    }
+
+    finishRegion(first, 0);
+    if (irDump != NULL) dump("top level", -1);
+}
+
+void optimizeUnit(int first) {
+    if (!irEnabled()) return;
+
+    ir.nodes = (IrNode *)safe_malloc(sizeof(IrNode) * ast.length);
+    if (ir.defs == NULL) growDefs();
+
+    // the globals a function sees are the top level's variables declared before it
+    int slot = 0, globals = 0;
+    for (int stmt = first; stmt != 0; stmt = ast.nodes[stmt].next) {
+        Node *n = &ast.nodes[stmt];
+        if (n->type == NODE_LET) nameSlot(slot++, n->a);
+    }
+    for (int stmt = first; stmt != 0; stmt = ast.nodes[stmt].next) {
+        Node *n = &ast.nodes[stmt];
+        if (n->type != NODE_FUNCTION) continue;
+
+        FunctionInfo *function = &ast.functions[n->c];
+        if (function->localsBase > globals) globals = function->localsBase;
+        if (function->cached < 0) {
+            optimizeFunction(stmt);
+        } else if (irDump != NULL) {
+            fprintf(irDump, "fun ");
+            dumpName(n->a);
+            fprintf(irDump, ": taken from the function cache\n\n");
+        }
+    }
+    optimizeTopLevel(first, globals);
+
+    free(ir.nodes);
+    ir.nodes = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef IR_H
+#define IR_H
+
+#include <stdio.h>
+
+// between resolution and code generation the body of every function and the top level of a unit
+// are built into a control flow graph in ssa form, see ir.c. on it copies are propagated, values
+// numbered (which folds constants too) and what nothing observes is dropped. the code generator
+// still walks the tree, which the results are written back to: an expression whose value is a
+// constant or already held by a variable is replaced by it, stores nothing reads are removed and
+// so are blocks that can't run
+
+// optimizes the functions of the unit not taken from the function cache and its top level, whose
+// first statement is first
+void optimizeUnit(int first);
+
+// 0 with NGS_IR=0, which leaves the tree as the resolver made it. part of a function's cache key
+int irEnabled(void);
+
+// optimizeUnit() prints the ir it ends up with to out, NULL stops it
+void setIrDump(FILE *out);
+
+#endif
@@ -0,0 +1,1133 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "jit.h"
+#include "array.h"
+#include "map.h"
+#include "builtins.h"
+#include "coroutine.h"
+#include "utils.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// a region is a function body (or the top level code outside of any function) compiled as one unit.
+// native code keeps the VM in rbx, the base of the operand stack in r12 and the operand stack pointer
+// in r13, everything else lives in the VM
+// so control can move between native code and the interpreter at any instruction boundary
+typedef int (*NativeEntry)(VM *vm, void *target);
+
+typedef enum {
+    REGION_COLD,
+    REGION_COMPILED,
+    REGION_FAILED,
+} RegionState;
+
+typedef struct {
+    RegionState state;
+    void *code;
+    size_t codeSize;
+    NativeEntry entry;
+} Region;
+
+typedef struct {
+    int enabled;
+    int threshold;
+
+    // indexed by pc
+    int *hotness;
+    int *owner;
+    void **entries;
+
+    // one region per function, the last one holds the top level code
+    Region *regions;
+    int regionsLength;
+
+    // native code calls native code on the c stack, past this many levels the callee is left to
+    // the interpreter, see jitStackDepth()
+    int maxDepth;
+} JIT;
+
+JIT jit;
+volatile sig_atomic_t jitDepth;
+
+// levels of native calls that fit in three quarters of the c stack rlimit, capped when it's
+// unlimited. a level is the entry trampoline, the native frame, jitCall() and enterNative()
+static int jitStackDepth(void) {
+    struct rlimit limit;
+    rlim_t bytes = JIT_STACK_CAP;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < bytes) {
+        bytes = limit.rlim_cur;
+    }
+    return (int)(bytes / 4 * 3 / JIT_FRAME_BYTES);
+}
+
+void initJIT(void) {
+    jit = (JIT){0};
+
+    if (!JIT_SUPPORTED || vm->programLength == 0) return;
+
+    char *env = getenv("NGS_JIT");
+    if (env != NULL && !strcmp(env, "0")) return;
+#ifdef NGS_COUNTERS
+    return;
+#endif
+
+    jit.threshold = JIT_DEFAULT_THRESHOLD;
+    env = getenv("NGS_JIT_THRESHOLD");
+    if (env != NULL && atoi(env) > 0) jit.threshold = atoi(env);
+    jit.maxDepth = jitStackDepth();
+
+    jit.hotness = (int *)safe_calloc(vm->programLength, sizeof(int));
+    jit.owner = (int *)safe_malloc(sizeof(int) * vm->programLength);
+    jit.entries = (void **)safe_calloc(vm->programLength, sizeof(void *));
+
+    jit.regionsLength = vm->functionsLength + 1;
+    jit.regions = (Region *)safe_calloc(jit.regionsLength, sizeof(Region));
+
+    for (int pc = 0; pc < vm->programLength; pc++) {
+        jit.owner[pc] = vm->functionsLength;
+    }
+    for (int i = 0; i < vm->functionsLength; i++) {
+        for (int pc = vm->functions[i].ip; pc < vm->functions[i].end; pc++) {
+            jit.owner[pc] = i;
+        }
+    }
+
+    jit.enabled = 1;
+}
+
+#if JIT_SUPPORTED
+
+// ===== RUNTIME HELPERS (called from native code with vm->sp in sync) =====
+
+static void jitAdd(void) {
+    STACK_POP(Box roperand);
+    STACK_POP(Box loperand);
+    STACK_PUSH(addBoxes(loperand, roperand));
+}
+
+static void jitSub(void) {
+    STACK_POP(Box roperand);
+    STACK_POP(Box loperand);
+    STACK_PUSH(subBoxes(loperand, roperand));
+}
+
+static void jitMult(void) {
+    STACK_POP(Box roperand);
+    STACK_POP(Box loperand);
+    STACK_PUSH(multBoxes(loperand, roperand));
+}
+
+static void jitDiv(void) {
+    STACK_POP(Box roperand);
+    STACK_POP(Box loperand);
+    STACK_PUSH(divBoxes(loperand, roperand));
+}
+
+static void jitNot(void) {
+    STACK_POP(Box value);
+    STACK_PUSH(notBox(value));
+}
+
+static void jitCompare(int condition) {
+    STACK_POP(Box roperand);
+    STACK_POP(Box loperand);
+    STACK_PUSH(compareBoxes(loperand, roperand, condition));
+}
+
+static void jitAssign(int slot) {
+    STACK_POP(Box value);
+    assignVar(slot, value);
+}
+
+static void jitAssignLocal(int offset) {
+    STACK_POP(Box value);
+    assignVar(localSlot(offset), value);
+}
+
+static int jitLoopStep(int pc) {
+    vm->pc = pc;
+    Inst *extra = vm->program + pc + 1;
+    Box limit = extra[3].type == INST_STACK_PUSH ? extra[3].operand : vm->operandStack[fetchedSlot(extra[3])];
+    return stepLoop(fetchedSlot(extra[0]), extra[1].operand.int32, extra[2].operand.int32, limit);
+}
+
+static int enterNative(int pc);
+
+// returns 0 once the callee has returned to returnPc, 1 if the callee left native code and the
+// interpreter has to take over at vm->pc
+static int jitCall(int returnPc, int target) {
+    vm->pc = returnPc - 1;
+    pushFrame(returnPc);
+
+    vm->pc = target;
+    int status = enterNative(target);
+    return status < 0 ? 1 : status;
+}
+
+// ===== CODE GENERATION =====
+
+typedef enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RSI = 6,
+    RDI = 7,
+} Reg;
+
+typedef enum {
+    CC_O = 0x0,
+    CC_B = 0x2,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_S = 0x8,
+    CC_NS = 0x9,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF,
+} CondCode;
+
+typedef struct {
+    size_t at;
+    int target;
+} Fixup;
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+
+    // native offset of each pc owned by the region being compiled, -1 otherwise
+    int *labels;
+    int region;
+
+    Fixup *fixups;
+    int fixupsLength;
+    int fixupsCapacity;
+
+    size_t exitLabel;
+} Assembler;
+
+Assembler as;
+
+#define EMIT(...) emitBytes((uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
+
+#define SP_OFFSET (int32_t)offsetof(VM, sp)
+#define CSP_OFFSET (int32_t)offsetof(VM, csp)
+#define FRAME_OFFSET (int32_t)offsetof(VM, frame)
+#define PC_OFFSET (int32_t)offsetof(VM, pc)
+#define CB_OFFSET (int32_t)offsetof(VM, conditionBreaker)
+#define FUEL_OFFSET (int32_t)offsetof(VM, fuel)
+#define OPERAND_STACK_OFFSET (int32_t)offsetof(VM, operandStack)
+#define CALL_STACK_OFFSET (int32_t)offsetof(VM, callStack)
+
+#define INT_TAG 0x7FF8
+// arrays and maps have the tags from ARRAY_TAG to LAST_TAG
+#define ARRAY_TAG (0x7FF8 | VAL_ARRAY)
+#define LAST_TAG 0x7FFF
+
+static void emitBytes(uint8_t *bytes, size_t length) {
+    if (as.length + length > as.capacity) {
+        as.capacity = as.capacity * 2 + length;
+        as.bytes = safe_realloc(as.bytes, as.capacity);
+    }
+    memcpy(as.bytes + as.length, bytes, length);
+    as.length += length;
+}
+
+static void emit32(int32_t value) {
+    emitBytes((uint8_t *)&value, 4);
+}
+
+static void emit64(uint64_t value) {
+    emitBytes((uint8_t *)&value, 8);
+}
+
+static void patch32(size_t at, int32_t value) {
+    memcpy(as.bytes + at, &value, 4);
+}
+
+// points the rel32 at `at` to the current position
+static void patchHere(size_t at) {
+    patch32(at, (int32_t)(as.length - (at + 4)));
+}
+
+static void addFixup(int target) {
+    if (as.fixupsLength >= as.fixupsCapacity) {
+        as.fixupsCapacity = as.fixupsCapacity * 2 + 16;
+        as.fixups = safe_realloc(as.fixups, sizeof(Fixup) * as.fixupsCapacity);
+    }
+    as.fixups[as.fixupsLength++] = (Fixup){.at = as.length, .target = target};
+    emit32(0);
+}
+
+// jmp to the native code of a bytecode pc
+static void jumpTo(int target) {
+    EMIT(0xE9);
+    addFixup(target);
+}
+
+static void jumpIfTo(CondCode cc, int target) {
+    EMIT(0x0F, 0x80 | cc);
+    addFixup(target);
+}
+
+// jcc to a native label that is not known yet, returns the rel32 to patch
+static size_t jumpIfForward(CondCode cc) {
+    EMIT(0x0F, 0x80 | cc);
+    emit32(0);
+    return as.length - 4;
+}
+
+static size_t jumpForward(void) {
+    EMIT(0xE9);
+    emit32(0);
+    return as.length - 4;
+}
+
+static void jumpIfToExit(CondCode cc) {
+    EMIT(0x0F, 0x80 | cc);
+    emit32((int32_t)(as.exitLabel - (as.length + 4)));
+}
+
+static void jumpToExit(void) {
+    EMIT(0xE9);
+    emit32((int32_t)(as.exitLabel - (as.length + 4)));
+}
+
+// mov reg, [r12 + r13*8 + slot*8]
+static void loadStack(Reg reg, int slot) {
+    EMIT(0x4B, 0x8B, 0x84 | reg << 3, 0xEC);
+    emit32(slot * 8);
+}
+
+// mov [r12 + r13*8 + slot*8], reg
+static void storeStack(Reg reg, int slot) {
+    EMIT(0x4B, 0x89, 0x84 | reg << 3, 0xEC);
+    emit32(slot * 8);
+}
+
+// mov reg, [r12 + slot*8]
+static void loadVar(Reg reg, int slot) {
+    EMIT(0x49, 0x8B, 0x84 | reg << 3, 0x24);
+    emit32(slot * 8);
+}
+
+// mov [r12 + slot*8], reg
+static void storeVar(Reg reg, int slot) {
+    EMIT(0x49, 0x89, 0x84 | reg << 3, 0x24);
+    emit32(slot * 8);
+}
+
+// mov reg, [rbx + offset]
+static void loadField(Reg reg, int32_t offset) {
+    EMIT(0x48, 0x8B, 0x83 | reg << 3);
+    emit32(offset);
+}
+
+// rsi = &operandStack[local 0] of the innermost frame, clobbers rax, rcx and rdx
+static void loadLocals(void) {
+    EMIT(0x48, 0x63, 0x93);              // movsxd rdx, [rbx + frame]
+    emit32(FRAME_OFFSET);
+    loadField(RCX, CALL_STACK_OFFSET);
+    EMIT(0x48, 0x63, 0x84, 0xD1);        // movsxd rax, [rcx + rdx*8 - 8] (caller's sp)
+    emit32(-8);
+    EMIT(0x49, 0x8D, 0x74, 0xC4, 0x08);  // lea rsi, [r12 + rax*8 + 8]
+}
+
+// mov reg, [rsi + offset*8]
+static void loadLocal(Reg reg, int offset) {
+    EMIT(0x48, 0x8B, 0x86 | reg << 3);
+    emit32(offset * 8);
+}
+
+// mov [rsi + offset*8], reg
+static void storeLocal(Reg reg, int offset) {
+    EMIT(0x48, 0x89, 0x86 | reg << 3);
+    emit32(offset * 8);
+}
+
+static int isLocal(Inst inst) {
+    return inst.type == INST_FETCH_LOCAL || inst.type == INST_ASSIGN_LOCAL;
+}
+
+// the variable an INST_FETCH_VAR, INST_FETCH_LOCAL or matching assign word refers to, loadLocals()
+// has to come first for a local
+static void loadFetched(Reg reg, Inst inst) {
+    if (isLocal(inst)) {
+        loadLocal(reg, inst.operand.int32);
+    } else {
+        loadVar(reg, inst.operand.int32);
+    }
+}
+
+static void storeFetched(Reg reg, Inst inst) {
+    if (isLocal(inst)) {
+        storeLocal(reg, inst.operand.int32);
+    } else {
+        storeVar(reg, inst.operand.int32);
+    }
+}
+
+// reg = argument index of the innermost frame, clobbers rdx
+static void loadArg(Reg reg, int index) {
+    EMIT(0x48, 0x63, 0x93);                         // movsxd rdx, [rbx + frame]
+    emit32(FRAME_OFFSET);
+    loadField(reg, CALL_STACK_OFFSET);
+    EMIT(0x2B, 0x94, 0xD0 | reg);                   // sub edx, [reg + rdx*8 - 24] (number of args)
+    emit32(-24);
+    EMIT(0x48, 0x63, 0xD2);                         // movsxd rdx, edx
+    EMIT(0x48, 0x8B, 0x84 | reg << 3, 0xD0 | reg);  // mov reg, [reg + rdx*8 + (index - 3)*8]
+    emit32((index - 3) * 8);
+}
+
+// mov dword [rbx + offset], value
+static void storeField32(int32_t offset, int32_t value) {
+    EMIT(0xC7, 0x83);
+    emit32(offset);
+    emit32(value);
+}
+
+static void movImm64(Reg reg, uint64_t value) {
+    EMIT(0x48, 0xB8 | reg);
+    emit64(value);
+}
+
+static void movImm32(Reg reg, int32_t value) {
+    EMIT(0xB8 | reg);
+    emit32(value);
+}
+
+static void incSp(void) {
+    EMIT(0x49, 0xFF, 0xC5);
+}
+
+static void decSp(void) {
+    EMIT(0x49, 0xFF, 0xCD);
+}
+
+// mov [rbx + sp], r13d
+static void syncSp(void) {
+    EMIT(0x44, 0x89, 0xAB);
+    emit32(SP_OFFSET);
+}
+
+// movsxd r13, [rbx + sp]
+static void reloadSp(void) {
+    EMIT(0x4C, 0x63, 0xAB);
+    emit32(SP_OFFSET);
+}
+
+#define HELPER(fn) ((uint64_t)(uintptr_t)(fn))
+
+static void callHelper(uint64_t helper) {
+    movImm64(RAX, helper);
+    EMIT(0xFF, 0xD0);
+}
+
+static void exitAt(int pc) {
+    storeField32(PC_OFFSET, pc);
+    movImm32(RAX, 1);
+    jumpToExit();
+}
+
+// CHARGE_BUDGET(cost) for the back-edge at pc
+static void chargeBudget(int pc, int cost) {
+    EMIT(0x48, 0x81, 0xAB);  // sub qword [rbx + fuel], cost
+    emit32(FUEL_OFFSET);
+    emit32(cost);
+    size_t ok = jumpIfForward(CC_NS);
+    storeField32(PC_OFFSET, pc);
+    callHelper(HELPER(checkBudget));
+    patchHere(ok);
+}
+
+static void pushReg(Reg reg) {
+    storeStack(reg, 1);
+    incSp();
+}
+
+// cmp the upper 16 bits of reg with tag
+static void compareTag(Reg reg, int32_t tag) {
+    EMIT(0x48, 0x89, 0xC2 | reg << 3);  // mov rdx, reg
+    EMIT(0x48, 0xC1, 0xEA, 0x30);       // shr rdx, 48
+    EMIT(0x81, 0xFA);                   // cmp edx, tag
+    emit32(tag);
+}
+
+// jumps to the returned patch slot unless reg holds an int box
+static size_t checkInt(Reg reg) {
+    compareTag(reg, INT_TAG);
+    return jumpIfForward(CC_NE);
+}
+
+// calls helper(arg) on the stack, pc is stored for the errors it may report
+static void stackHelper(int pc, uint64_t helper, int32_t arg) {
+    storeField32(PC_OFFSET, pc);
+    syncSp();
+    movImm32(RDI, arg);
+    callHelper(helper);
+    reloadSp();
+}
+
+// rax = int box of eax, replacing the two operands on top of the stack
+static void pushIntResult(void) {
+    movImm64(RDX, (uint64_t)INT_TAG << 48);
+    EMIT(0x48, 0x09, 0xD0);  // or rax, rdx
+    decSp();
+    storeStack(RAX, 0);
+}
+
+// eax = eax op ecx, adding the jumps taken where the vm would promote to float to slow. returns
+// how many it added
+static int intArith(InstType type, size_t *slow) {
+    switch (type) {
+    case INST_ADD:
+        EMIT(0x01, 0xC8);  // add eax, ecx
+        slow[0] = jumpIfForward(CC_O);
+        return 1;
+    case INST_SUB:
+        // subBoxes() promotes whenever the result grows
+        EMIT(0x89, 0xC2);  // mov edx, eax
+        EMIT(0x29, 0xC8);  // sub eax, ecx
+        EMIT(0x39, 0xD0);  // cmp eax, edx
+        slow[0] = jumpIfForward(CC_G);
+        return 1;
+    default:
+        // multBoxes() promotes when both operands are negative
+        EMIT(0x89, 0xC2);  // mov edx, eax
+        EMIT(0x21, 0xCA);  // and edx, ecx
+        slow[0] = jumpIfForward(CC_S);
+        EMIT(0x0F, 0xAF, 0xC1);  // imul eax, ecx
+        slow[1] = jumpIfForward(CC_O);
+        return 2;
+    }
+}
+
+// int fast path inline, anything else (promotion to float, strings, floats) goes through the helper
+static void compileArith(int pc, InstType type, uint64_t helper) {
+    loadStack(RAX, -1);
+    loadStack(RCX, 0);
+
+    size_t slow[4];
+    int slowLength = 0;
+    slow[slowLength++] = checkInt(RAX);
+    slow[slowLength++] = checkInt(RCX);
+    slowLength += intArith(type, slow + slowLength);
+
+    pushIntResult();
+    size_t done = jumpForward();
+
+    for (int i = 0; i < slowLength; i++) patchHere(slow[i]);
+    // mixed string operands and array length mismatches are reported at vm->pc
+    stackHelper(pc, helper, 0);
+    patchHere(done);
+}
+
+static CondCode conditionCode(Condition condition) {
+    switch (condition) {
+    case CMP_GT: return CC_G;
+    case CMP_LT: return CC_L;
+    case CMP_GE: return CC_GE;
+    case CMP_LE: return CC_LE;
+    case CMP_EQ: return CC_E;
+    default: return CC_NE;
+    }
+}
+
+static void compileCompare(int pc, Condition condition) {
+    CondCode cc = conditionCode(condition);
+
+    loadStack(RAX, -1);
+    loadStack(RCX, 0);
+
+    size_t lslow = checkInt(RAX);
+    size_t rslow = checkInt(RCX);
+
+    EMIT(0x39, 0xC8);             // cmp eax, ecx
+    EMIT(0x0F, 0x90 | cc, 0xC0);  // setcc al
+    EMIT(0x0F, 0xB6, 0xC0);       // movzx eax, al
+    pushIntResult();
+    size_t done = jumpForward();
+
+    patchHere(lslow);
+    patchHere(rslow);
+    stackHelper(pc, HELPER(jitCompare), condition);
+    patchHere(done);
+}
+
+// var += step; loop while (var CMP limit). ints stay in registers, everything else goes to stepLoop()
+static void compileLoopStep(int pc) {
+    Inst *extra = vm->program + pc + 1;
+    Inst var = extra[0];
+    Inst limit = extra[3];
+    int body = pc + vm->program[pc].operand.int32;
+
+    int cost = LOOP_STEP_LENGTH - vm->program[pc].operand.int32;
+
+    if (limit.type == INST_STACK_PUSH && TYPE(limit.operand) != VAL_INT) {
+        movImm32(RDI, pc);
+        callHelper(HELPER(jitLoopStep));
+        EMIT(0x85, 0xC0);  // test eax, eax
+        size_t done = jumpIfForward(CC_E);
+        chargeBudget(pc, cost);
+        jumpTo(body);
+        patchHere(done);
+        return;
+    }
+
+    size_t slow[3];
+    int slowLength = 0;
+
+    if (var.type == INST_FETCH_LOCAL || limit.type == INST_FETCH_LOCAL) loadLocals();
+    loadFetched(RAX, var);
+    slow[slowLength++] = checkInt(RAX);
+    if (limit.type != INST_STACK_PUSH) {
+        loadFetched(RCX, limit);
+        slow[slowLength++] = checkInt(RCX);
+    }
+
+    // overflow is exactly when addBoxes()/subBoxes() promote to float
+    EMIT(0x05);  // add eax, step
+    emit32(extra[1].operand.int32);
+    slow[slowLength++] = jumpIfForward(CC_O);
+
+    movImm64(RDX, (uint64_t)INT_TAG << 48);
+    EMIT(0x48, 0x09, 0xC2);  // or rdx, rax
+    storeFetched(RDX, var);
+
+    if (limit.type != INST_STACK_PUSH) {
+        EMIT(0x39, 0xC8);  // cmp eax, ecx
+    } else {
+        EMIT(0x3D);        // cmp eax, limit
+        emit32(limit.operand.int32);
+    }
+    size_t leave = jumpIfForward(conditionCode(extra[2].operand.int32) ^ 1);
+    EMIT(0x83, 0xBB);  // cmp dword [rbx + cb], 0
+    emit32(CB_OFFSET);
+    EMIT(0x00);
+    size_t broken = jumpIfForward(CC_NE);
+    chargeBudget(pc, cost);
+    jumpTo(body);
+
+    for (int i = 0; i < slowLength; i++) patchHere(slow[i]);
+    movImm32(RDI, pc);
+    callHelper(HELPER(jitLoopStep));
+    EMIT(0x85, 0xC0);  // test eax, eax
+    size_t done = jumpIfForward(CC_E);
+    chargeBudget(pc, cost);
+    jumpTo(body);
+
+    patchHere(leave);
+    patchHere(broken);
+    patchHere(done);
+}
+
+// reg = a source word of a register instruction, loadLocals() has to come first for a local.
+// clobbers rdx
+static void loadSource(Reg reg, Inst inst) {
+    if (inst.type == INST_FETCH_ARG) {
+        loadArg(reg, inst.operand.int32);
+    } else if (inst.type == INST_STACK_PUSH) {
+        uint64_t bits;
+        memcpy(&bits, &inst.operand, sizeof(bits));
+        movImm64(reg, bits);
+    } else {
+        loadFetched(reg, inst);
+    }
+}
+
+// loads the sources of the register instruction inst into eax and ecx, adding the jumps taken unless
+// both are ints to slow. returns how many it added, -1 if a constant is no int
+static int loadIntSources(Inst *inst, int sources, size_t *slow) {
+    int slowLength = 0;
+    for (int i = 0; i < sources; i++) {
+        if (inst[2 + i].type == INST_STACK_PUSH && TYPE(inst[2 + i].operand) != VAL_INT) return -1;
+    }
+
+    for (int i = 0; i < sources; i++) {
+        Reg reg = i == 0 ? RAX : RCX;
+        loadSource(reg, inst[2 + i]);
+        if (inst[2 + i].type != INST_STACK_PUSH) slow[slowLength++] = checkInt(reg);
+    }
+    return slowLength;
+}
+
+// rax = the operation of the register instruction at pc on its sources through the vm function the
+// stack instruction would call, with vm->sp in sync since strings and arrays look at the stacks
+static void callOperation(int pc) {
+    Inst *inst = vm->program + pc;
+    Condition condition = inst->type == INST_REG_JMP_IF_NOT ? inst[1].operand.int32 : inst->operand.int32;
+
+    storeField32(PC_OFFSET, pc);
+    syncSp();
+    if (isLocal(inst[2]) || isLocal(inst[3])) loadLocals();
+    // rsi is the base of the locals until the second source is loaded into it
+    loadSource(RDI, inst[2]);
+    loadSource(RSI, inst[3]);
+
+    switch (inst->type) {
+    case INST_REG_ADD:
+        callHelper(HELPER(addBoxes));
+        break;
+    case INST_REG_SUB:
+        callHelper(HELPER(subBoxes));
+        break;
+    case INST_REG_MULT:
+        callHelper(HELPER(multBoxes));
+        break;
+    case INST_REG_DIV:
+        callHelper(HELPER(divBoxes));
+        break;
+    default:
+        movImm32(RDX, condition);
+        callHelper(HELPER(compareBoxes));
+        break;
+    }
+}
+
+// stores rax into the dst word, which doesn't hold an array or map
+static void storeResult(Inst dst) {
+    if (dst.type == INST_STACK_PUSH) {
+        pushReg(RAX);
+    } else if (isLocal(dst)) {
+        EMIT(0x48, 0x89, 0xC7);  // mov rdi, rax
+        loadLocals();
+        storeLocal(RDI, dst.operand.int32);
+    } else {
+        storeVar(RAX, dst.operand.int32);
+    }
+}
+
+// dst = src1 op src2 with ints in registers, anything else goes through the function the stack
+// instruction calls. a dst holding an array or map that assignVar() may have to free goes through
+// runRegister()
+static void compileRegister(int pc) {
+    Inst *inst = vm->program + pc;
+    InstType type = inst->type;
+    int sources = type == INST_REG_MOVE ? 1 : 2;
+
+    if (isLocal(inst[1]) || isLocal(inst[2]) || (sources == 2 && isLocal(inst[3]))) loadLocals();
+
+    size_t collection = 0;
+    if (inst[1].type != INST_STACK_PUSH) {
+        loadFetched(RCX, inst[1]);
+        compareTag(RCX, ARRAY_TAG);
+        size_t plain = jumpIfForward(CC_B);
+        EMIT(0x81, 0xFA);  // cmp edx, LAST_TAG
+        emit32(LAST_TAG);
+        collection = jumpIfForward(CC_BE);
+        patchHere(plain);
+    }
+
+    size_t slow[5];
+    int slowLength = 0;
+    if (type == INST_REG_MOVE) {
+        loadSource(RAX, inst[2]);
+        storeFetched(RAX, inst[1]);
+    } else {
+        int loaded = type == INST_REG_DIV ? -1 : loadIntSources(inst, sources, slow);
+        if (loaded >= 0) {
+            slowLength = loaded;
+            if (type == INST_REG_CMP) {
+                CondCode cc = conditionCode(inst->operand.int32);
+                EMIT(0x39, 0xC8);             // cmp eax, ecx
+                EMIT(0x0F, 0x90 | cc, 0xC0);  // setcc al
+                EMIT(0x0F, 0xB6, 0xC0);       // movzx eax, al
+            } else {
+                slowLength += intArith((InstType)(type - INST_REG_ADD + INST_ADD), slow + slowLength);
+            }
+            movImm64(RDX, (uint64_t)INT_TAG << 48);
+            EMIT(0x48, 0x09, 0xD0);  // or rax, rdx
+            if (inst[1].type == INST_STACK_PUSH) {
+                pushReg(RAX);
+            } else {
+                storeFetched(RAX, inst[1]);
+            }
+        }
+
+        if (loaded < 0 || slowLength > 0) {
+            size_t done = loaded < 0 ? 0 : jumpForward();
+            for (int i = 0; i < slowLength; i++) patchHere(slow[i]);
+            callOperation(pc);
+            storeResult(inst[1]);
+            if (loaded >= 0) patchHere(done);
+        }
+    }
+
+    if (inst[1].type != INST_STACK_PUSH) {
+        size_t done = jumpForward();
+        patchHere(collection);
+        stackHelper(pc, HELPER(runRegister), pc);
+        patchHere(done);
+    }
+}
+
+static void compileRegisterJump(int pc) {
+    Inst *inst = vm->program + pc;
+    int target = pc + inst->operand.int32;
+
+    if (isLocal(inst[2]) || isLocal(inst[3])) loadLocals();
+
+    size_t slow[2];
+    int slowLength = loadIntSources(inst, 2, slow);
+    if (slowLength >= 0) {
+        EMIT(0x39, 0xC8);  // cmp eax, ecx
+        jumpIfTo(conditionCode(inst[1].operand.int32) ^ 1, target);
+    }
+    size_t done = slowLength > 0 ? jumpForward() : 0;
+
+    if (slowLength != 0) {
+        for (int i = 0; i < slowLength; i++) patchHere(slow[i]);
+        callOperation(pc);
+        EMIT(0x85, 0xC0);  // test eax, eax
+        jumpIfTo(CC_E, target);
+    }
+
+    if (slowLength > 0) patchHere(done);
+    EMIT(0x83, 0xBB);  // cmp dword [rbx + cb], 0
+    emit32(CB_OFFSET);
+    EMIT(0x00);
+    jumpIfTo(CC_NE, target);
+}
+
+static void compileInst(int pc) {
+    Inst inst = vm->program[pc];
+    int operand = inst.operand.int32;
+
+    switch (inst.type) {
+    case INST_STACK_PUSH: {
+        uint64_t bits;
+        memcpy(&bits, &inst.operand, sizeof(bits));
+        movImm64(RAX, bits);
+        pushReg(RAX);
+        break;
+    }
+    case INST_FETCH_VAR:
+        loadVar(RAX, operand);
+        pushReg(RAX);
+        break;
+    case INST_ASSIGN_VAR: {
+        // an array or map the variable held before may have to be freed
+        loadVar(RCX, operand);
+        compareTag(RCX, ARRAY_TAG);
+        size_t plain = jumpIfForward(CC_B);
+        EMIT(0x81, 0xFA);  // cmp edx, LAST_TAG
+        emit32(LAST_TAG);
+        size_t above = jumpIfForward(CC_A);
+        syncSp();
+        movImm32(RDI, operand);
+        callHelper(HELPER(jitAssign));
+        reloadSp();
+        size_t done = jumpForward();
+
+        patchHere(plain);
+        patchHere(above);
+        loadStack(RAX, 0);
+        decSp();
+        storeVar(RAX, operand);
+        patchHere(done);
+        break;
+    }
+    case INST_FETCH_LOCAL:
+        loadLocals();
+        loadLocal(RAX, operand);
+        pushReg(RAX);
+        break;
+    case INST_ASSIGN_LOCAL: {
+        loadLocals();
+        loadLocal(RCX, operand);
+        compareTag(RCX, ARRAY_TAG);
+        size_t plain = jumpIfForward(CC_B);
+        EMIT(0x81, 0xFA);  // cmp edx, LAST_TAG
+        emit32(LAST_TAG);
+        size_t above = jumpIfForward(CC_A);
+        syncSp();
+        movImm32(RDI, operand);
+        callHelper(HELPER(jitAssignLocal));
+        reloadSp();
+        size_t done = jumpForward();
+
+        patchHere(plain);
+        patchHere(above);
+        loadStack(RAX, 0);
+        decSp();
+        storeLocal(RAX, operand);
+        patchHere(done);
+        break;
+    }
+    case INST_ADD:
+        compileArith(pc, INST_ADD, HELPER(jitAdd));
+        break;
+    case INST_SUB:
+        compileArith(pc, INST_SUB, HELPER(jitSub));
+        break;
+    case INST_MULT:
+        compileArith(pc, INST_MULT, HELPER(jitMult));
+        break;
+    case INST_DIV:
+        stackHelper(pc, HELPER(jitDiv), 0);
+        break;
+    case INST_LOGICAL_NOT:
+        syncSp();
+        callHelper(HELPER(jitNot));
+        reloadSp();
+        break;
+    case INST_CMP:
+        compileCompare(pc, operand);
+        break;
+    case INST_JMP:
+        if (operand < 0) chargeBudget(pc, -operand);
+        jumpTo(pc + operand);
+        break;
+    case INST_LOOP_STEP:
+        compileLoopStep(pc);
+        break;
+    case INST_REG_ADD:
+    case INST_REG_SUB:
+    case INST_REG_MULT:
+    case INST_REG_DIV:
+    case INST_REG_CMP:
+    case INST_REG_MOVE:
+        compileRegister(pc);
+        break;
+    case INST_REG_JMP_IF_NOT:
+        compileRegisterJump(pc);
+        break;
+    case INST_JMP_IF_NOT:
+        loadStack(RAX, 0);
+        decSp();
+        EMIT(0x85, 0xC0);  // test eax, eax
+        jumpIfTo(CC_E, pc + operand);
+        EMIT(0x83, 0xBB);  // cmp dword [rbx + cb], 0
+        emit32(CB_OFFSET);
+        EMIT(0x00);
+        jumpIfTo(CC_NE, pc + operand);
+        break;
+    case INST_SET_CB:
+        storeField32(CB_OFFSET, 1);
+        break;
+    case INST_UNSET_CB:
+        storeField32(CB_OFFSET, 0);
+        break;
+    case INST_ARRAY_NEW:
+        stackHelper(pc, HELPER(arrayLiteral), operand);
+        break;
+    case INST_ARRAY_ALLOC:
+        stackHelper(pc, HELPER(allocArray), operand);
+        break;
+    case INST_INDEX_GET:
+        stackHelper(pc, HELPER(indexGet), 0);
+        break;
+    case INST_INDEX_SET:
+        stackHelper(pc, HELPER(indexSet), 0);
+        break;
+    case INST_ARRAY_REDUCE:
+        stackHelper(pc, HELPER(reduceArray), operand);
+        break;
+    case INST_MAP_NEW:
+        stackHelper(pc, HELPER(allocMap), 0);
+        break;
+    case INST_MAP_HAS:
+        stackHelper(pc, HELPER(mapHas), 0);
+        break;
+    case INST_MAP_DELETE:
+        stackHelper(pc, HELPER(mapRemove), 0);
+        break;
+    case INST_CALL_NATIVE:
+        if (natives[operand].suspends) {
+            exitAt(pc);
+            break;
+        }
+        stackHelper(pc, HELPER(callNative), operand);
+        break;
+    case INST_SPAWN:
+        stackHelper(pc, HELPER(spawnCoroutine), operand);
+        break;
+    case INST_STACK_SWEEP:
+        syncSp();
+        movImm32(RDI, operand);
+        callHelper(HELPER(sweepStack));
+        reloadSp();
+        break;
+    case INST_PUSH_ARG:
+        loadStack(RAX, 0);
+        decSp();
+        EMIT(0x8B, 0x93);              // mov edx, [rbx + csp]
+        emit32(CSP_OFFSET);
+        EMIT(0xFF, 0xC2);              // inc edx
+        EMIT(0x89, 0x93);              // mov [rbx + csp], edx
+        emit32(CSP_OFFSET);
+        EMIT(0x48, 0x63, 0xD2);        // movsxd rdx, edx
+        loadField(RCX, CALL_STACK_OFFSET);
+        EMIT(0x48, 0x89, 0x04, 0xD1);  // mov [rcx + rdx*8], rax
+        break;
+    case INST_FETCH_ARG:
+        EMIT(0x48, 0x63, 0x93);        // movsxd rdx, [rbx + frame]
+        emit32(FRAME_OFFSET);
+        loadField(RCX, CALL_STACK_OFFSET);
+        EMIT(0x48, 0x63, 0x84, 0xD1);  // movsxd rax, [rcx + rdx*8 - 24] (number of args)
+        emit32(-24);
+        EMIT(0x48, 0x29, 0xC2);        // sub rdx, rax
+        EMIT(0x48, 0x8B, 0x84, 0xD1);  // mov rax, [rcx + rdx*8 + (index - 3)*8]
+        emit32((operand - 3) * 8);
+        pushReg(RAX);
+        break;
+    case INST_CALL:
+        syncSp();
+        movImm32(RDI, pc + 1);
+        movImm32(RSI, operand);
+        callHelper(HELPER(jitCall));
+        reloadSp();
+        EMIT(0x85, 0xC0);  // test eax, eax
+        jumpIfToExit(CC_NE);
+        break;
+    case INST_RET:
+        syncSp();
+        callHelper(HELPER(returnFromFunction));
+        reloadSp();
+        EMIT(0x31, 0xC0);  // xor eax, eax
+        jumpToExit();
+        break;
+    default:
+        exitAt(pc);
+        break;
+    }
+}
+
+static int fallsThrough(InstType type) {
+    return type != INST_JMP && type != INST_RET;
+}
+
+static int ownedBy(int pc, int region) {
+    return pc >= 0 && pc < vm->programLength && jit.owner[pc] == region;
+}
+
+static void compileRegion(int index) {
+    Region *region = &jit.regions[index];
+    region->state = REGION_FAILED;
+
+    as = (Assembler){.region = index};
+    as.labels = (int *)safe_malloc(sizeof(int) * (vm->programLength + 1));
+    as.labels[vm->programLength] = -1;
+
+    // prologue: push rbx; push r12; push r13; mov rbx, rdi; mov r12, [rbx + operandStack];
+    // movsxd r13, [rbx + sp]; jmp rsi
+    EMIT(0x53, 0x41, 0x54, 0x41, 0x55);
+    EMIT(0x48, 0x89, 0xFB);
+    EMIT(0x4C, 0x8B, 0xA3);
+    emit32(OPERAND_STACK_OFFSET);
+    reloadSp();
+    EMIT(0xFF, 0xE6);
+
+    // exit with status in eax: mov [rbx + sp], r13d; pop r13; pop r12; pop rbx; ret
+    as.exitLabel = as.length;
+    syncSp();
+    EMIT(0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+
+    for (int pc = 0; pc < vm->programLength; pc++) {
+        as.labels[pc] = -1;
+    }
+    for (int pc = 0; pc < vm->programLength; pc += instLength(vm->program[pc].type)) {
+        if (!ownedBy(pc, index)) continue;
+
+        int next = pc + instLength(vm->program[pc].type);
+        as.labels[pc] = (int)as.length;
+        compileInst(pc);
+
+        if (fallsThrough(vm->program[pc].type) && !ownedBy(next, index)) {
+            jumpTo(next);
+        }
+    }
+
+    // jumps leaving the region hand control back to the interpreter
+    for (int i = 0; i < as.fixupsLength; i++) {
+        Fixup fixup = as.fixups[i];
+        if (as.labels[fixup.target] < 0) {
+            as.labels[fixup.target] = (int)as.length;
+            exitAt(fixup.target);
+        }
+        patch32(fixup.at, (int32_t)(as.labels[fixup.target] - (fixup.at + 4)));
+    }
+
+    void *code = mmap(NULL, as.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        memcpy(code, as.bytes, as.length);
+
+        if (mprotect(code, as.length, PROT_READ | PROT_EXEC) == 0) {
+            region->state = REGION_COMPILED;
+            region->code = code;
+            region->codeSize = as.length;
+            memcpy(&region->entry, &code, sizeof(region->entry));
+
+            for (int pc = 0; pc < vm->programLength; pc++) {
+                if (ownedBy(pc, index) && as.labels[pc] >= 0) jit.entries[pc] = (uint8_t *)code + as.labels[pc];
+            }
+        } else {
+            munmap(code, as.length);
+        }
+    }
+
+    free(as.labels);
+    free(as.fixups);
+    free(as.bytes);
+}
+
+// returns the status of the native code, or -1 if pc is not compiled or native code is nested
+// too deep to enter it again
+static int enterNative(int pc) {
+    if (jitDepth >= jit.maxDepth) return -1;
+    if (jit.entries[pc] == NULL) {
+        if (jit.regions[jit.owner[pc]].state != REGION_COLD) return -1;
+        if (++jit.hotness[pc] < jit.threshold) return -1;
+
+        compileRegion(jit.owner[pc]);
+        if (jit.entries[pc] == NULL) return -1;
+    }
+
+    jitDepth += 1;
+    int status = jit.regions[jit.owner[pc]].entry(vm, jit.entries[pc]);
+    jitDepth -= 1;
+    return status;
+}
+
+int jitExecute(int pc) {
+    if (!jit.enabled) return 0;
+    return enterNative(pc) >= 0;
+}
+
+void freeJIT(void) {
+    for (int i = 0; i < jit.regionsLength; i++) {
+        if (jit.regions[i].state == REGION_COMPILED) {
+            munmap(jit.regions[i].code, jit.regions[i].codeSize);
+        }
+    }
+
+    free(jit.regions);
+    free(jit.entries);
+    free(jit.owner);
+    free(jit.hotness);
+}
+
+#else
+
+int jitExecute(int pc) {
+    (void)pc;
+    return 0;
+}
+
+void freeJIT(void) {}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <signal.h>
+#include "vm.h"
+
+// number of calls to a function, or back-edges to a loop header, before its region is compiled
+#define JIT_DEFAULT_THRESHOLD 50
+// c stack a native call from native code takes, with room to spare, and how much of the stack
+// is used for them when its size is unlimited
+#define JIT_FRAME_BYTES 512
+#define JIT_STACK_CAP (256 << 20)
+
+void initJIT(void);
+void freeJIT(void);
+
+// runs native code starting at pc if its region is (or just became) compiled.
+// returns 1 if native code ran, in which case vm->pc and vm->sp have been updated and
+// the interpreter should resume at vm->pc, or 0 if pc must be interpreted
+int jitExecute(int pc);
+
+// native code entered and not yet left, while it runs vm->pc only says where it was entered. read
+// from signal handlers, see perf.c
+extern volatile sig_atomic_t jitDepth;
+
+#endif
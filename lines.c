@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include "lines.h"
+#include "utils.h"
+
+static int putVarint(uint8_t *bytes, int at, uint32_t value) {
+    while (value >= 0x80) {
+        bytes[at++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[at++] = (uint8_t)value;
+    return at;
+}
+
+static int getVarint(uint8_t *bytes, int at, uint32_t *value) {
+    uint32_t result = 0;
+    int shift = 0;
+
+    while (bytes[at] & 0x80) {
+        result |= (uint32_t)(bytes[at++] & 0x7F) << shift;
+        shift += 7;
+    }
+    result |= (uint32_t)bytes[at++] << shift;
+
+    *value = result;
+    return at;
+}
+
+LineTable encodeLines(int *lines, int length) {
+    // worst case: a change of line at every pc and the terminating entry, 5 bytes per varint
+    uint8_t *bytes = (uint8_t *)safe_malloc(((size_t)length + 1) * 10);
+    int at = 0;
+
+    int lastPc = 0;
+    int lastLine = 0;
+    for (int pc = 0; pc < length; pc++) {
+        if (lines[pc] == lastLine) continue;
+
+        int delta = lines[pc] - lastLine;
+        at = putVarint(bytes, at, (uint32_t)(pc - lastPc));
+        at = putVarint(bytes, at, delta < 0 ? ((uint32_t)-delta << 1) - 1 : (uint32_t)delta << 1);
+
+        lastPc = pc;
+        lastLine = lines[pc];
+    }
+
+    // one terminating entry marks the end of the covered range
+    at = putVarint(bytes, at, (uint32_t)(length - lastPc));
+    at = putVarint(bytes, at, 0);
+
+    return (LineTable){.bytes = safe_realloc(bytes, at), .length = at};
+}
+
+void freeLines(LineTable *table) {
+    free(table->bytes);
+    *table = (LineTable){0};
+}
+
+int lineForPc(LineTable *table, int pc) {
+    int at = 0;
+    int currentPc = 0;
+    int line = 0;
+
+    while (at < table->length) {
+        uint32_t pcDelta, lineDelta;
+        at = getVarint(table->bytes, at, &pcDelta);
+        at = getVarint(table->bytes, at, &lineDelta);
+
+        if (currentPc + (int)pcDelta > pc) return line;
+
+        currentPc += pcDelta;
+        line += lineDelta & 1 ? -(int)((lineDelta + 1) >> 1) : (int)(lineDelta >> 1);
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef LINES_H
+#define LINES_H
+
+#include <stdint.h>
+
+// source line of every pc, kept out of the Inst array. stored as one (pc delta, line delta) pair
+// per change of line, each a varint, the line delta zigzag encoded since lines can go backwards
+typedef struct {
+    uint8_t *bytes;
+    int length;
+} LineTable;
+
+// lines[pc] for every pc in [0, length)
+LineTable encodeLines(int *lines, int length);
+void freeLines(LineTable *table);
+
+// 0 if the table is empty or pc is not covered. doesn't allocate, so it is safe in signal handlers
+int lineForPc(LineTable *table, int pc);
+
+#endif
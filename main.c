@@ -1,9 +1,22 @@
+#define _DEFAULT_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "scanner.h"
 #include "vm.h"
 #include "compiler.h"
 #include "utils.h"
+#include "aot.h"
+#include "ir.h"
+#include "counters.h"
+#include "allocs.h"
+#include "profiler.h"
+#include "perf.h"
+#include "ngs.h"
+#include "snapshot.h"
+#include "cache.h"
 
 char* readFile(const char *filepath) {
     FILE *file;
@@ -22,26 +35,252 @@ char* readFile(const char *filepath) {
     return buffer;
 }
 
+typedef enum {
+    // executes the program, printing only what the script does
+    MODE_RUN,
+    // prints the program's instructions
+    MODE_DISASSEMBLE,
+    // compiles it, errors and all, and stops there
+    MODE_CHECK,
+    // runs the top level once, then calls the entry function with every line of the input
+    MODE_EACH,
+    // carries on from a file snapshot() wrote instead of compiling a script
+    MODE_RESUME,
+} Mode;
+
+#define EACH_ENTRY_DEFAULT "record"
+#define EACH_OUTPUT_BUFFER (1 << 16)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// records is -1 unless the program ran in each mode
+static void printStats(double compileSeconds, double executeSeconds, unsigned long long compileAllocations,
+                       long long records, double recordSeconds) {
+    int operandSlots;
+    int callSlots;
+    stackPeaks(&operandSlots, &callSlots);
+
+    fprintf(stderr, "===== STATS =====\n\n");
+    fprintf(stderr, "compile time         %12.3f ms\n", compileSeconds * 1e3);
+    fprintf(stderr, "execute time         %12.3f ms\n", executeSeconds * 1e3);
+    if (records >= 0) {
+        fprintf(stderr, "records              %12lld in %.3f ms, %.0f per second\n", records, recordSeconds * 1e3,
+                recordSeconds > 0 ? records / recordSeconds : 0.0);
+    }
+    fprintf(stderr, "fuel charged         %12lld (calls and loop passes, see setBudget)\n", fuelSpent());
+#ifdef NGS_COUNTERS
+    fprintf(stderr, "instructions         %12llu\n", instructionsExecuted());
+#endif
+    fprintf(stderr, "peak operand stack   %12d slots (to the page)\n", operandSlots);
+    fprintf(stderr, "peak call stack      %12d slots (to the page)\n", callSlots);
+    fprintf(stderr, "allocations          %12llu compiling, %llu running\n", compileAllocations,
+            allocations - compileAllocations);
+}
+
+// the top level code once, then entry(line) for every line of input without its newline. a
+// record's runtime error is reported and the next record goes on from the same globals, a budget
+// stop ends the batch. returns 0 or the status of the last record that stopped
+static int runEach(FILE *input, const char *entry, long long *records, double *recordSeconds) {
+    setvbuf(stdout, NULL, _IOFBF, EACH_OUTPUT_BUFFER);
+
+    Phase outer = perfPhase(PHASE_RUN);
+    startProfiler();
+
+    int status = ngsStart();
+    int function = status == 0 ? ngsFunction(entry) : -1;
+    if (status == 0 && function < 0) {
+        fprintf(stderr, "no function %s to call for each record\n", entry);
+        status = 1;
+    }
+
+    double start = now();
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while (function >= 0 && (length = getline(&line, &capacity, input)) >= 0) {
+        if (length > 0 && line[length - 1] == '\n') line[length - 1] = '\0';
+
+        Box record = ngsString(line);
+        Box result;
+        int stopped = ngsCall(function, &record, 1, &result);
+        if (stopped == 0) ngsRelease(result);
+        ngsRelease(record);
+        *records += 1;
+
+        if (stopped) status = stopped;
+        if (stopped == EXIT_OUT_OF_FUEL || stopped == EXIT_DEADLINE) break;
+    }
+    *recordSeconds = now() - start;
+    free(line);
+
+    stopProfiler();
+    perfPhase(outer);
+    fflush(stdout);
+
+#ifdef NGS_COUNTERS
+    dumpCounters();
+#endif
+#ifdef NGS_ALLOCS
+    dumpAllocs();
+#endif
+    return status;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    Mode mode = MODE_RUN;
+    char *emitPath = NULL;
+    long long fuel = 0;
+    long long deadlineMs = 0;
+    int stackSlots = 0;
+    int callStackSlots = 0;
+    int dumpIr = 0;
+    int dumpStacks = 0;
+    int stats = 0;
+    int status = 0;
+    const char *entry = EACH_ENTRY_DEFAULT;
+
+    int arg = 1;
+    if (arg < argc && !strcmp(argv[arg], "run")) {
+        arg += 1;
+    } else if (arg < argc && !strcmp(argv[arg], "disassemble")) {
+        mode = MODE_DISASSEMBLE;
+        arg += 1;
+    } else if (arg < argc && !strcmp(argv[arg], "check")) {
+        mode = MODE_CHECK;
+        arg += 1;
+    } else if (arg < argc && !strcmp(argv[arg], "each")) {
+        mode = MODE_EACH;
+        arg += 1;
+    } else if (arg < argc && !strcmp(argv[arg], "resume")) {
+        mode = MODE_RESUME;
+        arg += 1;
+    }
+
+    while (arg < argc && !strncmp(argv[arg], "--", 2)) {
+        // prints the ir of every function and top level instead of running the program. the cache
+        // is skipped, what it holds has no ir to print
+        if (!strcmp(argv[arg], "--dump-ir")) {
+            dumpIr = 1;
+            setIrDump(stdout);
+            setCacheEnabled(0);
+            arg += 1;
+            continue;
+        }
+        // prints the operand and call stacks once the program is done
+        if (!strcmp(argv[arg], "--dump-stacks")) {
+            dumpStacks = 1;
+            arg += 1;
+            continue;
+        }
+        // compiles everything from source and leaves the cache as it is
+        if (!strcmp(argv[arg], "--no-cache")) {
+            setCacheEnabled(0);
+            arg += 1;
+            continue;
+        }
+        if (!strcmp(argv[arg], "--stats")) {
+            stats = 1;
+            arg += 1;
+            continue;
+        }
+
+        if (arg + 1 >= argc) {
+            printf("missing value for %s\n", argv[arg]);
+            return 1;
+        }
+
+        if (!strcmp(argv[arg], "--emit-c")) {
+            emitPath = argv[arg + 1];
+        } else if (!strcmp(argv[arg], "--fuel")) {
+            fuel = atoll(argv[arg + 1]);
+        } else if (!strcmp(argv[arg], "--deadline-ms")) {
+            deadlineMs = atoll(argv[arg + 1]);
+        } else if (!strcmp(argv[arg], "--stack-size")) {
+            stackSlots = atoi(argv[arg + 1]);
+        } else if (!strcmp(argv[arg], "--callstack-size")) {
+            callStackSlots = atoi(argv[arg + 1]);
+        } else if (!strcmp(argv[arg], "--entry")) {
+            entry = argv[arg + 1];
+        } else {
+            printf("usage: %s [run | disassemble | check | each | resume] [--emit-c out.c] [--fuel n] [--deadline-ms n] [--stack-size slots] [--callstack-size slots] [--entry function] [--dump-ir] [--dump-stacks] [--no-cache] [--stats] file.ngs [records] | file.snap\n", argv[0]);
+            return 1;
+        }
+        arg += 2;
+    }
+
+    if (arg >= argc) {
         printf("missing path to .ngs file to compile\n");
         return 1;
     }
+    char *sourcePath = argv[arg];
+
+    FILE *input = stdin;
+    if (mode == MODE_EACH && arg + 1 < argc) {
+        input = fopen(argv[arg + 1], "r");
+        if (input == NULL) {
+            fprintf(stderr, "could not open %s\n", argv[arg + 1]);
+            return 1;
+        }
+    }
+
+    double start = now();
+    setStackSizes(stackSlots, callStackSlots);
+    if (mode == MODE_RESUME) {
+        restoreSnapshot(sourcePath);
+    } else {
+        char *sourceFile = readFile(sourcePath);
+        scannerInitialize(sourceFile);
 
-    char *sourceFile = readFile(argv[1]);
-    scannerInitialize(sourceFile);
+        int programSize = 0;
+        Function *functions = NULL;
+        int functionsLength = 0;
+        LineTable lines;
+        Inst *program = compile(sourcePath, &programSize, &functions, &functionsLength, &lines);
 
-    int programSize = 0;
-    Inst *program = compile(&programSize);
+        free(sourceFile);
+        initVM(program, programSize, functions, functionsLength, lines);
+    }
+    double compileSeconds = now() - start;
+    unsigned long long compileAllocations = allocations;
 
-    free(sourceFile);
+    if (emitPath != NULL) {
+        FILE *out = fopen(emitPath, "w");
+        if (out == NULL) {
+            fprintf(stderr, "could not open %s for writing\n", emitPath);
+            return 1;
+        }
+        emitC(out, sourcePath);
+        fclose(out);
+    } else if (mode == MODE_DISASSEMBLE) {
+        dumpProgram();
+    } else if ((mode == MODE_RUN || mode == MODE_RESUME) && !dumpIr) {
+        setBudget(fuel, deadlineMs);
+        start = now();
+        executeProgram();
+        double executeSeconds = now() - start;
 
-    initVM(program, programSize);
+        if (dumpStacks) {
+            dumpOperandStack();
+            dumpCallStack();
+        }
+        if (stats) printStats(compileSeconds, executeSeconds, compileAllocations, -1, 0);
+    } else if (mode == MODE_EACH && !dumpIr) {
+        setBudget(fuel, deadlineMs);
+        start = now();
+        long long records = 0;
+        double recordSeconds = 0;
+        status = runEach(input, entry, &records, &recordSeconds);
+        double executeSeconds = now() - start;
 
-    dumpProgram();
-    executeProgram();
+        if (stats) printStats(compileSeconds, executeSeconds, compileAllocations, records, recordSeconds);
+    }
 
+    if (input != stdin) fclose(input);
     freeVM();
 
-    return 0;
+    return status;
 }
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "map.h"
+#include "utils.h"
+#include "allocs.h"
+
+#define MIN_CAPACITY 8
+#define PRINT_MAX_ENTRIES 16
+
+// grow once more than 7/8 of the slots are taken
+static int overloaded(size_t count, size_t capacity) {
+    return count * 8 > capacity * 7;
+}
+
+static int isObject(Box box) {
+    ValueType type = TYPE(box);
+    return type == VAL_STRING || type == VAL_ARRAY || type == VAL_MAP;
+}
+
+static void retain(Box box) {
+    if (isObject(box)) ((Object *)(intptr_t)box.obj)->refs += 1;
+}
+
+static void release(Box box) {
+    if (!isObject(box)) return;
+    ((Object *)(intptr_t)box.obj)->refs -= 1;
+    cleanup_object(box);
+}
+
+static Box normalizeKey(Box key) {
+    switch (TYPE(key)) {
+    case VAL_INT:
+    case VAL_STRING:
+        return key;
+    case VAL_FLOAT: {
+        double value = key.float64;
+        if (value >= INT32_MIN && value <= INT32_MAX && value == (double)(int32_t)value) {
+            int32_t integer = (int32_t)value;
+            return createBox(&integer, VAL_INT);
+        }
+        return key;
+    }
+    default:
+        runtimeError("map keys must be numbers or strings");
+        return key;
+    }
+}
+
+static uint32_t mix(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xFF51AFD7ED558CCDULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// FNV-1a over the bytes of a string, computed once per string object
+static uint32_t stringHash(Object *obj) {
+    if (obj->hash) return obj->hash;
+
+    uint32_t hash = 2166136261u;
+    unsigned char *bytes = (unsigned char *)obj->ref;
+    for (size_t i = 0; i + 1 < obj->length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    obj->hash = hash ? hash : 1;
+    return obj->hash;
+}
+
+static uint32_t hashKey(Box key) {
+    if (TYPE(key) == VAL_STRING) return stringHash((Object *)(intptr_t)key.obj);
+
+    uint64_t bits;
+    memcpy(&bits, &key, sizeof(bits));
+    return mix(bits);
+}
+
+static int sameKey(Box a, Box b) {
+    if (TYPE(a) != TYPE(b)) return 0;
+    if (TYPE(a) != VAL_STRING) return !memcmp(&a, &b, sizeof(Box));
+
+    Object *l = (Object *)(intptr_t)a.obj;
+    Object *r = (Object *)(intptr_t)b.obj;
+    return l == r || (l->length == r->length && !memcmp(l->ref, r->ref, l->length));
+}
+
+Map* newMap(size_t expected) {
+    size_t capacity = MIN_CAPACITY;
+    while (overloaded(expected, capacity)) capacity *= 2;
+
+    Map *map = (Map *)safe_malloc(sizeof(Map));
+    map->obj = (Object){.ref = safe_calloc(capacity, sizeof(Entry))};
+    map->capacity = capacity;
+    TRACK_ALLOC(map, sizeof(Map) + capacity * sizeof(Entry), OBJECT_MAP);
+    return map;
+}
+
+void freeMap(Map *map) {
+    Entry *table = (Entry *)map->obj.ref;
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (!table[i].distance) continue;
+        release(table[i].key);
+        release(table[i].value);
+    }
+    TRACK_FREE(map);
+    free(table);
+    free(map);
+}
+
+// places an entry whose key is not in the table yet, taking slots from entries closer to home
+static void insertEntry(Entry *table, size_t capacity, Entry entry) {
+    size_t mask = capacity - 1;
+    size_t at = entry.hash & mask;
+    entry.distance = 1;
+
+    while (table[at].distance) {
+        if (table[at].distance < entry.distance) {
+            Entry displaced = table[at];
+            table[at] = entry;
+            entry = displaced;
+        }
+        at = (at + 1) & mask;
+        entry.distance += 1;
+    }
+    table[at] = entry;
+}
+
+static void grow(Map *map) {
+    Entry *old = (Entry *)map->obj.ref;
+    size_t oldCapacity = map->capacity;
+
+    map->capacity *= 2;
+    map->obj.ref = safe_calloc(map->capacity, sizeof(Entry));
+    TRACK_RESIZE(map, sizeof(Map) + map->capacity * sizeof(Entry));
+
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].distance) insertEntry((Entry *)map->obj.ref, map->capacity, old[i]);
+    }
+    free(old);
+}
+
+static Entry* findNormalized(Map *map, Box key, uint32_t hash) {
+    Entry *table = (Entry *)map->obj.ref;
+    size_t mask = map->capacity - 1;
+    size_t at = hash & mask;
+
+    // an entry further from home than the probe would have taken this slot
+    for (uint32_t distance = 1; table[at].distance >= distance; distance++) {
+        if (table[at].hash == hash && sameKey(table[at].key, key)) return &table[at];
+        at = (at + 1) & mask;
+    }
+    return NULL;
+}
+
+Entry* mapFind(Map *map, Box key) {
+    key = normalizeKey(key);
+    return findNormalized(map, key, hashKey(key));
+}
+
+void mapSet(Map *map, Box key, Box value) {
+    key = normalizeKey(key);
+    uint32_t hash = hashKey(key);
+
+    Entry *entry = findNormalized(map, key, hash);
+    if (entry != NULL) {
+        Box previous = entry->value;
+        entry->value = value;
+        retain(value);
+        release(previous);
+        return;
+    }
+
+    if (overloaded(map->obj.length + 1, map->capacity)) grow(map);
+
+    retain(key);
+    retain(value);
+    insertEntry((Entry *)map->obj.ref, map->capacity, (Entry){.key = key, .value = value, .hash = hash});
+    map->obj.length += 1;
+}
+
+int mapDelete(Map *map, Box key) {
+    Entry *entry = mapFind(map, key);
+    if (entry == NULL) return 0;
+
+    Entry removed = *entry;
+    Entry *table = (Entry *)map->obj.ref;
+    size_t mask = map->capacity - 1;
+    size_t at = entry - table;
+
+    // shift the rest of the probe run back by one, no tombstones
+    for (size_t next = (at + 1) & mask; table[next].distance > 1; next = (next + 1) & mask) {
+        table[at] = table[next];
+        table[at].distance -= 1;
+        at = next;
+    }
+    table[at] = (Entry){0};
+    map->obj.length -= 1;
+
+    release(removed.key);
+    release(removed.value);
+    return 1;
+}
+
+Box mapGet(Map *map, Box key) {
+    Entry *entry = mapFind(map, key);
+    if (entry == NULL) runtimeError("key not found in map");
+    return entry->value;
+}
+
+static Map* asMap(Box box) {
+    if (TYPE(box) != VAL_MAP) runtimeError("expected a map");
+    return (Map *)(intptr_t)box.obj;
+}
+
+void allocMap(void) {
+    STACK_POP(Box expected);
+    if (TYPE(expected) != VAL_INT || expected.int32 < 0) runtimeError("map size must be a non-negative int");
+
+    STACK_PUSH(createBox(newMap(expected.int32), VAL_MAP));
+}
+
+void mapHas(void) {
+    STACK_POP(Box key);
+    STACK_POP(Box map);
+
+    int found = mapFind(asMap(map), key) != NULL;
+    STACK_PUSH(createBox(&found, VAL_INT));
+    cleanup_object(key);
+    cleanup_object(map);
+}
+
+void mapRemove(void) {
+    STACK_POP(Box key);
+    STACK_POP(Box map);
+
+    int removed = mapDelete(asMap(map), key);
+    STACK_PUSH(createBox(&removed, VAL_INT));
+    cleanup_object(key);
+    cleanup_object(map);
+}
+
+void printMap(Map *map) {
+    Entry *table = (Entry *)map->obj.ref;
+    size_t printed = 0;
+
+    printf("{");
+    for (size_t i = 0; i < map->capacity && printed < PRINT_MAX_ENTRIES; i++) {
+        if (!table[i].distance) continue;
+        if (printed++) printf(", ");
+        printBox(table[i].key);
+        printf(": ");
+        printBox(table[i].value);
+    }
+    if (map->obj.length > PRINT_MAX_ENTRIES) printf(", ... %zu entries", map->obj.length);
+    printf("}");
+}
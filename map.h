@@ -0,0 +1,41 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "vm.h"
+
+// hash maps with int, float or string keys, kept in one open-addressing table with robin hood
+// probing. a float key with an int value is the same key as that int. keys and values that are
+// objects are pinned through Object.refs for as long as an entry holds them
+
+typedef struct {
+    Box key;
+    Box value;
+    uint32_t hash;
+    // 1 + how far the entry sits from the slot its hash points at, 0 for an empty slot
+    uint32_t distance;
+} Entry;
+
+typedef struct {
+    // length is the number of entries, ref the table of capacity (a power of two) slots
+    Object obj;
+    size_t capacity;
+} Map;
+
+// expected is the number of entries the table is sized for up front
+Map* newMap(size_t expected);
+void freeMap(Map *map);
+
+// NULL if the key is missing
+Entry* mapFind(Map *map, Box key);
+void mapSet(Map *map, Box key, Box value);
+int mapDelete(Map *map, Box key);
+Box mapGet(Map *map, Box key);
+
+// operand stack entry points
+void allocMap(void);
+void mapHas(void);
+void mapRemove(void);
+
+void printMap(Map *map);
+
+#endif
@@ -0,0 +1,326 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include "module.h"
+#include "compiler.h"
+#include "cache.h"
+#include "utils.h"
+
+typedef struct {
+    Unit **units;
+    int length;
+    int capacity;
+} ModuleTable;
+
+ModuleTable modules;
+
+static char* copyString(const char *text) {
+    size_t length = strlen(text);
+    char *copy = (char *)safe_malloc(length + 1);
+    memcpy(copy, text, length + 1);
+    return copy;
+}
+
+static char* readSource(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t size = ftell(file);
+    rewind(file);
+
+    char *buffer = (char *)safe_malloc(size + 1);
+    buffer[fread(buffer, 1, size, file)] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+static uint64_t unitKey(const char *source) {
+    return hashBytes(buildKey(), source, strlen(source));
+}
+
+static void writeUnit(Unit *unit, uint64_t key) {
+    char *path = cachePath(unit->path, "unit", 1);
+    if (path == NULL) return;
+    // written next to the cache file and renamed over it, so a concurrent run never reads half of one
+    char *temp = (char *)safe_malloc(strlen(path) + 32);
+    sprintf(temp, "%s.%d", path, (int)getpid());
+
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL) {
+        free(temp);
+        free(path);
+        return;
+    }
+
+    fwrite("NGSU", 1, 4, file);
+    fwrite(&key, sizeof(key), 1, file);
+
+    writeInt(file, unit->length);
+    writeCode(file, unit->code, unit->length);
+    fwrite(unit->lines, sizeof(int), unit->length, file);
+
+    writeInt(file, unit->exportsLength);
+    for (int i = 0; i < unit->exportsLength; i++) {
+        writeString(file, unit->exports[i].name, strlen(unit->exports[i].name));
+        writeInt(file, unit->exports[i].ip);
+        writeInt(file, unit->exports[i].end);
+    }
+
+    writeInt(file, unit->importsLength);
+    for (int i = 0; i < unit->importsLength; i++) {
+        writeString(file, unit->imports[i].module, strlen(unit->imports[i].module));
+        writeString(file, unit->imports[i].name, strlen(unit->imports[i].name));
+    }
+
+    writeInt(file, unit->depsLength);
+    for (int i = 0; i < unit->depsLength; i++) {
+        writeString(file, unit->deps[i], strlen(unit->deps[i]));
+    }
+
+    writeInt(file, unit->relocationsLength);
+    fwrite(unit->relocations, sizeof(int), unit->relocationsLength, file);
+
+    if (fclose(file) == 0) {
+        rename(temp, path);
+    } else {
+        unlink(temp);
+    }
+    free(temp);
+    free(path);
+}
+
+static void freeUnit(Unit *unit) {
+    free(unit->code);
+    free(unit->lines);
+    for (int i = 0; i < unit->exportsLength; i++) free(unit->exports[i].name);
+    free(unit->exports);
+    for (int i = 0; i < unit->importsLength; i++) {
+        free(unit->imports[i].module);
+        free(unit->imports[i].name);
+    }
+    free(unit->imports);
+    for (int i = 0; i < unit->depsLength; i++) free(unit->deps[i]);
+    free(unit->deps);
+    free(unit->relocations);
+
+    char *path = unit->path;
+    *unit = (Unit){.path = path};
+}
+
+// fills in unit from its cache file, 0 if there is none for key or it can't be read
+static int readUnit(Unit *unit, uint64_t key) {
+    char *path = cachePath(unit->path, "unit", 0);
+    if (path == NULL) return 0;
+    CacheReader reader;
+    int found = openCacheReader(&reader, path);
+    free(path);
+    if (!found) return 0;
+
+    char magic[4];
+    uint64_t cachedKey;
+    int ok = readBytes(&reader, magic, 4) && !memcmp(magic, "NGSU", 4) &&
+             readBytes(&reader, &cachedKey, sizeof(cachedKey)) && cachedKey == key &&
+             readInt(&reader, &unit->length) && unit->length >= 0 && unit->length <= PROGRAM_MAX_SIZE;
+
+    if (ok) {
+        unit->code = (Inst *)safe_malloc(sizeof(Inst) * (unit->length + 1));
+        unit->lines = (int *)safe_malloc(sizeof(int) * (unit->length + 1));
+        if (!readCode(&reader, unit->code, unit->length)) {
+            free(unit->code);
+            unit->code = NULL;
+            ok = 0;
+        }
+    }
+    ok = ok && readBytes(&reader, unit->lines, sizeof(int) * unit->length);
+
+    ok = ok && readInt(&reader, &unit->exportsLength) && unit->exportsLength >= 0 && unit->exportsLength <= unit->length;
+    if (ok) unit->exports = (Function *)safe_calloc(unit->exportsLength + 1, sizeof(Function));
+    for (int i = 0; ok && i < unit->exportsLength; i++) {
+        int length;
+        ok = (unit->exports[i].name = readString(&reader, &length)) != NULL &&
+             readInt(&reader, &unit->exports[i].ip) && readInt(&reader, &unit->exports[i].end);
+    }
+
+    ok = ok && readInt(&reader, &unit->importsLength) && unit->importsLength >= 0 && unit->importsLength <= PROGRAM_MAX_SIZE;
+    if (ok) unit->imports = (Import *)safe_calloc(unit->importsLength + 1, sizeof(Import));
+    for (int i = 0; ok && i < unit->importsLength; i++) {
+        int length;
+        ok = (unit->imports[i].module = readString(&reader, &length)) != NULL &&
+             (unit->imports[i].name = readString(&reader, &length)) != NULL;
+    }
+
+    ok = ok && readInt(&reader, &unit->depsLength) && unit->depsLength >= 0 && unit->depsLength <= PROGRAM_MAX_SIZE;
+    if (ok) unit->deps = (char **)safe_calloc(unit->depsLength + 1, sizeof(char *));
+    for (int i = 0; ok && i < unit->depsLength; i++) {
+        int length;
+        ok = (unit->deps[i] = readString(&reader, &length)) != NULL;
+    }
+
+    ok = ok && readInt(&reader, &unit->relocationsLength) && unit->relocationsLength >= 0 && unit->relocationsLength <= unit->length;
+    if (ok) {
+        unit->relocations = (int *)safe_malloc(sizeof(int) * (unit->relocationsLength + 1));
+        ok = readBytes(&reader, unit->relocations, sizeof(int) * unit->relocationsLength);
+    }
+
+    closeCacheReader(&reader);
+    // the counts above are only trusted if the unit is whole, a stale or damaged file is recompiled
+    if (!ok) {
+        if (unit->code != NULL) freeLiterals(unit->code, unit->length);
+        if (unit->exports == NULL) unit->exportsLength = 0;
+        if (unit->imports == NULL) unit->importsLength = 0;
+        if (unit->deps == NULL) unit->depsLength = 0;
+        freeUnit(unit);
+    }
+    return ok;
+}
+
+char* resolveModule(const char *importer, const char *name, int length) {
+    int dir = 0;
+    if (importer != NULL && name[0] != '/') {
+        const char *slash = strrchr(importer, '/');
+        if (slash != NULL) dir = slash - importer + 1;
+    }
+    if (dir + length >= PATH_MAX) return NULL;
+
+    char path[PATH_MAX];
+    memcpy(path, importer, dir);
+    memcpy(path + dir, name, length);
+    path[dir + length] = '\0';
+    return realpath(path, NULL);
+}
+
+Unit* loadModule(const char *path) {
+    for (int i = 0; i < modules.length; i++) {
+        if (strcmp(modules.units[i]->path, path)) continue;
+
+        if (modules.units[i]->loading) {
+            fprintf(stderr, "import cycle through %s\n", path);
+            exit(1);
+        }
+        return modules.units[i];
+    }
+
+    char *source = readSource(path);
+    if (source == NULL) {
+        fprintf(stderr, "cannot open module %s\n", path);
+        exit(1);
+    }
+
+    if (modules.length >= modules.capacity) {
+        modules.capacity = modules.capacity == 0 ? 8 : modules.capacity * 2;
+        modules.units = (Unit **)safe_realloc(modules.units, sizeof(Unit *) * modules.capacity);
+    }
+    Unit *unit = (Unit *)safe_calloc(1, sizeof(Unit));
+    unit->path = copyString(path);
+    unit->loading = 1;
+    modules.units[modules.length++] = unit;
+
+    uint64_t key = unitKey(source);
+    if (readUnit(unit, key)) {
+        for (int i = 0; i < unit->depsLength; i++) loadModule(unit->deps[i]);
+    } else {
+        compileModule(unit, source);
+        writeUnit(unit, key);
+    }
+
+    free(source);
+    unit->loading = 0;
+    return unit;
+}
+
+void findRelocations(Unit *unit) {
+    unit->relocations = (int *)safe_malloc(sizeof(int) * (unit->length + 1));
+    unit->relocationsLength = 0;
+
+    for (int pc = 0; pc < unit->length; pc += instLength(unit->code[pc].type)) {
+        InstType type = unit->code[pc].type;
+        if (type == INST_CALL || type == INST_SPAWN) unit->relocations[unit->relocationsLength++] = pc;
+    }
+}
+
+static int moduleIndex(const char *path) {
+    for (int i = 0; i < modules.length; i++) {
+        if (!strcmp(modules.units[i]->path, path)) return i;
+    }
+    fprintf(stderr, "module %s was never loaded\n", path);
+    exit(1);
+}
+
+// code has already been copied to base
+static void relocate(Unit *unit, Inst *code, int base, int *bases) {
+    for (int i = 0; i < unit->relocationsLength; i++) {
+        Inst *call = &code[base + unit->relocations[i]];
+        int target = call->operand.int32;
+
+        if (target >= 0) {
+            target += base;
+        } else {
+            Import import = unit->imports[-1 - target];
+            int module = moduleIndex(import.module);
+            Unit *exporter = modules.units[module];
+
+            int found = -1;
+            for (int e = 0; e < exporter->exportsLength && found < 0; e++) {
+                if (!strcmp(exporter->exports[e].name, import.name)) found = e;
+            }
+            // the importer may be cached from a version of the module that still had it
+            if (found < 0) {
+                fprintf(stderr, "%s: %s does not define %s\n", unit->path == NULL ? "script" : unit->path, import.module, import.name);
+                exit(1);
+            }
+            target = bases[module] + exporter->exports[found].ip;
+        }
+        call->operand = createBox(&target, VAL_INT);
+    }
+}
+
+void linkProgram(Unit *program, Function **functions, int *functionsLength) {
+    int *bases = (int *)safe_malloc(sizeof(int) * (modules.length + 1));
+    int length = program->length;
+    int exports = 0;
+
+    for (int i = 0; i < modules.length; i++) {
+        Unit *unit = modules.units[i];
+        if (length + unit->length > PROGRAM_MAX_SIZE) {
+            fprintf(stderr, "program is too large once %s is linked in\n", unit->path);
+            exit(1);
+        }
+
+        // modules only hold function declarations, which the main unit falls through at its end
+        bases[i] = length;
+        memcpy(program->code + length, unit->code, sizeof(Inst) * unit->length);
+        memcpy(program->lines + length, unit->lines, sizeof(int) * unit->length);
+        length += unit->length;
+        exports += unit->exportsLength;
+    }
+
+    relocate(program, program->code, 0, bases);
+    for (int i = 0; i < modules.length; i++) {
+        relocate(modules.units[i], program->code, bases[i], bases);
+    }
+    program->length = length;
+
+    *functions = (Function *)safe_realloc(*functions, sizeof(Function) * (*functionsLength + exports + 1));
+    for (int i = 0; i < modules.length; i++) {
+        Unit *unit = modules.units[i];
+        for (int e = 0; e < unit->exportsLength; e++) {
+            Function function = unit->exports[e];
+            (*functions)[(*functionsLength)++] = (Function){.name = copyString(function.name), .ip = bases[i] + function.ip, .end = bases[i] + function.end};
+        }
+    }
+
+    for (int i = 0; i < modules.length; i++) {
+        freeUnit(modules.units[i]);
+        free(modules.units[i]->path);
+        free(modules.units[i]);
+    }
+    free(modules.units);
+    modules = (ModuleTable){0};
+    free(bases);
+}
@@ -0,0 +1,62 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include "vm.h"
+
+// `import "helpers.ngs";` at the top level of a script makes the functions of helpers.ngs callable
+// from the rest of it. the path is relative to the importing file. a module only holds fun
+// declarations and imports of its own, its functions see none of the importer's globals.
+//
+// every module is compiled on its own into a relocatable unit, whose calls address its own code
+// from 0 or an entry of its import table. the unit is cached (see cache.h) and reused while the
+// module's source is unchanged. once the script is compiled, the linker lays out the script
+// followed by every module in one program and patches the calls between them
+
+typedef struct {
+    // canonical path of the module exporting it
+    char *module;
+    char *name;
+} Import;
+
+typedef struct {
+    char *path;
+    // set while its imports are loaded, an import of it then is a cycle
+    int loading;
+
+    Inst *code;
+    // source line of each instruction
+    int *lines;
+    int length;
+
+    // its functions, ips relative to the start of code
+    Function *exports;
+    int exportsLength;
+
+    // the operand of an INST_CALL or INST_SPAWN is an ip of code, or -1 - i to call imports[i]
+    Import *imports;
+    int importsLength;
+    // paths of the modules it imports
+    char **deps;
+    int depsLength;
+
+    // pcs of its INST_CALL and INST_SPAWN instructions
+    int *relocations;
+    int relocationsLength;
+} Unit;
+
+// canonical path of the module named by an import in the file at importer (NULL for a source
+// without a file, the path is relative to the working directory then)
+char* resolveModule(const char *importer, const char *name, int length);
+// compiles the module at path, or takes it from the cache, along with its own imports. returns the
+// module's unit, which stays valid until linkProgram()
+Unit* loadModule(const char *path);
+
+// fills in the unit's relocations once its code is final
+void findRelocations(Unit *unit);
+
+// appends the code of every loaded module to program, the main unit whose code has room for
+// PROGRAM_MAX_SIZE instructions, patches the calls of all of them and adds the modules' exports
+// to functions. the loaded modules are freed afterwards
+void linkProgram(Unit *program, Function **functions, int *functionsLength);
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ngs.h"
+#include "scanner.h"
+#include "compiler.h"
+#include "jit.h"
+#include "coroutine.h"
+#include "allocs.h"
+#include "utils.h"
+
+// operand stack top once the top level code has run, everything up to it is a global
+int globalsTop;
+
+int ngsLoad(const char *source) {
+    if (vm != NULL) ngsFree();
+
+    // the scanner works on a mutable buffer, lexemes are copied out by the compiler
+    size_t length = strlen(source);
+    char *buffer = (char *)safe_malloc(length + 1);
+    memcpy(buffer, source, length + 1);
+    scannerInitialize(buffer);
+
+    int programLength = 0;
+    Function *functions = NULL;
+    int functionsLength = 0;
+    LineTable lines;
+    Inst *program = compile(NULL, &programLength, &functions, &functionsLength, &lines);
+
+    free(buffer);
+
+    initVM(program, programLength, functions, functionsLength, lines);
+    return ngsStart();
+}
+
+int ngsStart(void) {
+    jmp_buf trap;
+    // an error longjmps out of native code past the jitDepth -= 1 of every level it was in
+    sig_atomic_t depth = jitDepth;
+    errorTrap = &trap;
+    int status = setjmp(trap);
+    if (status == 0) runProgram();
+    else jitDepth = depth;
+    errorTrap = NULL;
+
+    globalsTop = vm->sp;
+    return status;
+}
+
+void ngsFree(void) {
+    sweepStack(vm->sp + 1);
+    freeVM();
+    vm = NULL;
+}
+
+int ngsFunction(const char *name) {
+    for (int i = 0; i < vm->functionsLength; i++) {
+        if (!strcmp(vm->functions[i].name, name)) return i;
+    }
+    return -1;
+}
+
+int ngsCall(int function, Box *args, int nargs, Box *result) {
+    jmp_buf trap;
+    sig_atomic_t depth = jitDepth;
+    errorTrap = &trap;
+
+    int status = setjmp(trap);
+    if (status == 0) {
+        // the same frame INST_PUSH_ARG and INST_CALL build, returning to the end of the program
+        // is what stops runProgram()
+        for (int i = 0; i < nargs; i++) {
+            CALLSTACK_PUSH(args[i]);
+        }
+        CALLSTACK_PUSH(createBox(&nargs, VAL_INT));
+        pushFrame(vm->programLength);
+
+        vm->pc = vm->functions[function].ip;
+        jitExecute(vm->pc);
+        runProgram();
+
+        STACK_POP(*result);
+    } else {
+        jitDepth = depth;
+        ngsReset();
+    }
+
+    errorTrap = NULL;
+    return status;
+}
+
+void ngsReset(void) {
+    resetCoroutines();
+    // the frames still pin the caller's arguments while the temporaries are freed
+    sweepStack(vm->sp - globalsTop);
+    vm->csp = -1;
+    vm->frame = -1;
+    vm->pc = vm->programLength;
+    vm->conditionBreaker = 0;
+}
+
+Box ngsString(const char *text) {
+    size_t length = strlen(text);
+    char *bytes = (char *)safe_malloc(length + 1);
+    memcpy(bytes, text, length + 1);
+
+    Object *obj = (Object *)safe_malloc(sizeof(Object));
+    *obj = (Object){.length = length + 1, .ref = bytes};
+    TRACK_ALLOC(obj, sizeof(Object) + length + 1, OBJECT_STRING);
+    return createBox(obj, VAL_STRING);
+}
+
+void ngsRelease(Box box) {
+    cleanup_object(box);
+}
@@ -0,0 +1,35 @@
+#ifndef NGS_H
+#define NGS_H
+
+#include "vm.h"
+
+// embedding API, built into libngs.a and libngs.so with `make lib`. one script is loaded at a time
+// into the global vm: compile it once with ngsLoad(), then call its functions as often as needed.
+// globals keep their values from one call to the next, ngsReset() only drops what a call left
+// on the stacks. compile errors are reported like the ngs binary does and exit the process
+
+// compiles source and runs its top level code to set up the globals. returns 0 or the exit status
+// of a runtime error in the top level code
+int ngsLoad(const char *source);
+// the second half of ngsLoad() for a program compiled and handed to initVM() by the host
+int ngsStart(void);
+void ngsFree(void);
+
+// index of the script function called name, -1 if there is none
+int ngsFunction(const char *name);
+
+// calls function with nargs arguments, which stay owned by the caller. returns 0 and stores the
+// returned value in result, or the exit status of a runtime error or budget stop (see setBudget)
+// after the error has been reported and the vm reset
+int ngsCall(int function, Box *args, int nargs, Box *result);
+
+// drops temporaries left on the operand stack and any unfinished frames. ngsCall() leaves the vm
+// clean, so this is only needed when the host drives the vm directly
+void ngsReset(void);
+
+// string arguments for ngsCall(), release them (and strings returned by a call) with ngsRelease()
+Box ngsString(const char *text);
+// frees a string, array or map unless a global or a container in the vm still holds it
+void ngsRelease(Box box);
+
+#endif
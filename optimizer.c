@@ -0,0 +1,572 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "optimizer.h"
+#include "ast.h"
+#include "builtins.h"
+#include "utils.h"
+
+// a value on the simulated operand stack while scanning a loop
+typedef struct {
+    // first instruction computing the value, -1 if it was on the stack before the loop
+    int start;
+    int end;
+    int invariant;
+    // can never be a string or an array, so arithmetic can't allocate or fail on it
+    int numeric;
+    // contains at least one operation, so hoisting it saves work
+    int computed;
+    // a constant that can't make int division fault
+    int safeDivisor;
+} Value;
+
+typedef struct {
+    int start;
+    int end;
+    // a register instruction storing into a variable, the loop keeps an INST_REG_MOVE of the result
+    int store;
+} Range;
+
+typedef struct {
+    Inst *program;
+    int *lines;
+    int start;
+    int end;
+    int base;
+    // first variable of the enclosing function, whose variables are frame relative, -1 at top level
+    int locals;
+
+    // slots below base written anywhere the loop can reach
+    char *assigned;
+    // whether the loop can store into an array element or a map, directly or through a call
+    int storesElements;
+
+    Value *stack;
+    int sp;
+
+    Range *hoisted;
+    int hoistedLength;
+} Loop;
+
+Loop loop;
+
+static int isJump(InstType type) {
+    return type == INST_JMP || type == INST_JMP_IF_NOT || type == INST_LOOP_STEP || type == INST_REG_JMP_IF_NOT;
+}
+
+static int isRegisterOp(InstType type) {
+    return type >= INST_REG_ADD && type <= INST_REG_MOVE;
+}
+
+// variable slot as the compiler numbers them, locals are stored relative to their function's first.
+// -1 for the locals of another function when the loop is at top level
+static int varSlot(Inst inst) {
+    if (inst.type != INST_FETCH_LOCAL && inst.type != INST_ASSIGN_LOCAL) return inst.operand.int32;
+    return loop.locals < 0 ? -1 : loop.locals + inst.operand.int32;
+}
+
+static void markAssigned(int from, int to) {
+    for (int pc = from; pc < to; pc += instLength(loop.program[pc].type)) {
+        Inst inst = loop.program[pc];
+        int slot = -1;
+        if (inst.type == INST_ASSIGN_VAR || inst.type == INST_ASSIGN_LOCAL) {
+            slot = varSlot(inst);
+        } else if (inst.type == INST_LOOP_STEP) {
+            slot = varSlot(loop.program[pc + 1]);
+        } else if (isRegisterOp(inst.type) && loop.program[pc + 1].type != INST_STACK_PUSH) {
+            slot = varSlot(loop.program[pc + 1]);
+        }
+        if (slot >= 0 && slot < loop.base) loop.assigned[slot] = 1;
+    }
+}
+
+static void pushValue(Value value) {
+    loop.stack[loop.sp] = value;
+    loop.sp += 1;
+}
+
+static Value popValue(void) {
+    if (loop.sp == 0) return (Value){.start = -1};
+    loop.sp -= 1;
+    return loop.stack[loop.sp];
+}
+
+// the value is used by something that has to stay in the loop, hoist it if it is worth it
+static void consume(Value value) {
+    if (value.start < 0 || !value.invariant || !value.computed) return;
+    loop.hoisted[loop.hoistedLength] = (Range){.start = value.start, .end = value.end};
+    loop.hoistedLength += 1;
+}
+
+static int compareRanges(const void *a, const void *b) {
+    return ((Range *)a)->start - ((Range *)b)->start;
+}
+
+// the value an INST_STACK_PUSH, INST_FETCH_VAR, INST_FETCH_LOCAL or INST_FETCH_ARG at pc pushes, or
+// the source word of a register instruction reads
+static Value sourceValue(Inst inst, int pc) {
+    switch (inst.type) {
+    case INST_STACK_PUSH: {
+        ValueType type = TYPE(inst.operand);
+        int numeric = type != VAL_STRING;
+        int safeDivisor = type == VAL_INT ? inst.operand.int32 != 0 && inst.operand.int32 != -1 : type == VAL_FLOAT;
+        return (Value){.start = pc, .end = pc + 1, .invariant = numeric, .numeric = numeric, .safeDivisor = safeDivisor};
+    }
+    case INST_FETCH_VAR:
+    case INST_FETCH_LOCAL: {
+        int slot = varSlot(inst);
+        return (Value){.start = pc, .end = pc + 1, .invariant = slot < loop.base && !loop.assigned[slot]};
+    }
+    default:
+        return (Value){.start = pc, .end = pc + 1, .invariant = 1};
+    }
+}
+
+// loperand op roperand computed by the instructions from start to end, op being an arithmetic
+// instruction or INST_CMP
+static Value operation(InstType op, Value loperand, Value roperand, int start, int end) {
+    int invariant = loperand.invariant && roperand.invariant;
+    int numeric = loperand.numeric && roperand.numeric;
+    // string concatenation allocates and mixing strings with numbers is a runtime error,
+    // neither may happen ahead of a loop that might not run
+    if (op == INST_ADD && !numeric) invariant = 0;
+    // an array and a number never fail, but two arrays may differ in length and the result
+    // goes stale once an element is stored
+    if (op != INST_ADD && op != INST_CMP && !numeric) {
+        if (!(loperand.numeric || roperand.numeric) || loop.storesElements) invariant = 0;
+    }
+    if (op == INST_DIV && !roperand.safeDivisor) invariant = 0;
+
+    if (!invariant) {
+        consume(loperand);
+        consume(roperand);
+    }
+
+    if (op == INST_CMP) numeric = 1;
+    return (Value){.start = start, .end = end, .invariant = invariant, .numeric = numeric, .computed = 1};
+}
+
+static void findInvariants(void) {
+    for (int pc = loop.start; pc < loop.end; pc += instLength(loop.program[pc].type)) {
+        Inst inst = loop.program[pc];
+
+        switch (inst.type) {
+        case INST_STACK_PUSH:
+        case INST_FETCH_VAR:
+        case INST_FETCH_LOCAL:
+        case INST_FETCH_ARG:
+            pushValue(sourceValue(inst, pc));
+            break;
+        case INST_ADD:
+        case INST_SUB:
+        case INST_MULT:
+        case INST_DIV:
+        case INST_CMP: {
+            Value roperand = popValue();
+            Value loperand = popValue();
+            pushValue(operation(inst.type, loperand, roperand, loperand.start, pc + 1));
+            break;
+        }
+        case INST_REG_ADD:
+        case INST_REG_SUB:
+        case INST_REG_MULT:
+        case INST_REG_DIV:
+        case INST_REG_CMP: {
+            InstType type = inst.type == INST_REG_CMP ? INST_CMP : (InstType)(inst.type - INST_REG_ADD + INST_ADD);
+            Value loperand = sourceValue(loop.program[pc + 2], pc + 2);
+            Value roperand = sourceValue(loop.program[pc + 3], pc + 3);
+            Value value = operation(type, loperand, roperand, pc, pc + REG_LENGTH);
+
+            if (loop.program[pc + 1].type == INST_STACK_PUSH) {
+                pushValue(value);
+            } else if (value.invariant) {
+                loop.hoisted[loop.hoistedLength] = (Range){.start = pc, .end = pc + REG_LENGTH, .store = 1};
+                loop.hoistedLength += 1;
+            }
+            break;
+        }
+        case INST_LOGICAL_NOT: {
+            Value value = popValue();
+            pushValue((Value){.start = value.start, .end = pc + 1, .invariant = value.invariant, .numeric = 1, .computed = 1});
+            break;
+        }
+        case INST_ASSIGN_VAR:
+        case INST_ASSIGN_LOCAL:
+        case INST_PUSH_ARG:
+        case INST_JMP_IF_NOT:
+        case INST_RET:
+            consume(popValue());
+            break;
+        case INST_STACK_SWEEP:
+            for (int i = 0; i < inst.operand.int32; i++) {
+                consume(popValue());
+            }
+            break;
+        case INST_CALL:
+        case INST_SPAWN:
+            pushValue((Value){.start = pc, .end = pc + 1});
+            break;
+        case INST_YIELD:
+            break;
+        case INST_ARRAY_NEW:
+            for (int i = 0; i < inst.operand.int32; i++) {
+                consume(popValue());
+            }
+            pushValue((Value){.start = pc, .end = pc + 1});
+            break;
+        case INST_INDEX_GET:
+        case INST_MAP_HAS:
+        case INST_MAP_DELETE:
+            consume(popValue());
+            consume(popValue());
+            pushValue((Value){.start = pc, .end = pc + 1});
+            break;
+        case INST_ARRAY_ALLOC:
+        case INST_ARRAY_REDUCE:
+        case INST_MAP_NEW:
+        case INST_RESUME:
+        case INST_WAIT:
+            consume(popValue());
+            pushValue((Value){.start = pc, .end = pc + 1});
+            break;
+        case INST_CALL_NATIVE:
+            for (int i = 0; i < natives[inst.operand.int32].arity; i++) {
+                consume(popValue());
+            }
+            pushValue((Value){.start = pc, .end = pc + 1});
+            break;
+        case INST_INDEX_SET:
+            for (int i = 0; i < 3; i++) {
+                consume(popValue());
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    while (loop.sp > 0) {
+        consume(popValue());
+    }
+
+    qsort(loop.hoisted, loop.hoistedLength, sizeof(Range), compareRanges);
+}
+
+static void shiftSlot(Inst *inst, int count) {
+    if (varSlot(*inst) >= loop.base) {
+        int slot = inst->operand.int32 + count;
+        inst->operand = createBox(&slot, VAL_INT);
+    }
+}
+
+// evaluates the invariant expressions once ahead of the loop into fresh slots starting at base,
+// which the loop reads instead and which are swept when it exits. returns the new loop start
+static int hoistInvariants(int *programLength) {
+    int count = loop.hoistedLength;
+    if (count == 0) return loop.start;
+
+    int removed = 0, stores = 0;
+    for (int i = 0; i < count; i++) {
+        removed += loop.hoisted[i].end - loop.hoisted[i].start;
+        stores += loop.hoisted[i].store;
+    }
+
+    int loopLength = loop.end - loop.start;
+    int outLength = removed + (loopLength - removed + count + 2 * stores) + 1;
+    if (loop.start + outLength > PROGRAM_MAX_SIZE) return loop.start;
+
+    Inst *out = (Inst *)safe_malloc(sizeof(Inst) * outLength);
+    int *outLines = (int *)safe_malloc(sizeof(int) * outLength);
+    int *map = (int *)safe_malloc(sizeof(int) * (loopLength + 1));
+    int length = 0;
+
+    for (int i = 0; i < count; i++) {
+        for (int pc = loop.hoisted[i].start; pc < loop.hoisted[i].end; pc++) {
+            outLines[length] = loop.lines[pc];
+            out[length++] = loop.program[pc];
+        }
+        if (loop.hoisted[i].store) out[length - REG_LENGTH + 1] = (Inst){.type = INST_STACK_PUSH};
+    }
+    int header = length;
+
+    int next = 0;
+    for (int pc = loop.start; pc < loop.end;) {
+        map[pc - loop.start] = length;
+
+        if (next < count && loop.hoisted[next].start == pc) {
+            int slot = loop.base + next;
+            InstType fetch = INST_FETCH_VAR;
+            if (loop.locals >= 0) {
+                slot -= loop.locals;
+                fetch = INST_FETCH_LOCAL;
+            }
+            if (loop.hoisted[next].store) {
+                Inst store = loop.program[pc + 1];
+                shiftSlot(&store, count);
+                outLines[length] = loop.lines[pc];
+                outLines[length + 1] = loop.lines[pc + 1];
+                out[length++] = (Inst){.type = INST_REG_MOVE};
+                out[length++] = store;
+            }
+            outLines[length] = loop.lines[pc];
+            out[length++] = (Inst){.type = fetch, .operand = createBox(&slot, VAL_INT)};
+            pc = loop.hoisted[next].end;
+            next += 1;
+            continue;
+        }
+
+        int instLen = instLength(loop.program[pc].type);
+        for (int i = 0; i < instLen; i++) {
+            Inst inst = loop.program[pc + i];
+            InstType type = inst.type;
+            if (type == INST_FETCH_VAR || type == INST_ASSIGN_VAR || type == INST_FETCH_LOCAL || type == INST_ASSIGN_LOCAL) {
+                shiftSlot(&inst, count);
+            }
+            out[length + i] = inst;
+            outLines[length + i] = loop.lines[pc + i];
+        }
+
+        length += instLen;
+        pc += instLen;
+    }
+    map[loopLength] = length;
+    outLines[length] = loop.lines[loop.end - 1];
+    out[length++] = (Inst){.type = INST_STACK_SWEEP, .operand = createBox(&count, VAL_INT)};
+
+    for (int pc = loop.start; pc < loop.end; pc += instLength(loop.program[pc].type)) {
+        Inst inst = loop.program[pc];
+        if (!isJump(inst.type) || map[pc - loop.start] < header) continue;
+
+        int target = pc + inst.operand.int32;
+        int offset = map[target - loop.start] - map[pc - loop.start];
+        out[map[pc - loop.start]].operand = createBox(&offset, VAL_INT);
+    }
+
+    memcpy(loop.program + loop.start, out, sizeof(Inst) * length);
+    memcpy(loop.lines + loop.start, outLines, sizeof(int) * length);
+    *programLength = loop.start + length;
+
+    free(map);
+    free(outLines);
+    free(out);
+
+    return loop.start + header;
+}
+
+// rewrites the back-edge of `loop i < limit { ...; i = i + c; }` into INST_LOOP_STEP. the tail
+// (increment, optional sweep, jmp) is exactly as long as the fused instruction, so nothing moves.
+// the condition and the increment are four words either as stack or as register instructions
+static void fuseCountedLoop(int header, int backEdge) {
+    Inst *program = loop.program;
+
+    if (program[backEdge].type != INST_JMP || backEdge + program[backEdge].operand.int32 != header) return;
+
+    Inst var, limit, cjmp;
+    int condition;
+    if (program[header].type == INST_REG_JMP_IF_NOT) {
+        cjmp = program[header];
+        condition = program[header + 1].operand.int32;
+        var = program[header + 2];
+        limit = program[header + 3];
+        if (header + cjmp.operand.int32 != backEdge + 1) return;
+    } else {
+        var = program[header];
+        limit = program[header + 1];
+        cjmp = program[header + 3];
+        condition = program[header + 2].operand.int32;
+        if (program[header + 2].type != INST_CMP || cjmp.type != INST_JMP_IF_NOT) return;
+        if (header + 3 + cjmp.operand.int32 != backEdge + 1) return;
+    }
+
+    if (var.type != INST_FETCH_VAR && var.type != INST_FETCH_LOCAL) return;
+
+    int slot = var.operand.int32;
+    InstType assignType = var.type == INST_FETCH_LOCAL ? INST_ASSIGN_LOCAL : INST_ASSIGN_VAR;
+    if (limit.type == INST_FETCH_VAR || limit.type == INST_FETCH_LOCAL) {
+        if (limit.type == var.type && limit.operand.int32 == slot) return;
+    } else if (limit.type != INST_STACK_PUSH || TYPE(limit.operand) == VAL_STRING) {
+        return;
+    }
+
+    int sweep = program[backEdge - 1].type == INST_STACK_SWEEP;
+    int increment = backEdge - 4 - sweep;
+    if (increment <= header + 3) return;
+
+    // operand words of a register instruction may look like the increment too
+    int boundary = header;
+    while (boundary < increment) boundary += instLength(program[boundary].type);
+    if (boundary != increment) return;
+
+    Inst fetch, step, op, assign;
+    if (program[increment].type == INST_REG_ADD || program[increment].type == INST_REG_SUB) {
+        op = (Inst){.type = program[increment].type == INST_REG_ADD ? INST_ADD : INST_SUB};
+        assign = program[increment + 1];
+        fetch = program[increment + 2];
+        step = program[increment + 3];
+    } else {
+        fetch = program[increment];
+        step = program[increment + 1];
+        op = program[increment + 2];
+        assign = program[increment + 3];
+    }
+
+    if (fetch.type != var.type || fetch.operand.int32 != slot) return;
+    if (assign.type != assignType || assign.operand.int32 != slot) return;
+    if (step.type != INST_STACK_PUSH || TYPE(step.operand) != VAL_INT) return;
+
+    int amount = step.operand.int32;
+    if (op.type == INST_ADD && amount >= 0) {
+        // keep amount
+    } else if (op.type == INST_SUB && amount > 0) {
+        amount = -amount;
+    } else {
+        return;
+    }
+
+    // nothing may jump into the middle of the tail being replaced
+    for (int pc = header; pc <= backEdge; pc += instLength(program[pc].type)) {
+        if (!isJump(program[pc].type)) continue;
+        int target = pc + program[pc].operand.int32;
+        if (target > increment && target <= backEdge) return;
+    }
+
+    int at = increment;
+    if (sweep) program[at++] = program[backEdge - 1];
+
+    int offset = (header + 4) - at;
+    program[at] = (Inst){.type = INST_LOOP_STEP, .operand = createBox(&offset, VAL_INT)};
+    program[at + 1] = (Inst){.type = var.type, .operand = createBox(&slot, VAL_INT)};
+    program[at + 2] = (Inst){.type = INST_EXTRA, .operand = createBox(&amount, VAL_INT)};
+    program[at + 3] = (Inst){.type = INST_EXTRA, .operand = createBox(&condition, VAL_INT)};
+    program[at + 4] = limit;
+}
+
+void optimizeLoop(Inst *program, int *lines, int *programLength, int start, int base, int locals) {
+    loop = (Loop){.program = program, .lines = lines, .start = start, .end = *programLength, .base = base, .locals = locals};
+    loop.assigned = (char *)safe_calloc(base + 1, 1);
+
+    markAssigned(start, loop.end);
+    for (int pc = start; pc < loop.end; pc += instLength(program[pc].type)) {
+        // a callee, or another coroutine getting a turn, may assign any global or store into any array
+        InstType type = program[pc].type;
+        int suspends = type == INST_CALL_NATIVE && natives[program[pc].operand.int32].suspends;
+        if (type == INST_CALL || type == INST_YIELD || type == INST_RESUME || type == INST_WAIT || suspends) {
+            markAssigned(0, start);
+            loop.storesElements = 1;
+            break;
+        }
+        // natives only see their arguments, but those may be arrays or maps they write to
+        if (program[pc].type == INST_INDEX_SET || program[pc].type == INST_MAP_DELETE || program[pc].type == INST_CALL_NATIVE) {
+            loop.storesElements = 1;
+        }
+    }
+
+    int loopLength = loop.end - loop.start;
+    loop.stack = (Value *)safe_malloc(sizeof(Value) * loopLength);
+    loop.hoisted = (Range *)safe_malloc(sizeof(Range) * loopLength);
+
+    findInvariants();
+    int header = hoistInvariants(programLength);
+
+    int backEdge = *programLength - 1;
+    if (header != loop.start) backEdge -= 1;
+    fuseCountedLoop(header, backEdge);
+
+    free(loop.hoisted);
+    free(loop.stack);
+    free(loop.assigned);
+}
+
+static void foldNode(int node);
+
+static void foldList(int node) {
+    for (; node != 0; node = ast.nodes[node].next) foldNode(node);
+}
+
+int foldBoxes(int compare, int op, Box left, Box right, Box *result) {
+    ValueType ltype = TYPE(left);
+    ValueType rtype = TYPE(right);
+    if ((ltype != VAL_INT && ltype != VAL_FLOAT) || (rtype != VAL_INT && rtype != VAL_FLOAT)) return 0;
+
+    if (compare) {
+        *result = compareBoxes(left, right, (Condition)op);
+        return 1;
+    }
+
+    switch (op) {
+    case INST_ADD:
+        *result = addBoxes(left, right);
+        break;
+    case INST_SUB:
+        *result = subBoxes(left, right);
+        break;
+    case INST_MULT:
+        *result = multBoxes(left, right);
+        break;
+    default:
+        if (ltype == VAL_INT && rtype == VAL_INT && (right.int32 == 0 || (left.int32 == INT_MIN && right.int32 == -1))) return 0;
+        *result = divBoxes(left, right);
+    }
+    return 1;
+}
+
+static void foldNode(int node) {
+    Node *n = &ast.nodes[node];
+
+    switch (n->type) {
+    case NODE_BINARY:
+    case NODE_COMPARE: {
+        foldNode(n->a);
+        foldNode(n->b);
+
+        Node *left = &ast.nodes[n->a];
+        Node *right = &ast.nodes[n->b];
+        if (left->type != NODE_CONSTANT || right->type != NODE_CONSTANT) break;
+        if (!foldBoxes(n->type == NODE_COMPARE, n->c, left->value, right->value, &n->value)) break;
+        n->type = NODE_CONSTANT;
+        break;
+    }
+    case NODE_CALL:
+    case NODE_SPAWN:
+    case NODE_NATIVE:
+    case NODE_INTRINSIC:
+        foldList(n->b);
+        break;
+    case NODE_ARRAY:
+    case NODE_BLOCK:
+        foldList(n->a);
+        break;
+    case NODE_ARG:
+    case NODE_RETURN:
+        foldNode(n->a);
+        break;
+    case NODE_INDEX:
+        foldNode(n->a);
+        foldNode(n->b);
+        break;
+    case NODE_LET:
+    case NODE_ASSIGN:
+        foldNode(n->b);
+        break;
+    case NODE_INDEX_ASSIGN:
+        foldNode(n->b);
+        foldNode(n->c);
+        break;
+    case NODE_IF:
+    case NODE_LOOP:
+        foldNode(n->a);
+        foldNode(n->b);
+        if (n->type == NODE_IF) foldNode(n->c);
+        break;
+    case NODE_FUNCTION:
+        // the body of a function taken from the cache is never emitted
+        if (ast.functions[n->c].cached < 0) foldNode(n->b);
+        break;
+    default:
+        break;
+    }
+}
+
+void foldConstants(int node) {
+    foldList(node);
+}
@@ -0,0 +1,19 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "vm.h"
+
+// runs on a loop that was just emitted at the end of the program: start is the first instruction of
+// its condition and base is the first variable slot that belongs to the loop (parser.varsLength).
+// inside a function locals is its first variable slot (parser.localsBase), -1 at top level.
+// lines[pc] is moved along with the instruction at pc
+void optimizeLoop(Inst *program, int *lines, int *programLength, int start, int base, int locals);
+
+// folds the arithmetic and comparisons of number literals in the statements from node on, the way the
+// vm would compute them. divisions that would fault are left to run
+void foldConstants(int node);
+// stores left op right in result the way the vm would compute it, op being an InstType or with
+// compare set a Condition. 0 if either isn't a number or the division would fault
+int foldBoxes(int compare, int op, Box left, Box right, Box *result);
+
+#endif
@@ -0,0 +1,745 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parser.h"
+#include "scanner.h"
+#include "ast.h"
+#include "cache.h"
+
+typedef struct {
+    Token prev;
+    Token curr;
+    int steppedBack;
+    // names of prev and curr once interned, -1 until then
+    int prevName;
+    int currName;
+
+    int hashFunctions;
+} TokenReader;
+
+TokenReader tr;
+
+Token pushForward(void) {
+    if (tr.steppedBack) {
+        tr.steppedBack = 0;
+    } else {
+        tr.prev = tr.curr;
+        tr.prevName = tr.currName;
+        tr.curr = nextToken();
+        tr.currName = -1;
+    }
+    return tr.curr;
+}
+
+void pushBack(void) {
+    tr.steppedBack = 1;
+}
+
+int matchingKeyword(Token token, char *keyword, size_t length) {
+    if (token.length != length) return 0;
+    return !memcmp(token.lexeme, keyword, length);
+}
+
+// the tokens named are at most one behind the reader
+int nameOf(Token token) {
+    if (token.lexeme == tr.curr.lexeme && tr.currName >= 0) return tr.currName;
+    if (token.lexeme == tr.prev.lexeme && tr.prevName >= 0) return tr.prevName;
+    return internName(token.lexeme, token.length);
+}
+
+int expression(void);
+int stmt(void);
+
+// arrayExpr := "[" [ expression {: "," expression :} ] "]"
+int arrayExpr(void) {
+    int first = 0, last = 0;
+
+    if (pushForward().type != TOK_RBRACKET) {
+        first = last = expression();
+
+        while (pushForward().type == TOK_COMMA) {
+            pushForward();
+            int element = expression();
+            ast.nodes[last].next = element;
+            last = element;
+        }
+
+        if (tr.curr.type != TOK_RBRACKET) {
+            fprintf(stderr, "line %d: missing closing ] for array\n", tr.curr.line);
+            exit(1);
+        }
+    }
+
+    int node = newNode(NODE_ARRAY, tr.curr.line);
+    ast.nodes[node].a = first;
+    return node;
+}
+
+// an argument keeps the line of the token after it, which its INST_PUSH_ARG is attributed to
+int argument(void) {
+    int expr = expression();
+    int node = newNode(NODE_ARG, tr.curr.line);
+    ast.nodes[node].a = expr;
+    return node;
+}
+
+// args := [ expression {: , expression :} ]
+int args(void) {
+    int first = 0, last = 0;
+
+    if (pushForward().type != TOK_RPAREN) {
+        first = last = argument();
+
+        while (pushForward().type == TOK_COMMA) {
+            pushForward();
+            int arg = argument();
+            ast.nodes[last].next = arg;
+            last = arg;
+        }
+    }
+    pushBack();
+    return first;
+}
+
+// IDENT "(" args ")" once the "(" has been read
+int callExpr(NodeType type, Token ident) {
+    int first = args();
+
+    Token rparen = pushForward();
+    if (rparen.type != TOK_RPAREN) {
+        fprintf(stderr, "line %d: expected )\n", rparen.line);
+        exit(1);
+    }
+
+    int node = newNode(type, rparen.line);
+    ast.nodes[node].a = nameOf(ident);
+    ast.nodes[node].b = first;
+    return node;
+}
+
+// spawnExpr := "spawn" IDENT "(" args ")", evaluates to the id of the new coroutine
+int spawnExpr(void) {
+    Token keyword = tr.curr;
+
+    Token ident = pushForward();
+    if (ident.type != TOK_IDENT || pushForward().type != TOK_LPAREN) {
+        fprintf(stderr, "line %d: spawn expects a function call\n", keyword.line);
+        exit(1);
+    }
+
+    int node = callExpr(NODE_SPAWN, ident);
+    ast.nodes[node].c = keyword.line;
+    return node;
+}
+
+// identifier := spawnExpr | IDENT "(" args ")" | IDENT. whether an IDENT is a function, native,
+// intrinsic or variable is up to the resolver
+int identifier(void) {
+    if (matchingKeyword(tr.curr, "spawn", 5)) return spawnExpr();
+
+    Token ident = tr.curr;
+    if (pushForward().type == TOK_LPAREN) return callExpr(NODE_CALL, ident);
+    pushBack();
+
+    int node = newNode(NODE_NAME, ident.line);
+    ast.nodes[node].a = nameOf(ident);
+    return node;
+}
+
+// primary := identifier | arrayExpr | STRING | CHARACTER | DECIMAL | INTEGER | "(" expression ")"
+int primary(void) {
+    if (tr.curr.type == TOK_LPAREN) {
+        pushForward();
+        int node = expression();
+
+        Token rparen = pushForward();
+        if (rparen.type != TOK_RPAREN) {
+            fprintf(stderr, "line %d: missing closing ) for expression\n", rparen.line);
+            exit(1);
+        }
+        return node;
+    }
+
+    char *endptr = tr.curr.lexeme + tr.curr.length;
+    int node;
+
+    switch (tr.curr.type) {
+    case TOK_INTEGER: {
+        long v = strtol(tr.curr.lexeme, &endptr, 10);
+        node = newNode(NODE_CONSTANT, tr.curr.line);
+        ast.nodes[node].value = createBox(&v, VAL_INT);
+        break;
+    }
+    case TOK_FLOAT: {
+        double v = strtod(tr.curr.lexeme, &endptr);
+        node = newNode(NODE_CONSTANT, tr.curr.line);
+        ast.nodes[node].value = createBox(&v, VAL_FLOAT);
+        break;
+    }
+    case TOK_IDENT:
+        node = identifier();
+        break;
+    case TOK_STRING:
+        node = newNode(NODE_STRING, tr.curr.line);
+        ast.nodes[node].a = tr.curr.lexeme - ast.source;
+        ast.nodes[node].b = tr.curr.length;
+        break;
+    case TOK_LBRACKET:
+        node = arrayExpr();
+        break;
+    default:
+        fprintf(stderr, "line %d: expected identifier or expression\n", tr.curr.line);
+        exit(1);
+    }
+    return node;
+}
+
+// subscript := primary {: "[" expression "]" :}
+int subscript(void) {
+    int node = primary();
+
+    while (pushForward().type == TOK_LBRACKET) {
+        pushForward();
+        int index = expression();
+
+        Token rbracket = pushForward();
+        if (rbracket.type != TOK_RBRACKET) {
+            fprintf(stderr, "line %d: missing closing ] for index\n", rbracket.line);
+            exit(1);
+        }
+
+        int get = newNode(NODE_INDEX, rbracket.line);
+        ast.nodes[get].a = node;
+        ast.nodes[get].b = index;
+        node = get;
+    }
+    pushBack();
+    return node;
+}
+
+// unary := ("+" | "-") unary | subscript
+int unary(void) {
+    return subscript();
+}
+
+// the operator is attributed to the line of the token after its right operand
+int binaryNode(NodeType type, int op, int left, int right) {
+    int node = newNode(type, tr.curr.line);
+    ast.nodes[node].a = left;
+    ast.nodes[node].b = right;
+    ast.nodes[node].c = op;
+    return node;
+}
+
+// factor := unary {: ("*" | "/") unary :}
+int factor(void) {
+    int node = unary();
+
+    step:
+        switch (pushForward().type) {
+        case TOK_MULT:
+            pushForward();
+            node = binaryNode(NODE_BINARY, INST_MULT, node, unary());
+            goto step;
+        case TOK_DIV:
+            pushForward();
+            node = binaryNode(NODE_BINARY, INST_DIV, node, unary());
+            goto step;
+        default:
+            pushBack();
+        }
+    return node;
+}
+
+// term := factor {: ("+" | "-") factor :}
+int term(void) {
+    int node = factor();
+
+    step:
+        switch (pushForward().type) {
+        case TOK_PLUS:
+            pushForward();
+            node = binaryNode(NODE_BINARY, INST_ADD, node, factor());
+            goto step;
+        case TOK_MINUS:
+            pushForward();
+            node = binaryNode(NODE_BINARY, INST_SUB, node, factor());
+            goto step;
+        default:
+            pushBack();
+        }
+    return node;
+}
+
+// comparison := term {: (">=" | ">" | "<=" | "<") term :}
+int comparison(void) {
+    int node = term();
+    Condition c;
+
+    step:
+        switch (pushForward().type) {
+        case TOK_GE:
+            c = CMP_GE;
+            break;
+        case TOK_LE:
+            c = CMP_LE;
+            break;
+        case TOK_GT:
+            c = CMP_GT;
+            break;
+        case TOK_LT:
+            c = CMP_LT;
+            break;
+        default:
+            pushBack();
+            return node;
+        }
+
+    pushForward();
+    node = binaryNode(NODE_COMPARE, c, node, term());
+    goto step;
+}
+
+// equality := comparison {: ("==" | "!=") comparison :}
+int equality(void) {
+    int node = comparison();
+    Condition c;
+
+    step:
+        switch (pushForward().type) {
+        case TOK_EQ:
+            c = CMP_EQ;
+            break;
+        case TOK_NE:
+            c = CMP_NE;
+            break;
+        default:
+            pushBack();
+            return node;
+        }
+
+    pushForward();
+    node = binaryNode(NODE_COMPARE, c, node, comparison());
+    goto step;
+}
+
+// expression := equality;
+int expression(void) {
+    return equality();
+}
+
+// declStmt := "let" IDENT "=" expression
+int declStmt(void) {
+    if (!matchingKeyword(pushForward(), "let", 3)) {
+        pushBack();
+        return 0;
+    }
+
+    Token ident = pushForward();
+    if (ident.type != TOK_IDENT) {
+        fprintf(stderr, "line %d: expected identifier\n", ident.line);
+        exit(1);
+    }
+
+    Token assignment = pushForward();
+    if (assignment.type != TOK_ASSIGNMENT) {
+        fprintf(stderr, "line %d: expected assignment after variable declaration\n", assignment.line);
+        exit(1);
+    }
+
+    pushForward();
+    int init = expression();
+
+    int node = newNode(NODE_LET, ident.line);
+    ast.nodes[node].a = nameOf(ident);
+    ast.nodes[node].b = init;
+    return node;
+}
+
+// programBlock := "{" {: stmt :} "}"
+int programBlock(void) {
+    Token lsquirly = pushForward();
+    if (lsquirly.type != TOK_LSQUIRLY) {
+        fprintf(stderr, "line %d: expected {\n", lsquirly.line);
+        exit(1);
+    }
+
+    int first = 0, last = 0;
+    Token terminator;
+
+    step:
+        terminator = pushForward();
+
+        switch(terminator.type) {
+        case TOK_RSQUIRLY:
+        case TOK_EOF:
+            break;
+        default: {
+            pushBack();
+            int node = stmt();
+            if (!node) {
+                fprintf(stderr, "line %d: unrecognizable statement\n", pushForward().line);
+                exit(1);
+            }
+
+            if (last) {
+                ast.nodes[last].next = node;
+            } else {
+                first = node;
+            }
+            last = node;
+            goto step;
+        }
+        }
+
+    if (terminator.type != TOK_RSQUIRLY) {
+        fprintf(stderr, "line %d: expected closing } for block statement\n", terminator.line);
+        exit(1);
+    }
+
+    int node = newNode(NODE_BLOCK, lsquirly.line);
+    ast.nodes[node].a = first;
+    ast.nodes[node].c = terminator.line;
+    return node;
+}
+
+// ifStmt := "if" expression programBlock [ "else" (ifStmt | programBlock) ]
+int ifStmt(void) {
+    if (!matchingKeyword(pushForward(), "if", 2)) {
+        pushBack();
+        return 0;
+    }
+
+    pushForward();
+    int condition = expression();
+    int then = programBlock();
+
+    int otherwise = 0;
+    if (matchingKeyword(pushForward(), "else", 4)) {
+        otherwise = ifStmt();
+        if (!otherwise) otherwise = programBlock();
+    } else {
+        pushBack();
+    }
+
+    int node = newNode(NODE_IF, tr.curr.line);
+    ast.nodes[node].a = condition;
+    ast.nodes[node].b = then;
+    ast.nodes[node].c = otherwise;
+    return node;
+}
+
+// loopStmt := "loop" expression programBlock
+int loopStmt(void) {
+    Token keyword = pushForward();
+    if (!matchingKeyword(keyword, "loop", 4)) {
+        pushBack();
+        return 0;
+    }
+
+    pushForward();
+    int condition = expression();
+    int body = programBlock();
+
+    int node = newNode(NODE_LOOP, keyword.line);
+    ast.nodes[node].a = condition;
+    ast.nodes[node].b = body;
+    return node;
+}
+
+// returnStmt := "return" expression
+int returnStmt(void) {
+    if (!matchingKeyword(pushForward(), "return", 6)) {
+        pushBack();
+        return 0;
+    }
+
+    pushForward();
+    int value = expression();
+
+    int node = newNode(NODE_RETURN, tr.curr.line);
+    ast.nodes[node].a = value;
+    return node;
+}
+
+// yieldStmt := "yield"
+int yieldStmt(void) {
+    if (!matchingKeyword(pushForward(), "yield", 5)) {
+        pushBack();
+        return 0;
+    }
+    return newNode(NODE_YIELD, tr.curr.line);
+}
+
+// "[" expression "]" "=" expression, after the IDENT of assignmentStmt
+int indexAssignment(Token ident) {
+    int target = newNode(NODE_NAME, tr.curr.line);
+    ast.nodes[target].a = nameOf(ident);
+
+    pushForward();
+    int index = expression();
+
+    Token rbracket = pushForward();
+    if (rbracket.type != TOK_RBRACKET) {
+        fprintf(stderr, "line %d: missing closing ] for index\n", rbracket.line);
+        exit(1);
+    }
+
+    Token assignment = pushForward();
+    if (assignment.type != TOK_ASSIGNMENT) {
+        fprintf(stderr, "line %d: expected assignment after index\n", assignment.line);
+        exit(1);
+    }
+
+    pushForward();
+    int value = expression();
+
+    int node = newNode(NODE_INDEX_ASSIGN, tr.curr.line);
+    ast.nodes[node].a = target;
+    ast.nodes[node].b = index;
+    ast.nodes[node].c = value;
+    return node;
+}
+
+// callStmt := spawnExpr | IDENT "(" args ")", with the result dropped
+// assignmentStmt := IDENT [ "[" expression "]" ] "=" expression
+// both start with an IDENT, so this has to come last since it looks two tokens ahead
+int identStmt(void) {
+    Token ident = pushForward();
+    if (ident.type != TOK_IDENT) {
+        pushBack();
+        return 0;
+    }
+    if (matchingKeyword(ident, "spawn", 5)) return spawnExpr();
+
+    Token next = pushForward();
+    if (next.type == TOK_LPAREN) return callExpr(NODE_CALL, ident);
+    if (next.type == TOK_LBRACKET) return indexAssignment(ident);
+
+    if (next.type == TOK_ASSIGNMENT) {
+        pushForward();
+        int value = expression();
+
+        int node = newNode(NODE_ASSIGN, tr.curr.line);
+        ast.nodes[node].a = nameOf(ident);
+        ast.nodes[node].b = value;
+        ast.nodes[node].c = next.line;
+        return node;
+    }
+
+    pushBack();
+    return 0;
+}
+
+// stmt := declStmt; | yieldStmt; | returnStmt; | callStmt; | assignmentStmt; | ifStmt | loopStmt
+int stmt(void) {
+    int node = ifStmt();
+    if (!node) node = loopStmt();
+    if (node) return node;
+
+    node = declStmt();
+    if (!node) node = yieldStmt();
+    if (!node) node = returnStmt();
+    if (!node) node = identStmt();
+
+    if (node) {
+        Token semicol = pushForward();
+        if (semicol.type != TOK_SEMICOL) {
+            fprintf(stderr, "line %d: missing semicolon\n", semicol.line);
+            exit(1);
+        }
+    }
+    return node;
+}
+
+// params := [ IDENT {: , IDENT :} ]
+int params(void) {
+    Token param = pushForward();
+    if (param.type != TOK_IDENT) {
+        pushBack();
+        return 0;
+    }
+
+    int first = newNode(NODE_NAME, param.line);
+    ast.nodes[first].a = nameOf(param);
+    int last = first;
+
+    while (pushForward().type == TOK_COMMA) {
+        param = pushForward();
+        if (param.type != TOK_IDENT) {
+            fprintf(stderr, "line %d: expected identifier\n", param.line);
+            exit(1);
+        }
+
+        int node = newNode(NODE_NAME, param.line);
+        ast.nodes[node].a = nameOf(param);
+        ast.nodes[last].next = node;
+        last = node;
+    }
+    pushBack();
+    return first;
+}
+
+// IDENT "(" params ")" programBlock, the rest of the function declared by node
+void functionRest(int node) {
+    Token ident = pushForward();
+    if (ident.type != TOK_IDENT) {
+        fprintf(stderr, "line %d: expected identifier for function declaration\n", ident.line);
+        exit(1);
+    }
+    int name = nameOf(ident);
+
+    Token lparen = pushForward();
+    if (lparen.type != TOK_LPAREN) {
+        fprintf(stderr, "line %d: missing (\n", lparen.line);
+        exit(1);
+    }
+
+    int first = params();
+
+    Token rparen = pushForward();
+    if (rparen.type != TOK_RPAREN) {
+        fprintf(stderr, "line %d: missing )\n", rparen.line);
+        exit(1);
+    }
+
+    int body = programBlock();
+
+    Node *function = &ast.nodes[node];
+    function->line = ident.line;
+    function->a = name;
+    function->b = body;
+    ast.functions[function->c].params = first;
+}
+
+// only hashes the tokens of the function declared by node from its name to its closing } into its
+// key, see FunctionInfo. the resolver has its body parsed if the function cache holds no code for
+// it. 0 if the file ends first, the function is parsed right away then so the error is reported
+int skipFunction(int node) {
+    int function = ast.nodes[node].c;
+    int firstLine = ast.functions[function].firstLine;
+    Scanner start = scanner;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    // names already among the function's, most identifiers are found here without interning them
+    uint64_t seen[64] = {0};
+
+    Token name = nextToken();
+    Token prev = tr.curr;
+    int depth = 0;
+    for (Token token = name; name.type == TOK_IDENT && token.type != TOK_EOF && token.type != TOK_ERR; token = nextToken()) {
+        uint64_t lexeme = hashBytes(0xcbf29ce484222325ULL, token.lexeme, token.length) | 1;
+        hash = hashInt(hash, (int64_t)(token.line - firstLine) << 32 | token.type);
+        hash = hashInt(hash, lexeme);
+
+        if (token.type == TOK_IDENT && seen[lexeme % 64] != lexeme) {
+            seen[lexeme % 64] = lexeme;
+            int at = internName(token.lexeme, token.length);
+            if (ast.names[at].keyed != function) {
+                ast.names[at].keyed = function;
+                addKeyName(at);
+                ast.functions[function].namesLength += 1;
+            }
+        } else if (token.type == TOK_LSQUIRLY) {
+            depth += 1;
+        } else if (token.type == TOK_RSQUIRLY && --depth == 0) {
+            FunctionInfo *info = &ast.functions[function];
+            info->tokens = hash == 0 ? 1 : hash;
+            info->start = start;
+
+            ast.nodes[node].line = name.line;
+            ast.nodes[node].a = internName(name.lexeme, name.length);
+            tr.prev = prev;
+            tr.curr = token;
+            tr.prevName = tr.currName = -1;
+            return 1;
+        }
+        prev = token;
+    }
+
+    scanner = start;
+    ast.keyNamesLength = ast.functions[function].names;
+    ast.functions[function].namesLength = 0;
+    return 0;
+}
+
+void parseFunction(int node) {
+    TokenReader reader = tr;
+    Scanner rest = scanner;
+
+    scanner = ast.functions[ast.nodes[node].c].start;
+    tr = (TokenReader){.prevName = -1, .currName = -1};
+    functionRest(node);
+
+    tr = reader;
+    scanner = rest;
+}
+
+// functionDecl := "fun" IDENT "(" params ")" programBlock
+int functionDecl(void) {
+    if (!matchingKeyword(pushForward(), "fun", 3)) {
+        pushBack();
+        return 0;
+    }
+
+    int node = newNode(NODE_FUNCTION, tr.curr.line);
+    ast.nodes[node].c = newFunction(tr.curr.line);
+
+    if (!tr.hashFunctions || !skipFunction(node)) functionRest(node);
+    return node;
+}
+
+// importDecl := "import" STRING ";"
+int importDecl(void) {
+    if (!matchingKeyword(pushForward(), "import", 6)) {
+        pushBack();
+        return 0;
+    }
+
+    Token name = pushForward();
+    if (name.type != TOK_STRING) {
+        fprintf(stderr, "line %d: expected the path of a module\n", name.line);
+        exit(1);
+    }
+    if (pushForward().type != TOK_SEMICOL) {
+        fprintf(stderr, "line %d: missing semicolon\n", name.line);
+        exit(1);
+    }
+
+    int node = newNode(NODE_IMPORT, name.line);
+    ast.nodes[node].a = name.lexeme - ast.source;
+    ast.nodes[node].b = name.length;
+    return node;
+}
+
+// globalScope := {: importDecl | stmt | function :}
+// moduleScope := {: importDecl | function :}
+int parseUnit(int module, int hashFunctions) {
+    tr = (TokenReader){.prevName = -1, .currName = -1, .hashFunctions = hashFunctions};
+    int first = 0, last = 0;
+
+    while (pushForward().type != TOK_EOF) {
+        pushBack();
+
+        int node = importDecl();
+        if (!node) node = functionDecl();
+        if (!node && !module) node = stmt();
+
+        if (!node) {
+            if (module) {
+                fprintf(stderr, "line %d: a module can only import modules and declare functions\n", pushForward().line);
+            } else {
+                fprintf(stderr, "line %d: unrecognizable statement\n", pushForward().line);
+            }
+            exit(1);
+        }
+
+        if (last) {
+            ast.nodes[last].next = node;
+        } else {
+            first = node;
+        }
+        last = node;
+    }
+    return first;
+}
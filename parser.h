@@ -0,0 +1,12 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+// parses the unit the scanner was initialized with into ast (see ast.h), which astInitialize() has
+// emptied for it, and returns its first top-level node. a module may only import modules and declare
+// functions. with hashFunctions set every function gets the hash of its tokens the function cache
+// keys it by, and its body is left for parseFunction()
+int parseUnit(int module, int hashFunctions);
+// parses the body of the NODE_FUNCTION whose tokens parseUnit() only hashed
+void parseFunction(int node);
+
+#endif
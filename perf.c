@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perf.h"
+#include "vm.h"
+#include "jit.h"
+
+typedef enum {
+    CLASS_STACK,
+    CLASS_ARITHMETIC,
+    CLASS_REGISTER,
+    CLASS_JUMP,
+    CLASS_CALL,
+    CLASS_COROUTINE,
+    CLASS_COLLECTION,
+    CLASS_NATIVE,
+    CLASSES_LENGTH,
+} OpcodeClass;
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    // events between two samples
+    uint64_t period;
+} Event;
+
+#define EVENTS_LENGTH 6
+#define CACHE_EVENT(cache, op, result) ((cache) | ((op) << 8) | ((result) << 16))
+
+static const Event events[EVENTS_LENGTH] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1000003},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 1000003},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 10007},
+    {"l1d-misses", PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), 10007},
+    {"llc-misses", PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), 1009},
+    {"task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 100003},
+};
+
+static const char *phaseNames[PHASES_LENGTH] = {"other", "parse", "resolve", "optimize", "emit", "run"};
+static const char *classNames[CLASSES_LENGTH] = {
+    "stack", "arithmetic", "register", "jump", "call", "coroutine", "collection", "native",
+};
+
+typedef struct {
+    int initialized;
+    int enabled;
+    int sampling;
+
+    // -1 for a counter that couldn't be opened, with the errno it failed with
+    int fds[EVENTS_LENGTH];
+    int errors[EVENTS_LENGTH];
+
+    Phase phase;
+    // scaled count of each counter when the current phase started
+    double last[EVENTS_LENGTH];
+    double perPhase[PHASES_LENGTH][EVENTS_LENGTH];
+
+    volatile sig_atomic_t samples[CLASSES_LENGTH][EVENTS_LENGTH];
+} Perf;
+
+Perf perf;
+
+static OpcodeClass classOf(InstType type) {
+    switch (type) {
+    case INST_ADD:
+    case INST_SUB:
+    case INST_MULT:
+    case INST_DIV:
+    case INST_CMP:
+    case INST_LOGICAL_NOT:
+        return CLASS_ARITHMETIC;
+    case INST_REG_ADD:
+    case INST_REG_SUB:
+    case INST_REG_MULT:
+    case INST_REG_DIV:
+    case INST_REG_CMP:
+    case INST_REG_MOVE:
+    case INST_REG_JMP_IF_NOT:
+        return CLASS_REGISTER;
+    case INST_JMP:
+    case INST_JMP_IF_NOT:
+    case INST_LOOP_STEP:
+    case INST_SET_CB:
+    case INST_UNSET_CB:
+        return CLASS_JUMP;
+    case INST_CALL:
+    case INST_RET:
+    case INST_CALL_NATIVE:
+        return CLASS_CALL;
+    case INST_SPAWN:
+    case INST_YIELD:
+    case INST_RESUME:
+    case INST_WAIT:
+        return CLASS_COROUTINE;
+    case INST_ARRAY_NEW:
+    case INST_ARRAY_ALLOC:
+    case INST_INDEX_GET:
+    case INST_INDEX_SET:
+    case INST_ARRAY_REDUCE:
+    case INST_MAP_NEW:
+    case INST_MAP_HAS:
+    case INST_MAP_DELETE:
+        return CLASS_COLLECTION;
+    default:
+        return CLASS_STACK;
+    }
+}
+
+// charges a sample of the counter that overflowed to what the program is running, then rearms it
+static void takeSample(int signal, siginfo_t *info, void *context) {
+    (void)signal;
+    (void)context;
+
+    for (int i = 0; i < EVENTS_LENGTH; i++) {
+        if (perf.fds[i] != info->si_fd) continue;
+
+        if (perf.phase == PHASE_RUN && vm != NULL) {
+            int pc = vm->pc;
+            OpcodeClass class = CLASS_NATIVE;
+            if (!jitDepth) class = pc >= 0 && pc < vm->programLength ? classOf(vm->program[pc].type) : CLASS_STACK;
+            perf.samples[class][i] += 1;
+        }
+        ioctl(perf.fds[i], PERF_EVENT_IOC_REFRESH, 1);
+        return;
+    }
+}
+
+static int openEvent(int index) {
+    const Event *event = &events[index];
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if (perf.sampling) {
+        attr.sample_period = event->period;
+        attr.wakeup_events = 1;
+    }
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        perf.errors[index] = errno;
+        return -1;
+    }
+
+    if (perf.sampling) {
+        struct f_owner_ex owner = {.type = F_OWNER_TID, .pid = (pid_t)syscall(SYS_gettid)};
+        if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGIO) != 0 ||
+            fcntl(fd, F_SETOWN_EX, &owner) != 0 || ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) != 0) {
+            perf.errors[index] = errno;
+            close(fd);
+            return -1;
+        }
+    } else if (ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) != 0) {
+        perf.errors[index] = errno;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// count of the counter so far, scaled up for the time the kernel had it multiplexed out
+static double readEvent(int fd) {
+    uint64_t values[3];
+    if (read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) return 0;
+    return (double)values[0] * values[1] / values[2];
+}
+
+static void readAll(double *counts) {
+    for (int i = 0; i < EVENTS_LENGTH; i++) {
+        counts[i] = perf.fds[i] >= 0 ? readEvent(perf.fds[i]) : 0;
+    }
+}
+
+static void writeCount(FILE *out, int event, double count) {
+    if (perf.fds[event] < 0) {
+        fprintf(out, "null");
+    } else {
+        fprintf(out, "%.0f", count);
+    }
+}
+
+static void writeIpc(FILE *out, double *counts) {
+    if (perf.fds[0] < 0 || perf.fds[1] < 0 || counts[0] == 0) {
+        fprintf(out, "null");
+    } else {
+        fprintf(out, "%.3f", counts[1] / counts[0]);
+    }
+}
+
+static void writeReport(FILE *out) {
+    fprintf(out, "===== PERF =====\n\n");
+    for (int i = 0; i < EVENTS_LENGTH; i++) {
+        if (perf.fds[i] < 0) fprintf(out, "%s unavailable: %s\n", events[i].name, strerror(perf.errors[i]));
+    }
+
+    fprintf(out, "%-10s", "phase");
+    for (int i = 0; i < EVENTS_LENGTH; i++) fprintf(out, "%16s", events[i].name);
+    fprintf(out, "%8s\n", "ipc");
+
+    for (int phase = 0; phase < PHASES_LENGTH; phase++) {
+        double *counts = perf.perPhase[phase];
+        fprintf(out, "%-10s", phaseNames[phase]);
+        for (int i = 0; i < EVENTS_LENGTH; i++) {
+            if (perf.fds[i] < 0) {
+                fprintf(out, "%16s", "-");
+            } else {
+                fprintf(out, "%16.0f", counts[i]);
+            }
+        }
+        if (perf.fds[0] < 0 || perf.fds[1] < 0 || counts[0] == 0) {
+            fprintf(out, "%8s\n", "-");
+        } else {
+            fprintf(out, "%8.2f\n", counts[1] / counts[0]);
+        }
+    }
+
+    if (!perf.sampling) {
+        fprintf(out, "\n");
+        return;
+    }
+
+    fprintf(out, "\nrun per opcode class, estimated from samples:\n%-10s", "class");
+    for (int i = 0; i < EVENTS_LENGTH; i++) fprintf(out, "%16s", events[i].name);
+    fprintf(out, "\n");
+    for (int class = 0; class < CLASSES_LENGTH; class++) {
+        fprintf(out, "%-10s", classNames[class]);
+        for (int i = 0; i < EVENTS_LENGTH; i++) {
+            if (perf.fds[i] < 0) {
+                fprintf(out, "%16s", "-");
+            } else {
+                fprintf(out, "%16.0f", (double)perf.samples[class][i] * events[i].period);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "\n");
+}
+
+static void writeJSON(FILE *out) {
+    fprintf(out, "{\n  \"phases\": {");
+    for (int phase = 0; phase < PHASES_LENGTH; phase++) {
+        fprintf(out, "%s\n    \"%s\": {", phase ? "," : "", phaseNames[phase]);
+        for (int i = 0; i < EVENTS_LENGTH; i++) {
+            fprintf(out, "\"%s\": ", events[i].name);
+            writeCount(out, i, perf.perPhase[phase][i]);
+            fprintf(out, ", ");
+        }
+        fprintf(out, "\"ipc\": ");
+        writeIpc(out, perf.perPhase[phase]);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  }");
+
+    if (perf.sampling) {
+        fprintf(out, ",\n  \"classes\": {");
+        for (int class = 0; class < CLASSES_LENGTH; class++) {
+            fprintf(out, "%s\n    \"%s\": {", class ? "," : "", classNames[class]);
+            for (int i = 0; i < EVENTS_LENGTH; i++) {
+                fprintf(out, "%s\"%s\": ", i ? ", " : "", events[i].name);
+                writeCount(out, i, (double)perf.samples[class][i] * events[i].period);
+            }
+            fprintf(out, "}");
+        }
+        fprintf(out, "\n  }");
+    }
+    fprintf(out, "\n}\n");
+}
+
+static void reportPerf(void) {
+    perfPhase(PHASE_OTHER);
+    signal(SIGIO, SIG_IGN);
+    for (int i = 0; i < EVENTS_LENGTH; i++) {
+        if (perf.fds[i] >= 0) close(perf.fds[i]);
+    }
+    perf.enabled = 0;
+
+    writeReport(stderr);
+
+    char *path = getenv("NGS_PERF_JSON");
+    if (path == NULL) path = PERF_JSON_DEFAULT;
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "could not open %s for writing\n", path);
+        return;
+    }
+    writeJSON(out);
+    fclose(out);
+}
+
+static int enabled(const char *name) {
+    char *env = getenv(name);
+    return env != NULL && *env && strcmp(env, "0");
+}
+
+static void startPerf(void) {
+    perf.initialized = 1;
+    if (!enabled("NGS_PERF")) return;
+    perf.sampling = enabled("NGS_PERF_SAMPLE");
+
+    if (perf.sampling) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = takeSample;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGIO, &action, NULL) != 0) {
+            fprintf(stderr, "perf: could not install SIGIO handler, not sampling\n");
+            perf.sampling = 0;
+        }
+    }
+
+    int opened = 0;
+    for (int i = 0; i < EVENTS_LENGTH; i++) {
+        perf.fds[i] = openEvent(i);
+        opened += perf.fds[i] >= 0;
+    }
+    if (!opened) {
+        fprintf(stderr, "perf: no counters available: %s\n", strerror(perf.errors[0]));
+        signal(SIGIO, SIG_DFL);
+        return;
+    }
+
+    readAll(perf.last);
+    perf.enabled = 1;
+    atexit(reportPerf);
+}
+
+Phase perfPhase(Phase phase) {
+    if (!perf.initialized) startPerf();
+
+    Phase left = perf.phase;
+    if (!perf.enabled) return left;
+
+    double counts[EVENTS_LENGTH];
+    readAll(counts);
+    for (int i = 0; i < EVENTS_LENGTH; i++) {
+        perf.perPhase[left][i] += counts[i] - perf.last[i];
+        perf.last[i] = counts[i];
+    }
+    perf.phase = phase;
+    return left;
+}
@@ -0,0 +1,28 @@
+#ifndef PERF_H
+#define PERF_H
+
+// hardware counters read through perf_event_open around each compile pass and the run. set
+// NGS_PERF=1 for a summary per phase on stderr and as JSON in $NGS_PERF_JSON (or
+// PERF_JSON_DEFAULT) once the process exits. NGS_PERF_SAMPLE=1 also samples every counter on
+// overflow and attributes the samples taken while the program runs to the class of the opcode
+// being dispatched, with native code as a class of its own. counters the kernel or the container
+// doesn't provide are reported as missing, the software task clock usually still works
+
+#define PERF_JSON_DEFAULT "ngs-perf.json"
+
+typedef enum {
+    // startup, output and anything else outside of the phases below
+    PHASE_OTHER,
+    PHASE_PARSE,
+    PHASE_RESOLVE,
+    PHASE_OPTIMIZE,
+    PHASE_EMIT,
+    PHASE_RUN,
+    PHASES_LENGTH,
+} Phase;
+
+// charges the counts so far to the current phase and makes phase the current one, returns the
+// phase it replaced so a nested one can hand back to it. opens the counters on its first call
+Phase perfPhase(Phase phase);
+
+#endif
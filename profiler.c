@@ -0,0 +1,141 @@
+#define _DEFAULT_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "profiler.h"
+#include "utils.h"
+
+typedef struct {
+    int enabled;
+    char *path;
+
+    // samples back to back: depth, then that many pcs from the innermost frame outwards
+    int *buffer;
+    volatile sig_atomic_t length;
+    volatile sig_atomic_t dropped;
+} Profiler;
+
+Profiler profiler;
+
+static void takeSample(int signal) {
+    (void)signal;
+
+    int at = profiler.length;
+    if (at + PROFILE_MAX_DEPTH + 1 > PROFILE_BUFFER_SIZE) {
+        profiler.dropped += 1;
+        return;
+    }
+
+    int *frames = profiler.buffer + at + 1;
+    int depth = 0;
+    frames[depth++] = vm->pc;
+
+    // frames of ngsCall() and of a coroutine's first call return to the end of the program
+    for (int frame = vm->frame; frame >= 0 && depth < PROFILE_MAX_DEPTH; frame = vm->callStack[frame].int32) {
+        int returnPc = vm->callStack[frame - 2].int32;
+        if (returnPc < vm->programLength) frames[depth++] = returnPc - 1;
+    }
+
+    profiler.buffer[at] = depth;
+    profiler.length = at + 1 + depth;
+}
+
+void startProfiler(void) {
+    profiler = (Profiler){0};
+
+    profiler.path = getenv("NGS_PROFILE");
+    if (profiler.path == NULL || !*profiler.path) return;
+
+    int hz = PROFILE_DEFAULT_HZ;
+    char *env = getenv("NGS_PROFILE_HZ");
+    if (env != NULL && atoi(env) > 0) hz = atoi(env);
+
+    profiler.buffer = (int *)safe_malloc(sizeof(int) * PROFILE_BUFFER_SIZE);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = takeSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        fprintf(stderr, "profiler: could not install SIGPROF handler\n");
+        free(profiler.buffer);
+        return;
+    }
+
+    struct itimerval timer = {0};
+    timer.it_interval.tv_sec = hz == 1 ? 1 : 0;
+    timer.it_interval.tv_usec = hz == 1 ? 0 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    profiler.enabled = 1;
+}
+
+static int appendFrame(char *stack, int length, int pc) {
+    const char *name = "<script>";
+    for (int i = 0; i < vm->functionsLength; i++) {
+        if (pc >= vm->functions[i].ip && pc < vm->functions[i].end) name = vm->functions[i].name;
+    }
+    return length + sprintf(stack + length, "%s%.200s:%d", length ? ";" : "", name, lineForPc(&vm->lines, pc));
+}
+
+static int compareStacks(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+void stopProfiler(void) {
+    if (!profiler.enabled) return;
+    profiler.enabled = 0;
+
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    int samplesLength = 0;
+    for (int at = 0; at < profiler.length; at += profiler.buffer[at] + 1) {
+        samplesLength += 1;
+    }
+
+    char **stacks = (char **)safe_malloc(sizeof(char *) * (samplesLength + 1));
+    int i = 0;
+    for (int at = 0; at < profiler.length; at += profiler.buffer[at] + 1) {
+        int depth = profiler.buffer[at];
+        char *stack = (char *)safe_malloc((size_t)depth * 224 + 1);
+        int length = 0;
+        stack[0] = '\0';
+
+        for (int frame = depth; frame >= 1; frame--) {
+            length = appendFrame(stack, length, profiler.buffer[at + frame]);
+        }
+        stacks[i++] = stack;
+    }
+    qsort(stacks, samplesLength, sizeof(char *), compareStacks);
+
+    FILE *out = fopen(profiler.path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "could not open %s for writing\n", profiler.path);
+    } else {
+        for (int start = 0; start < samplesLength;) {
+            int end = start + 1;
+            while (end < samplesLength && !strcmp(stacks[start], stacks[end])) end++;
+
+            fprintf(out, "%s %d\n", stacks[start], end - start);
+            start = end;
+        }
+        fclose(out);
+    }
+
+    if (profiler.dropped) {
+        fprintf(stderr, "profiler: buffer full, dropped %d samples\n", (int)profiler.dropped);
+    }
+
+    for (int j = 0; j < samplesLength; j++) {
+        free(stacks[j]);
+    }
+    free(stacks);
+    free(profiler.buffer);
+}
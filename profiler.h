@@ -0,0 +1,18 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "vm.h"
+
+// SIGPROF sampling profiler. set NGS_PROFILE=out.folded to enable it, NGS_PROFILE_HZ to change the
+// rate. each sample is the call stack as script function and line, written as collapsed stacks
+// ("<script>:12;fib:3;fib:5 42") that flamegraph.pl and speedscope read directly. while native
+// code runs, the innermost line is the one where the JIT was entered
+
+#define PROFILE_DEFAULT_HZ 97
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_BUFFER_SIZE (1 << 20)
+
+void startProfiler(void);
+void stopProfiler(void);
+
+#endif
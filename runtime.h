@@ -0,0 +1,92 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+// support code for C emitted by --emit-c. the int fast paths mirror the int branches of
+// addBoxes()/subBoxes()/multBoxes()/compareBoxes() and report 0 whenever those would do
+// something else, in which case the generated code falls back to the library call
+
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+#include "array.h"
+#include "map.h"
+#include "builtins.h"
+#include "utils.h"
+
+#define INT_BITS 0x7FF8000000000000ULL
+
+static inline Box boxFromBits(uint64_t bits) {
+    Box box;
+    memcpy(&box, &bits, sizeof(box));
+    return box;
+}
+
+static inline Box intBox(int value) {
+    return boxFromBits(INT_BITS | (uint32_t)value);
+}
+
+static inline Box stringLiteral(const char *value, size_t length) {
+    char *str = (char *)safe_malloc(length + 1);
+    memcpy(str, value, length);
+    str[length] = '\0';
+
+    Object *obj = (Object *)safe_malloc(sizeof(Object));
+    *obj = (Object){.length = length + 1, .ref = str, .isLiteral = 1};
+
+    return createBox(obj, VAL_STRING);
+}
+
+static inline int intAdd(Box loperand, Box roperand, Box *result) {
+    if (TYPE(loperand) != VAL_INT || TYPE(roperand) != VAL_INT) return 0;
+
+    long long value = (long long)loperand.int32 + roperand.int32;
+    if (value != (int)value) return 0;
+
+    *result = intBox((int)value);
+    return 1;
+}
+
+static inline int intSub(Box loperand, Box roperand, Box *result) {
+    if (TYPE(loperand) != VAL_INT || TYPE(roperand) != VAL_INT) return 0;
+
+    int value = (int)((unsigned)loperand.int32 - (unsigned)roperand.int32);
+    if (value > loperand.int32) return 0;
+
+    *result = intBox(value);
+    return 1;
+}
+
+static inline int intMult(Box loperand, Box roperand, Box *result) {
+    if (TYPE(loperand) != VAL_INT || TYPE(roperand) != VAL_INT) return 0;
+    if (loperand.int32 < 0 && roperand.int32 < 0) return 0;
+
+    long long value = (long long)loperand.int32 * roperand.int32;
+    if (value != (int)value) return 0;
+
+    *result = intBox((int)value);
+    return 1;
+}
+
+static inline int intCompare(Box loperand, Box roperand, Condition condition, Box *result) {
+    if (TYPE(loperand) != VAL_INT || TYPE(roperand) != VAL_INT) return 0;
+
+    int l = loperand.int32;
+    int r = roperand.int32;
+
+    switch (condition) {
+    case CMP_GT: *result = intBox(l > r); break;
+    case CMP_LT: *result = intBox(l < r); break;
+    case CMP_GE: *result = intBox(l >= r); break;
+    case CMP_LE: *result = intBox(l <= r); break;
+    case CMP_EQ: *result = intBox(l == r); break;
+    case CMP_NE: *result = intBox(l != r); break;
+    }
+    return 1;
+}
+
+static inline void callFunction(int returnPc, void (*function)(void)) {
+    pushFrame(returnPc);
+    function();
+}
+
+#endif
@@ -4,12 +4,6 @@
 #include <string.h>
 #include "scanner.h"
 
-typedef struct {
-    char *start;
-    char *current;
-    int line;
-} Scanner;
-
 Scanner scanner;
 
 void scannerInitialize(char *file) {
@@ -122,8 +116,8 @@ Token nextToken(void) {
                 break;
             case '/':
                 if (*scanner.current == '/') {
-                    while (*scanner.current != '\n') scanner.current++;
-                    scanner.current++;
+                    // the newline is left to be counted
+                    while (*scanner.current != '\n' && *scanner.current != '\0') scanner.current++;
                 } else {
                     tok = constructToken(TOK_DIV);
                 }
@@ -140,6 +134,12 @@ Token nextToken(void) {
             case '}':
                 tok = constructToken(TOK_RSQUIRLY);
                 break;
+            case '[':
+                tok = constructToken(TOK_LBRACKET);
+                break;
+            case ']':
+                tok = constructToken(TOK_RBRACKET);
+                break;
             case '>':
                 if (*scanner.current == '=') {
                     tok = constructToken(TOK_GE);
@@ -161,6 +161,7 @@ Token nextToken(void) {
                     tok = constructToken(TOK_NE);
                     scanner.current += 1;
                 }
+                break;
             case '\n':
                 scanner.line++;
                 break;
@@ -185,6 +186,8 @@ char* stringifyToken(Token token) {
     case TOK_COMMA: return "TOK_COMMA";
     case TOK_LSQUIRLY: return "TOK_LSQUIRLY";
     case TOK_RSQUIRLY: return "TOK_RSQUIRLY";
+    case TOK_LBRACKET: return "TOK_LBRACKET";
+    case TOK_RBRACKET: return "TOK_RBRACKET";
     case TOK_EQ: return "TOK_EQ";
     case TOK_NE: return "TOK_NE";
     case TOK_GT: return "TOK_GT";
@@ -206,6 +209,7 @@ char* stringifyToken(Token token) {
     case TOK_EOF: return "TOK_EOF";
     case TOK_ERR: return "TOK_ERR";
     }
+    return "TOK_UNKNOWN";
 }
 
 void printToken(Token token) {
@@ -14,6 +14,8 @@ typedef enum {
     TOK_RPAREN,
     TOK_LSQUIRLY,
     TOK_RSQUIRLY,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
 
     // DELIMETERS
     TOK_SEMICOL,
@@ -47,6 +49,15 @@ typedef struct {
     int line;
 } Token;
 
+typedef struct {
+    char *start;
+    char *current;
+    int line;
+} Scanner;
+
+// saved and restored around compiling an imported module, see module.h
+extern Scanner scanner;
+
 Token nextToken(void);
 
 void scannerInitialize(char *file);
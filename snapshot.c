@@ -0,0 +1,463 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "array.h"
+#include "map.h"
+#include "cache.h"
+#include "coroutine.h"
+#include "utils.h"
+
+// a snapshot file is this header followed by the sections it points at, each 8 byte aligned.
+// boxes of strings, arrays and maps hold the offset of the object in the heap section instead of
+// its address, an object's ref the offset of its bytes
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t conditionBreaker;
+    // buildKey() of the ngs that wrote it, instruction encoding and native indices
+    uint64_t build;
+
+    int32_t programLength;
+    int32_t functionsLength;
+    int32_t pc;
+    int32_t sp;
+    int32_t csp;
+    int32_t linesLength;
+    uint64_t namesLength;
+    uint64_t heapLength;
+    uint64_t objectsLength;
+
+    // file offsets
+    uint64_t program;
+    uint64_t functions;
+    uint64_t names;
+    uint64_t lines;
+    uint64_t operandStack;
+    uint64_t callStack;
+    uint64_t heap;
+    uint64_t objects;
+} SnapshotHeader;
+
+typedef struct {
+    // into the names section
+    uint64_t name;
+    int32_t ip;
+    int32_t end;
+} SnapshotFunction;
+
+// where an object sits in the heap section, in the order they were written
+typedef struct {
+    uint64_t offset;
+    int32_t type;
+    int32_t reserved;
+} SnapshotObject;
+
+typedef struct {
+    void *object;
+    ValueType type;
+    uint64_t offset;
+} Placed;
+
+typedef struct {
+    Placed *placed;
+    int placedLength;
+    int placedCapacity;
+    // open addressing on the object's address, 1 + the index into placed, 0 for an empty slot
+    int *slots;
+    int slotsCapacity;
+    uint64_t heapLength;
+
+    FILE *file;
+    uint64_t at;
+} Writer;
+
+Writer writer;
+
+// the mapping restoreSnapshot() keeps for as long as its objects can be reached
+typedef struct {
+    const char *path;
+    char *base;
+    size_t length;
+    char *heap;
+    uint64_t heapLength;
+} Restored;
+
+Restored restored;
+
+static uint64_t align8(uint64_t bytes) {
+    return (bytes + 7) & ~(uint64_t)7;
+}
+
+static int isObject(ValueType type) {
+    return type == VAL_STRING || type == VAL_ARRAY || type == VAL_MAP;
+}
+
+// ===== WRITING =====
+
+static size_t slotFor(void *object) {
+    uint64_t address = (uint64_t)(uintptr_t)object >> 3;
+    return (size_t)(address * 0x9E3779B97F4A7C15ull >> 20) & (writer.slotsCapacity - 1);
+}
+
+static void growSlots(void) {
+    free(writer.slots);
+    writer.slotsCapacity *= 2;
+    writer.slots = (int *)safe_calloc(writer.slotsCapacity, sizeof(int));
+
+    for (int i = 0; i < writer.placedLength; i++) {
+        size_t slot = slotFor(writer.placed[i].object);
+        while (writer.slots[slot]) slot = (slot + 1) & (writer.slotsCapacity - 1);
+        writer.slots[slot] = i + 1;
+    }
+}
+
+static uint64_t objectBytes(void *object, ValueType type) {
+    switch (type) {
+    case VAL_STRING:
+        return sizeof(Object) + align8(((Object *)object)->length);
+    case VAL_ARRAY: {
+        Array *array = (Array *)object;
+        size_t element = array->kind == ARRAY_F64 ? sizeof(double) : sizeof(int32_t);
+        return sizeof(Array) + align8(element * (array->obj.length + 1));
+    }
+    default:
+        // the entries as key, value pairs, the table is rebuilt when restoring
+        return sizeof(Map) + 2 * sizeof(Box) * ((Map *)object)->obj.length;
+    }
+}
+
+// gives the object behind box and everything a map of it holds a place in the heap, returns the
+// box as it is written
+static Box place(Box box) {
+    ValueType type = TYPE(box);
+    if (!isObject(type)) return box;
+
+    void *object = (void *)(intptr_t)box.obj;
+    size_t slot = slotFor(object);
+    while (writer.slots[slot] && writer.placed[writer.slots[slot] - 1].object != object) {
+        slot = (slot + 1) & (writer.slotsCapacity - 1);
+    }
+
+    if (!writer.slots[slot]) {
+        if (writer.placedLength == writer.placedCapacity) {
+            writer.placedCapacity = writer.placedCapacity ? writer.placedCapacity * 2 : 64;
+            Placed *placed = (Placed *)safe_malloc(sizeof(Placed) * writer.placedCapacity);
+            if (writer.placedLength) memcpy(placed, writer.placed, sizeof(Placed) * writer.placedLength);
+            free(writer.placed);
+            writer.placed = placed;
+        }
+        writer.placed[writer.placedLength] = (Placed){.object = object, .type = type, .offset = writer.heapLength};
+        writer.slots[slot] = ++writer.placedLength;
+        writer.heapLength += objectBytes(object, type);
+        if (writer.placedLength * 2 > writer.slotsCapacity) growSlots();
+
+        if (type == VAL_MAP) {
+            Map *map = (Map *)object;
+            Entry *entries = (Entry *)map->obj.ref;
+            for (size_t i = 0; i < map->capacity; i++) {
+                if (!entries[i].distance) continue;
+                place(entries[i].key);
+                place(entries[i].value);
+            }
+        }
+        return place(box);
+    }
+
+    return createBox((void *)(intptr_t)writer.placed[writer.slots[slot] - 1].offset, type);
+}
+
+// appends bytes and the padding after them, returns the file offset they start at
+static uint64_t writeSection(const void *bytes, uint64_t length) {
+    static const char zeros[8] = {0};
+    uint64_t offset = writer.at;
+    if (length) fwrite(bytes, 1, length, writer.file);
+    fwrite(zeros, 1, align8(length) - length, writer.file);
+    writer.at += align8(length);
+    return offset;
+}
+
+static void writeObject(Placed *placed) {
+    uint64_t ref = placed->offset;
+    switch (placed->type) {
+    case VAL_STRING: {
+        Object copy = *(Object *)placed->object;
+        copy.ref = (void *)(intptr_t)(ref + sizeof(Object));
+        copy.isLiteral = 1;
+        copy.refs = 0;
+        writeSection(&copy, sizeof(Object));
+        writeSection(((Object *)placed->object)->ref, copy.length);
+        break;
+    }
+    case VAL_ARRAY: {
+        Array copy = *(Array *)placed->object;
+        size_t element = copy.kind == ARRAY_F64 ? sizeof(double) : sizeof(int32_t);
+        copy.obj.ref = (void *)(intptr_t)(ref + sizeof(Array));
+        copy.obj.isLiteral = 1;
+        copy.obj.refs = 0;
+        writeSection(&copy, sizeof(Array));
+        writeSection(((Array *)placed->object)->obj.ref, element * (copy.obj.length + 1));
+        break;
+    }
+    default: {
+        Map *map = (Map *)placed->object;
+        Map copy = {.obj = {.length = map->obj.length}};
+        writeSection(&copy, sizeof(Map));
+
+        Entry *entries = (Entry *)map->obj.ref;
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (!entries[i].distance) continue;
+            Box pair[2] = {place(entries[i].key), place(entries[i].value)};
+            writeSection(pair, sizeof(pair));
+        }
+        break;
+    }
+    }
+}
+
+void writeSnapshot(const char *path) {
+    if (vm->pc >= vm->programLength || vm->program[vm->pc].type != INST_CALL_NATIVE) {
+        runtimeError("snapshot() only works in interpreted programs");
+    }
+    if (vm->frame != -1) runtimeError("snapshot() has to be called at the top level");
+    if (liveCoroutines() > 1) runtimeError("snapshot() can't be taken while coroutines are live");
+
+    // written next to path and renamed over it, so a concurrent resume never reads half of it
+    char *temp = (char *)safe_malloc(strlen(path) + 32);
+    sprintf(temp, "%s.%d", path, (int)getpid());
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL) {
+        free(temp);
+        runtimeError("snapshot() could not open its file for writing");
+    }
+
+    writer = (Writer){.file = file, .slotsCapacity = 256};
+    writer.slots = (int *)safe_calloc(writer.slotsCapacity, sizeof(int));
+
+    // the program carries on after the call with its argument replaced by 1
+    int one = 1;
+    Box *operandStack = (Box *)safe_malloc(sizeof(Box) * (vm->sp + 1));
+    for (int i = 0; i < vm->sp; i++) {
+        operandStack[i] = place(vm->operandStack[i]);
+    }
+    operandStack[vm->sp] = createBox(&one, VAL_INT);
+
+    Box *callStack = (Box *)safe_malloc(sizeof(Box) * (vm->csp + 2));
+    for (int i = 0; i <= vm->csp; i++) {
+        callStack[i] = place(vm->callStack[i]);
+    }
+
+    Inst *program = (Inst *)safe_malloc(sizeof(Inst) * (vm->programLength + 1));
+    for (int pc = 0; pc < vm->programLength; pc++) {
+        program[pc] = (Inst){.type = vm->program[pc].type, .operand = place(vm->program[pc].operand)};
+    }
+
+    SnapshotFunction *functions = (SnapshotFunction *)safe_malloc(sizeof(SnapshotFunction) * (vm->functionsLength + 1));
+    uint64_t namesLength = 0;
+    for (int i = 0; i < vm->functionsLength; i++) {
+        namesLength += strlen(vm->functions[i].name) + 1;
+    }
+    char *names = (char *)safe_malloc(namesLength + 1);
+    namesLength = 0;
+    for (int i = 0; i < vm->functionsLength; i++) {
+        functions[i] = (SnapshotFunction){.name = namesLength, .ip = vm->functions[i].ip, .end = vm->functions[i].end};
+        strcpy(names + namesLength, vm->functions[i].name);
+        namesLength += strlen(vm->functions[i].name) + 1;
+    }
+
+    SnapshotHeader header = {
+        .version = SNAPSHOT_VERSION,
+        .conditionBreaker = vm->conditionBreaker,
+        .build = buildKey(),
+        .programLength = vm->programLength,
+        .functionsLength = vm->functionsLength,
+        .pc = vm->pc + 1,
+        .sp = vm->sp,
+        .csp = vm->csp,
+        .linesLength = vm->lines.length,
+        .namesLength = namesLength,
+        .heapLength = writer.heapLength,
+        .objectsLength = writer.placedLength,
+    };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+
+    writeSection(&header, sizeof(header));
+    header.program = writeSection(program, sizeof(Inst) * vm->programLength);
+    header.functions = writeSection(functions, sizeof(SnapshotFunction) * vm->functionsLength);
+    header.names = writeSection(names, namesLength);
+    header.lines = writeSection(vm->lines.bytes, vm->lines.length);
+    header.operandStack = writeSection(operandStack, sizeof(Box) * (vm->sp + 1));
+    header.callStack = writeSection(callStack, sizeof(Box) * (vm->csp + 1));
+
+    header.heap = writer.at;
+    for (int i = 0; i < writer.placedLength; i++) {
+        writeObject(&writer.placed[i]);
+    }
+
+    header.objects = writer.at;
+    for (int i = 0; i < writer.placedLength; i++) {
+        SnapshotObject object = {.offset = writer.placed[i].offset, .type = writer.placed[i].type};
+        writeSection(&object, sizeof(object));
+    }
+
+    fseek(writer.file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, writer.file);
+
+    int failed = ferror(writer.file);
+    if (fclose(writer.file) == 0 && !failed) {
+        rename(temp, path);
+    } else {
+        unlink(temp);
+    }
+
+    free(temp);
+    free(names);
+    free(functions);
+    free(program);
+    free(callStack);
+    free(operandStack);
+    free(writer.slots);
+    free(writer.placed);
+    writer = (Writer){0};
+
+    if (failed) runtimeError("snapshot() could not write its file");
+}
+
+// ===== RESTORING =====
+
+static void unusable(const char *path, const char *why) {
+    fprintf(stderr, "could not resume from %s: %s\n", path, why);
+    exit(1);
+}
+
+// whether count elements of size starting at offset lie inside the file
+static int fits(uint64_t offset, uint64_t count, size_t size) {
+    return offset <= restored.length && count <= (restored.length - offset) / size;
+}
+
+static Box relocate(Box box) {
+    ValueType type = TYPE(box);
+    if (!isObject(type)) return box;
+
+    // every object is at least as long as a Map
+    uint64_t offset = (uint64_t)box.obj;
+    if (offset + sizeof(Map) > restored.heapLength) unusable(restored.path, "it is truncated or corrupt");
+    void *object = restored.heap + offset;
+    // a map's ref points at the map it was rebuilt into, see restoreSnapshot()
+    if (type == VAL_MAP) object = ((Map *)object)->obj.ref;
+    return createBox(object, type);
+}
+
+void restoreSnapshot(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) unusable(path, "it can't be opened");
+
+    restored = (Restored){.path = path, .length = (size_t)info.st_size};
+    if (restored.length < sizeof(SnapshotHeader)) unusable(path, "it is too short");
+    // private, so fixing up the pointers never writes back to the file
+    restored.base = mmap(NULL, restored.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (restored.base == MAP_FAILED) unusable(path, "it can't be mapped");
+
+    SnapshotHeader *header = (SnapshotHeader *)restored.base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) || header->version != SNAPSHOT_VERSION) {
+        unusable(path, "it is not a snapshot");
+    }
+    if (header->build != buildKey()) unusable(path, "it was written by a different build of ngs");
+    if (header->programLength < 0 || header->functionsLength < 0 || header->linesLength < 0 ||
+        header->pc < 0 || header->pc > header->programLength || header->sp < -1 || header->csp < -1 ||
+        !fits(header->program, header->programLength, sizeof(Inst)) ||
+        !fits(header->functions, header->functionsLength, sizeof(SnapshotFunction)) ||
+        !fits(header->names, header->namesLength, 1) ||
+        !fits(header->lines, header->linesLength, 1) ||
+        !fits(header->operandStack, header->sp + 1, sizeof(Box)) ||
+        !fits(header->callStack, header->csp + 1, sizeof(Box)) ||
+        !fits(header->heap, header->heapLength, 1) ||
+        !fits(header->objects, header->objectsLength, sizeof(SnapshotObject)) ||
+        (header->namesLength && restored.base[header->names + header->namesLength - 1] != '\0')) {
+        unusable(path, "it is truncated or corrupt");
+    }
+    restored.heap = restored.base + header->heap;
+    restored.heapLength = header->heapLength;
+
+    SnapshotObject *objects = (SnapshotObject *)(restored.base + header->objects);
+    for (uint64_t i = 0; i < header->objectsLength; i++) {
+        if (!isObject(objects[i].type) || objects[i].offset + sizeof(Map) > restored.heapLength) {
+            unusable(path, "it is truncated or corrupt");
+        }
+        Object *object = (Object *)(restored.heap + objects[i].offset);
+        if (object->length > restored.heapLength ||
+            objects[i].offset + objectBytes(object, objects[i].type) > restored.heapLength) {
+            unusable(path, "it is truncated or corrupt");
+        }
+    }
+
+    // what freeVM() frees is copied out of the mapping, the objects stay in it
+    Inst *program = (Inst *)safe_malloc(sizeof(Inst) * (header->programLength + 1));
+    memcpy(program, restored.base + header->program, sizeof(Inst) * header->programLength);
+
+    Function *functions = (Function *)safe_malloc(sizeof(Function) * (header->functionsLength + 1));
+    SnapshotFunction *saved = (SnapshotFunction *)(restored.base + header->functions);
+    for (int i = 0; i < header->functionsLength; i++) {
+        if (saved[i].name >= header->namesLength) unusable(path, "it is truncated or corrupt");
+        const char *name = restored.base + header->names + saved[i].name;
+        functions[i] = (Function){.name = (char *)safe_malloc(strlen(name) + 1), .ip = saved[i].ip, .end = saved[i].end};
+        strcpy(functions[i].name, name);
+    }
+
+    LineTable lines = {.bytes = (uint8_t *)safe_malloc(header->linesLength + 1), .length = header->linesLength};
+    memcpy(lines.bytes, restored.base + header->lines, header->linesLength);
+
+    initVM(program, header->programLength, functions, header->functionsLength, lines);
+    if (header->sp >= vm->stackSize) unusable(path, "its operand stack is deeper than --stack-size");
+    if (header->csp >= vm->callStackSize) unusable(path, "its call stack is deeper than --callstack-size");
+
+    // allocs.h charges the rebuilt maps to where the program resumes
+    vm->pc = header->pc;
+
+    // strings and arrays are used where they are, maps get a new table and leave a pointer to it
+    // behind for relocate() until their entries are put back in
+    for (uint64_t i = 0; i < header->objectsLength; i++) {
+        Object *object = (Object *)(restored.heap + objects[i].offset);
+        switch (objects[i].type) {
+        case VAL_STRING:
+        case VAL_ARRAY:
+            object->ref = restored.heap + (uintptr_t)object->ref;
+            break;
+        default:
+            object->ref = newMap(object->length);
+            break;
+        }
+    }
+    for (uint64_t i = 0; i < header->objectsLength; i++) {
+        if (objects[i].type != VAL_MAP) continue;
+        Map *saved = (Map *)(restored.heap + objects[i].offset);
+        Box *pairs = (Box *)(saved + 1);
+        for (size_t entry = 0; entry < saved->obj.length; entry++) {
+            mapSet((Map *)saved->obj.ref, relocate(pairs[2 * entry]), relocate(pairs[2 * entry + 1]));
+        }
+    }
+
+    for (int pc = 0; pc < vm->programLength; pc++) {
+        vm->program[pc].operand = relocate(vm->program[pc].operand);
+    }
+    Box *operandStack = (Box *)(restored.base + header->operandStack);
+    for (int i = 0; i <= header->sp; i++) {
+        vm->operandStack[i] = relocate(operandStack[i]);
+    }
+    Box *callStack = (Box *)(restored.base + header->callStack);
+    for (int i = 0; i <= header->csp; i++) {
+        vm->callStack[i] = relocate(callStack[i]);
+    }
+
+    vm->sp = header->sp;
+    vm->csp = header->csp;
+    vm->conditionBreaker = header->conditionBreaker;
+}
@@ -0,0 +1,24 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "vm.h"
+
+// warm starts. snapshot(path) at the top level of a script writes the program, both stacks and
+// every string, array and map on them to path, and evaluates to 0. `main resume path` maps the
+// file back in, points the objects at where it landed and carries on after the call, where
+// snapshot() evaluates to 1 instead. strings and arrays stay in the mapping and, like string
+// constants, are never freed. maps are rebuilt on the heap since they grow. open files and
+// natives registered by a host are not part of a snapshot, and it only loads into the build of
+// ngs that wrote it
+
+#define SNAPSHOT_MAGIC "NGSSNAP"
+#define SNAPSHOT_VERSION 1
+
+// run by the snapshot() native with vm->pc on its INST_CALL_NATIVE. reports a runtime error if
+// the program is in a call or has coroutines, which a resumed one couldn't return to
+void writeSnapshot(const char *path);
+// does what compile() and initVM() do for a program that starts from the snapshot at path,
+// exits if it can't be read. the mapping stays until the process exits
+void restoreSnapshot(const char *path);
+
+#endif
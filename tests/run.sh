@@ -0,0 +1,71 @@
+#!/bin/sh
+# runs every tests/*.ngs, or the ones named, with the jit, the ir and the register instructions each
+# on and off, and with the cache cold and warm, and checks that they all print the same as the
+# plain interpreter and as name.out.
+# a first line "// args: ..." passes options to main, a run that leaves resume.snap behind is
+# resumed from it and what that prints is part of its output. make test builds main and runs it:
+#   ./tests/run.sh [path to main] [test...]
+main=$(cd "$(dirname "${1:-./main}")" && pwd)/$(basename "${1:-./main}")
+[ $# -gt 0 ] && shift
+dir=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+export ASAN_OPTIONS=detect_leaks=0
+export XDG_CACHE_HOME="$work/cache"
+
+# the first is the reference the others are compared with. the last two fill the cache and then
+# run from it
+configs="NGS_CACHE=0:NGS_JIT=0:NGS_IR=0:NGS_REGISTERS=0
+NGS_CACHE=0:NGS_JIT=0:NGS_IR=0
+NGS_CACHE=0:NGS_JIT=0
+NGS_CACHE=0:NGS_JIT_THRESHOLD=1:NGS_IR=0
+NGS_CACHE=0:NGS_JIT_THRESHOLD=1
+NGS_CACHE=0:NGS_JIT_THRESHOLD=1:NGS_REGISTERS=0
+NGS_CACHE=0
+default
+default"
+
+if [ $# -eq 0 ]; then
+    set -- $(ls "$dir"/*.ngs | sed 's|.*/||; s|\.ngs$||')
+fi
+
+# output and exit status of the test with the settings in $1, run from a copy of tests/ so the
+# files it leaves go away with it
+run() {
+    rm -f resume.snap
+    args=$(sed -n '1s|^// args: ||p' "$name.ngs")
+    env $(echo "$1" | tr ':' ' ' | sed 's/default//') "$main" $args "$name.ngs" 2>&1
+    echo "exit $?"
+    if [ -f resume.snap ]; then
+        env $(echo "$1" | tr ':' ' ' | sed 's/default//') "$main" resume resume.snap 2>&1
+        echo "exit $?"
+    fi
+}
+
+cp -R "$dir"/. "$work"
+cd "$work" || exit 1
+
+failed=0
+for name in "$@"; do
+    expected=$(cat "$name.out" 2>/dev/null)
+    reference=""
+    status=ok
+    for config in $configs; do
+        output=$(run "$config")
+        if [ -z "$reference" ]; then
+            reference=$output
+            if [ "$output" != "$expected" ]; then
+                status="differs from $name.out"
+                echo "$output" > "$name.actual"
+                diff "$name.out" "$name.actual" | head -20 >&2
+            fi
+        elif [ "$output" != "$reference" ]; then
+            status="differs with $config"
+            break
+        fi
+    done
+    echo "$name: $status"
+    [ "$status" = ok ] || failed=1
+done
+
+cd / && rm -rf "$work"
+exit $failed
@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include "utils.h"
 
+unsigned long long allocations;
+
 void* safe_malloc(size_t size) {
+    allocations += 1;
     void *memory = malloc(size);
     if (memory == NULL) {
         fprintf(stderr, "ERROR: Cannot allocate more memory");
@@ -11,6 +14,7 @@ void* safe_malloc(size_t size) {
 }
 
 void* safe_calloc(size_t count, size_t size) {
+    allocations += 1;
     void *memory = calloc(count, size);
     if (memory == NULL) {
         fprintf(stderr, "ERROR: Cannot allocate more memory");
@@ -18,3 +22,12 @@ void* safe_calloc(size_t count, size_t size) {
     }
     return memory;
 }
+
+void* safe_realloc(void *memory, size_t size) {
+    memory = realloc(memory, size);
+    if (memory == NULL && size > 0) {
+        fprintf(stderr, "ERROR: Cannot allocate more memory");
+        exit(1);
+    }
+    return memory;
+}
@@ -3,7 +3,12 @@
 
 #include <stdlib.h>
 
+// blocks safe_malloc() and safe_calloc() have handed out
+extern unsigned long long allocations;
+
 void* safe_malloc(size_t size);
 void* safe_calloc(size_t count, size_t size);
+// resizes don't count as allocations
+void* safe_realloc(void *memory, size_t size);
 
 #endif
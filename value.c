@@ -14,6 +14,8 @@ inline Box createBox(void *value, ValueType type) {
         ((uint8_t *)(&box))[6] = 0xF8 | type;
         break;
     case VAL_STRING:
+    case VAL_ARRAY:
+    case VAL_MAP:
         box.obj = (uint64_t)value;
         ((uint8_t *)(&box))[6] = 0xF8 | type;
         break;
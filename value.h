@@ -2,12 +2,20 @@
 #define VALUE_H
 
 #include <math.h>
+#include <stdint.h>
 
 #define TYPE(box) (!isnan(box.float64) ? VAL_FLOAT : ((uint8_t *)&box)[6] & 0x7)
 
 typedef struct {
     size_t length;
     void *ref;
+    // string constants and whatever a snapshot restored (see snapshot.h) belong to the program
+    // and are never freed at runtime
+    int isLiteral;
+    // number of map entries holding this object as key or value, it is not freed while nonzero
+    int refs;
+    // hash of a string's bytes once it has been used as a map key, 0 until then
+    uint32_t hash;
 } Object;
 
 typedef union {
@@ -20,6 +28,10 @@ typedef enum {
     VAL_INT,
     VAL_FLOAT,
     VAL_STRING,
+    // numeric arrays, see array.h
+    VAL_ARRAY,
+    // hash maps, see map.h
+    VAL_MAP,
 } ValueType;
 
 Box createBox(void *value, ValueType type);
@@ -1,364 +1,982 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "vm.h"
+#include "array.h"
+#include "map.h"
+#include "builtins.h"
+#include "coroutine.h"
+#include "io.h"
 #include "utils.h"
+#include "jit.h"
+#include "counters.h"
+#include "profiler.h"
+#include "perf.h"
+#include "allocs.h"
 
-#define STACK_PUSH(value) vm->sp += 1;                      \
-                          vm->operandStack[vm->sp] = value; \
+VM *vm;
+jmp_buf *errorTrap;
 
-#define STACK_POP(value)  value = vm->operandStack[vm->sp]; \
-                          vm->sp -= 1;                      \
+// with a deadline the clock is read once per slice of fuel
+#define BUDGET_SLICE (1 << 16)
 
-#define CALLSTACK_PUSH(value) vm->csp += 1;                   \
-                              vm->callStack[vm->csp] = value; \
+typedef struct {
+    // fuel not handed out to vm->fuel yet, -1 without a limit
+    long long remaining;
+    int hasDeadline;
+    struct timespec deadline;
 
-VM *vm;
+    // fuel used up by the slices before the current one, and the size of that one
+    long long spent;
+    long long slice;
+} Budget;
+
+Budget budget;
+
+static void refillBudget(void) {
+    budget.spent += budget.slice - vm->fuel;
+
+    long long slice = budget.hasDeadline ? BUDGET_SLICE : LLONG_MAX / 2;
+    if (budget.remaining >= 0) {
+        if (budget.remaining < slice) slice = budget.remaining;
+        budget.remaining -= slice;
+    }
+    budget.slice = slice;
+    vm->fuel = slice;
+}
+
+long long fuelSpent(void) {
+    return budget.spent + budget.slice - vm->fuel;
+}
+
+// a stack with one guard page below and one above the usable slots, followed by the segments of
+// coroutine stacks, each behind a guard page of its own
+typedef struct {
+    uint8_t *base;
+    size_t length;
+    size_t page;
+    uintptr_t usableStart;
+    uintptr_t usableEnd;
+    size_t segmentUsable;
+    const char *overflow;
+} StackMapping;
+
+typedef struct {
+    int operandSlots;
+    int callSlots;
+
+    StackMapping operand;
+    StackMapping call;
+    // segments whose pages are usable, they are handed out in order
+    int segmentsMapped;
+
+    // the handler may run on an overflowed C stack too
+    void *signalStack;
+} Stacks;
+
+Stacks stacks;
+
+void setStackSizes(int operandSlots, int callSlots) {
+    stacks.operandSlots = operandSlots;
+    stacks.callSlots = callSlots;
+}
+
+static int stackSize(int configured, const char *env, int fallback) {
+    if (configured > 0) return configured;
+
+    char *value = getenv(env);
+    if (value != NULL && atoi(value) > 0) return atoi(value);
+    return fallback;
+}
+
+static size_t roundToPage(size_t bytes, size_t page) {
+    return (bytes + page - 1) / page * page;
+}
+
+static Box *mapStack(StackMapping *mapping, int slots, const char *overflow) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t usable = roundToPage((size_t)slots * sizeof(Box), page);
+
+    // a coroutine's segment has as many slots as the stack itself, as long as every slot of the
+    // mapping keeps an int index
+    size_t slotsLeft = (size_t)INT_MAX - usable / sizeof(Box);
+    size_t segmentSlots = slotsLeft / COROUTINES_MAX - 2 * page / sizeof(Box);
+    if ((size_t)slots < segmentSlots) segmentSlots = slots;
+
+    mapping->page = page;
+    mapping->segmentUsable = roundToPage(segmentSlots * sizeof(Box), page);
+    mapping->length = usable + 2 * page + COROUTINES_MAX * (page + mapping->segmentUsable);
+    mapping->base = mmap(NULL, mapping->length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping->base == MAP_FAILED || mprotect(mapping->base + page, usable, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "could not map a stack of %d slots\n", slots);
+        exit(1);
+    }
+
+    mapping->usableStart = (uintptr_t)(mapping->base + page);
+    mapping->usableEnd = mapping->usableStart + usable;
+    mapping->overflow = overflow;
+
+    // the usable part ends right at the upper guard page
+    return (Box *)(mapping->usableEnd - (size_t)slots * sizeof(Box));
+}
+
+static uintptr_t segmentStart(StackMapping *mapping, int segment) {
+    return mapping->usableEnd + mapping->page + (size_t)segment * (mapping->page + mapping->segmentUsable);
+}
+
+void mapSegment(int segment, int *stackBase, int *callStackBase) {
+    if (segment >= stacks.segmentsMapped) {
+        if (mprotect((void *)segmentStart(&stacks.operand, segment), stacks.operand.segmentUsable, PROT_READ | PROT_WRITE) != 0 ||
+            mprotect((void *)segmentStart(&stacks.call, segment), stacks.call.segmentUsable, PROT_READ | PROT_WRITE) != 0) {
+            runtimeError("could not map a coroutine stack");
+        }
+        stacks.segmentsMapped = segment + 1;
+    }
+
+    *stackBase = (int)((segmentStart(&stacks.operand, segment) - (uintptr_t)vm->operandStack) / sizeof(Box));
+    *callStackBase = (int)((segmentStart(&stacks.call, segment) - (uintptr_t)vm->callStack) / sizeof(Box));
+}
+
+static int inGuard(StackMapping *mapping, uintptr_t address) {
+    uintptr_t start = (uintptr_t)mapping->base;
+    uintptr_t end = start + mapping->length;
+    if (mapping->base == NULL || address < start || address >= end) return 0;
+
+    if (address < mapping->usableEnd) return address < mapping->usableStart;
+    return (address - mapping->usableEnd) % (mapping->page + mapping->segmentUsable) < mapping->page;
+}
+
+static size_t appendText(char *buffer, size_t at, const char *text) {
+    while (*text) buffer[at++] = *text++;
+    return at;
+}
+
+static void onSegfault(int signal, siginfo_t *info, void *context) {
+    (void)context;
 
-void initVM(Inst *program, size_t length) {
+    uintptr_t address = (uintptr_t)info->si_addr;
+    StackMapping *mapping = NULL;
+    if (inGuard(&stacks.operand, address)) mapping = &stacks.operand;
+    if (inGuard(&stacks.call, address)) mapping = &stacks.call;
+
+    if (mapping == NULL) {
+        // not ours, crash as usual once the handler returns
+        struct sigaction action = {0};
+        action.sa_handler = SIG_DFL;
+        sigaction(signal, &action, NULL);
+        return;
+    }
+
+    // async-signal-safe formatting of "line N: runtime error: ..."
+    char message[160];
+    size_t length = 0;
+    int line = lineForPc(&vm->lines, vm->pc);
+    if (line > 0) {
+        char digits[12];
+        int count = 0;
+        for (; line > 0; line /= 10) digits[count++] = (char)('0' + line % 10);
+
+        length = appendText(message, length, "line ");
+        while (count > 0) message[length++] = digits[--count];
+        length = appendText(message, length, ": ");
+    }
+    length = appendText(message, length, "runtime error: ");
+    length = appendText(message, length, mapping->overflow);
+    message[length++] = '\n';
+
+    ssize_t written = write(STDERR_FILENO, message, length);
+    (void)written;
+    _exit(1);
+}
+
+static void initStacks(void) {
+    vm->stackSize = stackSize(stacks.operandSlots, "NGS_STACK_SIZE", MEM_SIZE);
+    vm->callStackSize = stackSize(stacks.callSlots, "NGS_CALLSTACK_SIZE", CALLSTACK_MAX_SIZE);
+
+    vm->operandStack = mapStack(&stacks.operand, vm->stackSize, "Maximum operand stack size exceeded");
+    vm->callStack = mapStack(&stacks.call, vm->callStackSize, "Maximum callstack size exceeded");
+
+    if (stacks.signalStack == NULL) {
+        stacks.signalStack = safe_malloc(SIGSTKSZ);
+
+        stack_t signalStack = {.ss_sp = stacks.signalStack, .ss_size = SIGSTKSZ};
+        sigaltstack(&signalStack, NULL);
+
+        struct sigaction action = {0};
+        action.sa_sigaction = onSegfault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, NULL);
+    }
+}
+
+// slots from the bottom of the stack to the end of the highest page of it a run has written to,
+// which are the only ones the kernel backs
+static int touchedSlots(StackMapping *mapping, Box *stack) {
+    size_t pages = (mapping->usableEnd - mapping->usableStart) / mapping->page;
+    unsigned char *resident = (unsigned char *)safe_malloc(pages + 1);
+    int slots = 0;
+
+    if (mincore((void *)mapping->usableStart, pages * mapping->page, resident) == 0) {
+        for (size_t i = pages; i > 0; i--) {
+            if (!(resident[i - 1] & 1)) continue;
+            uintptr_t end = mapping->usableStart + i * mapping->page;
+            slots = (int)((end - (uintptr_t)stack) / sizeof(Box));
+            break;
+        }
+    }
+
+    free(resident);
+    return slots;
+}
+
+void stackPeaks(int *operandSlots, int *callSlots) {
+    *operandSlots = touchedSlots(&stacks.operand, vm->operandStack);
+    *callSlots = touchedSlots(&stacks.call, vm->callStack);
+}
+
+static void freeStacks(void) {
+    munmap(stacks.operand.base, stacks.operand.length);
+    munmap(stacks.call.base, stacks.call.length);
+    stacks.operand = (StackMapping){0};
+    stacks.call = (StackMapping){0};
+    stacks.segmentsMapped = 0;
+}
+
+void initVM(Inst *program, size_t length, Function *functions, int functionsLength, LineTable lines) {
     vm = safe_calloc(1, sizeof(VM));
+    initStacks();
     vm->csp = -1;
+    vm->frame = -1;
     vm->sp = -1;
     vm->programLength = length;
     vm->program = program;
+    vm->functions = functions;
+    vm->functionsLength = functionsLength;
+    vm->lines = lines;
+
+    budget = (Budget){.remaining = -1};
+    refillBudget();
+
+    initCoroutines();
+    initJIT();
+#ifdef NGS_COUNTERS
+    initCounters();
+#endif
 }
 
 void freeVM(void) {
+    freeIo();
+    freeCoroutines();
+    freeJIT();
+#ifdef NGS_COUNTERS
+    freeCounters();
+#endif
+
+    for (int i = 0; i < vm->functionsLength; i++) {
+        free(vm->functions[i].name);
+    }
+    free(vm->functions);
+    freeLines(&vm->lines);
     free(vm->program);
+    freeStacks();
     free(vm);
 }
 
-void cleanup_object(Box box) {
-    for (int i = vm->sp; i >= 0; i--) {
-        if (vm->operandStack[i].obj == box.obj) return;
+static void stopAt(int status, const char *kind, const char *message) {
+    int line = lineForPc(&vm->lines, vm->pc);
+    if (line > 0) {
+        fprintf(stderr, "line %d: %s: %s\n", line, kind, message);
+    } else {
+        fprintf(stderr, "%s: %s\n", kind, message);
     }
-    
-    switch (TYPE(box)) {
-    case VAL_STRING:
-        free((char *)(((Object *)box.obj)->ref));
-        free((Object *)box.obj);
+    if (errorTrap != NULL) longjmp(*errorTrap, status);
+    exit(status);
+}
+
+void runtimeError(const char *message) {
+    stopAt(1, "runtime error", message);
+}
+
+void setBudget(long long fuel, long long deadlineMs) {
+    budget = (Budget){.remaining = fuel > 0 ? fuel : -1, .spent = budget.spent, .slice = budget.slice};
+
+    if (deadlineMs > 0) {
+        budget.hasDeadline = 1;
+        clock_gettime(CLOCK_MONOTONIC, &budget.deadline);
+        budget.deadline.tv_sec += deadlineMs / 1000;
+        budget.deadline.tv_nsec += (deadlineMs % 1000) * 1000000;
+        if (budget.deadline.tv_nsec >= 1000000000) {
+            budget.deadline.tv_sec += 1;
+            budget.deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    refillBudget();
+}
+
+void checkBudget(void) {
+    if (vm->fuel >= 0) return;
+
+    if (budget.remaining >= 0) {
+        // give back what is left of the slice, or take the overdraft
+        budget.remaining += vm->fuel;
+        if (budget.remaining < 0) stopAt(EXIT_OUT_OF_FUEL, "execution stopped", "out of fuel");
     }
+
+    if (budget.hasDeadline) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > budget.deadline.tv_sec ||
+            (now.tv_sec == budget.deadline.tv_sec && now.tv_nsec >= budget.deadline.tv_nsec)) {
+            stopAt(EXIT_DEADLINE, "execution stopped", "deadline exceeded");
+        }
+    }
+
+    refillBudget();
 }
 
-void executeProgram(void) {
-    while (vm->pc < vm->programLength) {
-        InstType opcode = vm->program[vm->pc].type;
-        Box operand = vm->program[vm->pc].operand;
+static int isCollection(ValueType type) {
+    return type == VAL_ARRAY || type == VAL_MAP;
+}
 
-        switch (opcode) {
-        case INST_STACK_PUSH:
-            STACK_PUSH(operand);
-            break;
-        case INST_ADD: {
-            STACK_POP(Box roperand);
-            STACK_POP(Box loperand);
-
-            ValueType ltype = TYPE(loperand);
-            ValueType rtype = TYPE(roperand);
-
-            if (!(ltype ^ rtype)) {
-                switch (ltype) {
-                case VAL_INT: {
-                    int lv = loperand.int32;
-                    int rv = roperand.int32;
-                    int result = lv + rv;
-
-                    if ((lv < 0 && rv < 0 && result >= 0) || (lv > 0 && rv > 0 && result <= 0)) {
-                        double promotion = (double)lv + (double)rv;
-                        STACK_PUSH(createBox(&promotion, VAL_FLOAT));
-                    } else {
-                        STACK_PUSH(createBox(&result, VAL_INT));
-                    }
-                    break;
-                }
-                case VAL_STRING: {
-                    Object *lobj = (Object *)loperand.obj;
-                    Object *robj = (Object *)roperand.obj;
-                    size_t newLength = lobj->length - 1 + robj->length - 1;
+void cleanup_object(Box box) {
+    ValueType type = TYPE(box);
+    if (type != VAL_STRING && !isCollection(type)) return;
+    if (((Object *)(intptr_t)box.obj)->refs) return;
+    if (((Object *)(intptr_t)box.obj)->isLiteral) return;
 
-                    char *concat = safe_malloc(newLength + 1);               
-                    memcpy(concat, (char *)lobj->ref, lobj->length - 1);
-                    memcpy(concat + lobj->length - 1, (char *)robj->ref, robj->length);
+    if (stacksHold(box)) return;
 
-                    Object *obj = safe_malloc(sizeof(Object));
-                    obj->length = newLength;
-                    obj->ref = concat;
+    switch (type) {
+    case VAL_STRING:
+        TRACK_FREE((Object *)(intptr_t)box.obj);
+        free((char *)(((Object *)(intptr_t)box.obj)->ref));
+        free((Object *)(intptr_t)box.obj);
+        break;
+    case VAL_ARRAY:
+        freeArray((Array *)(intptr_t)box.obj);
+        break;
+    case VAL_MAP:
+        freeMap((Map *)(intptr_t)box.obj);
+        break;
+    default:
+        break;
+    }
+}
 
-                    cleanup_object(loperand);
-                    cleanup_object(roperand);
+void sweepStack(int count) {
+    for (int i = 0; i < count; i++) {
+        STACK_POP(Box box);
+        cleanup_object(box);
+    }
+}
 
-                    STACK_PUSH(createBox(obj, VAL_STRING));
-                    break;
-                }
-                case VAL_FLOAT: {
-                    double result = loperand.float64 + roperand.float64;
-                    STACK_PUSH(createBox(&result, VAL_FLOAT));
-                }
-                }
-                break;
-            }
+void assignVar(int slot, Box value) {
+    Box previous = vm->operandStack[slot];
+    vm->operandStack[slot] = value;
+    if (isCollection(TYPE(previous))) cleanup_object(previous);
+}
 
-            if (ltype == VAL_STRING || rtype == VAL_STRING) {
-                fprintf(stderr, "runtime error: illegal operation between (X) and (X)\n");
-                exit(1);
-            }
+void indexGet(void) {
+    STACK_POP(Box index);
+    STACK_POP(Box container);
 
-            double lv = loperand.float64;
-            double rv = roperand.float64;
+    if (TYPE(container) == VAL_MAP) {
+        STACK_PUSH(mapGet((Map *)(intptr_t)container.obj, index));
+        cleanup_object(index);
+    } else {
+        STACK_PUSH(arrayGet(container, index));
+    }
+    cleanup_object(container);
+}
 
-            if (ltype == VAL_INT) {
-                lv = (double)loperand.int32;
-            } else if (rtype == VAL_INT) {
-                rv = (double)roperand.int32;
-            }
+void indexSet(void) {
+    STACK_POP(Box value);
+    STACK_POP(Box index);
+    STACK_POP(Box container);
 
-            double result = lv + rv;
-            STACK_PUSH(createBox(&result, VAL_FLOAT));
-            break;
-        }
-        case INST_SUB: {
-            STACK_POP(Box roperand);
-            STACK_POP(Box loperand);
-
-            if (TYPE(loperand) == VAL_INT && TYPE(roperand) == VAL_INT) {
-                int lv = loperand.int32;
-                int rv = roperand.int32;
-                int result = lv - rv;
-
-                if (result > lv) {
-                    double promotion = (double)lv - (double)rv;
-                    STACK_PUSH(createBox(&promotion, VAL_FLOAT));
-                } else {
-                    STACK_PUSH(createBox(&result, VAL_INT));
-                }
-            } else {
-                double lv = loperand.float64;
-                double rv = roperand.float64;
-
-                if (TYPE(loperand) == VAL_INT) {
-                    lv = (double)loperand.int32;
-                } else if (TYPE(roperand) == VAL_INT) {
-                    rv = (double)roperand.int32;
-                }
+    if (TYPE(container) == VAL_MAP) {
+        mapSet((Map *)(intptr_t)container.obj, index, value);
+        cleanup_object(index);
+    } else {
+        arraySet(container, index, value);
+    }
+    cleanup_object(container);
+}
 
-                double result = lv - rv;
-                STACK_PUSH(createBox(&result, VAL_FLOAT));
-            }
-            break;
-        }
-        case INST_MULT: {
-            STACK_POP(Box roperand);
-            STACK_POP(Box loperand);
-
-            if (TYPE(loperand) == VAL_INT && TYPE(roperand) == VAL_INT) {
-                int lv = loperand.int32;
-                int rv = roperand.int32;
-                int result = lv * rv;
-
-                if ((lv < 0 && rv < 0 && result >= 0) || (lv > 0 && rv > 0 && result <= 0)) {
-                    double promotion = (double)lv * (double)rv;
-                    STACK_PUSH(createBox(&promotion, VAL_FLOAT));
-                } else {
-                    STACK_PUSH(createBox(&result, VAL_INT));
-                }
-            } else {
-                double lv = loperand.float64;
-                double rv = roperand.float64;
-
-                if (TYPE(loperand) == VAL_INT) {
-                    lv = (double)loperand.int32;
-                } else if (TYPE(roperand) == VAL_INT) {
-                    rv = (double)roperand.int32;
-                }
+Box addBoxes(Box loperand, Box roperand) {
+    ValueType ltype = TYPE(loperand);
+    ValueType rtype = TYPE(roperand);
 
-                double result = lv * rv;
-                STACK_PUSH(createBox(&result, VAL_FLOAT));
-            }
-            break;
-        }
-        case INST_DIV: {
-            STACK_POP(Box roperand);
-            STACK_POP(Box loperand);
-
-            if (TYPE(loperand) == VAL_INT && TYPE(roperand) == VAL_INT) {
-                int result = loperand.int32 / roperand.int32;
-                STACK_PUSH(createBox(&result, VAL_INT));
-            } else {
-                double lv = loperand.float64;
-                double rv = roperand.float64;
-
-                if (TYPE(loperand) == VAL_INT) {
-                    lv = (double)loperand.int32;
-                } else if (TYPE(roperand) == VAL_INT) {
-                    rv = (double)roperand.int32;
-                }
+    if (isCollection(ltype) || isCollection(rtype)) return arrayArith(INST_ADD, loperand, roperand);
 
-                double result = lv / rv;
-                STACK_PUSH(createBox(&result, VAL_FLOAT));
-            }
-            break;
-        }
-        case INST_LOGICAL_NOT: {
-            int result;
+    if (!(ltype ^ rtype)) {
+        switch (ltype) {
+        case VAL_INT: {
+            int lv = loperand.int32;
+            int rv = roperand.int32;
+            // wrap through unsigned, signed overflow is undefined and the check below would be optimized out
+            int result = (int)((unsigned)lv + (unsigned)rv);
 
-            STACK_POP(Box value);
-            switch (TYPE(value)) {
-            case VAL_INT: {
-                result = !value.int32;
-                break;
-            }
-            case VAL_FLOAT: {
-                result = !value.float64;
-                break;
-            }
+            if ((lv < 0 && rv < 0 && result >= 0) || (lv > 0 && rv > 0 && result <= 0)) {
+                double promotion = (double)lv + (double)rv;
+                return createBox(&promotion, VAL_FLOAT);
             }
-            STACK_PUSH(createBox(&result, VAL_INT));
-            break;
+            return createBox(&result, VAL_INT);
         }
-        case INST_CMP: {
-            int result;
-
-            STACK_POP(Box roperand);
-            STACK_POP(Box loperand);
-
-            if (TYPE(roperand) == VAL_INT && TYPE(loperand) == VAL_INT) {
-                    switch(operand.int32) {
-                    case CMP_EQ:
-                        result = loperand.int32 == roperand.int32;
-                        break;
-                    case CMP_NE:
-                        result = loperand.int32 != roperand.int32;
-                        break;
-                    case CMP_GE:
-                        result = loperand.int32 >= roperand.int32;
-                        break;
-                    case CMP_GT:
-                        result = loperand.int32 > roperand.int32;
-                        break;
-                    case CMP_LE:
-                        result = loperand.int32 <= roperand.int32;
-                        break;
-                    case CMP_LT:
-                        result = loperand.int32 < roperand.int32;
-                        break;
-                    }
-            } else {
-                float lv = loperand.float64;
-                float rv = roperand.float64;
-
-                if (TYPE(loperand) == VAL_INT) {
-                    lv = (double)loperand.int32;
-                } else if (TYPE(roperand) == VAL_INT) {
-                    rv = (double)roperand.int32;
-                }
+        case VAL_STRING: {
+            Object *lobj = (Object *)(intptr_t)loperand.obj;
+            Object *robj = (Object *)(intptr_t)roperand.obj;
+            size_t newLength = lobj->length - 1 + robj->length - 1;
 
-                switch(operand.int32) {
-                case CMP_EQ:
-                    result = lv == rv;
-                    break;
-                case CMP_NE:
-                    result = lv != rv;
-                    break;
-                case CMP_GE:
-                    result = lv >= rv;
-                    break;
-                case CMP_GT:
-                    result = lv > rv;
-                    break;
-                case CMP_LE:
-                    result = lv <= rv;
-                    break;
-                case CMP_LT:
-                    result = lv < rv;
-                    break;
-                }
-            }
-            STACK_PUSH(createBox(&result, VAL_INT));
+            char *concat = safe_malloc(newLength + 1);               
+            memcpy(concat, (char *)lobj->ref, lobj->length - 1);
+            memcpy(concat + lobj->length - 1, (char *)robj->ref, robj->length);
+
+            Object *obj = safe_malloc(sizeof(Object));
+            *obj = (Object){.length = newLength + 1, .ref = concat};
+            TRACK_ALLOC(obj, sizeof(Object) + newLength + 1, OBJECT_STRING);
+
+            cleanup_object(loperand);
+            cleanup_object(roperand);
+
+            return createBox(obj, VAL_STRING);
+        }
+        case VAL_FLOAT: {
+            double result = loperand.float64 + roperand.float64;
+            return createBox(&result, VAL_FLOAT);
+        }
+        case VAL_ARRAY:
+        case VAL_MAP:
             break;
         }
-        case INST_CALL: {
-            int nextInstruction = vm->pc + 1;
+    }
+
+    if (ltype == VAL_STRING || rtype == VAL_STRING) {
+        runtimeError("illegal operation between (X) and (X)");
+    }
+
+    double lv = loperand.float64;
+    double rv = roperand.float64;
 
-            CALLSTACK_PUSH(createBox(&nextInstruction, VAL_INT));
-            CALLSTACK_PUSH(createBox(&vm->sp, VAL_INT));
+    if (ltype == VAL_INT) {
+        lv = (double)loperand.int32;
+    } else if (rtype == VAL_INT) {
+        rv = (double)roperand.int32;
+    }
+
+    double result = lv + rv;
+    return createBox(&result, VAL_FLOAT);
+}
+
+Box subBoxes(Box loperand, Box roperand) {
+    if (isCollection(TYPE(loperand)) || isCollection(TYPE(roperand))) return arrayArith(INST_SUB, loperand, roperand);
+
+    if (TYPE(loperand) == VAL_INT && TYPE(roperand) == VAL_INT) {
+        int lv = loperand.int32;
+        int rv = roperand.int32;
+        int result = (int)((unsigned)lv - (unsigned)rv);
 
-            vm->pc = operand.int32;
-            continue;
+        if (result > lv) {
+            double promotion = (double)lv - (double)rv;
+            return createBox(&promotion, VAL_FLOAT);
         }
-        case INST_RET: {
-            STACK_POP(Box returnedValue);
+        return createBox(&result, VAL_INT);
+    }
+
+    double lv = loperand.float64;
+    double rv = roperand.float64;
 
-            vm->sp = vm->callStack[vm->csp].int32;
-            vm->csp -= 1;
-            vm->pc = vm->callStack[vm->csp].int32;
-            vm->csp -= 1;
+    if (TYPE(loperand) == VAL_INT) {
+        lv = (double)loperand.int32;
+    } else if (TYPE(roperand) == VAL_INT) {
+        rv = (double)roperand.int32;
+    }
+
+    double result = lv - rv;
+    return createBox(&result, VAL_FLOAT);
+}
 
-            int numberOfArgs = vm->callStack[vm->csp].int32;
-            vm->csp -= 1;
-            vm->csp -= numberOfArgs;
+Box multBoxes(Box loperand, Box roperand) {
+    if (isCollection(TYPE(loperand)) || isCollection(TYPE(roperand))) return arrayArith(INST_MULT, loperand, roperand);
 
-            STACK_PUSH(returnedValue);
-            continue;
+    if (TYPE(loperand) == VAL_INT && TYPE(roperand) == VAL_INT) {
+        int lv = loperand.int32;
+        int rv = roperand.int32;
+        int result = (int)((unsigned)lv * (unsigned)rv);
+
+        if ((lv < 0 && rv < 0 && result >= 0) || (lv > 0 && rv > 0 && result <= 0)) {
+            double promotion = (double)lv * (double)rv;
+            return createBox(&promotion, VAL_FLOAT);
         }
-        case INST_JMP:
-            vm->pc += operand.int32;
-            continue;
-        case INST_PUSH_ARG:
-            vm->csp += 1;
-            STACK_POP(vm->callStack[vm->csp]);
+        return createBox(&result, VAL_INT);
+    }
+
+    double lv = loperand.float64;
+    double rv = roperand.float64;
+
+    if (TYPE(loperand) == VAL_INT) {
+        lv = (double)loperand.int32;
+    } else if (TYPE(roperand) == VAL_INT) {
+        rv = (double)roperand.int32;
+    }
+
+    double result = lv * rv;
+    return createBox(&result, VAL_FLOAT);
+}
+
+Box divBoxes(Box loperand, Box roperand) {
+    if (isCollection(TYPE(loperand)) || isCollection(TYPE(roperand))) return arrayArith(INST_DIV, loperand, roperand);
+
+    if (TYPE(loperand) == VAL_INT && TYPE(roperand) == VAL_INT) {
+        int result = loperand.int32 / roperand.int32;
+        return createBox(&result, VAL_INT);
+    }
+
+    double lv = loperand.float64;
+    double rv = roperand.float64;
+
+    if (TYPE(loperand) == VAL_INT) {
+        lv = (double)loperand.int32;
+    } else if (TYPE(roperand) == VAL_INT) {
+        rv = (double)roperand.int32;
+    }
+
+    double result = lv / rv;
+    return createBox(&result, VAL_FLOAT);
+}
+
+Box notBox(Box value) {
+    int result = 0;
+
+    switch (TYPE(value)) {
+    case VAL_INT: {
+        result = !value.int32;
+        break;
+    }
+    case VAL_FLOAT: {
+        result = !value.float64;
+        break;
+    }
+    }
+    return createBox(&result, VAL_INT);
+}
+
+Box compareBoxes(Box loperand, Box roperand, Condition condition) {
+    int result = 0;
+
+    if (isCollection(TYPE(loperand)) || isCollection(TYPE(roperand))) runtimeError("arrays and maps can't be compared");
+
+    if (TYPE(roperand) == VAL_INT && TYPE(loperand) == VAL_INT) {
+        switch(condition) {
+        case CMP_EQ:
+            result = loperand.int32 == roperand.int32;
+            break;
+        case CMP_NE:
+            result = loperand.int32 != roperand.int32;
             break;
-        case INST_FETCH_ARG: {
-            int index = operand.int32;
-            int basept = vm->csp - 2 - vm->callStack[vm->csp - 2].int32;
-            STACK_PUSH(vm->callStack[basept + index]);
+        case CMP_GE:
+            result = loperand.int32 >= roperand.int32;
+            break;
+        case CMP_GT:
+            result = loperand.int32 > roperand.int32;
+            break;
+        case CMP_LE:
+            result = loperand.int32 <= roperand.int32;
+            break;
+        case CMP_LT:
+            result = loperand.int32 < roperand.int32;
             break;
         }
-        case INST_JMP_IF_NOT: {
-            STACK_POP(Box value);
+    } else {
+        float lv = loperand.float64;
+        float rv = roperand.float64;
 
-            int shouldJump = !value.int32;
-            if (shouldJump || vm->conditionBreaker) {
-                vm->pc += operand.int32;
-                continue;
-            };
-            break;
+        if (TYPE(loperand) == VAL_INT) {
+            lv = (double)loperand.int32;
+        } else if (TYPE(roperand) == VAL_INT) {
+            rv = (double)roperand.int32;
         }
-        case INST_SET_CB:
-            vm->conditionBreaker = 1;
+
+        switch(condition) {
+        case CMP_EQ:
+            result = lv == rv;
             break;
-        case INST_UNSET_CB:
-            vm->conditionBreaker = 0;
+        case CMP_NE:
+            result = lv != rv;
             break;
-        case INST_STACK_SWEEP:
-            for (int i = 0; i < operand.int32; i++) {
-                STACK_POP(Box box);
-                switch (TYPE(box)) {
-                case VAL_STRING:
-                    cleanup_object(box);
-                }
-            }
+        case CMP_GE:
+            result = lv >= rv;
             break;
-        case INST_FETCH_VAR: {
-            Box value = vm->operandStack[operand.int32];
-            STACK_PUSH(value);
+        case CMP_GT:
+            result = lv > rv;
             break;
-        }
-        case INST_ASSIGN_VAR: {
-            STACK_POP(vm->operandStack[operand.int32]);
+        case CMP_LE:
+            result = lv <= rv;
+            break;
+        case CMP_LT:
+            result = lv < rv;
             break;
         }
-        }
+    }
+    return createBox(&result, VAL_INT);
+}
 
-        if (vm->csp >= CALLSTACK_MAX_SIZE) {
-            fprintf(stderr, "runtime error: Maximum callstack size exceeded");
-            exit(1);
-        }
+int instLength(InstType type) {
+    switch (type) {
+    case INST_LOOP_STEP:
+        return LOOP_STEP_LENGTH;
+    case INST_REG_ADD:
+    case INST_REG_SUB:
+    case INST_REG_MULT:
+    case INST_REG_DIV:
+    case INST_REG_CMP:
+    case INST_REG_JMP_IF_NOT:
+        return REG_LENGTH;
+    case INST_REG_MOVE:
+        return REG_LENGTH - 1;
+    default:
+        return 1;
+    }
+}
+
+// the fused back-edge of a counted loop, returns whether to jump back into the body
+int stepLoop(int slot, int step, Condition condition, Box limit) {
+    Box *var = &vm->operandStack[slot];
+    int magnitude = step < 0 ? -step : step;
+    Box delta = createBox(&magnitude, VAL_INT);
+
+    *var = step < 0 ? subBoxes(*var, delta) : addBoxes(*var, delta);
+    return compareBoxes(*var, limit, condition).int32 && !vm->conditionBreaker;
+}
+
+void pushFrame(int returnPc) {
+    CHARGE_BUDGET(1);
+
+    CALLSTACK_PUSH(createBox(&returnPc, VAL_INT));
+    CALLSTACK_PUSH(createBox(&vm->sp, VAL_INT));
+    CALLSTACK_PUSH(createBox(&vm->frame, VAL_INT));
+    vm->frame = vm->csp;
+}
 
-        vm->pc += 1;
+void returnFromFunction(void) {
+    STACK_POP(Box returnedValue);
+
+    int frame = vm->frame;
+    vm->sp = vm->callStack[frame - 1].int32;
+    vm->pc = vm->callStack[frame - 2].int32;
+
+    int numberOfArgs = vm->callStack[frame - 3].int32;
+    vm->csp = frame - 4 - numberOfArgs;
+    vm->frame = vm->callStack[frame].int32;
+
+    STACK_PUSH(returnedValue);
+}
+
+int localSlot(int offset) {
+    return vm->callStack[vm->frame - 1].int32 + 1 + offset;
+}
+
+int fetchedSlot(Inst inst) {
+    return inst.type == INST_FETCH_LOCAL ? localSlot(inst.operand.int32) : inst.operand.int32;
+}
+
+// value of a source word of a register instruction
+static Box regSource(Inst inst) {
+    switch (inst.type) {
+    case INST_FETCH_VAR:
+        return vm->operandStack[inst.operand.int32];
+    case INST_FETCH_LOCAL:
+        return vm->operandStack[localSlot(inst.operand.int32)];
+    case INST_FETCH_ARG:
+        return vm->callStack[vm->frame - 3 - vm->callStack[vm->frame - 3].int32 + inst.operand.int32];
+    default:
+        return inst.operand;
     }
+}
+
+// stores the result of a register instruction as its dst word says
+static void regStore(Inst dst, Box value) {
+    switch (dst.type) {
+    case INST_ASSIGN_VAR:
+        assignVar(dst.operand.int32, value);
+        break;
+    case INST_ASSIGN_LOCAL:
+        assignVar(localSlot(dst.operand.int32), value);
+        break;
+    default:
+        STACK_PUSH(value);
+        break;
+    }
+}
 
-    dumpOperandStack();
-    dumpCallStack();
+void runRegister(int pc) {
+    Inst *inst = vm->program + pc;
+
+    switch (inst->type) {
+    case INST_REG_ADD:
+        regStore(inst[1], addBoxes(regSource(inst[2]), regSource(inst[3])));
+        break;
+    case INST_REG_SUB:
+        regStore(inst[1], subBoxes(regSource(inst[2]), regSource(inst[3])));
+        break;
+    case INST_REG_MULT:
+        regStore(inst[1], multBoxes(regSource(inst[2]), regSource(inst[3])));
+        break;
+    case INST_REG_DIV:
+        regStore(inst[1], divBoxes(regSource(inst[2]), regSource(inst[3])));
+        break;
+    case INST_REG_CMP:
+        regStore(inst[1], compareBoxes(regSource(inst[2]), regSource(inst[3]), inst->operand.int32));
+        break;
+    default:
+        regStore(inst[1], regSource(inst[2]));
+        break;
+    }
+}
+
+void runProgram(void) {
+    do {
+        while (vm->pc < vm->programLength) {
+            InstType opcode = vm->program[vm->pc].type;
+            Box operand = vm->program[vm->pc].operand;
+            COUNT_INST(vm->pc);
+
+            switch (opcode) {
+            case INST_STACK_PUSH:
+                STACK_PUSH(operand);
+                break;
+            case INST_ADD: {
+                STACK_POP(Box roperand);
+                STACK_POP(Box loperand);
+                STACK_PUSH(addBoxes(loperand, roperand));
+                break;
+            }
+            case INST_SUB: {
+                STACK_POP(Box roperand);
+                STACK_POP(Box loperand);
+                STACK_PUSH(subBoxes(loperand, roperand));
+                break;
+            }
+            case INST_MULT: {
+                STACK_POP(Box roperand);
+                STACK_POP(Box loperand);
+                STACK_PUSH(multBoxes(loperand, roperand));
+                break;
+            }
+            case INST_DIV: {
+                STACK_POP(Box roperand);
+                STACK_POP(Box loperand);
+                STACK_PUSH(divBoxes(loperand, roperand));
+                break;
+            }
+            case INST_LOGICAL_NOT: {
+                STACK_POP(Box value);
+                STACK_PUSH(notBox(value));
+                break;
+            }
+            case INST_CMP: {
+                STACK_POP(Box roperand);
+                STACK_POP(Box loperand);
+                STACK_PUSH(compareBoxes(loperand, roperand, operand.int32));
+                break;
+            }
+            case INST_CALL: {
+                COUNT_CALL(operand.int32);
+                pushFrame(vm->pc + 1);
+
+                vm->pc = operand.int32;
+                jitExecute(vm->pc);
+                continue;
+            }
+            case INST_RET:
+                COUNT_RETURN();
+                returnFromFunction();
+                continue;
+            case INST_JMP:
+                if (operand.int32 < 0) {
+                    CHARGE_BUDGET(-operand.int32);
+                    vm->pc += operand.int32;
+                    jitExecute(vm->pc);
+                    continue;
+                }
+                vm->pc += operand.int32;
+                continue;
+            case INST_LOOP_STEP: {
+                Inst *extra = vm->program + vm->pc + 1;
+                Box limit = extra[3].type == INST_STACK_PUSH ? extra[3].operand : vm->operandStack[fetchedSlot(extra[3])];
+
+                if (stepLoop(fetchedSlot(extra[0]), extra[1].operand.int32, extra[2].operand.int32, limit)) {
+                    CHARGE_BUDGET(LOOP_STEP_LENGTH - operand.int32);
+                    vm->pc += operand.int32;
+                    jitExecute(vm->pc);
+                } else {
+                    vm->pc += LOOP_STEP_LENGTH;
+                }
+                continue;
+            }
+            // each operation has a case of its own, a shared one would dispatch twice
+            case INST_REG_ADD: {
+                Inst *inst = vm->program + vm->pc;
+                regStore(inst[1], addBoxes(regSource(inst[2]), regSource(inst[3])));
+                vm->pc += REG_LENGTH;
+                continue;
+            }
+            case INST_REG_SUB: {
+                Inst *inst = vm->program + vm->pc;
+                regStore(inst[1], subBoxes(regSource(inst[2]), regSource(inst[3])));
+                vm->pc += REG_LENGTH;
+                continue;
+            }
+            case INST_REG_MULT: {
+                Inst *inst = vm->program + vm->pc;
+                regStore(inst[1], multBoxes(regSource(inst[2]), regSource(inst[3])));
+                vm->pc += REG_LENGTH;
+                continue;
+            }
+            case INST_REG_DIV: {
+                Inst *inst = vm->program + vm->pc;
+                regStore(inst[1], divBoxes(regSource(inst[2]), regSource(inst[3])));
+                vm->pc += REG_LENGTH;
+                continue;
+            }
+            case INST_REG_CMP: {
+                Inst *inst = vm->program + vm->pc;
+                regStore(inst[1], compareBoxes(regSource(inst[2]), regSource(inst[3]), operand.int32));
+                vm->pc += REG_LENGTH;
+                continue;
+            }
+            case INST_REG_MOVE: {
+                Inst *inst = vm->program + vm->pc;
+                regStore(inst[1], regSource(inst[2]));
+                vm->pc += REG_LENGTH - 1;
+                continue;
+            }
+            case INST_REG_JMP_IF_NOT: {
+                Inst *inst = vm->program + vm->pc;
+                Box holds = compareBoxes(regSource(inst[2]), regSource(inst[3]), inst[1].operand.int32);
+                vm->pc += !holds.int32 || vm->conditionBreaker ? operand.int32 : REG_LENGTH;
+                continue;
+            }
+            case INST_EXTRA:
+                break;
+            case INST_PUSH_ARG:
+                vm->csp += 1;
+                STACK_POP(vm->callStack[vm->csp]);
+                break;
+            case INST_FETCH_ARG: {
+                int index = operand.int32;
+                int basept = vm->frame - 3 - vm->callStack[vm->frame - 3].int32;
+                STACK_PUSH(vm->callStack[basept + index]);
+                break;
+            }
+            case INST_JMP_IF_NOT: {
+                STACK_POP(Box value);
+
+                int shouldJump = !value.int32;
+                if (shouldJump || vm->conditionBreaker) {
+                    vm->pc += operand.int32;
+                    continue;
+                };
+                break;
+            }
+            case INST_SET_CB:
+                vm->conditionBreaker = 1;
+                break;
+            case INST_UNSET_CB:
+                vm->conditionBreaker = 0;
+                break;
+            case INST_STACK_SWEEP:
+                sweepStack(operand.int32);
+                break;
+            case INST_FETCH_VAR: {
+                Box value = vm->operandStack[operand.int32];
+                STACK_PUSH(value);
+                break;
+            }
+            case INST_ASSIGN_VAR: {
+                STACK_POP(Box value);
+                assignVar(operand.int32, value);
+                break;
+            }
+            case INST_FETCH_LOCAL: {
+                Box value = vm->operandStack[localSlot(operand.int32)];
+                STACK_PUSH(value);
+                break;
+            }
+            case INST_ASSIGN_LOCAL: {
+                STACK_POP(Box value);
+                assignVar(localSlot(operand.int32), value);
+                break;
+            }
+            case INST_ARRAY_NEW:
+                arrayLiteral(operand.int32);
+                break;
+            case INST_ARRAY_ALLOC:
+                allocArray(operand.int32);
+                break;
+            case INST_INDEX_GET:
+                indexGet();
+                break;
+            case INST_INDEX_SET:
+                indexSet();
+                break;
+            case INST_ARRAY_REDUCE:
+                reduceArray(operand.int32);
+                break;
+            case INST_MAP_NEW:
+                allocMap();
+                break;
+            case INST_MAP_HAS:
+                mapHas();
+                break;
+            case INST_MAP_DELETE:
+                mapRemove();
+                break;
+            case INST_CALL_NATIVE:
+                if (callNative(operand.int32)) continue;
+                break;
+            case INST_SPAWN:
+                spawnCoroutine(operand.int32);
+                break;
+            case INST_YIELD:
+                yieldCoroutine();
+                continue;
+            case INST_RESUME:
+                resumeCoroutine();
+                continue;
+            case INST_WAIT:
+                waitCoroutine();
+                continue;
+            }
+
+            vm->pc += 1;
+        }
+    } while (finishCoroutine());
+}
+
+void executeProgram(void) {
+    startProfiler();
+    Phase outer = perfPhase(PHASE_RUN);
+    runProgram();
+    perfPhase(outer);
+    stopProfiler();
+
+#ifdef NGS_COUNTERS
+    dumpCounters();
+#endif
+#ifdef NGS_ALLOCS
+    dumpAllocs();
+#endif
 }
 
 char* stringifyInst(InstType type) {
@@ -369,8 +987,22 @@ char* stringifyInst(InstType type) {
     case INST_PUSH_ARG: return "INST_PUSH_ARG";
     case INST_CALL: return "INST_CALL";
     case INST_RET: return "INST_RET";
+    case INST_CALL_NATIVE: return "INST_CALL_NATIVE";
+    case INST_SPAWN: return "INST_SPAWN";
+    case INST_YIELD: return "INST_YIELD";
+    case INST_RESUME: return "INST_RESUME";
+    case INST_WAIT: return "INST_WAIT";
     case INST_JMP: return "INST_JMP";
     case INST_JMP_IF_NOT: return "INST_JMP_IF_NOT";
+    case INST_LOOP_STEP: return "INST_LOOP_STEP";
+    case INST_REG_ADD: return "INST_REG_ADD";
+    case INST_REG_SUB: return "INST_REG_SUB";
+    case INST_REG_MULT: return "INST_REG_MULT";
+    case INST_REG_DIV: return "INST_REG_DIV";
+    case INST_REG_CMP: return "INST_REG_CMP";
+    case INST_REG_MOVE: return "INST_REG_MOVE";
+    case INST_REG_JMP_IF_NOT: return "INST_REG_JMP_IF_NOT";
+    case INST_EXTRA: return "INST_EXTRA";
     case INST_STACK_PUSH: return "INST_PUSH";
     case INST_ADD: return "INST_ADD";
     case INST_SUB: return "INST_SUB";
@@ -381,7 +1013,18 @@ char* stringifyInst(InstType type) {
     case INST_SET_CB: return "INST_SET_CB";
     case INST_UNSET_CB: return "INST_UNSET_CB";
     case INST_FETCH_VAR: return "INST_FETCH_VAR";
+    case INST_FETCH_LOCAL: return "INST_FETCH_LOCAL";
+    case INST_ASSIGN_LOCAL: return "INST_ASSIGN_LOCAL";
+    case INST_ARRAY_NEW: return "INST_ARRAY_NEW";
+    case INST_ARRAY_ALLOC: return "INST_ARRAY_ALLOC";
+    case INST_INDEX_GET: return "INST_INDEX_GET";
+    case INST_INDEX_SET: return "INST_INDEX_SET";
+    case INST_ARRAY_REDUCE: return "INST_ARRAY_REDUCE";
+    case INST_MAP_NEW: return "INST_MAP_NEW";
+    case INST_MAP_HAS: return "INST_MAP_HAS";
+    case INST_MAP_DELETE: return "INST_MAP_DELETE";
     }
+    return "INST_UNKNOWN";
 }
 
 void printBox(Box box) {
@@ -393,7 +1036,13 @@ void printBox(Box box) {
         printf("%f", box.float64);
         break;
     case VAL_STRING:
-        printf("%s", (char *)(((Object *)box.obj)->ref));
+        printf("%s", (char *)(((Object *)(intptr_t)box.obj)->ref));
+        break;
+    case VAL_ARRAY:
+        printArray((Array *)(intptr_t)box.obj);
+        break;
+    case VAL_MAP:
+        printMap((Map *)(intptr_t)box.obj);
         break;
     default:
         break;
@@ -403,11 +1052,24 @@ void printBox(Box box) {
 void dumpProgram(void) {
     printf("===== DISASSEMBLY =====\n\n");
 
-    for (int i = 0; i < vm->programLength; i++) {
+    for (int i = 0; i < vm->programLength; i += instLength(vm->program[i].type)) {
         printf("PC: (0x%04X) %s ", i, stringifyInst(vm->program[i].type));
         if (vm->program[i].operand.float64) {
             printBox(vm->program[i].operand);
         }
+
+        // the operand words go on the line of their instruction, so every PC: line is one of them
+        int end = i + instLength(vm->program[i].type);
+        if (end > vm->programLength) end = vm->programLength;
+        for (int word = i + 1; word < end; word++) {
+            if (word == i + 1 && vm->program[i].operand.float64) printf(" ");
+            printf("%s%s", word == i + 1 ? "[" : ", ", stringifyInst(vm->program[word].type));
+            if (vm->program[word].operand.float64) {
+                printf(" ");
+                printBox(vm->program[word].operand);
+            }
+            if (word == end - 1) printf("]");
+        }
         printf("\n");
     }
     printf("\n");
@@ -2,10 +2,18 @@
 #define VM_H
 
 #include <stdlib.h>
+#include <setjmp.h>
 #include "value.h"
+#include "lines.h"
 
+// default number of slots of each stack, see setStackSizes()
 #define MEM_SIZE 4096
 #define CALLSTACK_MAX_SIZE 9 * 3200
+#define PROGRAM_MAX_SIZE (1 << 20)
+
+// exit statuses of a run stopped by setBudget() limits, runtime errors exit with 1
+#define EXIT_OUT_OF_FUEL 3
+#define EXIT_DEADLINE 4
 
 typedef enum {
     CMP_GT,
@@ -22,6 +30,9 @@ typedef enum {
     INST_STACK_SWEEP,
     INST_FETCH_VAR,
     INST_ASSIGN_VAR,
+    // variables declared in a function body, operand is the offset from the frame's first slot
+    INST_FETCH_LOCAL,
+    INST_ASSIGN_LOCAL,
 
     // OPERATIONS
     INST_ADD,
@@ -34,18 +45,78 @@ typedef enum {
     // JUMPS
     INST_JMP,
     INST_JMP_IF_NOT,
+    // var += step, then jump back into the loop body while (var CMP limit), see LOOP_STEP_LENGTH
+    INST_LOOP_STEP,
 
     // CONDITIONALS
     INST_SET_CB,
     INST_UNSET_CB,
-    
+
+    // ARRAYS
+    // pops operand elements into a new array
+    INST_ARRAY_NEW,
+    // pops a length, pushes a zeroed array of the ArrayKind in operand
+    INST_ARRAY_ALLOC,
+    // array or map, index -> element
+    INST_INDEX_GET,
+    // array or map, index, value -> nothing
+    INST_INDEX_SET,
+    // array -> the Reduction in operand
+    INST_ARRAY_REDUCE,
+
+    // MAPS
+    // pops the number of entries to size the table for, pushes an empty map
+    INST_MAP_NEW,
+    // map, key -> 1 if the key is present
+    INST_MAP_HAS,
+    // map, key -> 1 if the key was present and has been removed
+    INST_MAP_DELETE,
+
     // FUNCTIONS
     INST_CALL,
     INST_PUSH_ARG,
     INST_FETCH_ARG,
     INST_RET,
+    // arguments -> result of natives[operand], see builtins.h
+    INST_CALL_NATIVE,
+
+    // COROUTINES, see coroutine.h
+    // like INST_CALL but the call runs as a new coroutine, pushes its id
+    INST_SPAWN,
+    INST_YIELD,
+    // id -> 1 if it switched to that coroutine
+    INST_RESUME,
+    // id -> return value of the coroutine, yielding until it has one
+    INST_WAIT,
+
+    // REGISTERS, three address forms of the stack instructions that skip the operand stack, see
+    // REG_LENGTH. dst = src1 op src2
+    INST_REG_ADD,
+    INST_REG_SUB,
+    INST_REG_MULT,
+    INST_REG_DIV,
+    // dst = src1 CMP src2, operand is the Condition
+    INST_REG_CMP,
+    // dst = src1
+    INST_REG_MOVE,
+    // jumps by operand unless src1 CMP src2 holds and the condition breaker is unset
+    INST_REG_JMP_IF_NOT,
+
+    // operand word of the preceding instruction, never executed
+    INST_EXTRA,
 } InstType;
 
+// INST_LOOP_STEP (operand: offset to the loop body) is followed by the var encoded as the
+//   INST_FETCH_VAR or INST_FETCH_LOCAL it replaced, INST_EXTRA step, INST_EXTRA condition, and the
+//   limit encoded as the INST_FETCH_VAR, INST_FETCH_LOCAL or INST_STACK_PUSH it replaced
+#define LOOP_STEP_LENGTH 5
+
+// register instructions are followed by a dst, src1 and src2 word (INST_REG_MOVE has no src2), each
+//   encoded as the stack instruction it replaced: dst as INST_ASSIGN_VAR, INST_ASSIGN_LOCAL or
+//   INST_STACK_PUSH to push the result, sources as INST_FETCH_VAR, INST_FETCH_LOCAL, INST_FETCH_ARG
+//   or INST_STACK_PUSH of a number. INST_REG_JMP_IF_NOT has an INST_EXTRA condition for its dst
+#define REG_LENGTH 4
+
 typedef struct {
     InstType type;
     Box operand;
@@ -57,25 +128,109 @@ typedef struct {
 } Reference;
 
 typedef struct {
-    Box operandStack[MEM_SIZE];
+    char *name;
+    int ip;
+    // one past the trailing INST_RET of the body
+    int end;
+} Function;
+
+typedef struct {
+    // both stacks are mmap'd between PROT_NONE guard pages, running into one is reported as a
+    // runtime error by the SIGSEGV handler so pushes need no bounds checks
+    Box *operandStack;
     int sp;
-    
-    Box callStack[CALLSTACK_MAX_SIZE];
+    int stackSize;
+
+    // a frame is args..., nargs, returnPc, savedSp, savedFrame
+    Box *callStack;
     int csp;
+    int callStackSize;
+    // call stack slot of the innermost frame's savedFrame, -1 outside of calls
+    int frame;
 
     Inst *program;
     int pc;
     int programLength;
 
+    Function *functions;
+    int functionsLength;
+
+    LineTable lines;
+
+    // what is left of the current budget slice, charged at backward jumps and calls.
+    // checkBudget() looks at the real limits once it goes negative
+    long long fuel;
+
     // if a conditional statement passes (CJMP returns 0) set this to 1 to force all other chained conditions to fallthrough
     int conditionBreaker;
 } VM;
 
-void initVM(Inst *instructions, size_t length);
+#define STACK_PUSH(value) vm->sp += 1;                      \
+                          vm->operandStack[vm->sp] = value; \
+
+#define STACK_POP(value)  value = vm->operandStack[vm->sp]; \
+                          vm->sp -= 1;                      \
+
+#define CALLSTACK_PUSH(value) vm->csp += 1;                   \
+                              vm->callStack[vm->csp] = value; \
+
+extern VM *vm;
+// when set, runtime errors and budget stops longjmp here with their exit status instead of exiting
+extern jmp_buf *errorTrap;
+
+// slots of the operand and call stacks for the next initVM(), 0 keeps $NGS_STACK_SIZE and
+// $NGS_CALLSTACK_SIZE or the defaults. pages are only committed once they are touched
+void setStackSizes(int operandSlots, int callSlots);
+// first operand and call stack slot of a coroutine's stack segment, the segment's pages are made
+// usable the first time it is handed out
+void mapSegment(int segment, int *stackBase, int *callStackBase);
+// deepest the operand and call stacks have been outside of coroutine segments, rounded up to the
+// page. costs the run nothing since the kernel tracks which pages were touched
+void stackPeaks(int *operandSlots, int *callSlots);
+void initVM(Inst *instructions, size_t length, Function *functions, int functionsLength, LineTable lines);
 void freeVM(void);
 
+// runProgram() interprets from vm->pc to the end of the program, executeProgram() runs the whole
+// program under the profiler
+void runProgram(void);
 void executeProgram(void);
 
+// fuel is roughly an instruction count: every call costs 1 and every backward jump costs the
+// length of the loop it closes. 0 means no limit
+void setBudget(long long fuel, long long deadlineMs);
+void checkBudget(void);
+// fuel charged since initVM(), which counts the instructions of loop bodies and calls
+long long fuelSpent(void);
+
+#define CHARGE_BUDGET(cost) if ((vm->fuel -= (cost)) < 0) checkBudget()
+
+// reports the error at the source line of vm->pc, then exits
+void runtimeError(const char *message);
+
+void cleanup_object(Box box);
+// stores value in a variable, freeing the array or map it held before once nothing refers to it
+void assignVar(int slot, Box value);
+void indexGet(void);
+void indexSet(void);
+void sweepStack(int count);
+int instLength(InstType type);
+int stepLoop(int slot, int step, Condition condition, Box limit);
+// runs the register instruction at pc, other than INST_REG_JMP_IF_NOT
+void runRegister(int pc);
+void pushFrame(int returnPc);
+void returnFromFunction(void);
+// operand stack slot of a function local
+int localSlot(int offset);
+// operand stack slot an INST_FETCH_VAR or INST_FETCH_LOCAL reads
+int fetchedSlot(Inst inst);
+
+Box addBoxes(Box loperand, Box roperand);
+Box subBoxes(Box loperand, Box roperand);
+Box multBoxes(Box loperand, Box roperand);
+Box divBoxes(Box loperand, Box roperand);
+Box compareBoxes(Box loperand, Box roperand, Condition condition);
+Box notBox(Box value);
+
 void dumpProgram(void);
 void dumpOperandStack(void);
 void dumpCallStack(void);